@@ -0,0 +1,173 @@
+/*! @file boundary.cpp
+ *
+ * @brief Benchmark the MIME boundary search
+ *
+ * A multi-megabyte body full of near misses like "--" and "\n-" is
+ * searched for a delimiter line at its end with BoundaryScanner::find(),
+ * memmem() and std::search(). Then a message with a long preamble is fed
+ * to BoundaryScanner::scan() in chunks of several sizes, and the content
+ * after the preamble is checked for every chunk size.
+ *
+ * @author Christian Roessner <c@roessner.co>
+ * @version 1607.1.4
+ * @date 2016-06-10
+ * @copyright Copyright 2016 Christian Roessner <c@roessner.co>
+ */
+
+#include <sysexits.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <boost/program_options.hpp>
+
+#include "boundary.h"
+
+namespace po = boost::program_options;
+using benchclock = std::chrono::steady_clock;
+
+//! @brief Turn on/off debugging output
+bool debug = false;
+
+static double since(benchclock::time_point start) {
+    std::chrono::duration<double> elapsed = benchclock::now() - start;
+
+    return elapsed.count();
+}
+
+/*!
+ * @brief Text lines with dashes, but without the delimiter
+ */
+static std::string filler(std::size_t size) {
+    static const char *lines[] = {
+            "-- \r\n", "Some text -- with dashes\r\n", "---------\r\n",
+            "--=_Part_Other\r\n", "\r\n", "Lorem ipsum dolor sit amet\r\n"
+    };
+    std::string text;
+
+    for (std::size_t i = 0; text.size() < size; i++)
+        text += lines[(i * 7) % 6];
+    text.resize(size);
+
+    return text;
+}
+
+int main(int argc, const char *argv[]) {
+    std::size_t size;
+    unsigned int rounds;
+
+    po::options_description desc("The following options are available");
+    desc.add_options()
+            ("help,h", "produce help message")
+            ("size", po::value<std::size_t>(&size)->default_value(8388608),
+             "Body size in bytes")
+            ("rounds,n", po::value<unsigned int>(&rounds)->default_value(20),
+             "Searches per method")
+    ;
+
+    po::variables_map vm;
+    try {
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+    }
+    catch (const std::exception &e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        std::cout << desc << std::endl;
+        exit(EX_USAGE);
+    }
+    po::notify(vm);
+
+    if (vm.count("help") || rounds == 0) {
+        std::cout << "Usage: sigh-bench-boundary [options]" << std::endl
+                  << desc << std::endl;
+        exit(EX_USAGE);
+    }
+
+    const std::string boundary = "=_Part_0_123456789.1465553856";
+    const std::string delimiter = "\n--" + boundary;
+    std::string body = filler(size) + delimiter + "\r\n";
+    const std::size_t expected = size;
+    int status = EX_OK;
+
+    // The length changes, so that no search is moved out of the loop
+    std::size_t found = 0;
+    auto start = benchclock::now();
+    for (unsigned int i = 0; i < rounds; i++)
+        found = mlt::BoundaryScanner::find(body.data(), body.size() - i % 2,
+                                           delimiter.data(),
+                                           delimiter.size());
+    double simd = since(start);
+    if (found != expected)
+        status = EX_SOFTWARE;
+
+    start = benchclock::now();
+    for (unsigned int i = 0; i < rounds; i++) {
+        const void *hit = memmem(body.data(), body.size() - i % 2,
+                                 delimiter.data(), delimiter.size());
+        found = hit == nullptr ? std::string::npos
+                : static_cast<const char *>(hit) - body.data();
+    }
+    double glibc = since(start);
+    if (found != expected)
+        status = EX_SOFTWARE;
+
+    start = benchclock::now();
+    for (unsigned int i = 0; i < rounds; i++)
+        found = std::search(body.begin(), body.end() - i % 2,
+                            delimiter.begin(), delimiter.end())
+                - body.begin();
+    double search = since(start);
+    if (found != expected)
+        status = EX_SOFTWARE;
+
+    double megabytes = static_cast<double>(body.size()) * rounds / 1e6;
+    std::cout << body.size() << " bytes" << std::endl
+              << "BoundaryScanner::find: " << megabytes / simd << " MB/s"
+              << std::endl
+              << "memmem: " << megabytes / glibc << " MB/s" << std::endl
+              << "std::search: " << megabytes / search << " MB/s"
+              << std::endl;
+
+    // A preamble just below the limit, followed by the first part
+    const std::string content = "--" + boundary + "\r\n"
+                                "Content-Type: text/plain\r\n\r\nHello\r\n"
+                                "--" + boundary + "--\r\n";
+    const std::string message = filler(60000) + "\r\n" + content;
+
+    for (std::size_t chunk : {1, 7, 4096, 65536}) {
+        mlt::BoundaryScanner scanner;
+        std::string out;
+
+        start = benchclock::now();
+        scanner.start(boundary);
+        for (std::size_t pos = 0; pos < message.size(); pos += chunk) {
+            std::size_t len = std::min(chunk, message.size() - pos);
+            if (!scanner.scanning()) {
+                out.append(message, pos, len);
+                continue;
+            }
+            std::size_t offset = scanner.scan(message.data() + pos, len);
+            out += scanner.pending();
+            if (offset != std::string::npos)
+                out.append(message, pos + offset, len - offset);
+        }
+        // As in mlfi_eom
+        if (scanner.scanning()) {
+            scanner.stop();
+            out += scanner.pending();
+        }
+        double took = since(start);
+
+        bool right = out == content;
+        if (!right)
+            status = EX_SOFTWARE;
+
+        std::cout << "scan() in chunks of " << chunk << " bytes: "
+                  << took * 1e6 << " us, "
+                  << (right ? "content found" : "wrong content")
+                  << std::endl;
+    }
+
+    return status;
+}
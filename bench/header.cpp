@@ -0,0 +1,161 @@
+/*! @file header.cpp
+ *
+ * @brief Benchmark header classification and capture
+ *
+ * A message has many Received and DKIM-Signature headers and a few MIME
+ * headers. Every header is classified and the MIME headers are copied
+ * into the arena of the message, as in mlfi_header. For comparison, the
+ * same headers run through a linear strncasecmp() loop over a list of
+ * names, and the matches are copied into pairs of strings.
+ *
+ * @author Christian Roessner <c@roessner.co>
+ * @version 1607.1.4
+ * @date 2016-06-10
+ * @copyright Copyright 2016 Christian Roessner <c@roessner.co>
+ */
+
+#include <sysexits.h>
+#include <strings.h>
+
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+#include <boost/program_options.hpp>
+
+#include "mimeheader.h"
+
+namespace po = boost::program_options;
+using benchclock = std::chrono::steady_clock;
+
+//! @brief Turn on/off debugging output
+bool debug = false;
+
+static double since(benchclock::time_point start) {
+    std::chrono::duration<double> elapsed = benchclock::now() - start;
+
+    return elapsed.count();
+}
+
+int main(int argc, const char *argv[]) {
+    std::size_t received;
+    std::size_t dkim;
+    std::size_t messages;
+
+    po::options_description desc("The following options are available");
+    desc.add_options()
+            ("help,h", "produce help message")
+            ("received,r", po::value<std::size_t>(&received)
+                     ->default_value(300), "Received headers per message")
+            ("dkim,d", po::value<std::size_t>(&dkim)->default_value(20),
+             "DKIM-Signature headers per message")
+            ("messages,m", po::value<std::size_t>(&messages)
+                     ->default_value(20000), "Number of messages")
+    ;
+
+    po::variables_map vm;
+    try {
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+    }
+    catch (const std::exception &e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        std::cout << desc << std::endl;
+        exit(EX_USAGE);
+    }
+    po::notify(vm);
+
+    if (vm.count("help") || messages == 0) {
+        std::cout << "Usage: sigh-bench-header [options]" << std::endl
+                  << desc << std::endl;
+        exit(EX_USAGE);
+    }
+
+    std::vector<std::pair<std::string, std::string>> headers;
+    for (std::size_t i = 0; i < received; i++)
+        headers.emplace_back("Received", "from relay" + std::to_string(i)
+                + ".example.org (relay" + std::to_string(i)
+                + ".example.org [192.0.2.1]) by mx.example.com (Postfix) "
+                  "with ESMTPS id 4Xyz" + std::to_string(i)
+                + " for <user@example.com>; Mon, 10 Jun 2016 12:00:00 "
+                  "+0200 (CEST)");
+    for (std::size_t i = 0; i < dkim; i++)
+        headers.emplace_back("DKIM-Signature", "v=1; a=rsa-sha256; "
+                "c=relaxed/relaxed; d=example.org; s=selector"
+                + std::to_string(i) + "; h=from:to:subject:date; bh="
+                + std::string(44, 'b') + "; b=" + std::string(344, 's'));
+    headers.emplace_back("From", "Sender <sender@example.org>");
+    headers.emplace_back("To", "Recipient <user@example.com>");
+    headers.emplace_back("Subject", "Benchmark");
+    headers.emplace_back("MIME-Version", "1.0");
+    headers.emplace_back("Content-Type",
+                         "multipart/mixed; boundary=\"----=_Part_1\"");
+    headers.emplace_back("Content-Transfer-Encoding", "7bit");
+    headers.emplace_back("Content-Typeface", "not a MIME header");
+
+    // The names as the milter sees them, null terminated
+    std::vector<const char *> names;
+    std::vector<const char *> values;
+    for (auto &it : headers) {
+        names.push_back(it.first.c_str());
+        values.push_back(it.second.c_str());
+    }
+
+    std::size_t found = 0;
+    mlt::Arena arena;
+    std::vector<mlt::MarkedHeader> marked;
+    auto start = benchclock::now();
+
+    for (std::size_t m = 0; m < messages; m++) {
+        arena.reset();
+        marked.clear();
+        for (std::size_t i = 0; i < names.size(); i++) {
+            mlt::HeaderKind kind = mlt::HeaderClassifier::classify(names[i]);
+            if (kind == mlt::HeaderKind::OTHER)
+                continue;
+            marked.push_back({kind,
+                              arena.copy(names[i], strlen(names[i])),
+                              arena.copy(values[i], strlen(values[i]))});
+        }
+        found += marked.size();
+    }
+    double classified = since(start);
+
+    // The names that mlfi_header compared one by one
+    const std::vector<std::string> list = {
+            "X-Sigh", "MIME-Version", "Content-ID", "Content-Type",
+            "Content-Disposition", "Content-Description",
+            "Content-Transfer-Encoding"
+    };
+    std::vector<std::pair<std::string, std::string>> pairs;
+    std::size_t linearFound = 0;
+    start = benchclock::now();
+
+    for (std::size_t m = 0; m < messages; m++) {
+        pairs.clear();
+        for (std::size_t i = 0; i < names.size(); i++) {
+            for (auto &it : list) {
+                if (strncasecmp(names[i], it.c_str(), it.size()) == 0) {
+                    pairs.emplace_back(names[i], values[i]);
+                    break;
+                }
+            }
+        }
+        linearFound += pairs.size();
+    }
+    double linear = since(start);
+
+    double total = static_cast<double>(messages * names.size());
+
+    std::cout << names.size() << " headers per message, " << messages
+              << " messages" << std::endl
+              << "classifier and arena: " << classified * 1e9 / total
+              << " ns/header, " << found / messages << " captured"
+              << std::endl
+              << "strncasecmp and strings: " << linear * 1e9 / total
+              << " ns/header, " << linearFound / messages << " captured"
+              << std::endl;
+
+    return EX_OK;
+}
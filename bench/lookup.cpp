@@ -0,0 +1,177 @@
+/*! @file lookup.cpp
+ *
+ * @brief Benchmark map file lookups against a large map file
+ *
+ * Half of the queries have a map file entry. Every query is looked up the
+ * way the milter does it: hasSigner() at MAIL FROM, then the certificate
+ * and the key of the first pair at the end of the message. For comparison,
+ * the same queries run against a std::map with the raw values, which are
+ * split at every lookup.
+ *
+ * @author Christian Roessner <c@roessner.co>
+ * @version 1607.1.4
+ * @date 2016-06-10
+ * @copyright Copyright 2016 Christian Roessner <c@roessner.co>
+ */
+
+#include <sysexits.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+#include <boost/algorithm/string.hpp>
+#include <boost/program_options.hpp>
+
+#include "mapdb.h"
+#include "mapfile.h"
+
+namespace po = boost::program_options;
+using benchclock = std::chrono::steady_clock;
+
+//! @brief Turn on/off debugging output
+bool debug = false;
+
+static std::string address(std::size_t number) {
+    return "user" + std::to_string(number) + "@Example.ORG";
+}
+
+static std::string value(std::size_t number) {
+    return "cert:/etc/sigh/" + std::to_string(number) + ".crt,key:/etc/sigh/"
+           + std::to_string(number) + ".key";
+}
+
+static double since(benchclock::time_point start) {
+    std::chrono::duration<double> elapsed = benchclock::now() - start;
+
+    return elapsed.count();
+}
+
+int main(int argc, const char *argv[]) {
+    std::size_t entries;
+    std::size_t queries;
+    std::string file;
+
+    po::options_description desc("The following options are available");
+    desc.add_options()
+            ("help,h", "produce help message")
+            ("entries,e", po::value<std::size_t>(&entries)
+                     ->default_value(1000000), "Number of map file entries")
+            ("queries,q", po::value<std::size_t>(&queries)
+                     ->default_value(1000000), "Number of lookups")
+            ("compiled,c", po::bool_switch()->default_value(false),
+             "Look up in a compiled map file")
+            ("file,f", po::value<std::string>(&file)->default_value(
+                     "/tmp/sigh-bench-lookup.txt"), "Map file to write")
+    ;
+
+    po::variables_map vm;
+    try {
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+    }
+    catch (const std::exception &e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        std::cout << desc << std::endl;
+        exit(EX_USAGE);
+    }
+    po::notify(vm);
+
+    if (vm.count("help") || entries == 0) {
+        std::cout << "Usage: sigh-bench-lookup [options]" << std::endl
+                  << desc << std::endl;
+        exit(EX_USAGE);
+    }
+
+    {
+        std::ofstream out(file);
+        for (std::size_t i = 0; i < entries; i++)
+            out << address(i) << "\t" << value(i) << std::endl;
+        if (!out) {
+            std::cerr << "Error: Can not write " << file << std::endl;
+            exit(EX_CANTCREAT);
+        }
+    }
+
+    const std::string text = file;
+    if (vm["compiled"].as<bool>()) {
+        std::vector<mapfile::Identity> identities;
+        if (!mapfile::Map::parseMap(file, identities))
+            exit(EX_DATAERR);
+        mapfile::Store store(std::move(identities));
+        file += ".db";
+        if (!mapfile::MapDb::write(file, store.identities()))
+            exit(EX_CANTCREAT);
+    }
+
+    auto start = benchclock::now();
+    if (!mapfile::Map::readMap(file))
+        exit(EX_DATAERR);
+    std::cout << "readMap: " << since(start) * 1000 << " ms" << std::endl;
+
+    // Every second query has no entry
+    std::vector<std::string> envfrom;
+    envfrom.reserve(queries);
+    for (std::size_t i = 0; i < queries; i++)
+        envfrom.push_back(address((i * 2654435761ULL) % (entries * 2)));
+
+    std::size_t found = 0;
+    start = benchclock::now();
+    for (auto &it : envfrom) {
+        if (!mapfile::Map::hasSigner(it))
+            continue;
+        mapfile::Map map(it);
+        using mapfile::Smime;
+        if (!map.getSmimeFilename<Smime::CERT>().empty()
+            && !map.getSmimeFilename<Smime::KEY>().empty())
+            found++;
+    }
+    double indexed = since(start);
+
+    // The raw values, split at every lookup
+    std::map<std::string, std::string> raw;
+    for (std::size_t i = 0; i < entries; i++)
+        raw.emplace(boost::to_lower_copy(address(i)), value(i));
+
+    std::size_t splitFound = 0;
+    start = benchclock::now();
+    for (auto &it : envfrom) {
+        auto entry = raw.find(boost::to_lower_copy(it));
+        if (entry == raw.end())
+            continue;
+
+        std::string cert, key;
+        std::vector<std::string> pairs, parts;
+        boost::split(pairs, entry->second, boost::is_any_of(","),
+                     boost::token_compress_on);
+        for (auto &pair : pairs) {
+            boost::split(parts, pair, boost::is_any_of(":"),
+                         boost::token_compress_on);
+            if (parts.size() != 2)
+                continue;
+            if (parts[0] == "cert")
+                cert = parts[1];
+            else if (parts[0] == "key")
+                key = parts[1];
+        }
+        if (!cert.empty() && !key.empty())
+            splitFound++;
+    }
+    double split = since(start);
+
+    std::cout << entries << " entries, " << queries << " queries, "
+              << found << " found" << std::endl
+              << "index: " << indexed * 1e9 / queries << " ns/lookup"
+              << std::endl
+              << "std::map and split: " << split * 1e9 / queries
+              << " ns/lookup" << std::endl;
+
+    unlink(text.c_str());
+    if (file != text)
+        unlink(file.c_str());
+
+    return found == splitFound ? EX_OK : EX_SOFTWARE;
+}
@@ -0,0 +1,192 @@
+/*! @file pkcs11.cpp
+ *
+ * @brief Benchmark signing with a PKCS#11 token against a key file
+ *
+ * Every message looks up its credentials in the credential cache and signs
+ * data of the size of the signed attributes, as the milter does for each
+ * message. The token key uses the session pool and the cached key handle.
+ * Run it against SoftHSM to compare the token path with the file path on
+ * the same host, for example:
+ *
+ * sigh-bench-pkcs11 --module /usr/lib/softhsm/libsofthsm2.so --pin 1234
+ *   --cert signer.crt --key signer.key --uri "pkcs11:token=sigh;object=signer"
+ *
+ * @author Christian Roessner <c@roessner.co>
+ * @version 1607.1.4
+ * @date 2016-06-10
+ * @copyright Copyright 2016 Christian Roessner <c@roessner.co>
+ */
+
+#include <sysexits.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <boost/algorithm/string.hpp>
+#include <boost/program_options.hpp>
+
+#include "credcache.h"
+#include "pkcs11.h"
+#include "smime.h"
+
+namespace po = boost::program_options;
+using benchclock = std::chrono::steady_clock;
+
+//! @brief Turn on/off debugging output
+bool debug = false;
+
+/*!
+ * @brief Sign messages from several threads for some time
+ *
+ * @return Messages per second or a negative number, if signing failed
+ */
+static double run(const std::string &cert, const std::string &key,
+                  unsigned int threads, double seconds,
+                  const std::vector<unsigned char> &data) {
+    std::atomic<bool> running(true);
+    std::atomic<bool> failed(false);
+    std::atomic<unsigned long> messages(0);
+    std::vector<std::thread> workers;
+
+    auto start = benchclock::now();
+
+    for (unsigned int t = 0; t < threads; t++) {
+        workers.emplace_back([&]() {
+            std::vector<unsigned char> sig;
+            unsigned long done = 0;
+
+            while (running.load(std::memory_order_relaxed)) {
+                bool missing;
+                smime::credentials_t creds =
+                        smime::CredentialCache::get(cert, key, missing);
+                if (!creds
+                    || !smime::Smime::signData(*creds, creds->digest(),
+                                               data.data(), data.size(),
+                                               sig)) {
+                    failed = true;
+                    running = false;
+                }
+                done++;
+            }
+
+            messages += done;
+        });
+    }
+
+    std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+    running = false;
+    for (auto &it : workers)
+        it.join();
+
+    std::chrono::duration<double> elapsed = benchclock::now() - start;
+
+    return failed ? -1 : messages / elapsed.count();
+}
+
+int main(int argc, const char *argv[]) {
+    std::string module;
+    std::string pin;
+    std::string cert;
+    std::string key;
+    std::string uri;
+    std::string counts;
+    unsigned int sessions;
+    double seconds;
+
+    po::options_description desc("The following options are available");
+    desc.add_options()
+            ("help,h", "produce help message")
+            ("module,m", po::value<std::string>(&module),
+             "PKCS#11 module")
+            ("pin,p", po::value<std::string>(&pin), "User PIN of the token")
+            ("cert,c", po::value<std::string>(&cert),
+             "Certificate of the key")
+            ("key,k", po::value<std::string>(&key),
+             "Key file for comparison")
+            ("uri,u", po::value<std::string>(&uri),
+             "PKCS#11 URI of the same or another key for the certificate")
+            ("sessions", po::value<unsigned int>(&sessions)
+                     ->default_value(0),
+             "Sessions per token. 0 means one per thread")
+            ("threads,t", po::value<std::string>(&counts)->default_value(
+                     "1"), "Thread counts, for example 1,2,4,8")
+            ("seconds,s", po::value<double>(&seconds)->default_value(2),
+             "Seconds per run")
+    ;
+
+    po::variables_map vm;
+    try {
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+    }
+    catch (const std::exception &e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        std::cout << desc << std::endl;
+        exit(EX_USAGE);
+    }
+    po::notify(vm);
+
+    if (vm.count("help") || cert.empty() || (key.empty() && uri.empty())
+        || (!uri.empty() && module.empty())) {
+        std::cout << "Usage: sigh-bench-pkcs11 [options]" << std::endl
+                  << desc << std::endl;
+        exit(EX_USAGE);
+    }
+
+    std::vector<unsigned int> threads;
+    std::vector<std::string> parts;
+    boost::split(parts, counts, boost::is_any_of(","),
+                 boost::token_compress_on);
+    try {
+        for (auto &it : parts)
+            threads.push_back(static_cast<unsigned int>(std::stoul(it)));
+    }
+    catch (const std::exception &) {
+        std::cerr << "Error: Wrong thread counts " << counts << std::endl;
+        exit(EX_USAGE);
+    }
+
+    init_openssl();
+
+    if (!uri.empty()) {
+        unsigned int pool = sessions;
+        if (pool == 0)
+            for (auto &it : threads)
+                pool = std::max(pool, it);
+        if (!smime::Pkcs11::initialize(module, pin, pool))
+            exit(EX_UNAVAILABLE);
+    }
+
+    std::vector<unsigned char> data(160, 'a');
+    std::vector<std::pair<std::string, std::string>> runs;
+    if (!key.empty())
+        runs.emplace_back("file", key);
+    if (!uri.empty())
+        runs.emplace_back("token", uri);
+
+    for (auto &it : runs) {
+        for (auto &count : threads) {
+            double rate = run(cert, it.second, count, seconds, data);
+            if (rate < 0) {
+                std::cerr << "Error: Signing with the " << it.first
+                          << " key failed" << std::endl;
+                exit(EX_SOFTWARE);
+            }
+
+            std::cout << std::left << std::setw(8) << it.first << std::right
+                      << std::setw(3) << count << " threads"
+                      << std::fixed << std::setprecision(1) << std::setw(10)
+                      << rate << " messages/s" << std::endl;
+        }
+    }
+
+    smime::Pkcs11::finalize();
+    deinit_openssl();
+
+    return EX_OK;
+}
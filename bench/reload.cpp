@@ -0,0 +1,166 @@
+/*! @file reload.cpp
+ *
+ * @brief Benchmark map file lookups while the map file is reloaded
+ *
+ * Reader threads look up addresses the way the milter does at MAIL FROM
+ * and at the end of a message, while the main thread reads the map file
+ * again and again. Every address is in the map file, so every lookup that
+ * finds nothing is counted as a miss.
+ *
+ * @author Christian Roessner <c@roessner.co>
+ * @version 1607.1.4
+ * @date 2016-06-10
+ * @copyright Copyright 2016 Christian Roessner <c@roessner.co>
+ */
+
+#include <sysexits.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <boost/program_options.hpp>
+
+#include "mapdb.h"
+#include "mapfile.h"
+
+namespace po = boost::program_options;
+using benchclock = std::chrono::steady_clock;
+
+//! @brief Turn on/off debugging output
+bool debug = false;
+
+static std::string address(std::size_t number) {
+    return "user" + std::to_string(number) + "@Example.ORG";
+}
+
+int main(int argc, const char *argv[]) {
+    std::size_t entries;
+    unsigned int readers;
+    unsigned int reloads;
+    std::string file;
+
+    po::options_description desc("The following options are available");
+    desc.add_options()
+            ("help,h", "produce help message")
+            ("entries,e", po::value<std::size_t>(&entries)
+                     ->default_value(100000), "Number of map file entries")
+            ("readers,r", po::value<unsigned int>(&readers)
+                     ->default_value(8), "Number of reader threads")
+            ("reloads,n", po::value<unsigned int>(&reloads)
+                     ->default_value(20), "Number of reloads")
+            ("compiled,c", po::bool_switch()->default_value(false),
+             "Reload a compiled map file")
+            ("file,f", po::value<std::string>(&file)->default_value(
+                     "/tmp/sigh-bench-reload.txt"), "Map file to write")
+    ;
+
+    po::variables_map vm;
+    try {
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+    }
+    catch (const std::exception &e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        std::cout << desc << std::endl;
+        exit(EX_USAGE);
+    }
+    po::notify(vm);
+
+    if (vm.count("help")) {
+        std::cout << "Usage: sigh-bench-reload [options]" << std::endl
+                  << desc << std::endl;
+        exit(EX_USAGE);
+    }
+
+    {
+        std::ofstream out(file);
+        for (std::size_t i = 0; i < entries; i++)
+            out << address(i) << "\tcert:/etc/sigh/" << i << ".crt,key:/etc/"
+                << "sigh/" << i << ".key" << std::endl;
+        if (!out) {
+            std::cerr << "Error: Can not write " << file << std::endl;
+            exit(EX_CANTCREAT);
+        }
+    }
+
+    const std::string text = file;
+    if (vm["compiled"].as<bool>()) {
+        std::vector<mapfile::Identity> identities;
+        if (!mapfile::Map::parseMap(file, identities))
+            exit(EX_DATAERR);
+        mapfile::Store store(std::move(identities));
+        file += ".db";
+        if (!mapfile::MapDb::write(file, store.identities()))
+            exit(EX_CANTCREAT);
+    }
+
+    if (!mapfile::Map::readMap(file))
+        exit(EX_DATAERR);
+
+    std::atomic<bool> running(true);
+    std::atomic<unsigned long> lookups(0);
+    std::atomic<unsigned long> misses(0);
+    std::vector<std::thread> threads;
+
+    for (unsigned int t = 0; t < readers; t++) {
+        threads.emplace_back([&, t]() {
+            unsigned long done = 0;
+            unsigned long missed = 0;
+            std::size_t next = t * 7919;
+
+            while (running.load(std::memory_order_relaxed)) {
+                std::string envfrom = address(next % entries);
+                next += 104729;
+
+                if (!mapfile::Map::hasSigner(envfrom))
+                    missed++;
+                mapfile::Map map(envfrom);
+                if (map.getSigners().empty())
+                    missed++;
+                done += 2;
+            }
+
+            lookups += done;
+            misses += missed;
+        });
+    }
+
+    auto start = benchclock::now();
+    double slowest = 0;
+
+    for (unsigned int i = 0; i < reloads; i++) {
+        auto begin = benchclock::now();
+        if (!mapfile::Map::readMap(file))
+            exit(EX_DATAERR);
+        std::chrono::duration<double, std::milli> took =
+                benchclock::now() - begin;
+        if (took.count() > slowest)
+            slowest = took.count();
+    }
+
+    running = false;
+    for (auto &it : threads)
+        it.join();
+
+    std::chrono::duration<double> elapsed = benchclock::now() - start;
+
+    std::cout << entries << " entries, " << readers << " readers, "
+              << reloads << " reloads in " << elapsed.count() << " s"
+              << std::endl
+              << "lookups: " << lookups << " ("
+              << static_cast<unsigned long>(lookups / elapsed.count())
+              << "/s)" << std::endl
+              << "misses: " << misses << std::endl
+              << "slowest reload: " << slowest << " ms" << std::endl;
+
+    unlink(text.c_str());
+    if (file != text)
+        unlink(file.c_str());
+
+    return misses == 0 ? EX_OK : EX_SOFTWARE;
+}
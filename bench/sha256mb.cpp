@@ -0,0 +1,236 @@
+/*! @file sha256mb.cpp
+ *
+ * @brief Benchmark the multi-buffer SHA-256 engine against OpenSSL
+ *
+ * Threads hash messages of a fixed size, the way the milter hashes the
+ * content of concurrent messages. Each size and thread count runs with
+ * EVP, with Sha256Stream and with the portable scalar code. Every digest
+ * is compared with the digest from OpenSSL.
+ *
+ * The engine is only used on CPUs with AVX2. On CPUs with SHA extensions,
+ * it is turned on with --sha-ni for comparison only.
+ *
+ * @author Christian Roessner <c@roessner.co>
+ * @version 1607.1.4
+ * @date 2016-06-10
+ * @copyright Copyright 2016 Christian Roessner <c@roessner.co>
+ */
+
+#include <sysexits.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <boost/algorithm/string.hpp>
+#include <boost/program_options.hpp>
+
+#include <openssl/evp.h>
+
+#include "sha256mb.h"
+
+namespace po = boost::program_options;
+using benchclock = std::chrono::steady_clock;
+
+//! @brief Turn on/off debugging output
+bool debug = false;
+
+//! @brief Hash a message into a 32 byte digest
+using hash_t = std::function<void(const std::vector<unsigned char> &,
+                                  unsigned char *)>;
+
+//! @brief Body chunks are handed over in this size, as by the MTA
+static const std::size_t bodyChunk = 65536;
+
+/*!
+ * @brief Hash messages from several threads for some time
+ *
+ * @return MB per second or a negative number, if a digest was wrong
+ */
+static double run(const hash_t &hash, unsigned int threads, double seconds,
+                  const std::vector<unsigned char> &message,
+                  const unsigned char *expected) {
+    std::atomic<bool> running(true);
+    std::atomic<bool> failed(false);
+    std::atomic<unsigned long> messages(0);
+    std::vector<std::thread> workers;
+
+    auto start = benchclock::now();
+
+    for (unsigned int t = 0; t < threads; t++) {
+        workers.emplace_back([&]() {
+            unsigned char md[32];
+            unsigned long done = 0;
+
+            while (running.load(std::memory_order_relaxed)) {
+                hash(message, md);
+                if (std::memcmp(md, expected, sizeof(md)) != 0) {
+                    failed = true;
+                    running = false;
+                }
+                done++;
+            }
+
+            messages += done;
+        });
+    }
+
+    std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+    running = false;
+    for (auto &it : workers)
+        it.join();
+
+    std::chrono::duration<double> elapsed = benchclock::now() - start;
+
+    if (failed)
+        return -1;
+
+    return messages * static_cast<double>(message.size())
+           / elapsed.count() / 1e6;
+}
+
+/*!
+ * @brief Parse a comma separated list of numbers
+ */
+static std::vector<std::size_t> numbers(const std::string &list) {
+    std::vector<std::size_t> result;
+    std::vector<std::string> parts;
+
+    boost::split(parts, list, boost::is_any_of(","),
+                 boost::token_compress_on);
+    try {
+        for (auto &it : parts)
+            result.push_back(std::stoul(it));
+    }
+    catch (const std::exception &) {
+        std::cerr << "Error: Wrong list of numbers " << list << std::endl;
+        exit(EX_USAGE);
+    }
+
+    return result;
+}
+
+int main(int argc, const char *argv[]) {
+    std::string sizes;
+    std::string counts;
+    double seconds;
+
+    po::options_description desc("The following options are available");
+    desc.add_options()
+            ("help,h", "produce help message")
+            ("sizes", po::value<std::string>(&sizes)->default_value(
+                     "4096,32768,262144,2097152"), "Message sizes in bytes")
+            ("threads,t", po::value<std::string>(&counts)->default_value(
+                     "1,8"), "Thread counts, for example 1,4,8,16")
+            ("seconds,s", po::value<double>(&seconds)->default_value(1),
+             "Seconds per run")
+            ("sha-ni", po::bool_switch()->default_value(false),
+             "Use the engine even if the CPU has SHA extensions")
+    ;
+
+    po::variables_map vm;
+    try {
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+    }
+    catch (const std::exception &e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        std::cout << desc << std::endl;
+        exit(EX_USAGE);
+    }
+    po::notify(vm);
+
+    if (vm.count("help")) {
+        std::cout << "Usage: sigh-bench-sha256mb [options]" << std::endl
+                  << desc << std::endl;
+        exit(EX_USAGE);
+    }
+
+    smime::Sha256Engine::enable(true, vm["sha-ni"].as<bool>());
+    std::cout << "Multi-buffer engine "
+              << (smime::Sha256Engine::enabled() ? "on" : "off")
+              << std::endl;
+
+    hash_t evp = [](const std::vector<unsigned char> &message,
+                    unsigned char *md) {
+        EVP_Digest(message.data(), message.size(), md, nullptr,
+                   EVP_sha256(), nullptr);
+    };
+    hash_t lanes = [](const std::vector<unsigned char> &message,
+                      unsigned char *md) {
+        smime::Sha256Stream stream;
+        for (std::size_t pos = 0; pos < message.size(); pos += bodyChunk)
+            stream.update(message.data() + pos,
+                          std::min(bodyChunk, message.size() - pos));
+        stream.final(md);
+    };
+    hash_t scalar = [](const std::vector<unsigned char> &message,
+                       unsigned char *md) {
+        static const uint32_t initial[8] = {
+                0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+        };
+        uint32_t state[8];
+        std::copy(initial, initial + 8, state);
+
+        std::size_t whole = message.size() / 64;
+        smime::Sha256Engine::compressScalar(state, message.data(), whole);
+
+        // Padding, FIPS 180-4, 5.1.1
+        std::vector<unsigned char> tail(message.begin() + whole * 64,
+                                        message.end());
+        uint64_t bits = static_cast<uint64_t>(message.size()) * 8;
+        tail.push_back(0x80);
+        while (tail.size() % 64 != 56)
+            tail.push_back(0x00);
+        for (int i = 7; i >= 0; i--)
+            tail.push_back(static_cast<unsigned char>(bits >> (8 * i)));
+        smime::Sha256Engine::compressScalar(state, tail.data(),
+                                            tail.size() / 64);
+
+        for (int i = 0; i < 8; i++)
+            for (int b = 0; b < 4; b++)
+                md[4 * i + b] = static_cast<unsigned char>(
+                        state[i] >> (24 - 8 * b));
+    };
+
+    int status = EX_OK;
+
+    for (auto size : numbers(sizes)) {
+        std::vector<unsigned char> message(size);
+        for (std::size_t i = 0; i < size; i++)
+            message[i] = static_cast<unsigned char>(i * 131 + (i >> 9));
+
+        unsigned char expected[32];
+        evp(message, expected);
+
+        for (auto count : numbers(counts)) {
+            unsigned int threads = static_cast<unsigned int>(count);
+            double rates[3] = {
+                    run(evp, threads, seconds, message, expected),
+                    run(lanes, threads, seconds, message, expected),
+                    run(scalar, threads, seconds, message, expected)
+            };
+            if (rates[1] < 0 || rates[2] < 0) {
+                std::cerr << "Error: Wrong digest for " << size
+                          << " bytes" << std::endl;
+                status = EX_SOFTWARE;
+            }
+
+            std::cout << std::setw(8) << size << " bytes "
+                      << std::setw(3) << threads << " threads"
+                      << std::fixed << std::setprecision(1)
+                      << "  evp " << std::setw(8) << rates[0]
+                      << "  engine " << std::setw(8) << rates[1]
+                      << "  scalar " << std::setw(8) << rates[2]
+                      << " MB/s" << std::endl;
+        }
+    }
+
+    return status;
+}
@@ -0,0 +1,452 @@
+/*! @file sign.cpp
+ *
+ * @brief Benchmark signatures per second for each key type
+ *
+ * A fresh key of each type is created in memory. It then signs data of the
+ * size of the signed attributes of a message with Smime::signData(), which
+ * does the private key operation of every signature. The dual profile
+ * signs with an RSA and an EC key, as for a sender with two pairs in the
+ * map file.
+ *
+ * Before the runs, every profile signs the data into the detached
+ * SignedData structure of a mail with a self-signed certificate per key.
+ * RSA and EC signatures are checked with CMS_verify(), Ed25519 signatures
+ * with EVP_DigestVerify() over the signed attributes, and the messageDigest
+ * attribute of every signer is compared with the digest of the data. The
+ * same check must fail for changed data and for a changed signature. A
+ * wrong result ends the benchmark.
+ *
+ * With more than one thread count, every profile runs once per count, so
+ * that contention shows up as throughput that does not grow with the
+ * threads. With --implicit, the digest is looked up by its NID for every
+ * message instead of using the one fetched at startup.
+ *
+ * @author Christian Roessner <c@roessner.co>
+ * @version 1607.1.4
+ * @date 2016-06-10
+ * @copyright Copyright 2016 Christian Roessner <c@roessner.co>
+ */
+
+#include <sysexits.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <boost/algorithm/string.hpp>
+#include <boost/program_options.hpp>
+
+#include <openssl/cms.h>
+#include <openssl/evp.h>
+#include <openssl/ec.h>
+#include <openssl/rsa.h>
+#include <openssl/x509.h>
+
+#include "credcache.h"
+#include "smime.h"
+
+namespace po = boost::program_options;
+using benchclock = std::chrono::steady_clock;
+
+//! @brief Turn on/off debugging output
+bool debug = false;
+
+/*!
+ * @brief Create a key in memory
+ *
+ * @return nullptr, if the key type is unknown or not supported
+ */
+static EVP_PKEY *makeKey(const std::string &type) {
+    int id = EVP_PKEY_RSA;
+    if (type == "p256" || type == "p384")
+        id = EVP_PKEY_EC;
+    else if (type == "ed25519")
+        id = EVP_PKEY_ED25519;
+    else if (type != "rsa2048" && type != "rsa3072" && type != "rsa4096")
+        return nullptr;
+
+    std::unique_ptr<EVP_PKEY_CTX, decltype(&EVP_PKEY_CTX_free)> pctx(
+            EVP_PKEY_CTX_new_id(id, nullptr), EVP_PKEY_CTX_free);
+    if (!pctx || EVP_PKEY_keygen_init(pctx.get()) != 1)
+        return nullptr;
+
+    if (id == EVP_PKEY_RSA
+        && EVP_PKEY_CTX_set_rsa_keygen_bits(
+                pctx.get(), std::stoi(type.substr(3))) != 1)
+        return nullptr;
+    if (id == EVP_PKEY_EC
+        && EVP_PKEY_CTX_set_ec_paramgen_curve_nid(
+                pctx.get(), type == "p256" ? NID_X9_62_prime256v1
+                                           : NID_secp384r1) != 1)
+        return nullptr;
+
+    EVP_PKEY *key = nullptr;
+    if (EVP_PKEY_keygen(pctx.get(), &key) != 1)
+        return nullptr;
+
+    return key;
+}
+
+/*!
+ * @brief Create a self-signed certificate for a key
+ *
+ * Signers are told apart by issuer and serial number, so every certificate
+ * of a profile needs its own serial number.
+ *
+ * @return nullptr, if it could not be created
+ */
+static X509 *makeCert(EVP_PKEY *key, long serial) {
+    std::unique_ptr<X509, decltype(&X509_free)> cert(X509_new(), X509_free);
+    if (!cert)
+        return nullptr;
+
+    X509_NAME *name = X509_get_subject_name(cert.get());
+    const EVP_MD *md = EVP_PKEY_id(key) == EVP_PKEY_ED25519
+                       ? nullptr : EVP_sha256();
+
+    if (X509_set_version(cert.get(), 2) != 1
+        || ASN1_INTEGER_set(X509_get_serialNumber(cert.get()), serial) != 1
+        || X509_gmtime_adj(X509_getm_notBefore(cert.get()), 0) == nullptr
+        || X509_gmtime_adj(X509_getm_notAfter(cert.get()), 86400) == nullptr
+        || X509_set_pubkey(cert.get(), key) != 1
+        || X509_NAME_add_entry_by_txt(
+                name, "CN", MBSTRING_ASC,
+                reinterpret_cast<const unsigned char *>("sigh-bench"), -1,
+                -1, 0) != 1
+        || X509_set_issuer_name(cert.get(), name) != 1
+        || X509_sign(cert.get(), key, md) <= 0)
+        return nullptr;
+
+    return cert.release();
+}
+
+/*!
+ * @brief The DER encoded SET OF signed attributes, that was signed
+ */
+static std::vector<unsigned char> signedAttributes(CMS_SignerInfo *si) {
+    std::vector<std::vector<unsigned char>> attributes;
+    std::size_t total = 0;
+
+    for (int i = 0; i < CMS_signed_get_attr_count(si); i++) {
+        X509_ATTRIBUTE *attr = CMS_signed_get_attr(si, i);
+        unsigned char *encoded = nullptr;
+        int len = i2d_X509_ATTRIBUTE(attr, &encoded);
+        if (len <= 0)
+            return {};
+        attributes.emplace_back(encoded, encoded + len);
+        OPENSSL_free(encoded);
+        total += static_cast<std::size_t>(len);
+    }
+    std::sort(attributes.begin(), attributes.end());
+
+    // The length in short or long form, X.690, 8.1.3
+    std::vector<unsigned char> length;
+    for (std::size_t n = total; n > 0; n >>= 8)
+        length.insert(length.begin(), static_cast<unsigned char>(n & 0xff));
+    if (total >= 0x80)
+        length.insert(length.begin(),
+                      static_cast<unsigned char>(0x80 | length.size()));
+    else
+        length.assign(1, static_cast<unsigned char>(total));
+
+    std::vector<unsigned char> tbs(1, V_ASN1_SET | V_ASN1_CONSTRUCTED);
+    tbs.insert(tbs.end(), length.begin(), length.end());
+    for (auto &it : attributes)
+        tbs.insert(tbs.end(), it.begin(), it.end());
+
+    return tbs;
+}
+
+/*!
+ * @brief Check a detached signature for the data
+ *
+ * @return false, if a signature or a message digest is wrong
+ */
+static bool verify(const std::vector<unsigned char> &der,
+                   const std::vector<unsigned char> &data,
+                   const std::vector<smime::credentials_t> &creds) {
+    const unsigned char *p = der.data();
+    std::unique_ptr<CMS_ContentInfo, decltype(&CMS_ContentInfo_free)> cms(
+            d2i_CMS_ContentInfo(nullptr, &p, static_cast<long>(der.size())),
+            CMS_ContentInfo_free);
+    if (!cms)
+        return false;
+
+    STACK_OF(CMS_SignerInfo) *infos = CMS_get0_SignerInfos(cms.get());
+    if (infos == nullptr
+        || sk_CMS_SignerInfo_num(infos) != static_cast<int>(creds.size()))
+        return false;
+
+    bool ed25519 = false;
+
+    for (int i = 0; i < sk_CMS_SignerInfo_num(infos); i++) {
+        CMS_SignerInfo *si = sk_CMS_SignerInfo_value(infos, i);
+        auto found = std::find_if(
+                creds.begin(), creds.end(),
+                [si](const smime::credentials_t &it) {
+                    return CMS_SignerInfo_cert_cmp(si, it->cert.get()) == 0;
+                });
+        if (found == creds.end())
+            return false;
+        const smime::Credentials &signer = **found;
+
+        // The messageDigest attribute must be the digest of the data
+        auto *digest = static_cast<ASN1_OCTET_STRING *>(
+                CMS_signed_get0_data_by_OBJ(
+                        si, OBJ_nid2obj(NID_pkcs9_messageDigest), -3,
+                        V_ASN1_OCTET_STRING));
+        unsigned char md[EVP_MAX_MD_SIZE];
+        unsigned int mdlen = 0;
+        if (digest == nullptr
+            || EVP_Digest(data.data(), data.size(), md, &mdlen,
+                          signer.digest(), nullptr) != 1
+            || ASN1_STRING_length(digest) != static_cast<int>(mdlen)
+            || std::memcmp(ASN1_STRING_get0_data(digest), md, mdlen) != 0)
+            return false;
+
+        if (EVP_PKEY_id(signer.key.get()) != EVP_PKEY_ED25519) {
+            CMS_SignerInfo_set1_signer_cert(si, signer.cert.get());
+            if (CMS_SignerInfo_verify(si) != 1)
+                return false;
+            continue;
+        }
+
+        /*
+         * OpenSSL does not verify Ed25519 SignerInfos, RFC8419. The
+         * signature covers the signed attributes as a SET, which are stored
+         * with the tag [0]
+         */
+        ed25519 = true;
+        std::vector<unsigned char> tbs = signedAttributes(si);
+        if (tbs.empty())
+            return false;
+        std::vector<unsigned char> stored(tbs);
+        stored[0] = 0xa0;
+        if (std::search(der.begin(), der.end(), stored.begin(), stored.end())
+            == der.end())
+            return false;
+
+        ASN1_OCTET_STRING *sig = CMS_SignerInfo_get0_signature(si);
+        std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)> mdctx(
+                EVP_MD_CTX_new(), EVP_MD_CTX_free);
+        if (!mdctx
+            || EVP_DigestVerifyInit(mdctx.get(), nullptr, nullptr, nullptr,
+                                    X509_get0_pubkey(signer.cert.get())) != 1
+            || EVP_DigestVerify(mdctx.get(), ASN1_STRING_get0_data(sig),
+                                static_cast<std::size_t>(
+                                        ASN1_STRING_length(sig)),
+                                tbs.data(), tbs.size()) != 1)
+            return false;
+    }
+
+    if (ed25519)
+        return true;
+
+    // The whole structure, as a mail client checks it
+    std::unique_ptr<BIO, decltype(&BIO_free)> content(
+            BIO_new_mem_buf(data.data(), static_cast<int>(data.size())),
+            BIO_free);
+
+    return content
+           && CMS_verify(cms.get(), nullptr, nullptr, content.get(), nullptr,
+                         CMS_NO_SIGNER_CERT_VERIFY | CMS_BINARY) == 1;
+}
+
+/*!
+ * @brief Sign the data and check the signature, a wrong one must fail
+ */
+static bool check(const std::vector<smime::credentials_t> &creds,
+                  const std::vector<unsigned char> &data) {
+    std::vector<unsigned char> der;
+    if (!smime::Smime::signContent(creds, data.data(), data.size(), der)
+        || !verify(der, data, creds))
+        return false;
+
+    std::vector<unsigned char> changed(data);
+    changed[0] ^= 1;
+    if (verify(der, changed, creds))
+        return false;
+
+    // Change the signature of the first signer
+    const unsigned char *p = der.data();
+    std::unique_ptr<CMS_ContentInfo, decltype(&CMS_ContentInfo_free)> cms(
+            d2i_CMS_ContentInfo(nullptr, &p, static_cast<long>(der.size())),
+            CMS_ContentInfo_free);
+    if (!cms)
+        return false;
+    ASN1_OCTET_STRING *sig = CMS_SignerInfo_get0_signature(
+            sk_CMS_SignerInfo_value(CMS_get0_SignerInfos(cms.get()), 0));
+    std::vector<unsigned char> bytes(
+            ASN1_STRING_get0_data(sig),
+            ASN1_STRING_get0_data(sig) + ASN1_STRING_length(sig));
+    bytes[bytes.size() / 2] ^= 1;
+    unsigned char *out = nullptr;
+    int len = 0;
+    if (ASN1_STRING_set(sig, bytes.data(), static_cast<int>(bytes.size()))
+        != 1 || (len = i2d_CMS_ContentInfo(cms.get(), &out)) <= 0)
+        return false;
+    std::vector<unsigned char> wrong(out, out + len);
+    OPENSSL_free(out);
+
+    return !verify(wrong, data, creds);
+}
+
+/*!
+ * @brief Sign messages from several threads for some time
+ *
+ * @return Messages per second or a negative number, if signing failed
+ */
+static double run(const std::vector<smime::credentials_t> &creds,
+                  unsigned int threads, double seconds, bool implicit,
+                  const std::vector<unsigned char> &data) {
+    std::atomic<bool> running(true);
+    std::atomic<bool> failed(false);
+    std::atomic<unsigned long> messages(0);
+    std::vector<std::thread> workers;
+
+    auto start = benchclock::now();
+
+    for (unsigned int t = 0; t < threads; t++) {
+        workers.emplace_back([&]() {
+            std::vector<unsigned char> sig;
+            unsigned long done = 0;
+
+            while (running.load(std::memory_order_relaxed)) {
+                for (auto &it : creds) {
+                    const EVP_MD *md = it->digest();
+                    if (implicit)
+                        md = EVP_get_digestbynid(EVP_MD_type(md));
+                    if (!smime::Smime::signData(*it, md, data.data(),
+                                                data.size(), sig)) {
+                        failed = true;
+                        running = false;
+                    }
+                }
+                done++;
+            }
+
+            messages += done;
+        });
+    }
+
+    std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+    running = false;
+    for (auto &it : workers)
+        it.join();
+
+    std::chrono::duration<double> elapsed = benchclock::now() - start;
+
+    return failed ? -1 : messages / elapsed.count();
+}
+
+int main(int argc, const char *argv[]) {
+    std::string profiles;
+    std::string counts;
+    double seconds;
+    std::size_t size;
+
+    po::options_description desc("The following options are available");
+    desc.add_options()
+            ("help,h", "produce help message")
+            ("keys,k", po::value<std::string>(&profiles)->default_value(
+                     "rsa2048,rsa3072,rsa4096,p256,p384,ed25519,rsa3072+p256"),
+             "Key types. A + signs with several keys per message")
+            ("seconds,s", po::value<double>(&seconds)->default_value(2),
+             "Seconds per key type")
+            ("threads,t", po::value<std::string>(&counts)->default_value(
+                     "1"), "Thread counts, for example 1,2,4,8")
+            ("implicit,i", po::bool_switch()->default_value(false),
+             "Look up the digest for every message")
+            ("size", po::value<std::size_t>(&size)->default_value(160),
+             "Bytes to sign")
+    ;
+
+    po::variables_map vm;
+    try {
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+    }
+    catch (const std::exception &e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        std::cout << desc << std::endl;
+        exit(EX_USAGE);
+    }
+    po::notify(vm);
+
+    if (vm.count("help")) {
+        std::cout << "Usage: sigh-bench-sign [options]" << std::endl
+                  << desc << std::endl;
+        exit(EX_USAGE);
+    }
+
+    init_openssl();
+
+    std::vector<unsigned char> data(size, 'a');
+    std::vector<std::string> list;
+    boost::split(list, profiles, boost::is_any_of(","),
+                 boost::token_compress_on);
+
+    std::vector<unsigned int> threads;
+    std::vector<std::string> parts;
+    boost::split(parts, counts, boost::is_any_of(","),
+                 boost::token_compress_on);
+    try {
+        for (auto &it : parts)
+            threads.push_back(static_cast<unsigned int>(std::stoul(it)));
+    }
+    catch (const std::exception &) {
+        std::cerr << "Error: Wrong thread counts " << counts << std::endl;
+        exit(EX_USAGE);
+    }
+
+    for (auto &profile : list) {
+        std::vector<std::string> types;
+        boost::split(types, profile, boost::is_any_of("+"),
+                     boost::token_compress_on);
+
+        std::vector<smime::credentials_t> creds;
+        for (auto &type : types) {
+            auto it = std::make_shared<smime::Credentials>();
+            it->key.reset(makeKey(type));
+            if (it->key)
+                it->cert.reset(makeCert(it->key.get(),
+                                        static_cast<long>(creds.size()) + 1));
+            if (!it->cert) {
+                std::cerr << "Error: Can not create a " << type
+                          << " key" << std::endl;
+                exit(EX_SOFTWARE);
+            }
+            creds.push_back(it);
+        }
+
+        if (!check(creds, data)) {
+            std::cerr << "Error: Wrong signature with " << profile
+                      << std::endl;
+            exit(EX_SOFTWARE);
+        }
+
+        for (auto &count : threads) {
+            double rate = run(creds, count, seconds,
+                              vm["implicit"].as<bool>(), data);
+            if (rate < 0) {
+                std::cerr << "Error: Signing with " << profile
+                          << " failed" << std::endl;
+                exit(EX_SOFTWARE);
+            }
+
+            std::cout << std::left << std::setw(16) << profile << std::right
+                      << std::setw(3) << count << " threads"
+                      << std::fixed << std::setprecision(1) << std::setw(10)
+                      << rate << " messages/s" << std::endl;
+        }
+    }
+
+    deinit_openssl();
+
+    return EX_OK;
+}
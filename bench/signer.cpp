@@ -0,0 +1,227 @@
+/*! @file signer.cpp
+ *
+ * @brief Benchmark the signer process against signing in the milter
+ *
+ * The signer service runs in a child process and listens on a unix
+ * socket, as with sigh --signer. Threads sign the same data once in the
+ * benchmark process and once through SignClient, which pipelines the
+ * requests of all threads over a few connections. The difference is the
+ * cost of the split mode.
+ *
+ * @author Christian Roessner <c@roessner.co>
+ * @version 1607.1.4
+ * @date 2016-06-10
+ * @copyright Copyright 2016 Christian Roessner <c@roessner.co>
+ */
+
+#include <sysexits.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <boost/algorithm/string.hpp>
+#include <boost/program_options.hpp>
+
+#include "credcache.h"
+#include "mapfile.h"
+#include "signclient.h"
+#include "signpool.h"
+#include "signservice.h"
+#include "smime.h"
+
+namespace po = boost::program_options;
+using benchclock = std::chrono::steady_clock;
+
+//! @brief Turn on/off debugging output
+bool debug = false;
+
+//! @brief Sign data into a signature
+using sign_t = std::function<bool(const std::vector<unsigned char> &,
+                                  std::vector<unsigned char> &)>;
+
+/*!
+ * @brief Sign messages from several threads for some time
+ *
+ * @return Messages per second or a negative number, if signing failed
+ */
+static double run(const sign_t &sign, unsigned int threads, double seconds,
+                  const std::vector<unsigned char> &data) {
+    std::atomic<bool> running(true);
+    std::atomic<bool> failed(false);
+    std::atomic<unsigned long> messages(0);
+    std::vector<std::thread> workers;
+
+    auto start = benchclock::now();
+
+    for (unsigned int t = 0; t < threads; t++) {
+        workers.emplace_back([&]() {
+            std::vector<unsigned char> sig;
+            unsigned long done = 0;
+
+            while (running.load(std::memory_order_relaxed)) {
+                if (!sign(data, sig)) {
+                    failed = true;
+                    running = false;
+                }
+                done++;
+            }
+
+            messages += done;
+        });
+    }
+
+    std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+    running = false;
+    for (auto &it : workers)
+        it.join();
+
+    std::chrono::duration<double> elapsed = benchclock::now() - start;
+
+    return failed ? -1 : messages / elapsed.count();
+}
+
+int main(int argc, const char *argv[]) {
+    std::string cert;
+    std::string key;
+    std::string socket;
+    std::string counts;
+    unsigned int connections;
+    double seconds;
+
+    po::options_description desc("The following options are available");
+    desc.add_options()
+            ("help,h", "produce help message")
+            ("cert,c", po::value<std::string>(&cert), "Certificate file")
+            ("key,k", po::value<std::string>(&key), "Key file")
+            ("socket", po::value<std::string>(&socket)->default_value(
+                     "/tmp/sigh-bench-signer.sock"), "Signer socket")
+            ("connections", po::value<unsigned int>(&connections)
+                     ->default_value(2), "Connections to the signer")
+            ("threads,t", po::value<std::string>(&counts)->default_value(
+                     "1"), "Thread counts, for example 1,2,4,8")
+            ("seconds,s", po::value<double>(&seconds)->default_value(2),
+             "Seconds per run")
+            ("debug", po::bool_switch()->default_value(false),
+             "Turn on debugging output")
+    ;
+
+    po::variables_map vm;
+    try {
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+    }
+    catch (const std::exception &e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        std::cout << desc << std::endl;
+        exit(EX_USAGE);
+    }
+    po::notify(vm);
+
+    if (vm.count("help") || cert.empty() || key.empty()) {
+        std::cout << "Usage: sigh-bench-signer [options]" << std::endl
+                  << desc << std::endl;
+        exit(EX_USAGE);
+    }
+
+    if (vm["debug"].as<bool>())
+        ::debug = true;
+
+    std::vector<unsigned int> threads;
+    std::vector<std::string> parts;
+    boost::split(parts, counts, boost::is_any_of(","),
+                 boost::token_compress_on);
+    try {
+        for (auto &it : parts)
+            threads.push_back(static_cast<unsigned int>(std::stoul(it)));
+    }
+    catch (const std::exception &) {
+        std::cerr << "Error: Wrong thread counts " << counts << std::endl;
+        exit(EX_USAGE);
+    }
+
+    // A closed connection must not end the benchmark
+    signal(SIGPIPE, SIG_IGN);
+
+    init_openssl();
+
+    bool missing;
+    smime::credentials_t creds =
+            smime::CredentialCache::get(cert, key, missing);
+    if (!creds) {
+        std::cerr << "Error: Can not load " << cert << " and " << key
+                  << std::endl;
+        exit(EX_DATAERR);
+    }
+    const EVP_MD *md = creds->digest();
+
+    // Listen before the fork, so that the first request finds the socket
+    if (!smime::SignService::listen(socket))
+        exit(EX_UNAVAILABLE);
+
+    pid_t child = fork();
+    if (child < 0) {
+        perror("Error: Unable to start the signer process");
+        exit(EX_OSERR);
+    }
+    if (child == 0) {
+        // The signer process signs with one thread per CPU core
+        smime::SignerPool::start(0, 256);
+        smime::SignService::allow({mapfile::Entry{"bench", cert, key}});
+        smime::SignService::run();
+        _exit(EX_OK);
+    }
+
+    sign_t local = [&](const std::vector<unsigned char> &data,
+                       std::vector<unsigned char> &sig) {
+        bool missed;
+        smime::credentials_t found =
+                smime::CredentialCache::get(cert, key, missed);
+        return found && smime::Smime::signData(*found, md, data.data(),
+                                               data.size(), sig);
+    };
+    sign_t remote = [&](const std::vector<unsigned char> &data,
+                        std::vector<unsigned char> &sig) {
+        return smime::SignClient::sign(cert, key, md, data.data(),
+                                       data.size(), sig);
+    };
+
+    std::vector<unsigned char> data(160, 'a');
+    int status = EX_OK;
+
+    std::vector<double> inProcess;
+    for (auto &count : threads)
+        inProcess.push_back(run(local, count, seconds, data));
+
+    // From here on, the credential cache loads no private keys
+    smime::SignClient::setSocket(socket, connections, 10);
+
+    for (std::size_t i = 0; i < threads.size(); i++) {
+        double split = run(remote, threads[i], seconds, data);
+        if (inProcess[i] < 0 || split < 0) {
+            std::cerr << "Error: Signing failed" << std::endl;
+            status = EX_SOFTWARE;
+            break;
+        }
+
+        std::cout << std::setw(3) << threads[i] << " threads"
+                  << std::fixed << std::setprecision(1)
+                  << "  in process " << std::setw(10) << inProcess[i]
+                  << "/s  signer " << std::setw(10) << split << "/s"
+                  << std::endl;
+    }
+
+    smime::SignClient::stop();
+    kill(child, SIGTERM);
+    waitpid(child, nullptr, 0);
+    unlink(socket.c_str());
+    deinit_openssl();
+
+    return status;
+}
@@ -0,0 +1,343 @@
+/*! @file transcoder.cpp
+ *
+ * @brief Benchmark the 7bit encoders and the encoding of multipart parts
+ *
+ * 8bit text is encoded as quoted-printable and random binary data as base64
+ * in body chunks, as the milter does. Both are compared with a byte by byte
+ * reference encoder, whose output must be the same.
+ *
+ * Then a multipart body with 8bit, binary, 7bit and message parts and a
+ * nested multipart is encoded with MultipartTranscoder in chunks of several
+ * sizes. The result must be the body with every 8bit and binary part
+ * encoded by the reference encoder and a new Content-Transfer-Encoding
+ * header.
+ *
+ * @author Christian Roessner <c@roessner.co>
+ * @version 1607.1.4
+ * @date 2016-06-10
+ * @copyright Copyright 2016 Christian Roessner <c@roessner.co>
+ */
+
+#include <sysexits.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include <boost/program_options.hpp>
+
+#include "multipart.h"
+#include "transcoder.h"
+
+namespace po = boost::program_options;
+using benchclock = std::chrono::steady_clock;
+
+//! @brief Turn on/off debugging output
+bool debug = false;
+
+//! @brief Body chunks are handed over in this size, as by the MTA
+static const std::size_t bodyChunk = 65536;
+
+static double since(benchclock::time_point start) {
+    std::chrono::duration<double> elapsed = benchclock::now() - start;
+
+    return elapsed.count();
+}
+
+/*!
+ * @brief Quoted-printable, one byte at a time, RFC2045, 6.7
+ */
+static std::string referenceQp(const std::string &data) {
+    static const char hexDigits[] = "0123456789ABCDEF";
+    std::string out;
+    std::size_t column = 0;
+
+    for (std::size_t i = 0; i < data.size(); i++) {
+        auto c = static_cast<unsigned char>(data[i]);
+        bool last = i + 1 == data.size();
+        char next = last ? '\0' : data[i + 1];
+
+        if (c == '\n' || (c == '\r' && next == '\n')) {
+            if (c == '\r')
+                i++;
+            out += "\r\n";
+            column = 0;
+            continue;
+        }
+
+        bool literal = ((c >= ' ' && c <= '~' && c != '=') || c == '\t')
+                       && !((c == ' ' || c == '\t')
+                            && (last || next == '\r' || next == '\n'));
+        std::string piece(1, static_cast<char>(c));
+        if (!literal)
+            piece = {'=', hexDigits[c >> 4], hexDigits[c & 0x0f]};
+
+        if (column + piece.size() > 75) {
+            out += "=\r\n";
+            column = 0;
+        }
+        out += piece;
+        column += piece.size();
+    }
+
+    return out;
+}
+
+/*!
+ * @brief Base64, one byte at a time, RFC2045, 6.8
+ */
+static std::string referenceBase64(const std::string &data) {
+    static const char alphabet[] =
+            "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+    std::size_t column = 0;
+
+    for (std::size_t i = 0; i < data.size(); i += 3) {
+        unsigned long bits = 0;
+        std::size_t count = std::min<std::size_t>(3, data.size() - i);
+        for (std::size_t b = 0; b < 3; b++)
+            bits = (bits << 8) | (b < count
+                    ? static_cast<unsigned char>(data[i + b]) : 0);
+
+        for (std::size_t b = 0; b < 4; b++)
+            out += b <= count ? alphabet[(bits >> (18 - 6 * b)) & 0x3f] : '=';
+        column += 4;
+        if (column == 76) {
+            out += "\r\n";
+            column = 0;
+        }
+    }
+    if (column > 0)
+        out += "\r\n";
+
+    return out;
+}
+
+/*!
+ * @brief Encode data in chunks with a Transcoder
+ */
+static std::string encodeChunks(mlt::Encoding encoding,
+                                const std::string &data) {
+    mlt::Transcoder transcoder;
+    std::string out;
+
+    transcoder.start(encoding);
+    for (std::size_t pos = 0; pos < data.size(); pos += bodyChunk)
+        out += transcoder.encode(data.data() + pos,
+                                 std::min(bodyChunk, data.size() - pos));
+    out += transcoder.finish();
+
+    return out;
+}
+
+/*!
+ * @brief A MIME part and what the milter should make of it
+ */
+struct Part {
+    std::string headers;
+    std::string encodedHeaders;
+    std::string body;
+    mlt::Encoding encoding = mlt::Encoding::NONE;
+    std::string boundary;
+    std::vector<Part> parts;
+};
+
+/*!
+ * @brief A leaf part. An encoded part gets a new header
+ */
+static Part leafPart(const std::string &type, const char *encoding,
+                     const std::string &body) {
+    Part part;
+    part.headers = "Content-Type: " + type + "\r\n";
+    part.encodedHeaders = part.headers;
+    part.body = body;
+    if (encoding != nullptr) {
+        part.headers += std::string("Content-Transfer-Encoding: ")
+                        + encoding + "\r\n";
+        part.encoding = mlt::Transcoder::select(encoding, type.c_str());
+        part.encodedHeaders += std::string("Content-Transfer-Encoding: ")
+                + (part.encoding == mlt::Encoding::NONE
+                   ? encoding : mlt::Transcoder::name(part.encoding))
+                + "\r\n";
+    }
+
+    return part;
+}
+
+/*!
+ * @brief The body of a part, as sent or as encoded by the milter
+ */
+static std::string partBody(const Part &part, bool encoded) {
+    if (part.boundary.empty()) {
+        if (!encoded)
+            return part.body;
+
+        switch (part.encoding) {
+            case mlt::Encoding::QUOTED_PRINTABLE:
+                return referenceQp(part.body);
+            case mlt::Encoding::BASE64:
+                return referenceBase64(part.body);
+            default:
+                return part.body;
+        }
+    }
+
+    std::string body = "This is a multi-part message in MIME format.\r\n";
+    for (auto &it : part.parts)
+        body += "\r\n--" + part.boundary + "\r\n"
+                + (encoded ? it.encodedHeaders : it.headers) + "\r\n"
+                + partBody(it, encoded);
+    body += "\r\n--" + part.boundary + "--\r\n";
+
+    return body;
+}
+
+int main(int argc, const char *argv[]) {
+    std::size_t size;
+    unsigned int rounds;
+
+    po::options_description desc("The following options are available");
+    desc.add_options()
+            ("help,h", "produce help message")
+            ("size", po::value<std::size_t>(&size)->default_value(16777216),
+             "Data size in bytes")
+            ("rounds,n", po::value<unsigned int>(&rounds)->default_value(5),
+             "Runs per encoder")
+    ;
+
+    po::variables_map vm;
+    try {
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+    }
+    catch (const std::exception &e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        std::cout << desc << std::endl;
+        exit(EX_USAGE);
+    }
+    po::notify(vm);
+
+    if (vm.count("help") || rounds == 0) {
+        std::cout << "Usage: sigh-bench-transcoder [options]" << std::endl
+                  << desc << std::endl;
+        exit(EX_USAGE);
+    }
+
+    std::mt19937 random(1607);
+
+    // Text with German umlauts in UTF-8, lines of up to 100 bytes
+    std::string text;
+    while (text.size() < size) {
+        std::size_t length = random() % 100;
+        for (std::size_t i = 0; i < length; i++) {
+            unsigned int r = random() % 64;
+            if (r == 0)
+                text += "\xc3\xa4";
+            else if (r == 1)
+                text += ' ';
+            else
+                text += static_cast<char>('a' + r % 26);
+        }
+        text += random() % 8 == 0 ? " \r\n" : "\r\n";
+    }
+    text.resize(size);
+
+    std::string binary(size, '\0');
+    for (auto &it : binary)
+        it = static_cast<char>(random());
+
+    int status = EX_OK;
+    double megabytes = static_cast<double>(size) * rounds / 1e6;
+
+    std::string fast;
+    std::string reference;
+    auto start = benchclock::now();
+    for (unsigned int i = 0; i < rounds; i++)
+        fast = encodeChunks(mlt::Encoding::QUOTED_PRINTABLE, text);
+    double qp = since(start);
+    start = benchclock::now();
+    for (unsigned int i = 0; i < rounds; i++)
+        reference = referenceQp(text);
+    double qpReference = since(start);
+    if (fast != reference) {
+        std::cerr << "Error: Wrong quoted-printable" << std::endl;
+        status = EX_SOFTWARE;
+    }
+
+    start = benchclock::now();
+    for (unsigned int i = 0; i < rounds; i++)
+        fast = encodeChunks(mlt::Encoding::BASE64, binary);
+    double base64 = since(start);
+    start = benchclock::now();
+    for (unsigned int i = 0; i < rounds; i++)
+        reference = referenceBase64(binary);
+    double base64Reference = since(start);
+    if (fast != reference) {
+        std::cerr << "Error: Wrong base64" << std::endl;
+        status = EX_SOFTWARE;
+    }
+
+    std::cout << size << " bytes" << std::endl
+              << "quoted-printable: " << megabytes / qp << " MB/s, reference "
+              << megabytes / qpReference << " MB/s" << std::endl
+              << "base64: " << megabytes / base64 << " MB/s, reference "
+              << megabytes / base64Reference << " MB/s" << std::endl;
+
+    // A delimiter line of another multipart and near misses in the text
+    Part alternative;
+    alternative.boundary = "inner";
+    alternative.headers = "Content-Type: multipart/alternative; "
+                          "boundary=\"inner\"\r\n";
+    alternative.encodedHeaders = alternative.headers;
+    alternative.parts.push_back(leafPart(
+            "text/plain; charset=utf-8", "8bit",
+            "Gr\xc3\xbc\xc3\x9f" "e\r\n--out\r\n--outer-\r\n--inner2\r\n"));
+    alternative.parts.push_back(leafPart(
+            "text/html; charset=utf-8", "8bit", text.substr(0, 200000)));
+
+    Part message;
+    message.boundary = "outer";
+    message.parts.push_back(leafPart("text/plain; charset=utf-8", "8bit",
+                                     text.substr(0, 300000)));
+    message.parts.push_back(leafPart("application/octet-stream", "binary",
+                                     binary.substr(0, 1000000)));
+    message.parts.push_back(alternative);
+    message.parts.push_back(leafPart("text/plain", "7bit",
+                                     "Nothing to encode\r\n"));
+    message.parts.push_back(leafPart("message/rfc822", "8bit",
+                                     "Subject: F\xc3\xbcr dich\r\n\r\n"
+                                     "Bleibt, wie es ist\r\n"));
+    message.parts.push_back(leafPart("image/png", "binary",
+                                     binary.substr(0, 1001)));
+
+    // The milter skips the preamble before the first delimiter
+    std::string body = partBody(message, false);
+    body.erase(0, body.find("--outer"));
+    std::string expected = partBody(message, true);
+    expected.erase(0, expected.find("--outer"));
+
+    for (std::size_t chunk : {1, 7, 4096, 65536}) {
+        mlt::MultipartTranscoder parts;
+        std::string out;
+
+        start = benchclock::now();
+        parts.start("outer");
+        for (std::size_t pos = 0; pos < body.size(); pos += chunk)
+            out += parts.encode(body.data() + pos,
+                                std::min(chunk, body.size() - pos));
+        out += parts.finish();
+        double took = since(start);
+
+        bool right = out == expected;
+        if (!right)
+            status = EX_SOFTWARE;
+
+        std::cout << "multipart in chunks of " << chunk << " bytes: "
+                  << body.size() / took / 1e6 << " MB/s, "
+                  << (right ? "parts encoded" : "wrong content")
+                  << std::endl;
+    }
+
+    return status;
+}
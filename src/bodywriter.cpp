@@ -0,0 +1,72 @@
+/*! @file bodywriter.cpp
+ *
+ * @brief Hand a new message body to the MTA in chunks
+ *
+ * @author Christian Roessner <c@roessner.co>
+ * @version 1607.1.4
+ * @date 2016-06-10
+ * @copyright Copyright 2016 Christian Roessner <c@roessner.co>
+ */
+
+#include "bodywriter.h"
+
+#include <iostream>
+
+namespace smime {
+    // Public
+
+    BodyWriter::BodyWriter(SMFICTX *ctx, std::size_t chunkSize)
+            : ctx(ctx),
+              chunkSize(chunkSize > 0 ? chunkSize : defaultChunkSize),
+              buffer(),
+              total(0),
+              error(false) {
+        buffer.reserve(this->chunkSize);
+    }
+
+    bool BodyWriter::write(const char *data, std::size_t len) {
+        while (len > 0 && !error) {
+            std::size_t room = chunkSize - buffer.size();
+            std::size_t part = len < room ? len : room;
+
+            buffer.insert(buffer.end(), data, data + part);
+            data += part;
+            len -= part;
+
+            if (buffer.size() == chunkSize)
+                flush();
+        }
+
+        return !error;
+    }
+
+    bool BodyWriter::flush(void) {
+        if (error || buffer.empty())
+            return !error;
+
+        if (smfi_replacebody(ctx, buffer.data(),
+                             static_cast<int>(buffer.size())) == MI_FAILURE) {
+            std::cerr << "Error: Could not replace message body" << std::endl;
+            error = true;
+            return false;
+        }
+
+        total += buffer.size();
+        buffer.clear();
+
+        return true;
+    }
+
+    void BodyWriter::setChunkSize(std::size_t size) {
+        defaultChunkSize = size;
+    }
+
+    std::size_t BodyWriter::getChunkSize(void) {
+        return defaultChunkSize;
+    }
+
+    // Init static
+
+    std::size_t BodyWriter::defaultChunkSize = 65536;
+
+}  // namespace smime
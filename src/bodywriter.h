@@ -0,0 +1,95 @@
+/*! @file bodywriter.h
+ *
+ * @brief Hand a new message body to the MTA in chunks
+ *
+ * @author Christian Roessner <c@roessner.co>
+ * @version 1607.1.4
+ * @date 2016-06-10
+ * @copyright Copyright 2016 Christian Roessner <c@roessner.co>
+ */
+
+#ifndef SRC_BODYWRITER_H_
+#define SRC_BODYWRITER_H_
+
+#include <libmilter/mfapi.h>
+
+#include <vector>
+
+extern bool debug;
+
+namespace smime {
+    /*!
+     * @brief Buffered writer for smfi_replacebody()
+     *
+     * smfi_replacebody() may be called several times in the end of message
+     * callback. Each call appends data to the new body. This class collects
+     * output until a configured chunk size is reached and then passes the
+     * chunk to the MTA, so that a signed message never needs to be held in
+     * memory as a whole.
+     */
+    class BodyWriter {
+    public:
+        /*!
+         * @brief Constructor
+         */
+        BodyWriter(SMFICTX *, std::size_t);
+
+        /*!
+         * @brief Destructor
+         */
+        ~BodyWriter(void) = default;
+
+        /*!
+         * @brief Append data to the new body
+         */
+        bool write(const char *, std::size_t);
+
+        /*!
+         * @brief Pass all buffered data to the MTA
+         */
+        bool flush(void);
+
+        /*!
+         * @brief A call to smfi_replacebody() failed
+         */
+        inline bool failed(void) const { return error; }
+
+        /*!
+         * @brief Number of bytes passed to the MTA so far
+         */
+        inline std::size_t written(void) const { return total; }
+
+        /*!
+         * @brief Set the chunk size for all new writers
+         */
+        static void setChunkSize(std::size_t);
+
+        /*!
+         * @brief The chunk size for all new writers
+         */
+        static std::size_t getChunkSize(void);
+
+    private:
+        /*!
+         * @brief The current client context
+         */
+        SMFICTX *ctx;
+
+        //! @brief Size of a chunk that is passed to the MTA
+        const std::size_t chunkSize;
+
+        //! @brief Data that was not yet passed to the MTA
+        std::vector<unsigned char> buffer;
+
+        //! @brief Number of bytes passed to the MTA
+        std::size_t total;
+
+        //! @brief smfi_replacebody() failed
+        bool error;
+
+        //! @brief Chunk size from the configuration
+        static std::size_t defaultChunkSize;
+    };
+}  // namespace smime
+
+#endif  // SRC_BODYWRITER_H_
@@ -0,0 +1,254 @@
+/*! @file boundary.cpp
+ *
+ * @brief Find the first MIME boundary of a multipart body
+ *
+ * @author Christian Roessner <c@roessner.co>
+ * @version 1607.1.4
+ * @date 2016-06-10
+ * @copyright Copyright 2016 Christian Roessner <c@roessner.co>
+ */
+
+#include "boundary.h"
+
+#include <strings.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define _BOUNDARY_SIMD
+#include <immintrin.h>
+#endif  // defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+
+namespace mlt {
+    /*!
+     * @brief Find a string without SIMD instructions
+     *
+     * Starts at the given offset. Used for the end of a buffer and on other
+     * CPUs.
+     */
+    static std::size_t findScalar(const char *data, std::size_t len,
+                                  const char *needle, std::size_t size,
+                                  std::size_t from) {
+        for (std::size_t i = from; i + size <= len; i++) {
+            if (data[i] == needle[0] && data[i + size - 1] == needle[size - 1]
+                && std::memcmp(data + i + 1, needle + 1, size - 2) == 0)
+                return i;
+        }
+
+        return std::string::npos;
+    }
+
+#if defined _BOUNDARY_SIMD
+    /*
+     * Both versions compare the first and the last byte of the string at
+     * 16 or 32 positions at once. Only positions where both match are
+     * compared in full.
+     */
+
+    static std::size_t findSse2(const char *data, std::size_t len,
+                                const char *needle, std::size_t size) {
+        const __m128i first = _mm_set1_epi8(needle[0]);
+        const __m128i last = _mm_set1_epi8(needle[size - 1]);
+        std::size_t i = 0;
+
+        for (; i + size - 1 + 16 <= len; i += 16) {
+            __m128i a = _mm_loadu_si128(
+                    reinterpret_cast<const __m128i *>(data + i));
+            __m128i b = _mm_loadu_si128(
+                    reinterpret_cast<const __m128i *>(data + i + size - 1));
+            unsigned int mask = static_cast<unsigned int>(_mm_movemask_epi8(
+                    _mm_and_si128(_mm_cmpeq_epi8(a, first),
+                                  _mm_cmpeq_epi8(b, last))));
+            while (mask != 0) {
+                std::size_t pos = i + __builtin_ctz(mask);
+                if (std::memcmp(data + pos + 1, needle + 1, size - 2) == 0)
+                    return pos;
+                mask &= mask - 1;
+            }
+        }
+
+        return findScalar(data, len, needle, size, i);
+    }
+
+    __attribute__((target("avx2")))
+    static std::size_t findAvx2(const char *data, std::size_t len,
+                                const char *needle, std::size_t size) {
+        const __m256i first = _mm256_set1_epi8(needle[0]);
+        const __m256i last = _mm256_set1_epi8(needle[size - 1]);
+        std::size_t i = 0;
+
+        for (; i + size - 1 + 32 <= len; i += 32) {
+            __m256i a = _mm256_loadu_si256(
+                    reinterpret_cast<const __m256i *>(data + i));
+            __m256i b = _mm256_loadu_si256(
+                    reinterpret_cast<const __m256i *>(data + i + size - 1));
+            unsigned int mask = static_cast<unsigned int>(
+                    _mm256_movemask_epi8(_mm256_and_si256(
+                            _mm256_cmpeq_epi8(a, first),
+                            _mm256_cmpeq_epi8(b, last))));
+            while (mask != 0) {
+                std::size_t pos = i + __builtin_ctz(mask);
+                if (std::memcmp(data + pos + 1, needle + 1, size - 2) == 0)
+                    return pos;
+                mask &= mask - 1;
+            }
+        }
+
+        return findScalar(data, len, needle, size, i);
+    }
+#endif  // defined _BOUNDARY_SIMD
+
+    // Public
+
+    BoundaryScanner::BoundaryScanner(void)
+            : active(false),
+              delimiter(),
+              held(),
+              released() { /* empty */ }
+
+    std::string BoundaryScanner::parameter(const char *value) {
+        const char *it = value;
+
+        while ((it = std::strchr(it, ';')) != nullptr) {
+            it++;
+            while (isspace(static_cast<unsigned char>(*it)))
+                it++;
+
+            const char *name = it;
+            while (*it != '\0' && *it != '=' && *it != ';'
+                   && !isspace(static_cast<unsigned char>(*it)))
+                it++;
+            std::size_t nameLen = static_cast<std::size_t>(it - name);
+
+            while (isspace(static_cast<unsigned char>(*it)))
+                it++;
+            if (*it != '=')
+                continue;
+            it++;
+            while (isspace(static_cast<unsigned char>(*it)))
+                it++;
+
+            // A quoted string or a token, RFC2045, 5.1
+            std::string result;
+            if (*it == '"') {
+                it++;
+                while (*it != '\0' && *it != '"') {
+                    if (*it == '\\' && *(it + 1) != '\0')
+                        it++;
+                    result += *it++;
+                }
+                if (*it == '"')
+                    it++;
+            } else {
+                while (*it != '\0' && *it != ';'
+                       && !isspace(static_cast<unsigned char>(*it)))
+                    result += *it++;
+            }
+
+            if (nameLen == 8 && strncasecmp(name, "boundary", 8) == 0)
+                return result;
+        }
+
+        return std::string();
+    }
+
+    void BoundaryScanner::start(const std::string &boundary) {
+        reset();
+        if (boundary.empty())
+            return;
+
+        delimiter = "\n--" + boundary;
+        held = "\n";
+        active = true;
+    }
+
+    std::size_t BoundaryScanner::scan(const char *data, std::size_t len) {
+        released.clear();
+        if (!active)
+            return 0;
+
+        const std::size_t size = delimiter.size();
+
+        // A delimiter that starts in the held back preamble
+        std::size_t keep = std::min(held.size(), size - 1);
+        std::string window(held, held.size() - keep);
+        window.append(data, std::min(len, size - 1));
+
+        std::size_t pos = find(window.data(), window.size(),
+                               delimiter.data(), size);
+        if (pos != std::string::npos && pos < keep) {
+            // The content starts after the line break
+            std::size_t begin = held.size() - keep + pos + 1;
+            released.assign(held, begin, std::string::npos);
+            finish();
+            return 0;
+        }
+
+        pos = find(data, len, delimiter.data(), size);
+        if (pos != std::string::npos) {
+            finish();
+            return pos + 1;
+        }
+
+        held.append(data, len);
+        if (held.size() > maxPreamble) {
+            stop();
+            return len;
+        }
+
+        return std::string::npos;
+    }
+
+    void BoundaryScanner::stop(void) {
+        if (!active)
+            return;
+
+        released.assign(held, 1, std::string::npos);
+        finish();
+    }
+
+    void BoundaryScanner::reset(void) {
+        finish();
+        delimiter.clear();
+        released.clear();
+    }
+
+    std::size_t BoundaryScanner::find(const char *data, std::size_t len,
+                                      const char *needle, std::size_t size) {
+        if (size == 0)
+            return 0;
+        if (len < size)
+            return std::string::npos;
+        if (size == 1) {
+            const void *found = std::memchr(data, needle[0], len);
+            return found == nullptr ? std::string::npos
+                   : static_cast<std::size_t>(
+                           static_cast<const char *>(found) - data);
+        }
+
+#if defined _BOUNDARY_SIMD
+        static const bool avx2 = __builtin_cpu_supports("avx2");
+
+        if (avx2)
+            return findAvx2(data, len, needle, size);
+
+        return findSse2(data, len, needle, size);
+#else
+        return findScalar(data, len, needle, size, 0);
+#endif  // defined _BOUNDARY_SIMD
+    }
+
+    // Private
+
+    void BoundaryScanner::finish(void) {
+        active = false;
+        held.clear();
+    }
+
+    // Init static
+
+    const std::size_t BoundaryScanner::maxPreamble;
+
+}  // namespace mlt
@@ -0,0 +1,112 @@
+/*! @file boundary.h
+ *
+ * @brief Find the first MIME boundary of a multipart body
+ *
+ * @author Christian Roessner <c@roessner.co>
+ * @version 1607.1.4
+ * @date 2016-06-10
+ * @copyright Copyright 2016 Christian Roessner <c@roessner.co>
+ */
+
+#ifndef SRC_BOUNDARY_H_
+#define SRC_BOUNDARY_H_
+
+#include <string>
+
+namespace mlt {
+    /*!
+     * @brief Skip the preamble of a multipart body, RFC2046, 5.1.1
+     *
+     * The body arrives in chunks. The scanner holds back everything before
+     * the first delimiter line "--boundary" and tells where the content
+     * after the preamble starts. A delimiter may be split across chunks.
+     *
+     * The preamble that was held back is handed out again, if no delimiter
+     * shows up within a size limit or until the end of the body, so that no
+     * content of a broken message gets lost.
+     */
+    class BoundaryScanner {
+    public:
+        /*!
+         * @brief Constructor
+         */
+        BoundaryScanner(void);
+
+        /*!
+         * @brief The boundary parameter of a Content-Type header value
+         *
+         * @return An empty string, if there is none
+         */
+        static std::string parameter(const char *);
+
+        /*!
+         * @brief Start to look for a boundary
+         */
+        void start(const std::string &);
+
+        /*!
+         * @brief The first delimiter has not been seen yet
+         */
+        inline bool scanning(void) const { return active; }
+
+        /*!
+         * @brief Look at the next chunk of the body
+         *
+         * @return Offset in the chunk, where the content after the preamble
+         * starts. pending() must be written first. std::string::npos, if
+         * the whole chunk belongs to the preamble
+         */
+        std::size_t scan(const char *, std::size_t);
+
+        /*!
+         * @brief Give up and hand out the preamble in pending()
+         */
+        void stop(void);
+
+        /*!
+         * @brief Content that was held back and must be written now
+         */
+        inline const std::string &pending(void) const { return released; }
+
+        /*!
+         * @brief Stop scanning and forget everything
+         */
+        void reset(void);
+
+        /*!
+         * @brief Find a string in a buffer with SIMD instructions
+         *
+         * @return Offset of the first match or std::string::npos
+         */
+        static std::size_t find(const char *, std::size_t, const char *,
+                                std::size_t);
+
+    private:
+        /*!
+         * @brief Stop scanning
+         */
+        void finish(void);
+
+        //! @brief A delimiter is looked for
+        bool active;
+
+        //! @brief "\n--" and the boundary
+        std::string delimiter;
+
+        /*!
+         * @brief The preamble so far
+         *
+         * The first byte is a line break that is not part of the body. The
+         * body starts at a line, so a delimiter is found at its beginning.
+         */
+        std::string held;
+
+        //! @brief Content to write before the rest of a chunk
+        std::string released;
+
+        //! @brief A longer preamble is given up
+        static const std::size_t maxPreamble = 65536;
+    };
+}  // namespace mlt
+
+#endif  // SRC_BOUNDARY_H_
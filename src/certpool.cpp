@@ -0,0 +1,212 @@
+/*! @file certpool.cpp
+ *
+ * @brief Shared pool of intermediate certificates
+ *
+ * @author Christian Roessner <c@roessner.co>
+ * @version 1607.1.4
+ * @date 2016-06-10
+ * @copyright Copyright 2016 Christian Roessner <c@roessner.co>
+ */
+
+#include "certpool.h"
+
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+
+#include <iostream>
+#include <mutex>
+#include <boost/filesystem.hpp>
+
+namespace fs = boost::filesystem;
+
+namespace smime {
+    //! @brief This lock protects the pool
+    static std::mutex poolLock;
+
+    //! @brief Maximum length of a chain. Protects against issuer loops
+    static const int maxChainDepth = 10;
+
+    // Public
+
+    void IntermediatePool::rebuild(const std::vector<std::string> &files,
+                                   const std::string &cadir) {
+        pool_t fresh;
+
+        for (auto &file : files)
+            readFile(fresh, file, true, false);
+
+        if (!cadir.empty()) {
+            try {
+                if (fs::is_directory(fs::path(cadir))) {
+                    for (auto &it : fs::directory_iterator(cadir)) {
+                        if (fs::is_regular_file(it.path()))
+                            readFile(fresh, it.path().string(), false, true);
+                    }
+                } else {
+                    std::cerr << "Error: Can not read CA directory " << cadir
+                              << std::endl;
+                }
+            }
+            catch (const std::exception &e) {
+                std::cerr << "Error: " << e.what() << std::endl;
+            }
+        }
+
+        if (::debug)
+            std::cout << "Intermediate pool: " << fresh.size()
+                      << " certificates" << std::endl;
+
+        std::lock_guard<std::mutex> guard(poolLock);
+
+        // Chains that are still in use hold their own references
+        pool.swap(fresh);
+        release(fresh);
+    }
+
+    void IntermediatePool::addFile(const std::string &file) {
+        pool_t extra;
+
+        readFile(extra, file, true, false);
+
+        std::lock_guard<std::mutex> guard(poolLock);
+
+        for (auto &it : extra)
+            insert(pool, it.second.cert, it.second.fromCaDir);
+    }
+
+    X509 *IntermediatePool::intern(X509 *cert) {
+        std::lock_guard<std::mutex> guard(poolLock);
+
+        X509 *pooled = insert(pool, cert, false);
+        X509_up_ref(pooled);
+
+        return pooled;
+    }
+
+    STACK_OF_X509_ptr IntermediatePool::chainFor(X509 *cert) {
+        STACK_OF_X509_ptr empty(nullptr, stackOfX509Deleter);
+
+        STACK_OF_X509_ptr stack(sk_X509_new_null(), stackOfX509Deleter);
+        if (!stack)
+            return empty;
+
+        std::lock_guard<std::mutex> guard(poolLock);
+
+        X509 *current = cert;
+        for (int depth = 0; depth < maxChainDepth; depth++) {
+            // A self-signed certificate ends the chain
+            if (selfSigned(current))
+                break;
+
+            unsigned long hash = X509_NAME_hash(
+                    X509_get_issuer_name(current));
+            X509 *issuer = nullptr;
+            bool fromCaDir = false;
+
+            auto range = pool.equal_range(hash);
+            for (auto it = range.first; it != range.second; ++it) {
+                if (X509_check_issued(it->second.cert, current)
+                    == X509_V_OK) {
+                    issuer = it->second.cert;
+                    fromCaDir = it->second.fromCaDir;
+                    break;
+                }
+            }
+            if (issuer == nullptr)
+                break;
+
+            // Never send a trust anchor from the CA directory
+            if (fromCaDir && selfSigned(issuer))
+                break;
+
+            if (sk_X509_push(stack.get(), issuer) == 0)
+                return empty;
+            X509_up_ref(issuer);
+
+            current = issuer;
+        }
+
+        if (sk_X509_num(stack.get()) == 0)
+            return empty;
+
+        return stack;
+    }
+
+    bool IntermediatePool::selfSigned(X509 *cert) {
+        return X509_NAME_cmp(X509_get_subject_name(cert),
+                             X509_get_issuer_name(cert)) == 0;
+    }
+
+    std::size_t IntermediatePool::size(void) {
+        std::lock_guard<std::mutex> guard(poolLock);
+
+        return pool.size();
+    }
+
+    // Private
+
+    void IntermediatePool::readFile(pool_t &target, const std::string &file,
+                                    bool skipFirst, bool fromCaDir) {
+        BIO_ptr bio(BIO_new_file(file.c_str(), "r"), bioDeleter);
+        if (!bio) {
+            if (::debug)
+                std::cout << "\tCan not open " << file << std::endl;
+            ERR_clear_error();
+            return;
+        }
+
+        STACK_OF_X509_INFO_ptr stackInfo(PEM_X509_INFO_read_bio(
+                bio.get(), nullptr, nullptr, nullptr),
+                                         stackOfX509InfoDeleter);
+        if (!stackInfo) {
+            if (::debug)
+                std::cout << "\tNo certificates in " << file << std::endl;
+            ERR_clear_error();
+            return;
+        }
+
+        bool first = skipFirst;
+        while (sk_X509_INFO_num(stackInfo.get())) {
+            X509_INFO_ptr xi(sk_X509_INFO_shift(stackInfo.get()),
+                             x509InfoDeleter);
+            if (xi->x509 == nullptr)
+                continue;
+            if (first) {
+                first = false;
+                continue;  // This is the S/MIME certificate
+            }
+            insert(target, xi->x509, fromCaDir);
+            xi->x509 = nullptr;
+        }
+    }
+
+    X509 *IntermediatePool::insert(pool_t &target, X509 *cert,
+                                   bool fromCaDir) {
+        unsigned long hash = X509_NAME_hash(X509_get_subject_name(cert));
+
+        auto range = target.equal_range(hash);
+        for (auto it = range.first; it != range.second; ++it) {
+            if (X509_cmp(it->second.cert, cert) == 0) {
+                // Certificates from map files win over the CA directory
+                it->second.fromCaDir = it->second.fromCaDir && fromCaDir;
+                X509_free(cert);
+                return it->second.cert;
+            }
+        }
+
+        target.emplace(hash, Entry{cert, fromCaDir});
+
+        return cert;
+    }
+
+    void IntermediatePool::release(pool_t &target) {
+        for (auto &it : target)
+            X509_free(it.second.cert);
+        target.clear();
+    }
+
+    // Init static
+
+    IntermediatePool::pool_t IntermediatePool::pool = {};
+
+}  // namespace smime
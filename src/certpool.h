@@ -0,0 +1,124 @@
+/*! @file certpool.h
+ *
+ * @brief Shared pool of intermediate certificates
+ *
+ * @author Christian Roessner <c@roessner.co>
+ * @version 1607.1.4
+ * @date 2016-06-10
+ * @copyright Copyright 2016 Christian Roessner <c@roessner.co>
+ */
+
+#ifndef SRC_CERTPOOL_H_
+#define SRC_CERTPOOL_H_
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "smime.h"
+
+extern bool debug;
+
+namespace smime {
+    /*!
+     * @brief Process wide store for intermediate certificates
+     *
+     * Many map file entries usually share the same few intermediate
+     * certificates. Instead of decoding them again for each sender, all
+     * certificates are collected once when the map file is loaded. Each
+     * certificate is stored only once and indexed by the hash of its subject
+     * name. A signing chain is built by following the issuer names starting
+     * at an S/MIME certificate. The returned chains hold references to the
+     * pooled certificates and do not copy them.
+     *
+     * Optionally, a directory with CA certificates can be added. Such
+     * certificates complete chains, but self-signed root certificates from
+     * this directory are never added to a chain.
+     */
+    class IntermediatePool {
+    public:
+        /*!
+         * @brief Replace the pool
+         *
+         * Read all certificate files from the map file and an optional CA
+         * directory. The first certificate of each map file certificate is
+         * the S/MIME certificate itself and is not added to the pool.
+         */
+        static void rebuild(const std::vector<std::string> &,
+                            const std::string &);
+
+        /*!
+         * @brief Add the intermediate certificates of a certificate file
+         *
+         * This is used, if a certificate file changed after the pool was
+         * built.
+         */
+        static void addFile(const std::string &);
+
+        /*!
+         * @brief Share a certificate with the pool
+         *
+         * The given reference is consumed. If an equal certificate is
+         * already pooled, the pooled one is returned instead. The returned
+         * reference belongs to the caller.
+         */
+        static X509 *intern(X509 *);
+
+        /*!
+         * @brief Build the chain of intermediate certificates
+         *
+         * @return A stack of shared certificates or nullptr, if no issuer
+         * was found
+         */
+        static STACK_OF_X509_ptr chainFor(X509 *);
+
+        /*!
+         * @brief Subject and issuer name of a certificate are equal
+         */
+        static bool selfSigned(X509 *);
+
+        /*!
+         * @brief Number of distinct certificates in the pool
+         */
+        static std::size_t size(void);
+
+    private:
+        /*!
+         * @brief A pooled certificate
+         */
+        struct Entry {
+            //! @brief The certificate. Freed when the pool is replaced
+            X509 *cert;
+
+            //! @brief The certificate came from the CA directory
+            bool fromCaDir;
+        };
+
+        using pool_t = std::unordered_multimap<unsigned long, Entry>;
+
+        /*!
+         * @brief Read all certificates of a PEM file into a pool
+         */
+        static void readFile(pool_t &, const std::string &, bool, bool);
+
+        /*!
+         * @brief Insert a certificate, if it is not already known
+         *
+         * The certificate reference is moved into the pool or freed, if it
+         * is a duplicate.
+         *
+         * @return The pooled certificate
+         */
+        static X509 *insert(pool_t &, X509 *, bool);
+
+        /*!
+         * @brief Free all certificates of a pool
+         */
+        static void release(pool_t &);
+
+        //! @brief Certificates indexed by their subject name hash
+        static pool_t pool;
+    };
+}  // namespace smime
+
+#endif  // SRC_CERTPOOL_H_
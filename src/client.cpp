@@ -15,20 +15,33 @@
 
 #include "client.h"
 
+#include <strings.h>
+#include <syslog.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
 #include <mutex>
 #include <iostream>
 #include <string>
 
+#include "crlf.h"
+#include "smime.h"
+
 namespace mlt {
     //! @brief This lock is for the unique identifier
     static std::mutex uniqueIdLock;
 
+    //! @brief This lock is for the message counters
+    static std::mutex statsLock;
+
     // Public
 
-    Client::Client(const std::string &hostname, struct sockaddr *hostaddr)
-            : fcontent(nullptr),
-              hostname(hostname),
-              ipAndPort(Client::prepareIPandPort(hostaddr)),
+    Client::Client(void)
+            : content(),
+              hostname("unknown"),
+              ipAndPort("unknown"),
+              protocol(0),
               // Increase uniqueId and initialize member id
               id([]() -> decltype(uniqueId) {
                   uniqueIdLock.lock();
@@ -38,59 +51,246 @@ namespace mlt {
                   return uniqueId;
               }()),
               mailflags(mlt::mailflags::TYPE_NONE),
-              optionalPreamble(true),
+              preamble(),
+              transcoder(),
+              parts(),
               genericError(false),
-              fcontentStatus(false) { /* empty */ }
+              contentError(false),
+              digests(),
+              contentWritten(false),
+              lastWasCR(false),
+              canonical(),
+              headerArena() { /* empty */ }
 
     Client::~Client() {
-        try {
-            cleanup();
-        } catch (const std::exception &e) {
-            std::cerr << "Error: " << e.what() << std::endl;
-        }
+        content.close();
     }
 
-    bool Client::createContentFile(const std::string &tmpdir) {
-        try {
-            cleanup();
-        }
-        catch (const std::exception &e) {
-            std::cerr << "Error: " << e.what() << std::endl;
+    void Client::setPeer(const std::string &name, struct sockaddr *hostaddr) {
+        hostname = name;
+        ipAndPort = prepareIPandPort(hostaddr);
+    }
+
+    bool Client::startContent(const std::string &tmpdir) {
+        content.open(tmpdir);
+
+        // Start a new content digest for this message
+        lastWasCR = false;
+        contentWritten = false;
+        digests.clear();
+
+        return addContentDigest(getDigestType());
+    }
+
+    bool Client::addContentDigest(const EVP_MD *type) {
+        if (type == nullptr || contentWritten)
             return false;
+
+        for (auto &it : digests)
+            if (EVP_MD_type(it.type) == EVP_MD_type(type))
+                return true;
+
+        ContentDigest digest(type);
+
+        // Concurrent messages share the SIMD lanes for SHA-256
+        if (EVP_MD_type(type) == NID_sha256
+            && smime::Sha256Engine::enabled()) {
+            digest.ctx.reset();
+            digest.lanes.reset(new smime::Sha256Stream());
+            digests.push_back(std::move(digest));
+            return true;
         }
 
-        if (!fs::exists(fs::path(tmpdir))
-            && !fs::is_directory(fs::path(tmpdir))) {
-            std::cerr << "Error: Can not access temporary directory"
+        if (!digest.ctx
+            || EVP_DigestInit_ex(digest.ctx.get(), type, nullptr) != 1) {
+            std::cerr << "Error: Unable to initialize content digest"
                       << std::endl;
             return false;
         }
+        digests.push_back(std::move(digest));
+
+        return true;
+    }
 
-        // Create a temporary file for the email content
-        temp = fs::unique_path(tmpdir + "/%%%%-%%%%-%%%%-%%%%.eml");
-        try {
-            fcontent = fopen(temp.string().c_str(), "w+");
-            fcontentStatus = true;
+    bool Client::writeContent(const char *data, size_t len) {
+        if (!content.isOpen() || digests.empty())
+            return false;
+
+        auto emit = [&](const char *part, size_t partlen) {
+            if (partlen == 0)
+                return true;
+            if (!content.write(part, partlen))
+                return false;
+            for (auto &it : digests) {
+                if (it.lanes)
+                    it.lanes->update(part, partlen);
+                else if (!it.ctx
+                         || EVP_DigestUpdate(it.ctx.get(), part,
+                                             partlen) != 1)
+                    return false;
+            }
+            return true;
+        };
+
+        contentWritten = true;
+
+        size_t lf = findBareLf(data, len, 0, lastWasCR);
+
+        // Nothing to convert. This is the common case for SMTP
+        if (lf == len) {
+            if (!emit(data, len))
+                return false;
+        } else {
+            size_t start = 0;
+
+            canonical.clear();
+            while (lf < len) {
+                canonical.append(data + start, lf - start);
+                canonical += '\r';
+                // The LF itself starts the next part
+                start = lf;
+                lf = findBareLf(data, len, lf + 1, lastWasCR);
+            }
+            canonical.append(data + start, len - start);
+
+            if (!emit(canonical.data(), canonical.size()))
+                return false;
         }
-        catch (const std::exception &e) {
-            fcontent = nullptr;
-            std::cerr << "Error: " << e.what() << std::endl;
+
+        if (len > 0)
+            lastWasCR = data[len - 1] == '\r';
+
+        return true;
+    }
+
+    bool Client::getContentDigest(const EVP_MD *type, unsigned char *md,
+                                  unsigned int *mdlen) {
+        for (auto &it : digests) {
+            if (EVP_MD_type(it.type) != EVP_MD_type(type))
+                continue;
+
+            if (it.lanes) {
+                unsigned char value[smime::Sha256Stream::digestSize];
+                it.lanes->final(value);
+                it.lanes.reset();
+                it.value.assign(value, value + sizeof(value));
+            } else if (it.ctx) {
+                unsigned char value[EVP_MAX_MD_SIZE];
+                unsigned int len = 0;
+                bool result = EVP_DigestFinal_ex(it.ctx.get(), value,
+                                                 &len) == 1;
+                it.ctx.reset();
+                if (!result)
+                    return false;
+                it.value.assign(value, value + len);
+            }
+
+            std::copy(it.value.begin(), it.value.end(), md);
+            *mdlen = static_cast<unsigned int>(it.value.size());
+
+            return !it.value.empty();
         }
 
-        return fcontent != nullptr;
+        return false;
+    }
+
+    const EVP_MD *Client::getDigestType(void) {
+        return smime::getDigest(NID_sha256);
     }
 
     void Client::reset() {
         sessionData.clear();
         markedHeaders.clear();
         mailflags = mlt::mailflags::TYPE_NONE;
-        optionalPreamble = true;
+        preamble.reset();
+        transcoder.reset();
+        parts.reset();
         genericError = false;
-        fcontentStatus = false;
+        contentError = false;
+        content.clear();
+        digests.clear();
+        contentWritten = false;
+        lastWasCR = false;
+        headerArena.reset();
+    }
+
+    void Client::markHeader(HeaderKind kind, const char *name,
+                            const char *value) {
+        markedHeaders.push_back({kind,
+                                 headerArena.copy(name, strlen(name)),
+                                 headerArena.copy(value, strlen(value))});
+    }
+
+    const MarkedHeader *Client::findHeader(HeaderKind kind) const {
+        for (auto &it : markedHeaders)
+            if (it.kind == kind)
+                return &it;
+
+        return nullptr;
+    }
+
+    bool Client::isProtectedType(const char *value) {
+        static const char *protectedTypes[] = {
+                "multipart/signed",
+                "multipart/encrypted",
+                "application/pkcs7-mime",
+                "application/x-pkcs7-mime"
+        };
+
+        if (value == nullptr)
+            return false;
+
+        while (isspace(static_cast<unsigned char>(*value)))
+            value++;
+
+        // The media type ends at the parameters, a comment or whitespace
+        std::size_t len = 0;
+        while (value[len] != '\0' && value[len] != ';' && value[len] != '('
+               && !isspace(static_cast<unsigned char>(value[len])))
+            len++;
+
+        for (auto &it : protectedTypes)
+            if (strlen(it) == len && strncasecmp(value, it, len) == 0)
+                return true;
+
+        return false;
+    }
+
+    void Client::countMessage(Disposition disposition) {
+        std::lock_guard<std::mutex> guard(statsLock);
+
+        switch (disposition) {
+            case Disposition::SPOOLED:
+                spooled++;
+                break;
+            case Disposition::NO_SIGNER:
+                noSigner++;
+                break;
+            case Disposition::PROTECTED:
+                alreadyProtected++;
+                break;
+        }
+    }
+
+    void Client::logStats(void) {
+        std::lock_guard<std::mutex> guard(statsLock);
+
+        if (::debug)
+            std::cout << "Messages: spooled=" << spooled
+                      << " nosigner=" << noSigner
+                      << " protected=" << alreadyProtected << std::endl;
+        syslog(LOG_INFO, "Messages: spooled=%lu nosigner=%lu protected=%lu",
+               spooled, noSigner, alreadyProtected);
     }
 
     // Private
 
+    Client::ContentDigest::ContentDigest(const EVP_MD *type)
+            : type(type),
+              ctx(EVP_MD_CTX_new(), EVP_MD_CTX_free),
+              lanes(nullptr),
+              value() { /* empty */ }
+
     const std::string Client::prepareIPandPort(struct sockaddr *hostaddr) {
         assert(hostaddr != nullptr);
 
@@ -137,25 +337,11 @@ namespace mlt {
         return ipport;
     }
 
-    void Client::cleanup(void) {
-        if (getFcontentStatus() || fcontent != nullptr) {
-            fclose(fcontent);
-            fcontent = nullptr;
-        }
-#if !defined _KEEP_TEMPFILES
-        // Remove temporary file
-        try {
-            if (fs::exists(temp) && fs::is_regular(temp))
-                fs::remove(temp);
-        }
-        catch (const std::exception &e) {
-            std::cerr << "Error: " << e.what() << std::endl;
-        }
-#endif  // ! defined _KEEP_TEMPFILES
-    }
-
 // Init static
 
     counter_t Client::uniqueId = 0UL;
+    counter_t Client::spooled = 0UL;
+    counter_t Client::noSigner = 0UL;
+    counter_t Client::alreadyProtected = 0UL;
 
 }  // namespace mlt
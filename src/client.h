@@ -25,6 +25,15 @@
 
 #include <boost/filesystem.hpp>
 
+#include <openssl/evp.h>
+
+#include "boundary.h"
+#include "mimeheader.h"
+#include "multipart.h"
+#include "sha256mb.h"
+#include "spool.h"
+#include "transcoder.h"
+
 namespace fs = boost::filesystem;
 
 extern bool debug;
@@ -32,7 +41,7 @@ extern bool debug;
 namespace mlt {
     using counter_t = u_long;
     using sessionData_t = std::map<std::string, std::string>;
-    using markedHeaders_t = std::vector<std::pair<std::string, std::string>>;
+    using markedHeaders_t = std::vector<MarkedHeader>;
 
     /*!
      * @brief Internal detecting flags
@@ -42,7 +51,20 @@ namespace mlt {
     enum mailflags {
         TYPE_NONE        = 0x0,
         TYPE_MIME        = 0x1,
-        TYPE_MULTIPART   = 0x2
+        TYPE_MULTIPART   = 0x2,
+        TYPE_PROTECTED   = 0x4
+    };
+
+    /*!
+     * @brief What happened to a message
+     */
+    enum class Disposition {
+        //! @brief The message was spooled for signing
+        SPOOLED,
+        //! @brief Accepted at MAIL FROM. The sender has no map file entry
+        NO_SIGNER,
+        //! @brief Accepted at the Content-Type. Already signed or encrypted
+        PROTECTED
     };
 
     /*!
@@ -52,36 +74,73 @@ namespace mlt {
     public:
         /*!
          * @brief Constructor
+         *
+         * The client is created in mlfi_negotiate(), before the peer is
+         * known. Set it with setPeer()
          */
-        Client(const std::string &, struct sockaddr *);
+        Client(void);
+
+        /*!
+         * @brief Remember the connected peer
+         */
+        void setPeer(const std::string &, struct sockaddr *);
 
         /*!
          * @brief Destructor
          *
-         * On client disconnect, a temporary file will be removed
+         * On client disconnect, the spool memory and file are released
          */
         virtual ~Client(void);
 
         /*!
-         * @brief Create a new temporary file for each email
+         * @brief Start the content of a new message
+         *
+         * The content is spooled in memory. A file in the given temp
+         * directory is only created for large messages. The default content
+         * digest is started.
+         */
+        bool startContent(const std::string &);
+
+        /*!
+         * @brief Append message content to the spool
          *
-         * Whenever a connected client sends a message, a new temporary file
-         * gets created. If the file cannot be created, the internal pointer
-         * is set to nullptr.
+         * Bare LF line endings are converted to CRLF, so that the spool
+         * always contains the canonical form that gets signed. The content
+         * digest is updated with the same bytes, so no second pass over the
+         * content is required for signing.
          */
-        bool createContentFile(const std::string &);
+        bool writeContent(const char *, size_t);
 
         /*!
-         * @brief The path to a temp file for a connected client
+         * @brief Shortcut for writeContent()
          */
-        inline const std::string & getTempFile() const {
-            return temp.string();
+        inline bool writeContent(const std::string &content) {
+            return writeContent(content.data(), content.size());
         }
 
         /*!
-         * @brief Status of the temp file
+         * @brief Compute a further content digest while receiving
+         *
+         * Must be called before any content was written. The default digest
+         * is always computed.
+         */
+        bool addContentDigest(const EVP_MD *);
+
+        /*!
+         * @brief The content digest for a digest algorithm
+         *
+         * The digest is finished on the first call. Further calls return
+         * the same value.
+         *
+         * @return false, if this digest was not computed while receiving
          */
-        inline bool getFcontentStatus(void) { return fcontentStatus; }
+        bool getContentDigest(const EVP_MD *, unsigned char *,
+                              unsigned int *);
+
+        /*!
+         * @brief The digest algorithm that is always computed
+         */
+        static const EVP_MD *getDigestType(void);
 
         /*!
          * @brief Clear existing data structures for a client
@@ -92,24 +151,65 @@ namespace mlt {
          */
         void reset(void);
 
+        /*!
+         * @brief Remember a header until the end of the message
+         *
+         * The text is copied into the arena of the message.
+         */
+        void markHeader(HeaderKind, const char *, const char *);
+
+        /*!
+         * @brief The first remembered header of a kind
+         *
+         * @return nullptr, if there is none
+         */
+        const MarkedHeader *findHeader(HeaderKind) const;
+
+        /*!
+         * @brief The top-level Content-Type of a signed or encrypted message
+         *
+         * Only the media type of the header value is compared, not its
+         * parameters.
+         */
+        static bool isProtectedType(const char *);
+
+        /*!
+         * @brief Count a message for the statistics
+         */
+        static void countMessage(Disposition);
+
+        /*!
+         * @brief Write message counters to syslog
+         */
+        static void logStats(void);
+
         //! @brief SMTP session data map
         sessionData_t sessionData;
 
         /*!
          * @brief List of headers to be removed from original message
          *
-         * First element is a mail header key, second its header value
+         * Names and values point into the header arena. They are valid
+         * until reset() is called.
          */
         markedHeaders_t markedHeaders;
 
-        //! @brief Email content gets stored in a temp file
-        FILE *fcontent;
+        //! @brief Content of the current message
+        Spool content;
 
         //! @brief Hostname of a connected client
-        const std::string hostname;
+        std::string hostname;
 
         //! @brief IPv4/IPv6:port of a connected client
-        const std::string ipAndPort;
+        std::string ipAndPort;
+
+        /*!
+         * @brief Protocol steps agreed in mlfi_negotiate()
+         *
+         * Tells, which callbacks must not reply. 0, if the MTA did not
+         * negotiate.
+         */
+        u_long protocol;
 
         //! @brief Identifier that a client got after a connect
         const counter_t id;
@@ -117,12 +217,26 @@ namespace mlt {
         //! @brief Current detected header flags ORed together
         u_int8_t mailflags;
 
-        //! @brief Flag that signals an existing MIME preamble
-        bool optionalPreamble;
+        //! @brief Skips the preamble of a multipart body
+        BoundaryScanner preamble;
+
+        //! @brief Encodes an 8bit or binary body in 7bit before signing
+        Transcoder transcoder;
+
+        //! @brief Encodes 8bit and binary parts of a multipart body
+        MultipartTranscoder parts;
 
         //! @brief If an error occurs while signing the mail, this flag is set
         bool genericError;
 
+        /*!
+         * @brief Writing the content failed
+         *
+         * Set by callbacks that do not reply. Reported by the next callback
+         * that does.
+         */
+        bool contentError;
+
     private:
         /*!
          * @brief Convert struct sockaddr to a string representation
@@ -135,11 +249,6 @@ namespace mlt {
          */
         static const std::string prepareIPandPort(struct sockaddr *);
 
-        /*!
-         * @brief Close remaining content file and remove it safely
-         */
-        void cleanup(void);
-
         /*!
          * @brief Unique identifier
          *
@@ -148,11 +257,48 @@ namespace mlt {
          */
         static counter_t uniqueId;
 
-        //! @brief Name of a temporary file for email content
-        fs::path temp;
+        //! @brief Number of spooled messages
+        static counter_t spooled;
+
+        //! @brief Number of messages accepted at MAIL FROM
+        static counter_t noSigner;
+
+        //! @brief Number of signed or encrypted messages accepted at the header
+        static counter_t alreadyProtected;
+
+        /*!
+         * @brief A digest over everything written with writeContent()
+         */
+        struct ContentDigest {
+            ContentDigest(const EVP_MD *);
+
+            //! @brief The digest algorithm
+            const EVP_MD *type;
+
+            //! @brief Running digest. nullptr, when it was finished
+            std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)> ctx;
+
+            //! @brief Running SHA-256 in the multi-buffer engine, if used
+            std::unique_ptr<smime::Sha256Stream> lanes;
+
+            //! @brief The finished digest
+            std::vector<unsigned char> value;
+        };
+
+        //! @brief All content digests of the current message
+        std::vector<ContentDigest> digests;
+
+        //! @brief Content was written since the message was started
+        bool contentWritten;
+
+        //! @brief The last byte written was a CR
+        bool lastWasCR;
+
+        //! @brief A chunk with converted line endings, reused for the next
+        std::string canonical;
 
-        //! @brief The status of the tem file. Closed (false), open (true)
-        bool fcontentStatus;
+        //! @brief Text of the marked headers
+        Arena headerArena;
     };
 }  // namespace mlt
 
@@ -28,16 +28,16 @@ namespace util {
      * @param x A string literal
      * @return A pointer to char
      */
-    auto ccp = [](const std::string &str) {
+    inline char *ccp(const std::string &str) {
         return const_cast<char *> (str.c_str());
-    };
+    }
 
     /*!
      * @brief Data structure for each client connection
      */
-    auto mlfipriv = [](SMFICTX *ctx) {
+    inline mlt::Client *mlfipriv(SMFICTX *ctx) {
         return static_cast<mlt::Client *> (smfi_getpriv(ctx));
-    };
+    }
 }  // namespace util
 
 #endif  // SRC_UTIL_H_
@@ -10,7 +10,10 @@
 
 #include "config.h"
 
+#include <strings.h>
+
 #include <iostream>
+#include <limits>
 
 #include <boost/filesystem.hpp>
 #include <boost/property_tree/ptree.hpp>
@@ -21,6 +24,33 @@ namespace fs = boost::filesystem;
 namespace conf {
     using boost::any_cast;
 
+    /*!
+     * @brief A boolean setting of the Milter section
+     *
+     * Accepts yes/no, true/false, on/off and 1/0. A wrong value is reported
+     * and the default is used.
+     */
+    static bool flag(const boost::property_tree::ptree &pt,
+                     const std::string &key, bool fallback) {
+        boost::optional<std::string> value =
+                pt.get_optional<std::string>("Milter." + key);
+        if (!value)
+            return fallback;
+
+        for (const char *it : {"yes", "true", "on", "1"})
+            if (strcasecmp(value->c_str(), it) == 0)
+                return true;
+        for (const char *it : {"no", "false", "off", "0"})
+            if (strcasecmp(value->c_str(), it) == 0)
+                return false;
+
+        std::cerr << "Error: " << key << " must be yes or no, not "
+                  << *value << ". Using " << (fallback ? "yes" : "no")
+                  << std::endl;
+
+        return fallback;
+    }
+
     // Public
 
     MilterCfg::MilterCfg(const po::variables_map &vm) {
@@ -82,13 +112,128 @@ namespace conf {
             param["tmpdir"] = defaults.tmpdir;
         }
 
-#if !__APPLE__ && !defined _NOT_DAEMONIZE
         try {
-            param["daemon"] = pt.get<bool>("Milter.daemon");
+            param["spoolsize"] = pt.get<std::size_t>("Milter.spoolsize");
+        }
+        catch (...) {
+            param["spoolsize"] = defaults.spoolsize;
+        }
+
+        try {
+            param["cachesize"] = pt.get<std::size_t>("Milter.cachesize");
+        }
+        catch (...) {
+            param["cachesize"] = defaults.cachesize;
+        }
+
+        try {
+            param["prewarmthreads"] =
+                    pt.get<unsigned int>("Milter.prewarmthreads");
+        }
+        catch (...) {
+            param["prewarmthreads"] = defaults.prewarmthreads;
+        }
+
+        param["snapshot"] = flag(pt, "snapshot", defaults.snapshot);
+
+        try {
+            param["snapshotfile"] = pt.get<std::string>("Milter.snapshotfile");
+        }
+        catch (...) {
+            param["snapshotfile"] = defaults.snapshotfile;
+        }
+
+        try {
+            // Read signed, so that negative values are not wrapped around
+            long long chunksize = pt.get<long long>("Milter.chunksize");
+            if (chunksize < static_cast<long long>(defaults.minchunksize)
+                || chunksize > std::numeric_limits<int>::max()) {
+                std::cerr << "Error: chunksize must be between "
+                          << defaults.minchunksize << " and "
+                          << std::numeric_limits<int>::max()
+                          << ". Using " << defaults.chunksize << std::endl;
+                param["chunksize"] = defaults.chunksize;
+            } else {
+                param["chunksize"] = static_cast<std::size_t>(chunksize);
+            }
+        }
+        catch (...) {
+            param["chunksize"] = defaults.chunksize;
+        }
+
+        try {
+            param["cadir"] = pt.get<std::string>("Milter.cadir");
+        }
+        catch (...) {
+            param["cadir"] = defaults.cadir;
+        }
+
+        try {
+            param["signthreads"] = pt.get<unsigned int>("Milter.signthreads");
+        }
+        catch (...) {
+            param["signthreads"] = defaults.signthreads;
+        }
+
+        try {
+            param["signqueue"] = pt.get<std::size_t>("Milter.signqueue");
         }
         catch (...) {
-            param["daemon"] = defaults.daemon;
+            param["signqueue"] = defaults.signqueue;
+        }
+
+        try {
+            param["pkcs11module"] = pt.get<std::string>("Milter.pkcs11module");
         }
+        catch (...) {
+            param["pkcs11module"] = defaults.pkcs11module;
+        }
+
+        try {
+            param["pkcs11pin"] = pt.get<std::string>("Milter.pkcs11pin");
+        }
+        catch (...) {
+            param["pkcs11pin"] = defaults.pkcs11pin;
+        }
+
+        try {
+            param["pkcs11sessions"] =
+                    pt.get<unsigned int>("Milter.pkcs11sessions");
+        }
+        catch (...) {
+            param["pkcs11sessions"] = defaults.pkcs11sessions;
+        }
+
+        param["multibuffer"] = flag(pt, "multibuffer", defaults.multibuffer);
+
+        try {
+            param["signersocket"] =
+                    pt.get<std::string>("Milter.signersocket");
+        }
+        catch (...) {
+            param["signersocket"] = defaults.signersocket;
+        }
+
+        try {
+            param["signerconnections"] =
+                    pt.get<unsigned int>("Milter.signerconnections");
+        }
+        catch (...) {
+            param["signerconnections"] = defaults.signerconnections;
+        }
+
+        try {
+            param["signertimeout"] =
+                    pt.get<unsigned int>("Milter.signertimeout");
+        }
+        catch (...) {
+            param["signertimeout"] = defaults.signertimeout;
+        }
+
+        param["transcode"] = flag(pt, "transcode", defaults.transcode);
+
+#if !__APPLE__ && !defined _NOT_DAEMONIZE
+        param["daemon"] = flag(pt, "daemon", defaults.daemon);
 #endif  // !__APPLE__ && !defined _NOT_DAEMONIZE
 
         if (::debug) {
@@ -117,6 +262,54 @@ namespace conf {
             std::cout << "tmpdir="
                 << any_cast<std::string>(param["tmpdir"])
                 << std::endl;
+            std::cout << "spoolsize="
+                << any_cast<std::size_t>(param["spoolsize"])
+                << std::endl;
+            std::cout << "cachesize="
+                << any_cast<std::size_t>(param["cachesize"])
+                << std::endl;
+            std::cout << "prewarmthreads="
+                << any_cast<unsigned int>(param["prewarmthreads"])
+                << std::endl;
+            std::cout << "snapshot="
+                << std::boolalpha << any_cast<bool>(param["snapshot"])
+                << std::endl;
+            std::cout << "snapshotfile="
+                << any_cast<std::string>(param["snapshotfile"])
+                << std::endl;
+            std::cout << "chunksize="
+                << any_cast<std::size_t>(param["chunksize"])
+                << std::endl;
+            std::cout << "cadir="
+                << any_cast<std::string>(param["cadir"])
+                << std::endl;
+            std::cout << "signthreads="
+                << any_cast<unsigned int>(param["signthreads"])
+                << std::endl;
+            std::cout << "signqueue="
+                << any_cast<std::size_t>(param["signqueue"])
+                << std::endl;
+            std::cout << "pkcs11module="
+                << any_cast<std::string>(param["pkcs11module"])
+                << std::endl;
+            std::cout << "pkcs11sessions="
+                << any_cast<unsigned int>(param["pkcs11sessions"])
+                << std::endl;
+            std::cout << "multibuffer="
+                << any_cast<bool>(param["multibuffer"])
+                << std::endl;
+            std::cout << "signersocket="
+                << any_cast<std::string>(param["signersocket"])
+                << std::endl;
+            std::cout << "signerconnections="
+                << any_cast<unsigned int>(param["signerconnections"])
+                << std::endl;
+            std::cout << "signertimeout="
+                << any_cast<unsigned int>(param["signertimeout"])
+                << std::endl;
+            std::cout << "transcode="
+                << std::boolalpha << any_cast<bool>(param["transcode"])
+                << std::endl;
         }
     }
 }  // namespace conf
\ No newline at end of file
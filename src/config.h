@@ -82,6 +82,42 @@ namespace conf {
             std::string mapfile = std::string();
             //! @brief Location for temporary files
             std::string tmpdir = "/tmp";
+            //! @brief Messages up to this size are kept in memory
+            std::size_t spoolsize = 65536;
+            //! @brief Number of parsed credentials kept in memory
+            std::size_t cachesize = 1000;
+            //! @brief Threads that load all credentials on (re)load
+            unsigned int prewarmthreads = 4;
+            //! @brief Keep a binary snapshot of all credentials
+            bool snapshot = false;
+            //! @brief Snapshot file. Empty means the map file name + .snap
+            std::string snapshotfile = std::string();
+            //! @brief Size of body chunks passed to the MTA
+            std::size_t chunksize = 65536;
+            //! @brief Smallest accepted chunk size
+            std::size_t minchunksize = 4096;
+            //! @brief Optional directory with CA certificates
+            std::string cadir = std::string();
+            //! @brief Signing threads. 0 means one per CPU core
+            unsigned int signthreads = 0;
+            //! @brief Maximum number of messages waiting for a signing thread
+            std::size_t signqueue = 256;
+            //! @brief Optional PKCS#11 module for keys in tokens
+            std::string pkcs11module = std::string();
+            //! @brief PIN for PKCS#11 tokens
+            std::string pkcs11pin = std::string();
+            //! @brief Sessions per token. 0 means one per signing thread
+            unsigned int pkcs11sessions = 0;
+            //! @brief Hash concurrent messages in SIMD lanes
+            bool multibuffer = true;
+            //! @brief Optional socket of the signer process
+            std::string signersocket = std::string();
+            //! @brief Connections to the signer process
+            unsigned int signerconnections = 2;
+            //! @brief Seconds to wait for the signer process
+            unsigned int signertimeout = 10;
+            //! @brief Encode 8bit and binary bodies in 7bit before signing
+            bool transcode = false;
         } defaults;
     };
 
@@ -90,7 +126,7 @@ namespace conf {
     template <typename T, typename R>
     R MilterCfg::getValue(const std::string &key) {
         if (param.count(key) == 0)
-            return "";
+            return R();
         return any_cast<T>(param[key]);
     }
 }  // namespace conf
@@ -0,0 +1,442 @@
+/*! @file credcache.cpp
+ *
+ * @brief Cache parsed S/MIME signing credentials
+ *
+ * @author Christian Roessner <c@roessner.co>
+ * @version 1607.1.4
+ * @date 2016-06-10
+ * @copyright Copyright 2016 Christian Roessner <c@roessner.co>
+ */
+
+#include "credcache.h"
+
+#include <sys/stat.h>
+#include <syslog.h>
+
+#include <openssl/err.h>
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <mutex>
+#include <thread>
+
+#include "certpool.h"
+#include "signclient.h"
+#include "snapshot.h"
+
+namespace smime {
+    //! @brief This lock protects the LRU list, its index and the counters
+    static std::mutex cacheLock;
+
+    // Public
+
+    bool FileStamp::operator==(const FileStamp &other) const {
+        return dev == other.dev
+               && ino == other.ino
+               && size == other.size
+               && mtime == other.mtime
+               && ctime == other.ctime;
+    }
+
+    Credentials::Credentials(void)
+            : cert(nullptr, x509Deleter),
+              key(nullptr, evpPkeyDeleter),
+              token(nullptr),
+              remoteCert(),
+              remoteKey(),
+              chain(nullptr, stackOfX509Deleter),
+              certStamp(),
+              keyStamp() { /* empty */ }
+
+    const EVP_MD *Credentials::digest(void) const {
+        if (!key)
+            return nullptr;
+
+        switch (EVP_PKEY_id(key.get())) {
+            case EVP_PKEY_RSA:
+                return getDigest(NID_sha256);
+            case EVP_PKEY_EC:
+                if (EVP_PKEY_bits(key.get()) <= 256)
+                    return getDigest(NID_sha256);
+                if (EVP_PKEY_bits(key.get()) <= 384)
+                    return getDigest(NID_sha384);
+                return getDigest(NID_sha512);
+            case EVP_PKEY_ED25519:
+                return getDigest(NID_sha512);
+            default:
+                return nullptr;
+        }
+    }
+
+    credentials_t CredentialCache::get(const std::string &cert,
+                                       const std::string &key,
+                                       bool &missing) {
+        FileStamp certStamp;
+        FileStamp keyStamp;
+
+        missing = !stamp(cert, certStamp) || !stampKey(key, keyStamp);
+        if (missing)
+            return nullptr;
+
+        std::string id = cert + '\0' + key;
+
+        {
+            std::lock_guard<std::mutex> guard(cacheLock);
+
+            auto found = index.find(id);
+            if (found != index.end()) {
+                const credentials_t &entry = found->second->second;
+                if (entry->certStamp == certStamp
+                    && entry->keyStamp == keyStamp) {
+                    ++hits;
+                    lru.splice(lru.begin(), lru, found->second);
+                    return entry;
+                }
+                // Files changed on disk
+                lru.erase(found->second);
+                index.erase(found);
+            }
+            ++misses;
+        }
+
+        // Parse outside the lock. Other messages must not wait for us
+        credentials_t entry = load(cert, key);
+        if (!entry)
+            return nullptr;
+
+        std::lock_guard<std::mutex> guard(cacheLock);
+
+        auto found = index.find(id);
+        if (found != index.end()) {
+            // Another thread was faster
+            lru.erase(found->second);
+            index.erase(found);
+        }
+
+        if (capacity == 0)
+            return entry;
+
+        lru.emplace_front(id, entry);
+        index[id] = lru.begin();
+
+        while (lru.size() > capacity) {
+            index.erase(lru.back().first);
+            lru.pop_back();
+        }
+
+        return entry;
+    }
+
+    void CredentialCache::setCapacity(std::size_t size) {
+        std::lock_guard<std::mutex> guard(cacheLock);
+
+        capacity = size;
+        while (lru.size() > capacity) {
+            index.erase(lru.back().first);
+            lru.pop_back();
+        }
+    }
+
+    void CredentialCache::clear(void) {
+        std::lock_guard<std::mutex> guard(cacheLock);
+
+        index.clear();
+        lru.clear();
+    }
+
+    std::size_t CredentialCache::prewarm(
+            const std::vector<mapfile::Entry> &entries,
+            unsigned int threads) {
+        std::atomic<std::size_t> next(0);
+        std::atomic<std::size_t> failed(0);
+        std::vector<std::thread> workers;
+        std::size_t cached;
+
+        if (threads == 0 || entries.empty())
+            return 0;
+        if (threads > entries.size())
+            threads = static_cast<unsigned int>(entries.size());
+
+        {
+            std::lock_guard<std::mutex> guard(cacheLock);
+            cached = capacity;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+
+        auto warm = [&]() {
+            std::size_t i;
+            while ((i = next++) < entries.size()) {
+                const mapfile::Entry &entry = entries[i];
+                bool missing = false;
+
+                // The OpenSSL error queue is per thread
+                ERR_clear_error();
+                if (i < cached) {
+                    if (get(entry.cert, entry.key, missing))
+                        continue;
+                } else {
+                    // Only checked. Caching it would push out another entry
+                    FileStamp unused;
+                    if (load(entry.cert, entry.key))
+                        continue;
+                    missing = !stamp(entry.cert, unused)
+                              || !stampKey(entry.key, unused);
+                }
+
+                ++failed;
+                if (missing) {
+                    syslog(LOG_ERR, "Prewarm: missing certificate or key "
+                                    "for %s", entry.address.c_str());
+                    std::cerr << "Error: Prewarm: missing certificate or key "
+                              << "for " << entry.address << std::endl;
+                } else {
+                    char buf[120];
+                    (void) ERR_error_string(ERR_get_error(), buf);
+                    syslog(LOG_ERR, "Prewarm: can not load credentials "
+                                    "for %s: %s", entry.address.c_str(), buf);
+                    std::cerr << "Error: Prewarm: can not load credentials "
+                              << "for " << entry.address << ": " << buf
+                              << std::endl;
+                }
+            }
+            ERR_clear_error();
+        };
+
+        for (unsigned int i = 0; i < threads; i++)
+            workers.emplace_back(warm);
+        for (auto &it : workers)
+            it.join();
+
+        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - start).count();
+
+        if (::debug)
+            std::cout << "Prewarm: " << entries.size() << " entries, "
+                      << failed << " failed, " << threads << " threads, "
+                      << elapsed << " ms" << std::endl;
+        syslog(LOG_NOTICE, "Prewarm: %lu entries, %lu failed, %u threads, "
+                           "%ld ms",
+               entries.size(), failed.load(), threads,
+               static_cast<long>(elapsed));
+
+        if (entries.size() > cached)
+            syslog(LOG_WARNING, "Prewarm: cachesize %lu is smaller than the "
+                                "number of map file entries, the others were "
+                                "only checked", cached);
+
+        return failed;
+    }
+
+    void CredentialCache::logStats(void) {
+        std::lock_guard<std::mutex> guard(cacheLock);
+
+        if (::debug)
+            std::cout << "Credential cache: entries=" << lru.size()
+                      << " capacity=" << capacity
+                      << " hits=" << hits
+                      << " misses=" << misses << std::endl;
+        syslog(LOG_INFO,
+               "Credential cache: entries=%lu capacity=%lu hits=%lu misses=%lu",
+               lru.size(), capacity, hits, misses);
+    }
+
+    // Private
+
+    bool CredentialCache::stamp(const std::string &file, FileStamp &result) {
+        struct stat st;
+
+        // Keys in a token have no file. Their stamp never changes
+        if (Pkcs11::isUri(file)) {
+            result = FileStamp();
+            return true;
+        }
+
+        if (file.empty() || stat(file.c_str(), &st) != 0)
+            return false;
+        if (!S_ISREG(st.st_mode))
+            return false;
+
+        result.dev = st.st_dev;
+        result.ino = st.st_ino;
+        result.size = st.st_size;
+        result.mtime = st.st_mtime;
+        result.ctime = st.st_ctime;
+
+        return true;
+    }
+
+    credentials_t CredentialCache::load(const std::string &cert,
+                                        const std::string &key) {
+        auto entry = std::make_shared<Credentials>();
+
+        if (!stamp(cert, entry->certStamp)
+            || !stampKey(key, entry->keyStamp))
+            return nullptr;
+
+        bool inToken = Pkcs11::isUri(key);
+        bool remote = SignClient::enabled();
+
+        // DER data from the snapshot is much cheaper than PEM
+        credentials_t fromSnapshot = nullptr;
+        if (!inToken && !remote)
+            fromSnapshot = Snapshot::decode(
+                    cert, key, entry->certStamp, entry->keyStamp);
+        if (fromSnapshot) {
+            if (::debug)
+                std::cout << "\tloaded credentials for " << cert
+                          << " from snapshot" << std::endl;
+            return fromSnapshot;
+        }
+        ERR_clear_error();
+
+        /*
+         * Create a BIO source for the certificate file and read in the
+         * S/MIME certificate. Concatenated intermediate certificates were
+         * already collected by the intermediate pool
+         */
+        BIO_ptr certBio(BIO_new_file(cert.c_str(), "r"), bioDeleter);
+        if (!certBio)
+            return nullptr;
+
+        entry->cert.reset(
+                PEM_read_bio_X509(certBio.get(), nullptr, 0, nullptr));
+        if (!entry->cert)
+            return nullptr;
+
+        entry->chain = IntermediatePool::chainFor(entry->cert.get());
+        if (!entry->chain
+            && !IntermediatePool::selfSigned(entry->cert.get())) {
+            // The file may have changed since the map file was loaded
+            IntermediatePool::addFile(cert);
+            entry->chain = IntermediatePool::chainFor(entry->cert.get());
+        }
+
+        if (remote)
+            return loadRemoteKey(entry, cert, key);
+        if (inToken)
+            return loadTokenKey(entry, key);
+
+        /*
+         * Create a BIO source for the key file and read in a PEM formated key
+         */
+        BIO_ptr keyBio(BIO_new_file(key.c_str(), "r"), bioDeleter);
+        if (!keyBio)
+            return nullptr;
+
+        entry->key.reset(
+                PEM_read_bio_PrivateKey(keyBio.get(), nullptr, 0, nullptr));
+        if (!entry->key)
+            return nullptr;
+
+        // Certificate and key must belong together
+        if (X509_check_private_key(entry->cert.get(), entry->key.get()) != 1)
+            return nullptr;
+
+        // Only key types with a known signature algorithm can be used
+        if (entry->digest() == nullptr) {
+            EVPerr(0, EVP_R_UNSUPPORTED_ALGORITHM);
+            return nullptr;
+        }
+
+        if (::debug)
+            std::cout << "\tloaded credentials from " << cert << std::endl;
+
+        return entry;
+    }
+
+    bool CredentialCache::stampKey(const std::string &file,
+                                   FileStamp &result) {
+        // The signer process watches its key files itself
+        if (SignClient::enabled()) {
+            result = FileStamp();
+            return true;
+        }
+
+        return stamp(file, result);
+    }
+
+    credentials_t CredentialCache::loadRemoteKey(
+            std::shared_ptr<Credentials> entry, const std::string &cert,
+            const std::string &key) {
+        // CMS needs a key object that matches the certificate
+        EVP_PKEY *pub = X509_get_pubkey(entry->cert.get());
+        if (pub == nullptr)
+            return nullptr;
+        entry->key.reset(pub);
+
+        if (entry->digest() == nullptr) {
+            EVPerr(0, EVP_R_UNSUPPORTED_ALGORITHM);
+            return nullptr;
+        }
+
+        entry->remoteCert = cert;
+        entry->remoteKey = key;
+
+        if (::debug)
+            std::cout << "\tloaded certificate from " << cert
+                      << " for the signer process" << std::endl;
+
+        return entry;
+    }
+
+    credentials_t CredentialCache::loadTokenKey(
+            std::shared_ptr<Credentials> entry, const std::string &uri) {
+        entry->token = Pkcs11::findKey(uri);
+        if (!entry->token)
+            return nullptr;
+
+        // CMS needs a key object that matches the certificate
+        EVP_PKEY *pub = X509_get_pubkey(entry->cert.get());
+        if (pub == nullptr)
+            return nullptr;
+        entry->key.reset(pub);
+
+        const EVP_MD *md = entry->digest();
+        if (md == nullptr) {
+            EVPerr(0, EVP_R_UNSUPPORTED_ALGORITHM);
+            return nullptr;
+        }
+
+        /*
+         * Certificate and token key must belong together. Sign a test
+         * message and verify it with the certificate
+         */
+        static const unsigned char probe[] = "sigh PKCS#11 key check";
+        std::vector<unsigned char> tbs(probe, probe + sizeof(probe) - 1);
+        std::vector<unsigned char> sig;
+        if (!Pkcs11::sign(*entry->token, md, tbs.data(), tbs.size(), sig))
+            return nullptr;
+
+        std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)> mdctx(
+                EVP_MD_CTX_new(), EVP_MD_CTX_free);
+        bool eddsa = EVP_PKEY_id(pub) == EVP_PKEY_ED25519;
+        if (!mdctx
+            || EVP_DigestVerifyInit(mdctx.get(), nullptr,
+                                    eddsa ? nullptr : md, nullptr, pub) != 1
+            || EVP_DigestVerify(mdctx.get(), sig.data(), sig.size(),
+                                tbs.data(), tbs.size()) != 1) {
+            EVPerr(0, EVP_R_DIFFERENT_PARAMETERS);
+            return nullptr;
+        }
+
+        if (::debug)
+            std::cout << "\tloaded credentials for " << uri << std::endl;
+
+        return entry;
+    }
+
+    // Init static
+
+    CredentialCache::lru_t CredentialCache::lru = {};
+
+    CredentialCache::index_t CredentialCache::index = {};
+
+    std::size_t CredentialCache::capacity = 1000;
+
+    u_long CredentialCache::hits = 0UL;
+
+    u_long CredentialCache::misses = 0UL;
+
+}  // namespace smime
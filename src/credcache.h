@@ -0,0 +1,213 @@
+/*! @file credcache.h
+ *
+ * @brief Cache parsed S/MIME signing credentials
+ *
+ * @author Christian Roessner <c@roessner.co>
+ * @version 1607.1.4
+ * @date 2016-06-10
+ * @copyright Copyright 2016 Christian Roessner <c@roessner.co>
+ */
+
+#ifndef SRC_CREDCACHE_H_
+#define SRC_CREDCACHE_H_
+
+#include <sys/types.h>
+
+#include <string>
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+
+#include "smime.h"
+#include "mapfile.h"
+#include "pkcs11.h"
+
+extern bool debug;
+
+namespace smime {
+    /*!
+     * @brief Identity of a file on disk
+     *
+     * Used to find out, if a certificate or key file was replaced or
+     * modified since it was parsed.
+     */
+    struct FileStamp {
+        dev_t dev;
+        ino_t ino;
+        off_t size;
+        time_t mtime;
+        time_t ctime;
+
+        bool operator==(const FileStamp &) const;
+    };
+
+    /*!
+     * @brief Ready to use signing material for one map file entry
+     */
+    struct Credentials {
+        Credentials(void);
+
+        /*!
+         * @brief The digest algorithm that is used with the key
+         *
+         * RSA and P-256 keys use SHA-256, P-384 keys SHA-384, P-521 keys
+         * SHA-512. Ed25519 keys always use SHA-512, RFC8419.
+         *
+         * @return nullptr, if the key type is not supported
+         */
+        const EVP_MD *digest(void) const;
+
+        //! @brief The S/MIME certificate
+        X509_ptr cert;
+
+        /*!
+         * @brief The private key that belongs to the certificate
+         *
+         * For a key in a token or in the signer process, this is the public
+         * key of the certificate.
+         */
+        EVP_PKEY_ptr key;
+
+        //! @brief A private key in a PKCS#11 token. nullptr for key files
+        tokenkey_t token;
+
+        /*!
+         * @brief Map file names of a key in the signer process
+         *
+         * Empty, if the key was loaded by this process.
+         */
+        std::string remoteCert;
+        std::string remoteKey;
+
+        //! @brief Intermediate certificates. May be nullptr
+        STACK_OF_X509_ptr chain;
+
+        //! @brief Stamp of the certificate file at load time
+        FileStamp certStamp;
+
+        //! @brief Stamp of the key file at load time
+        FileStamp keyStamp;
+    };
+
+    using credentials_t = std::shared_ptr<const Credentials>;
+
+    /*!
+     * @brief Size bounded LRU cache for parsed signing credentials
+     *
+     * Parsing PEM files for every message is expensive. This cache keeps
+     * the X509, EVP_PKEY and intermediate chain objects for a map file entry
+     * in memory. An entry is dropped, if its files changed on disk (inode,
+     * size or time stamps), if it is the least recently used entry and the
+     * cache is full, or if the cache is cleared on SIGHUP.
+     *
+     * Entries are handed out as shared pointers, so an entry that gets
+     * evicted while a message is being signed stays valid until it is no
+     * longer used.
+     */
+    class CredentialCache {
+    public:
+        /*!
+         * @brief Get credentials for a certificate and key file
+         *
+         * The missing flag is set, if one of the files does not exist. In
+         * all other error cases the OpenSSL error queue holds the reason.
+         */
+        static credentials_t get(const std::string &, const std::string &,
+                                 bool &);
+
+        /*!
+         * @brief Set the maximum number of cached entries
+         */
+        static void setCapacity(std::size_t);
+
+        /*!
+         * @brief Drop all cached entries
+         */
+        static void clear(void);
+
+        /*!
+         * @brief Read the file stamp for a file
+         *
+         * @return false, if the file does not exist or is not a regular file
+         */
+        static bool stamp(const std::string &, FileStamp &);
+
+        /*!
+         * @brief Load all map file entries in advance
+         *
+         * Each certificate, key and chain is parsed and checked with the
+         * given number of threads. Broken entries are reported to syslog, so
+         * that problems show up at startup or on reload and not while a
+         * message is processed. The first mail of each sender does not pay
+         * for loading its credentials anymore. Only as many entries as the
+         * cache holds are cached, the others are checked and dropped.
+         *
+         * @return Number of entries that could not be loaded
+         */
+        static std::size_t prewarm(const std::vector<mapfile::Entry> &,
+                                   unsigned int);
+
+        /*!
+         * @brief Write hit and miss counters to syslog
+         */
+        static void logStats(void);
+
+    private:
+        using lru_t = std::list<std::pair<std::string, credentials_t>>;
+        using index_t = std::unordered_map<std::string, lru_t::iterator>;
+
+        /*!
+         * @brief Parse a certificate file and the key file
+         *
+         * If the snapshot has a current entry, it is decoded from there.
+         * Otherwise only the first certificate of the certificate file is
+         * parsed. The intermediate certificates are taken from the
+         * IntermediatePool.
+         */
+        static credentials_t load(const std::string &, const std::string &);
+
+        /*!
+         * @brief Complete credentials with a key from a PKCS#11 token
+         *
+         * The token key is checked against the certificate with a test
+         * signature.
+         */
+        static credentials_t loadTokenKey(std::shared_ptr<Credentials>,
+                                          const std::string &);
+
+        /*!
+         * @brief Read the file stamp for a key file
+         *
+         * Keys that are held by the signer process are not read here and
+         * always get an empty stamp.
+         */
+        static bool stampKey(const std::string &, FileStamp &);
+
+        /*!
+         * @brief Complete credentials for a key in the signer process
+         *
+         * Only the public key of the certificate is needed here.
+         */
+        static credentials_t loadRemoteKey(std::shared_ptr<Credentials>,
+                                           const std::string &,
+                                           const std::string &);
+
+        //! @brief Most recently used entries are at the front
+        static lru_t lru;
+
+        //! @brief Lookup table into the LRU list
+        static index_t index;
+
+        //! @brief Maximum number of entries
+        static std::size_t capacity;
+
+        //! @brief Number of cache hits
+        static u_long hits;
+
+        //! @brief Number of cache misses
+        static u_long misses;
+    };
+}  // namespace smime
+
+#endif  // SRC_CREDCACHE_H_
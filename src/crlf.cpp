@@ -0,0 +1,110 @@
+/*! @file crlf.cpp
+ *
+ * @brief Find line endings that are not in canonical form
+ *
+ * @author Christian Roessner <c@roessner.co>
+ * @version 1607.1.4
+ * @date 2016-06-10
+ * @copyright Copyright 2016 Christian Roessner <c@roessner.co>
+ */
+
+#include "crlf.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define _CRLF_SIMD
+#include <immintrin.h>
+#endif  // defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+
+namespace mlt {
+    /*!
+     * @brief Find a bare LF without SIMD instructions
+     *
+     * The byte at the start offset must not be the first byte of the
+     * buffer.
+     */
+    static std::size_t findScalar(const char *data, std::size_t len,
+                                  std::size_t from) {
+        for (std::size_t i = from; i < len; i++)
+            if (data[i] == '\n' && data[i - 1] != '\r')
+                return i;
+
+        return len;
+    }
+
+#if defined _CRLF_SIMD
+    /*
+     * Both versions compare a block with LF and the same block shifted by
+     * one byte with CR. A bare LF is an LF without a CR in the shifted
+     * block. Most text has one line ending every 40 to 80 bytes, so a block
+     * without any bare LF is skipped with a single test.
+     */
+
+    static std::size_t findSse2(const char *data, std::size_t len,
+                                std::size_t from) {
+        const __m128i lf = _mm_set1_epi8('\n');
+        const __m128i cr = _mm_set1_epi8('\r');
+        std::size_t i = from;
+
+        for (; i + 16 <= len; i += 16) {
+            __m128i cur = _mm_loadu_si128(
+                    reinterpret_cast<const __m128i *>(data + i));
+            __m128i prev = _mm_loadu_si128(
+                    reinterpret_cast<const __m128i *>(data + i - 1));
+            unsigned int mask = static_cast<unsigned int>(_mm_movemask_epi8(
+                    _mm_andnot_si128(_mm_cmpeq_epi8(prev, cr),
+                                     _mm_cmpeq_epi8(cur, lf))));
+            if (mask != 0)
+                return i + __builtin_ctz(mask);
+        }
+
+        return findScalar(data, len, i);
+    }
+
+    __attribute__((target("avx2")))
+    static std::size_t findAvx2(const char *data, std::size_t len,
+                                std::size_t from) {
+        const __m256i lf = _mm256_set1_epi8('\n');
+        const __m256i cr = _mm256_set1_epi8('\r');
+        std::size_t i = from;
+
+        for (; i + 32 <= len; i += 32) {
+            __m256i cur = _mm256_loadu_si256(
+                    reinterpret_cast<const __m256i *>(data + i));
+            __m256i prev = _mm256_loadu_si256(
+                    reinterpret_cast<const __m256i *>(data + i - 1));
+            unsigned int mask = static_cast<unsigned int>(
+                    _mm256_movemask_epi8(_mm256_andnot_si256(
+                            _mm256_cmpeq_epi8(prev, cr),
+                            _mm256_cmpeq_epi8(cur, lf))));
+            if (mask != 0)
+                return i + __builtin_ctz(mask);
+        }
+
+        return findScalar(data, len, i);
+    }
+#endif  // defined _CRLF_SIMD
+
+    std::size_t findBareLf(const char *data, std::size_t len,
+                           std::size_t from, bool lastWasCR) {
+        if (from >= len)
+            return len;
+
+        // The first byte has its predecessor in the previous chunk
+        if (from == 0) {
+            if (data[0] == '\n' && !lastWasCR)
+                return 0;
+            from = 1;
+        }
+
+#if defined _CRLF_SIMD
+        static const bool avx2 = __builtin_cpu_supports("avx2");
+
+        if (avx2)
+            return findAvx2(data, len, from);
+
+        return findSse2(data, len, from);
+#else
+        return findScalar(data, len, from);
+#endif  // defined _CRLF_SIMD
+    }
+}  // namespace mlt
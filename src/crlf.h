@@ -0,0 +1,30 @@
+/*! @file crlf.h
+ *
+ * @brief Find line endings that are not in canonical form
+ *
+ * @author Christian Roessner <c@roessner.co>
+ * @version 1607.1.4
+ * @date 2016-06-10
+ * @copyright Copyright 2016 Christian Roessner <c@roessner.co>
+ */
+
+#ifndef SRC_CRLF_H_
+#define SRC_CRLF_H_
+
+#include <cstddef>
+
+namespace mlt {
+    /*!
+     * @brief Find the next LF that is not preceded by CR
+     *
+     * Looks at 16 or 32 bytes at once on x86-64. The search starts at the
+     * given offset. The last flag tells whether the byte before the buffer
+     * was a CR, so that a CRLF pair split across two chunks is not
+     * converted.
+     *
+     * @return Offset of the LF or the length of the buffer, if there is none
+     */
+    std::size_t findBareLf(const char *, std::size_t, std::size_t, bool);
+}  // namespace mlt
+
+#endif  // SRC_CRLF_H_
@@ -0,0 +1,114 @@
+/*! @file headerplan.cpp
+ *
+ * @brief Plan the header changes of a message
+ *
+ * @author Christian Roessner <c@roessner.co>
+ * @version 1607.1.4
+ * @date 2016-06-10
+ * @copyright Copyright 2016 Christian Roessner <c@roessner.co>
+ */
+
+#include "headerplan.h"
+
+#include <strings.h>
+
+#include <algorithm>
+#include <iostream>
+
+#include <boost/algorithm/string.hpp>
+
+#include "common.h"
+
+namespace smime {
+    // Public
+
+    HeaderPlan::HeaderPlan(const mlt::markedHeaders_t &current,
+                           const headers_t &wanted)
+            : edits() {
+        // Header names in the order they are seen. Names are case-insensitive
+        std::vector<std::string> names;
+        auto add = [&names](const std::string &name) {
+            if (std::none_of(names.begin(), names.end(),
+                             [&name](const std::string &it) {
+                                 return boost::iequals(it, name);
+                             }))
+                names.push_back(name);
+        };
+        for (auto &it : current)
+            add(it.name.str());
+        for (auto &it : wanted)
+            add(it.first);
+
+        std::vector<Edit> deletes;
+        std::vector<Edit> adds;
+
+        for (auto &name : names) {
+            std::vector<const mlt::TextView *> before;
+            std::vector<const std::string *> after;
+            std::string currentName = name;
+
+            for (auto &it : current)
+                if (it.name.size == name.size()
+                    && strncasecmp(it.name.data, name.data(),
+                                   name.size()) == 0) {
+                    before.push_back(&it.value);
+                    currentName = it.name.str();
+                }
+            for (auto &it : wanted)
+                if (boost::iequals(it.first, name))
+                    after.push_back(&it.second);
+
+            std::size_t common = std::min(before.size(), after.size());
+            for (std::size_t i = 0; i < common; i++)
+                if (after[i]->compare(0, std::string::npos, before[i]->data,
+                                      before[i]->size) != 0)
+                    edits.push_back({Action::CHANGE, currentName,
+                                     static_cast<int>(i + 1), *after[i]});
+
+            for (std::size_t i = before.size(); i > common; i--)
+                deletes.push_back({Action::DELETE, currentName,
+                                   static_cast<int>(i), std::string()});
+
+            for (std::size_t i = common; i < after.size(); i++)
+                adds.push_back({Action::ADD, name, 0, *after[i]});
+        }
+
+        edits.insert(edits.end(), deletes.begin(), deletes.end());
+        edits.insert(edits.end(), adds.begin(), adds.end());
+    }
+
+    int HeaderPlan::apply(SMFICTX *ctx) const {
+        for (auto &it : edits) {
+            int result;
+
+            switch (it.action) {
+                case Action::CHANGE:
+                    result = smfi_chgheader(ctx, util::ccp(it.name),
+                                            it.index, util::ccp(it.value));
+                    break;
+                case Action::DELETE:
+                    result = smfi_chgheader(ctx, util::ccp(it.name),
+                                            it.index, nullptr);
+                    break;
+                case Action::ADD:
+                    result = smfi_addheader(ctx, util::ccp(it.name),
+                                            util::ccp(it.value));
+                    break;
+                default:
+                    result = MI_FAILURE;
+            }
+
+            if (result == MI_FAILURE) {
+                std::cerr << "Error: Unable to edit header " << it.name
+                          << std::endl;
+                return MI_FAILURE;
+            }
+        }
+
+        if (::debug)
+            std::cout << "\tSent " << edits.size() << " header edits"
+                      << std::endl;
+
+        return MI_SUCCESS;
+    }
+}  // namespace smime
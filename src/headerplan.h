@@ -0,0 +1,93 @@
+/*! @file headerplan.h
+ *
+ * @brief Plan the header changes of a message
+ *
+ * @author Christian Roessner <c@roessner.co>
+ * @version 1607.1.4
+ * @date 2016-06-10
+ * @copyright Copyright 2016 Christian Roessner <c@roessner.co>
+ */
+
+#ifndef SRC_HEADERPLAN_H_
+#define SRC_HEADERPLAN_H_
+
+#include <libmilter/mfapi.h>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "client.h"
+
+extern bool debug;
+
+namespace smime {
+    /*!
+     * @brief The smallest set of header edits from old to new headers
+     *
+     * Each edit is a message to the MTA. Headers with the same name are
+     * matched by position. A header that gets another value is changed in
+     * place, a header with the same value is left alone. Surplus old headers
+     * are deleted and missing ones are added.
+     *
+     * Changes are sent first. Deletes are sent from the last header of a
+     * name to the first, so that the indices stay valid, whether the MTA
+     * counts deleted headers or not.
+     */
+    class HeaderPlan {
+    public:
+        //! @brief Header names and values
+        using headers_t = std::vector<std::pair<std::string, std::string>>;
+
+        /*!
+         * @brief Compute the edits
+         *
+         * @param current Headers of the message, in their order
+         * @param wanted Headers that the message should have instead
+         */
+        HeaderPlan(const mlt::markedHeaders_t &, const headers_t &);
+
+        /*!
+         * @brief Send the edits to the MTA
+         *
+         * @return MI_FAILURE, if one of the edits failed
+         */
+        int apply(SMFICTX *) const;
+
+        /*!
+         * @brief Number of edits
+         */
+        inline std::size_t size(void) const { return edits.size(); }
+
+    private:
+        /*!
+         * @brief Kind of a header edit
+         */
+        enum class Action {
+            CHANGE,
+            DELETE,
+            ADD
+        };
+
+        /*!
+         * @brief One header edit
+         */
+        struct Edit {
+            Action action;
+
+            //! @brief Header name
+            std::string name;
+
+            //! @brief Index among the headers with this name. 1 is the first
+            int index;
+
+            //! @brief The new value. Empty for DELETE
+            std::string value;
+        };
+
+        //! @brief The edits in the order they are sent
+        std::vector<Edit> edits;
+    };
+}  // namespace smime
+
+#endif  // SRC_HEADERPLAN_H_
@@ -0,0 +1,86 @@
+/*! @file mapc.cpp
+ *
+ * @brief Compile a text map file for the milter
+ *
+ * sigh-mapc reads a text map file and writes it in the binary form that
+ * the milter maps into memory. Point the mapfile setting to the output
+ * and send SIGHUP to the milter after each run.
+ *
+ * @author Christian Roessner <c@roessner.co>
+ * @version 1607.1.4
+ * @date 2016-06-10
+ * @copyright Copyright 2016 Christian Roessner <c@roessner.co>
+ */
+
+#include <sysexits.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <boost/program_options.hpp>
+
+#include "mapdb.h"
+#include "mapfile.h"
+
+namespace po = boost::program_options;
+
+//! @brief Turn on/off debugging output
+bool debug = false;
+
+int main(int argc, const char *argv[]) {
+    std::string input;
+    std::string output;
+
+    po::options_description desc("The following options are available");
+    desc.add_options()
+            ("help,h", "produce help message")
+            ("input,i", po::value<std::string>(&input),
+             "Text map file")
+            ("output,o", po::value<std::string>(&output),
+             "Compiled map file. Defaults to the input with the suffix .db")
+            ("debug", po::bool_switch()->default_value(false),
+             "Turn on debugging output")
+    ;
+
+    po::positional_options_description positional;
+    positional.add("input", 1);
+    positional.add("output", 1);
+
+    po::variables_map vm;
+    try {
+        po::store(po::command_line_parser(argc, argv)
+                          .options(desc).positional(positional).run(), vm);
+    }
+    catch (const std::exception &e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        std::cout << desc << std::endl;
+        exit(EX_USAGE);
+    }
+    po::notify(vm);
+
+    if (vm.count("help") || input.empty()) {
+        std::cout << "Usage: sigh-mapc [options] input [output]" << std::endl
+                  << desc << std::endl;
+        exit(EX_USAGE);
+    }
+
+    if (vm["debug"].as<bool>())
+        ::debug = true;
+
+    if (output.empty())
+        output = input + ".db";
+
+    std::vector<mapfile::Identity> identities;
+    if (!mapfile::Map::parseMap(input, identities))
+        exit(EX_DATAERR);
+
+    // Later lines of an address replace earlier ones, as in the milter
+    mapfile::Store store(std::move(identities));
+    if (!mapfile::MapDb::write(output, store.identities()))
+        exit(EX_CANTCREAT);
+
+    std::cout << "Compiled " << store.identities().size()
+              << " entries to " << output << std::endl;
+
+    return EX_OK;
+}
@@ -0,0 +1,382 @@
+/*! @file mapdb.cpp
+ *
+ * @brief Compiled map file that is mapped into memory
+ *
+ * @author Christian Roessner <c@roessner.co>
+ * @version 1607.1.4
+ * @date 2016-06-10
+ * @copyright Copyright 2016 Christian Roessner <c@roessner.co>
+ */
+
+#include "mapdb.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+
+#include "mapfile.h"
+
+namespace mapfile {
+    //! @brief Magic bytes at the beginning of a compiled map file
+    static const char dbMagic[8] = {'S', 'I', 'G', 'H', 'M', 'A', 'P', 'C'};
+
+    //! @brief Format version. Increase on every layout change
+    static const std::uint32_t dbVersion = 1;
+
+    /*
+     * On-disk layout. The file is compiled on the host that uses it, so
+     * native byte order is used. String offsets are relative to the arena.
+     *
+     * DbHeader
+     * DbSlot[slots]            Hash table, linear probing
+     * DbIdentity[identities]
+     * DbPair[pairs]            Certificate and key pairs of all identities
+     * Arena                    Addresses and paths, not null terminated
+     */
+
+    struct DbHeader {
+        char magic[8];
+        std::uint32_t version;
+        std::uint32_t slots;
+        std::uint32_t identities;
+        std::uint32_t pairs;
+        std::uint64_t arena;
+        std::uint64_t size;
+    };
+
+    struct DbSlot {
+        std::uint64_t hash;
+        std::uint32_t identity;     // Number plus one, 0 for an empty slot
+        std::uint32_t reserved;
+    };
+
+    struct DbIdentity {
+        std::uint32_t address;
+        std::uint32_t addressSize;
+        std::uint32_t firstPair;
+        std::uint32_t pairs;
+    };
+
+    struct DbPair {
+        std::uint32_t cert;
+        std::uint32_t certSize;
+        std::uint32_t key;
+        std::uint32_t keySize;
+    };
+
+    /*!
+     * @brief Read a structure from the mapping
+     */
+    template <typename T>
+    static T readAt(const char *data, std::uint64_t offset) {
+        T result;
+        std::memcpy(&result, data + offset, sizeof(T));
+        return result;
+    }
+
+    /*!
+     * @brief Append a structure to a buffer
+     */
+    template <typename T>
+    static void append(std::string &buf, const T &value) {
+        buf.append(reinterpret_cast<const char *>(&value), sizeof(T));
+    }
+
+    static std::uint64_t slotOffset(const DbHeader &) {
+        return sizeof(DbHeader);
+    }
+
+    static std::uint64_t identityOffset(const DbHeader &header) {
+        return slotOffset(header) + std::uint64_t(header.slots) * sizeof(DbSlot);
+    }
+
+    static std::uint64_t pairOffset(const DbHeader &header) {
+        return identityOffset(header)
+               + std::uint64_t(header.identities) * sizeof(DbIdentity);
+    }
+
+    static std::uint64_t arenaOffset(const DbHeader &header) {
+        return pairOffset(header) + std::uint64_t(header.pairs) * sizeof(DbPair);
+    }
+
+    // Public
+
+    MapDb::~MapDb(void) {
+        munmap(const_cast<char *>(data), length);
+    }
+
+    bool MapDb::isCompiled(const std::string &file) {
+        char magic[sizeof(dbMagic)];
+        std::ifstream in(file, std::ios::binary);
+
+        return in.read(magic, sizeof(magic))
+               && std::memcmp(magic, dbMagic, sizeof(dbMagic)) == 0;
+    }
+
+    std::unique_ptr<const MapDb> MapDb::open(const std::string &file) {
+        std::unique_ptr<const MapDb> fresh;
+
+        int fd = ::open(file.c_str(), O_RDONLY);
+        if (fd == -1)
+            return fresh;
+
+        struct stat st;
+        if (fstat(fd, &st) == 0
+            && static_cast<std::uint64_t>(st.st_size) >= sizeof(DbHeader)) {
+            void *addr = mmap(nullptr, static_cast<std::size_t>(st.st_size),
+                              PROT_READ, MAP_SHARED, fd, 0);
+            if (addr != MAP_FAILED)
+                fresh.reset(new MapDb(
+                        addr, static_cast<std::size_t>(st.st_size)));
+        }
+        ::close(fd);
+
+        if (!fresh)
+            return fresh;
+
+        auto header = readAt<DbHeader>(fresh->data, 0);
+        if (std::memcmp(header.magic, dbMagic, sizeof(dbMagic)) != 0
+            || header.version != dbVersion
+            || header.size != fresh->length
+            || header.slots == 0
+            || (header.slots & (header.slots - 1)) != 0
+            || header.identities >= header.slots
+            || arenaOffset(header) + header.arena != header.size) {
+            std::cerr << "Error: Damaged compiled map file " << file
+                      << std::endl;
+            fresh.reset();
+            return fresh;
+        }
+
+        if (::debug)
+            std::cout << "Compiled map file " << file << " mapped with "
+                      << header.identities << " entries" << std::endl;
+
+        return fresh;
+    }
+
+    bool MapDb::write(const std::string &file,
+                      const std::vector<Identity> &identities) {
+        const std::uint64_t limit = std::numeric_limits<std::uint32_t>::max();
+
+        // At most half of the slots are used
+        std::uint64_t slotCount = 16;
+        while (slotCount < identities.size() * 2)
+            slotCount <<= 1;
+        if (slotCount > limit) {
+            std::cerr << "Error: Too many entries for a compiled map file"
+                      << std::endl;
+            return false;
+        }
+
+        std::vector<DbSlot> slots(slotCount, DbSlot{0, 0, 0});
+        std::string records;
+        std::string pairs;
+        std::string arena;
+        std::uint32_t pairCount = 0;
+
+        auto store = [&](const std::string &text, std::uint32_t &offset,
+                         std::uint32_t &size) {
+            offset = static_cast<std::uint32_t>(arena.size());
+            size = static_cast<std::uint32_t>(text.size());
+            arena.append(text);
+        };
+
+        for (std::size_t i = 0; i < identities.size(); i++) {
+            const Identity &it = identities[i];
+
+            std::uint64_t slot = it.hash & (slotCount - 1);
+            while (slots[slot].identity != 0)
+                slot = (slot + 1) & (slotCount - 1);
+            slots[slot].hash = it.hash;
+            slots[slot].identity = static_cast<std::uint32_t>(i + 1);
+
+            DbIdentity record;
+            store(it.address, record.address, record.addressSize);
+            record.firstPair = pairCount;
+            record.pairs = static_cast<std::uint32_t>(it.signers.size());
+            append(records, record);
+
+            for (auto &signer : it.signers) {
+                DbPair pair;
+                store(signer.cert, pair.cert, pair.certSize);
+                store(signer.key, pair.key, pair.keySize);
+                append(pairs, pair);
+                pairCount++;
+            }
+
+            if (arena.size() > limit) {
+                std::cerr << "Error: Too much text for a compiled map file"
+                          << std::endl;
+                return false;
+            }
+        }
+
+        DbHeader header;
+        std::memcpy(header.magic, dbMagic, sizeof(dbMagic));
+        header.version = dbVersion;
+        header.slots = static_cast<std::uint32_t>(slotCount);
+        header.identities = static_cast<std::uint32_t>(identities.size());
+        header.pairs = pairCount;
+        header.arena = arena.size();
+        header.size = arenaOffset(header) + arena.size();
+
+        std::string out;
+        out.reserve(header.size);
+        append(out, header);
+        for (auto &it : slots)
+            append(out, it);
+        out.append(records);
+        out.append(pairs);
+        out.append(arena);
+
+        // A reload must never see a half written file
+        std::string temp = file + ".tmp";
+        int fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1) {
+            perror("Error: Unable to create compiled map file");
+            return false;
+        }
+
+        std::size_t written = 0;
+        while (written < out.size()) {
+            ssize_t n = ::write(fd, out.data() + written, out.size() - written);
+            if (n <= 0) {
+                perror("Error: Unable to write compiled map file");
+                ::close(fd);
+                unlink(temp.c_str());
+                return false;
+            }
+            written += static_cast<std::size_t>(n);
+        }
+
+        if (fsync(fd) != 0 || ::close(fd) != 0
+            || rename(temp.c_str(), file.c_str()) != 0) {
+            perror("Error: Unable to store compiled map file");
+            unlink(temp.c_str());
+            return false;
+        }
+
+        return true;
+    }
+
+    bool MapDb::contains(const std::string &address) const {
+        return lookup(address) != 0;
+    }
+
+    bool MapDb::find(const std::string &address, Identity &identity) const {
+        std::uint32_t number = lookup(address);
+
+        return number != 0 && identityAt(number - 1, identity);
+    }
+
+    std::vector<Entry> MapDb::entries(void) const {
+        std::vector<Entry> result;
+        Identity identity;
+
+        for (std::uint32_t i = 0; i < size(); i++)
+            if (identityAt(i, identity))
+                result.insert(result.end(), identity.signers.begin(),
+                              identity.signers.end());
+
+        return result;
+    }
+
+    std::size_t MapDb::size(void) const {
+        return readAt<DbHeader>(data, 0).identities;
+    }
+
+    // Private
+
+    MapDb::MapDb(const void *addr, std::size_t length)
+            : data(static_cast<const char *>(addr)),
+              length(length) { /* empty */ }
+
+    std::uint32_t MapDb::lookup(const std::string &address) const {
+        auto header = readAt<DbHeader>(data, 0);
+        std::uint64_t h = Store::hash(address.data(), address.size());
+        std::uint64_t mask = header.slots - 1;
+
+        for (std::uint64_t slot = h & mask, probes = 0;
+             probes < header.slots;
+             slot = (slot + 1) & mask, probes++) {
+            auto entry = readAt<DbSlot>(
+                    data, slotOffset(header) + slot * sizeof(DbSlot));
+            if (entry.identity == 0)
+                return 0;
+            if (entry.hash != h || entry.identity > header.identities)
+                continue;
+
+            auto record = readAt<DbIdentity>(
+                    data, identityOffset(header)
+                          + (entry.identity - 1) * sizeof(DbIdentity));
+            const char *stored;
+            if (record.addressSize != address.size()
+                || !text(record.address, record.addressSize, stored))
+                continue;
+
+            std::size_t i = 0;
+            while (i < address.size()
+                   && Store::fold(static_cast<unsigned char>(address[i]))
+                      == static_cast<unsigned char>(stored[i]))
+                i++;
+            if (i == address.size())
+                return entry.identity;
+        }
+
+        return 0;
+    }
+
+    bool MapDb::identityAt(std::uint32_t number, Identity &identity) const {
+        auto header = readAt<DbHeader>(data, 0);
+        if (number >= header.identities)
+            return false;
+
+        auto record = readAt<DbIdentity>(
+                data, identityOffset(header) + number * sizeof(DbIdentity));
+        const char *address;
+        if (!text(record.address, record.addressSize, address)
+            || std::uint64_t(record.firstPair) + record.pairs > header.pairs)
+            return false;
+
+        identity.address.assign(address, record.addressSize);
+        identity.hash = Store::hash(address, record.addressSize);
+        identity.signers.clear();
+
+        for (std::uint32_t i = 0; i < record.pairs; i++) {
+            auto pair = readAt<DbPair>(
+                    data, pairOffset(header)
+                          + (record.firstPair + i) * sizeof(DbPair));
+            const char *cert;
+            const char *key;
+            if (!text(pair.cert, pair.certSize, cert)
+                || !text(pair.key, pair.keySize, key))
+                return false;
+
+            identity.signers.push_back({identity.address,
+                                        std::string(cert, pair.certSize),
+                                        std::string(key, pair.keySize)});
+        }
+
+        return true;
+    }
+
+    bool MapDb::text(std::uint32_t offset, std::uint32_t size,
+                     const char *&result) const {
+        auto header = readAt<DbHeader>(data, 0);
+        if (std::uint64_t(offset) + size > header.arena)
+            return false;
+
+        result = data + arenaOffset(header) + offset;
+
+        return true;
+    }
+
+}  // namespace mapfile
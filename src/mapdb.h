@@ -0,0 +1,123 @@
+/*! @file mapdb.h
+ *
+ * @brief Compiled map file that is mapped into memory
+ *
+ * @author Christian Roessner <c@roessner.co>
+ * @version 1607.1.4
+ * @date 2016-06-10
+ * @copyright Copyright 2016 Christian Roessner <c@roessner.co>
+ */
+
+#ifndef SRC_MAPDB_H_
+#define SRC_MAPDB_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+extern bool debug;
+
+namespace mapfile {
+    struct Entry;
+    struct Identity;
+
+    /*!
+     * @brief A map file in binary form, written by sigh-mapc
+     *
+     * The file holds a hash table over the addresses, the identities with
+     * their certificate and key pairs and all strings. It is mapped
+     * read-only and used as it is, so opening it takes the same time for
+     * any number of entries, and all processes share its pages in the page
+     * cache.
+     *
+     * Only the header is checked, when the file is opened. Every lookup
+     * checks the records that it reads, so a damaged file can not make the
+     * milter read outside of the mapping.
+     */
+    class MapDb {
+    public:
+        /*!
+         * @brief Destructor. Releases the mapping
+         */
+        ~MapDb(void);
+
+        MapDb(const MapDb &) = delete;
+        MapDb &operator=(const MapDb &) = delete;
+
+        /*!
+         * @brief The file starts with the magic bytes of a compiled map file
+         */
+        static bool isCompiled(const std::string &);
+
+        /*!
+         * @brief Map a compiled map file into memory
+         *
+         * @return nullptr, if the file can not be mapped or is damaged
+         */
+        static std::unique_ptr<const MapDb> open(const std::string &);
+
+        /*!
+         * @brief Write identities as a compiled map file
+         *
+         * Every address must be unique and in lower case. The file is
+         * replaced atomically, so that a reload never sees half of it.
+         */
+        static bool write(const std::string &, const std::vector<Identity> &);
+
+        /*!
+         * @brief The address has an identity. Does not allocate
+         */
+        bool contains(const std::string &) const;
+
+        /*!
+         * @brief Copy the identity of an address
+         *
+         * @return false, if the address has no identity
+         */
+        bool find(const std::string &, Identity &) const;
+
+        /*!
+         * @brief All certificate and key pairs of all identities
+         */
+        std::vector<Entry> entries(void) const;
+
+        /*!
+         * @brief Number of identities
+         */
+        std::size_t size(void) const;
+
+    private:
+        /*!
+         * @brief Constructor for a mapping
+         */
+        MapDb(const void *, std::size_t);
+
+        /*!
+         * @brief Find the identity of an address
+         *
+         * @return Its number plus one or 0, if not found
+         */
+        std::uint32_t lookup(const std::string &) const;
+
+        /*!
+         * @brief Copy an identity by its number
+         */
+        bool identityAt(std::uint32_t, Identity &) const;
+
+        /*!
+         * @brief A string of the arena
+         *
+         * @return false, if it is not inside of the arena
+         */
+        bool text(std::uint32_t, std::uint32_t, const char *&) const;
+
+        //! @brief Start of the mapping
+        const char *data;
+
+        //! @brief Length of the mapping
+        std::size_t length;
+    };
+}  // namespace mapfile
+
+#endif  // SRC_MAPDB_H_
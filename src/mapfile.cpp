@@ -11,7 +11,7 @@
 #include <fstream>
 #include <iostream>
 #include <sstream>
-#include <mutex>
+#include <memory>
 #include <boost/filesystem.hpp>
 
 #include "mapfile.h"
@@ -19,65 +19,318 @@
 namespace fs = boost::filesystem;
 
 namespace mapfile {
-    static std::mutex confLock;
+    //! @brief Compare an address with a lower case address
+    static bool sameAddress(const std::string &address,
+                            const std::string &lower) {
+        if (address.size() != lower.size())
+            return false;
+
+        for (std::size_t i = 0; i < address.size(); i++)
+            if (Store::fold(static_cast<unsigned char>(address[i]))
+                != static_cast<unsigned char>(lower[i]))
+                return false;
+
+        return true;
+    }
 
     // Public
 
+    Store::Store(std::vector<Identity> &&identities)
+            : entries(),
+              slots(),
+              mask(0),
+              compiled() {
+        // At most half of the slots are used
+        uint64_t size = 16;
+        while (size < identities.size() * 2)
+            size <<= 1;
+
+        slots.assign(size, 0);
+        mask = size - 1;
+        entries.reserve(identities.size());
+
+        for (auto &it : identities) {
+            uint64_t slot = it.hash & mask;
+
+            while (slots[slot] != 0) {
+                Identity &used = entries[slots[slot] - 1];
+                if (used.hash == it.hash && used.address == it.address)
+                    break;
+                slot = (slot + 1) & mask;
+            }
+
+            // A later line replaces an earlier one of the same address
+            if (slots[slot] != 0) {
+                entries[slots[slot] - 1] = std::move(it);
+            } else {
+                entries.push_back(std::move(it));
+                slots[slot] = static_cast<uint32_t>(entries.size());
+            }
+        }
+    }
+
+    Store::Store(std::unique_ptr<const MapDb> db)
+            : entries(),
+              slots(),
+              mask(0),
+              compiled(std::move(db)) { /* empty */ }
+
+    const Identity *Store::find(const std::string &address,
+                                Identity &copy) const {
+        if (!compiled)
+            return lookup(address);
+
+        return compiled->find(address, copy) ? &copy : nullptr;
+    }
+
+    bool Store::contains(const std::string &address) const {
+        if (!compiled)
+            return lookup(address) != nullptr;
+
+        return compiled->contains(address);
+    }
+
+    std::vector<Entry> Store::signers(void) const {
+        if (compiled)
+            return compiled->entries();
+
+        std::vector<Entry> result;
+        for (auto &it : entries)
+            result.insert(result.end(), it.signers.begin(), it.signers.end());
+
+        return result;
+    }
+
+    const Identity *Store::lookup(const std::string &address) const {
+        if (slots.empty())
+            return nullptr;
+
+        uint64_t h = hash(address.data(), address.size());
+
+        for (uint64_t slot = h & mask; slots[slot] != 0;
+             slot = (slot + 1) & mask) {
+            const Identity &it = entries[slots[slot] - 1];
+            if (it.hash == h && sameAddress(address, it.address))
+                return &it;
+        }
+
+        return nullptr;
+    }
+
+    uint64_t Store::hash(const char *address, std::size_t size) {
+        // FNV-1a over the lower case address
+        uint64_t h = 14695981039346656037ULL;
+        for (std::size_t i = 0; i < size; i++) {
+            h ^= Store::fold(static_cast<unsigned char>(address[i]));
+            h *= 1099511628211ULL;
+        }
+
+        // splitmix64 finalizer, so that the low bits select a slot
+        h ^= h >> 30;
+        h *= 0xbf58476d1ce4e5b9ULL;
+        h ^= h >> 27;
+        h *= 0x94d049bb133111ebULL;
+        h ^= h >> 31;
+
+        return h;
+    }
+
     Map::Map(const std::string &envfrom)
-            : mailFrom(envfrom),
-              smimeCert(std::string()),
-              smimeKey(std::string()) { /* empty */ }
+            : store(snapshot()),
+              found(),
+              identity(store ? store->find(envfrom, found) : nullptr) {
+        /* empty */
+    }
+
+    bool Map::readMap(const std::string &mapfile) {
+        std::shared_ptr<const Store> fresh;
+
+        if (MapDb::isCompiled(mapfile)) {
+            std::unique_ptr<const MapDb> db = MapDb::open(mapfile);
+            if (!db) {
+                std::cerr << "Error: Can not read mapfile " << mapfile
+                          << std::endl;
+                return false;
+            }
+            fresh = std::make_shared<Store>(std::move(db));
+        } else {
+            std::vector<Identity> identities;
+            if (!parseMap(mapfile, identities))
+                return false;
+            fresh = std::make_shared<Store>(std::move(identities));
+        }
+
+        // Lookups that already run keep the store they started with
+        {
+            std::lock_guard<std::mutex> lock(publishLock);
+            current = std::move(fresh);
+            generation.fetch_add(1, std::memory_order_release);
+        }
 
-    void Map::readMap(const std::string &mapfile) {
+        return true;
+    }
+
+    bool Map::parseMap(const std::string &mapfile,
+                       std::vector<Identity> &identities) {
         if (!fs::exists(fs::path(mapfile))
             && !fs::is_regular(fs::path(mapfile))) {
             std::cerr << "Error: Can not read mapfile " << mapfile << std::endl;
-            return;
+            return false;
         }
 
         try {
             std::ifstream store(mapfile);
             std::string line;
-            std::string keycol, valuecol;
+            std::size_t number = 0;
+
+            if (!store.is_open()) {
+                std::cerr << "Error: Can not read mapfile " << mapfile
+                          << std::endl;
+                return false;
+            }
 
             while (std::getline(store, line)) {
+                number++;
                 if (line.empty() || line.front() == '#')
                     continue;
                 std::stringstream record(line);
-                record >> keycol >> valuecol;
-                if (valuecol.empty()) {
-                    std::cerr << "Error: Wrong table format in mapfile "
-                              << mapfile << std::endl;
-                    return;
+                std::string keycol, valuecol;
+                if (!(record >> keycol >> valuecol)) {
+                    // Blank lines are fine, broken ones are left out
+                    if (!keycol.empty())
+                        std::cerr << "Error: Wrong table format in mapfile "
+                                  << mapfile << " line " << number
+                                  << std::endl;
+                    continue;
                 }
                 if (::debug)
                     std::cout << "keycol=" << keycol
                               << " valuecol=" << valuecol << std::endl;
 
-                confLock.lock();
-                certStore[keycol] = valuecol;
-                confLock.unlock();
+                Identity identity;
+                identity.address = keycol;
+                for (auto &c : identity.address)
+                    c = static_cast<char>(
+                            Store::fold(static_cast<unsigned char>(c)));
+                identity.hash = Store::hash(keycol.data(), keycol.size());
+
+                // Broken entries are reported once and not signed for
+                if (parseSigners(valuecol, identity))
+                    identities.push_back(std::move(identity));
             }
 
             store.close();
-            loaded = true;
         }
         catch (const std::exception &e) {
             std::cerr << "Error: " << e.what() << std::endl;
-            return;
+            return false;
         }
+
+        return true;
+    }
+
+    std::vector<Entry> Map::getEntries(void) {
+        const std::shared_ptr<const Store> &store = snapshot();
+
+        if (!store)
+            return std::vector<Entry>();
+
+        return store->signers();
     }
 
-    void Map::resetCertStore(void) {
-        confLock.lock();
-        certStore.clear();
-        confLock.unlock();
+    bool Map::hasSigner(const std::string &address) {
+        const std::shared_ptr<const Store> &store = snapshot();
+
+        return store && store->contains(address);
+    }
+
+    const std::vector<Entry> &Map::getSigners(void) const {
+        if (identity == nullptr)
+            return noSigners;
+
+        return identity->signers;
     }
 
     // Private
 
-    certstore_t Map::certStore = {};
+    bool Map::parseSigners(const std::string &raw, Identity &identity) {
+        std::vector<std::string> parts;
+
+        // Split at ",". Empty pieces are skipped
+        for (std::size_t pos = 0; pos <= raw.size();) {
+            std::size_t comma = raw.find(',', pos);
+            if (comma == std::string::npos)
+                comma = raw.size();
+            if (comma > pos)
+                parts.push_back(raw.substr(pos, comma - pos));
+            pos = comma + 1;
+        }
+
+        if (parts.size() < 2 || parts.size() % 2 != 0) {
+            std::cerr << "Error: Wrong value format in mapfile for "
+                      << identity.address << std::endl;
+            return false;
+        }
+
+        /*
+         * Each pair has a cert: and a key: part in any order. Instead of a
+         * key file, a PKCS#11 URI may name a key in a token. The URI is
+         * kept as it is
+         */
+        for (std::size_t i = 0; i < parts.size(); i += 2) {
+            Entry signer = {identity.address, std::string(), std::string()};
+
+            for (std::size_t pos = i; pos < i + 2; pos++) {
+                const std::string &field = parts.at(pos);
+                std::size_t colon = field.find(':');
+                if (colon == std::string::npos)
+                    continue;
+
+                std::string what = field.substr(0, colon);
+                if (what == "cert")
+                    signer.cert = field.substr(colon + 1);
+                else if (what == "key")
+                    signer.key = field.substr(colon + 1);
+                else if (what == "pkcs11")
+                    signer.key = field;
+            }
+
+            if (signer.cert.empty() || signer.key.empty()) {
+                std::cerr << "Error: Incomplete certificate and key pair for "
+                          << identity.address << std::endl;
+                continue;
+            }
+
+            identity.signers.push_back(std::move(signer));
+        }
+
+        return !identity.signers.empty();
+    }
+
+    const std::shared_ptr<const Store> &Map::snapshot(void) {
+        thread_local uint64_t seen = 0;
+        thread_local std::shared_ptr<const Store> cached;
+
+        // One atomic load, unless the map file was read again
+        if (generation.load(std::memory_order_acquire) != seen) {
+            std::lock_guard<std::mutex> lock(publishLock);
+            cached = current;
+            seen = generation.load(std::memory_order_relaxed);
+        }
+
+        return cached;
+    }
+
+    // Init static
+
+    std::shared_ptr<const Store> Map::current = nullptr;
+
+    std::mutex Map::publishLock;
+
+    std::atomic<uint64_t> Map::generation(0);
+
+    const std::vector<Entry> Map::noSigners = {};
 
-    bool Map::loaded = false;
+    const std::string Map::noFile = std::string();
 
-}  // namespace mapfile
\ No newline at end of file
+}  // namespace mapfile
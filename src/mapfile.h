@@ -11,26 +11,139 @@
 #ifndef SRC_MAP_H_
 #define SRC_MAP_H_
 
+#include <atomic>
+#include <cstdint>
 #include <string>
-#include <map>
+#include <memory>
+#include <mutex>
 #include <vector>
-#include <boost/algorithm/string.hpp>
+
+#include "mapdb.h"
 
 extern bool debug;
 
 namespace mapfile {
-    using boost::split;
-    using boost::is_any_of;
-    using boost::token_compress_on;
+    /*!
+     * @brief One record of the map file
+     */
+    struct Entry {
+        //! @brief The email address
+        std::string address;
+
+        //! @brief Path to the S/MIME certificate
+        std::string cert;
+
+        //! @brief Path to the S/MIME key
+        std::string key;
+    };
 
-    using certstore_t =  std::map<std::string, std::string>;
-    using split_t =  std::vector<std::string>;
+    /*!
+     * @brief An email address with all its certificate and key pairs
+     */
+    struct Identity {
+        //! @brief The email address in lower case
+        std::string address;
+
+        //! @brief Hash of the address
+        uint64_t hash;
+
+        //! @brief The certificate and key pairs in map file order
+        std::vector<Entry> signers;
+    };
 
     /*!
      * @brief Type selector. S/MIME certificate or key
      */
     enum class Smime {CERT, KEY};
 
+    /*!
+     * @brief The identities of one map file
+     *
+     * Every line of a text map file is parsed once, when the map file is
+     * read. The identities are found with an open addressing hash table
+     * over their addresses. A compiled map file is used as it is mapped.
+     * Addresses are compared case-insensitively.
+     *
+     * Built completely by readMap() and never changed afterwards. Readers
+     * keep the instance they started with, while a reload publishes a new
+     * one.
+     */
+    class Store {
+    public:
+        /*!
+         * @brief Constructor for a text map file
+         *
+         * If an address shows up more than once, the last one is used.
+         */
+        explicit Store(std::vector<Identity> &&);
+
+        /*!
+         * @brief Constructor for a compiled map file
+         */
+        explicit Store(std::unique_ptr<const MapDb>);
+
+        /*!
+         * @brief The identity of an address
+         *
+         * An identity of a compiled map file is copied into the given one.
+         *
+         * @return nullptr, if the address has no map file entry
+         */
+        const Identity *find(const std::string &, Identity &) const;
+
+        /*!
+         * @brief The address has a map file entry. Does not allocate
+         */
+        bool contains(const std::string &) const;
+
+        /*!
+         * @brief All certificate and key pairs of all identities
+         */
+        std::vector<Entry> signers(void) const;
+
+        /*!
+         * @brief The identities of a text map file
+         *
+         * Empty for a compiled map file.
+         */
+        inline const std::vector<Identity> &identities(void) const {
+            return entries;
+        }
+
+        /*!
+         * @brief Hash of an address, ignoring the case of ASCII letters
+         */
+        static uint64_t hash(const char *, std::size_t);
+
+        /*!
+         * @brief Lower case of an ASCII letter
+         */
+        static inline unsigned char fold(unsigned char c) {
+            return (c >= 'A' && c <= 'Z')
+                   ? static_cast<unsigned char>(c | 0x20) : c;
+        }
+
+    private:
+        /*!
+         * @brief Find an identity of a text map file
+         *
+         * @return nullptr, if the address has no map file entry
+         */
+        const Identity *lookup(const std::string &) const;
+
+        //! @brief The identities
+        std::vector<Identity> entries;
+
+        //! @brief Index into entries plus one. 0 marks an empty slot
+        std::vector<uint32_t> slots;
+
+        //! @brief Number of slots minus one. A power of two minus one
+        uint64_t mask;
+
+        //! @brief The compiled map file or nullptr for a text map file
+        std::unique_ptr<const MapDb> compiled;
+    };
+
     /*!
      * @brief Load a map file
      *
@@ -43,7 +156,8 @@ namespace mapfile {
         /*!
          * @brief Constructor
          *
-         * Find S/MIME cert and key based on an email address
+         * Find S/MIME cert and key based on an email address. All lookups
+         * of this instance use the map file that is current now.
          */
         Map(const std::string &);
 
@@ -53,101 +167,127 @@ namespace mapfile {
         virtual ~Map(void) = default;
 
         /*!
-         * @brief Read a map file and store data internally in certStore
+         * @brief Read a map file and publish it as the current store
+         *
+         * A compiled map file is mapped into memory. A text map file is
+         * parsed into a new store. Lookups that run meanwhile see the
+         * previous map file. If the file can not be read, the previous map
+         * file stays in use.
+         *
+         * @return false, if the file could not be read
+         */
+        static bool readMap(const std::string&);
+
+        /*!
+         * @brief Parse a text map file
+         *
+         * Broken values are reported and left out.
+         *
+         * @return false, if the file could not be read
+         */
+        static bool parseMap(const std::string &, std::vector<Identity> &);
+
+        /*!
+         * @brief All records of the map file with their files
          */
-        static void readMap(const std::string&);
+        static std::vector<Entry> getEntries(void);
 
         /*!
-         * @brief Reset the certificate table
+         * @brief The address has a map file entry
+         *
+         * Used when MAIL FROM is seen, so that messages of all other
+         * senders can be accepted without spooling them.
          */
-        static void resetCertStore(void);
+        static bool hasSigner(const std::string &);
 
         /*!
          * @brief A certificate or key
+         *
+         * If more than one certificate and key is configured, this is the
+         * first pair. Empty, if the address has no map file entry.
          */
         template <Smime>
-        const std::string & getSmimeFilename(void);
+        const std::string & getSmimeFilename(void) const;
+
+        /*!
+         * @brief All certificate and key pairs of the address
+         *
+         * A map file value may list more than one pair, for example an RSA
+         * and an EC key. The message is then signed with all of them.
+         *
+         * The pairs belong to the map file of this instance.
+         */
+        const std::vector<Entry> &getSigners(void) const;
 
     private:
         /*!
-         * @brief Setter which checks for a cert and key
+         * @brief Parse the value of a map file line
          *
-         * Prepare internal attributes smimeCert and smimeKey
+         * @return false, if the value has no complete pair
          */
-        template <Smime, size_t pos=0>
-        void setSmimeFile(const split_t &);
+        static bool parseSigners(const std::string &, Identity &);
 
         /*!
-         * @brief System wide certificate store
+         * @brief The current map file as seen by the calling thread
          *
-         * When data gets read by readMap(), all recognized table records are
-         * stored into this map. No further splitting or testing is done here.
+         * Each thread keeps its own reference to the current store. It is
+         * refreshed under publishLock only after a reload, so that lookups
+         * take no lock. hasSigner() and getEntries() also touch no shared
+         * reference count. A Map instance copies the reference once, so
+         * that its identity stays valid, when the thread sees a reload
+         * meanwhile. A thread holds on to a replaced store until its next
+         * lookup.
          */
-        static certstore_t certStore;
+        static const std::shared_ptr<const Store> &snapshot(void);
 
         /*!
-         * @brief Flag to signal, if a map file could be loaded
+         * @brief The current map file
+         *
+         * Replaced as a whole under publishLock, when the map file is read.
+         * nullptr, until a map file was loaded.
          */
-        static bool loaded;
+        static std::shared_ptr<const Store> current;
+
+        //! @brief Serializes access to current
+        static std::mutex publishLock;
+
+        //! @brief Increased after every change of current
+        static std::atomic<uint64_t> generation;
+
+        //! @brief Returned for addresses without map file entry
+        static const std::vector<Entry> noSigners;
+
+        //! @brief Returned for addresses without map file entry
+        static const std::string noFile;
 
         /*!
-         * @brief The MAIL FROM address as used as a key for the certStore
+         * @brief The map file that this instance looks at
+         *
+         * A copy, because identity points into it.
          */
-        const std::string mailFrom;
+        const std::shared_ptr<const Store> store;
 
         /*!
-         * @brief S/MIME certificate of a user
+         * @brief Copy of an identity from a compiled map file
          */
-        std::string smimeCert;
+        Identity found;
 
         /*!
-         * @brief S/MIME key of a user
+         * @brief The identity of the MAIL FROM address or nullptr
          */
-        std::string smimeKey;
+        const Identity *identity;
     };
 
     // Public
 
     template <Smime component>
-    const std::string & Map::getSmimeFilename() {
-        if (loaded && certStore.count(mailFrom) == 1) {
-            std::string raw = certStore[mailFrom];
-            split_t parts;
+    const std::string & Map::getSmimeFilename() const {
+        if (identity == nullptr)
+            return noFile;
 
-            // Split the value in two pieces
-            split(parts, raw, is_any_of(","), token_compress_on);
+        const Entry &first = identity->signers.front();
 
-            if (parts.size() == 2)
-                setSmimeFile<component>(parts);
-        }
-
-        return (component == Smime::CERT) ? smimeCert : smimeKey;
-    }
-
-    // Private
-
-    template <Smime component, size_t pos>
-    void Map::setSmimeFile(const split_t &src) {
-        split_t parts;
-        std::size_t found;
-        std::string what;
-
-        what = (component == Smime::CERT) ? "cert:" : "key:";
-
-        found = src.at(pos).find(what);
-        if (found != std::string::npos) {
-            split(parts, src.at(pos), is_any_of(":"), token_compress_on);
-            if (parts.size() != 2)
-                return;
-            if (component == Smime::CERT)
-                smimeCert = parts.at(1);
-            else
-                smimeKey = parts.at(1);
-        } else {
-            if (pos == 1)
-                return;
-            setSmimeFile<component, 1>(src);
-        }
+        return (component == Smime::CERT) ? first.cert : first.key;
     }
 }  // namespace mapfile
 
@@ -21,7 +21,13 @@
 #include <pwd.h>    // uid
 #include <grp.h>    // gid
 #include <syslog.h>
+#include <fcntl.h>
+#include <unistd.h>
 
+#include <openssl/err.h>
+
+#include <algorithm>
+#include <cerrno>
 #include <iostream>
 #include <string>
 #include <fstream>
@@ -35,6 +41,16 @@
 #include "smime.h"
 #include "common.h"
 #include "mapfile.h"
+#include "credcache.h"
+#include "certpool.h"
+#include "snapshot.h"
+#include "bodywriter.h"
+#include "headerplan.h"
+#include "signpool.h"
+#include "sha256mb.h"
+#include "pkcs11.h"
+#include "signclient.h"
+#include "signservice.h"
 
 namespace fs = boost::filesystem;
 namespace po = boost::program_options;
@@ -51,8 +67,14 @@ static const std::string version("1607.1.6");
 //! @brief  Configuration options for the milter
 static std::unique_ptr<conf::MilterCfg> config(nullptr);
 
-//! @brief Required headers for the smfi_header()-callback
-static std::vector<std::string> header;
+//! @brief Run as signer process that holds the private keys
+static bool signer = false;
+
+//! @brief Self-pipe. SIGHUP and SIGUSR1 write to it, signalWorker() reads it
+static int reloadPipe[2] = {-1, -1};
+
+//! @brief The last load found credentials that are not in the snapshot
+static bool snapshotDue = false;
 
 /*!
  * @brief Global data structure that maps all callbacks
@@ -72,7 +94,7 @@ static struct smfiDesc smfilter = {
 #else
         nullptr,
 #endif  // defined _CB_ENVFROM
-#if defined ENVRCPT
+#if defined _CB_ENVRCPT
         mlfi_envrcpt,       // envelope recipient filter
 #else
         nullptr,
@@ -117,28 +139,72 @@ static struct smfiDesc smfilter = {
 };
 
 /*!
- * @brief xxfi_connect() callback
+ * @brief Create the client data of a connection
+ *
+ * @return nullptr, if it could not be created
  */
-sfsistat mlfi_connect(SMFICTX *ctx, char *hostname, struct sockaddr *hostaddr) {
-    assert(ctx != nullptr);
-
+static mlt::Client *newClient(SMFICTX *ctx) {
     mlt::Client *client = nullptr;
 
     try {
-        client = new mlt::Client(hostname, hostaddr);
+        client = new mlt::Client();
     }
     catch (const std::bad_alloc &ba) {
         std::cerr << "Error: bad_alloc caught: " << ba.what() << std::endl;
-        return SMFIS_TEMPFAIL;
+        return nullptr;
     }
     catch (const std::exception &e) {
         std::cerr << "Error: " << e.what() << std::endl;
-        return SMFIS_TEMPFAIL;
+        return nullptr;
     }
 
     // Store new client data
     smfi_setpriv(ctx, static_cast<void *>(client));
 
+    return client;
+}
+
+/*!
+ * @brief Reply of a callback that always continues
+ *
+ * No reply is sent, if the MTA agreed to this step in mlfi_negotiate()
+ */
+static sfsistat proceed(SMFICTX *ctx, u_long noReply) {
+    auto *client = util::mlfipriv(ctx);
+
+    if (client != nullptr && (client->protocol & noReply) != 0)
+        return SMFIS_NOREPLY;
+
+    return SMFIS_CONTINUE;
+}
+
+/*!
+ * @brief Write body content, encoded if the body or its parts are encoded
+ */
+static bool writeBody(mlt::Client *client, const char *data, std::size_t len) {
+    if (client->transcoder.active())
+        return client->writeContent(client->transcoder.encode(data, len));
+    if (client->parts.active())
+        return client->writeContent(client->parts.encode(data, len));
+
+    return client->writeContent(data, len);
+}
+
+/*!
+ * @brief xxfi_connect() callback
+ */
+sfsistat mlfi_connect(SMFICTX *ctx, char *hostname, struct sockaddr *hostaddr) {
+    assert(ctx != nullptr);
+
+    // Usually created in mlfi_negotiate(). Older MTAs do not negotiate
+    auto *client = util::mlfipriv(ctx);
+    if (client == nullptr)
+        client = newClient(ctx);
+    if (client == nullptr)
+        return SMFIS_TEMPFAIL;
+
+    client->setPeer(hostname, hostaddr);
+
     if (::debug) {
         std::cout << "id=" << client->id
                   << " connect from hostname="
@@ -155,7 +221,7 @@ sfsistat mlfi_connect(SMFICTX *ctx, char *hostname, struct sockaddr *hostaddr) {
  * @brief xxfi_helo() callback
  */
 sfsistat mlfi_helo(SMFICTX *ctx, char *helohost) {
-    return SMFIS_CONTINUE;
+    return proceed(ctx, SMFIP_NR_HELO);
 }
 #endif  // defined _CB_HELO
 
@@ -167,17 +233,42 @@ sfsistat mlfi_envfrom(SMFICTX *ctx, char **smtp_argv) {
     assert(ctx != nullptr);
 
     auto *client = util::mlfipriv(ctx);
-    if (!client->createContentFile(::config->getValue("tmpdir")))
-        return SMFIS_TEMPFAIL;
 
-    // Copy envelope sender address
-    char *mailfrom = strdup(smtp_argv[0]);
-    if (mailfrom == nullptr) {
-        perror("Error: Unable to copy envfrom address");
-        return SMFIS_TEMPFAIL;
+    std::string envfrom = smtp_argv[0];
+    std::string address = envfrom;
+    if (address.size() >= 2 && address.front() == '<'
+        && address.back() == '>')
+        address = address.substr(1, address.size() - 2);
+
+    /*
+     * Null-mailer or a sender without map file entry. Nothing of this
+     * message is ever signed, so do not spool it
+     */
+    if (address.empty() || !mapfile::Map::hasSigner(address)) {
+        if (::debug)
+            std::cout << "No signer for " << envfrom << ", accepting"
+                      << std::endl;
+        client->reset();
+        mlt::Client::countMessage(mlt::Disposition::NO_SIGNER);
+        return SMFIS_ACCEPT;
     }
 
-    client->sessionData["envfrom"] = mailfrom;
+    if (!client->startContent(::config->getValue("tmpdir")))
+        return SMFIS_TEMPFAIL;
+
+    client->sessionData["envfrom"] = envfrom;
+
+    // The content digests of all signers run from the first body chunk
+    mapfile::Map email(address);
+    for (auto &it : email.getSigners()) {
+        bool missing = false;
+        smime::credentials_t creds = smime::CredentialCache::get(
+                it.cert, it.key, missing);
+        if (creds && creds->digest() != nullptr)
+            client->addContentDigest(creds->digest());
+    }
+    // Problems are reported, when the message is signed
+    ERR_clear_error();
 
     return SMFIS_CONTINUE;
 }
@@ -188,7 +279,7 @@ sfsistat mlfi_envfrom(SMFICTX *ctx, char **smtp_argv) {
  * @brief xxfi_envrcpt() callback
  */
 sfsistat mlfi_envrcpt(SMFICTX *ctx, char **smtp_argv) {
-    return SMFIS_CONTINUE;
+    return proceed(ctx, SMFIP_NR_RCPT);
 }
 #endif  // defined _CB_ENVRCPT
 
@@ -197,7 +288,7 @@ sfsistat mlfi_envrcpt(SMFICTX *ctx, char **smtp_argv) {
  * @brief xxfi_data() callback
  */
 sfsistat mlfi_data(SMFICTX *ctx) {
-    return SMFIS_CONTINUE;
+    return proceed(ctx, SMFIP_NR_DATA);
 }
 #endif  // defined _CB_DATA
 
@@ -206,13 +297,16 @@ sfsistat mlfi_data(SMFICTX *ctx) {
  * @brief xxfi_unknown() callback
  */
 sfsistat mlfi_unknown(SMFICTX *ctx, const char *cmd) {
-    return SMFIS_CONTINUE;
+    return proceed(ctx, SMFIP_NR_UNKN);
 }
 #endif  // defined _CB_UNKNOWN
 
 #if defined _CB_HEADER
 /*!
  * @brief xxfi_header() callback
+ *
+ * Always continues. If the MTA agreed, no reply is sent, so that it does
+ * not wait for each header. Decisions are made in mlfi_eoh()
  */
 sfsistat mlfi_header(
         SMFICTX *ctx, char *header_key, char *header_value) {
@@ -220,43 +314,64 @@ sfsistat mlfi_header(
 
     auto *client = util::mlfipriv(ctx);
 
-    for (std::size_t i=0; i<::header.size(); i++) {
-        if (strncasecmp(header_key, ::header.at(i).c_str(),
-                        ::header.at(i).size()) == 0) {
-            // Found MIME-VERSION
-            if (strncasecmp(header_key, "MIME-Version", 12) == 0) {
-                client->mailflags |= mlt::mailflags::TYPE_MIME;
-                continue;
+    // The message is accepted or fails at the end of the header
+    if (client->contentError
+        || client->mailflags & mlt::mailflags::TYPE_PROTECTED)
+        return proceed(ctx, SMFIP_NR_HDR);
+
+    mlt::HeaderKind kind = mlt::HeaderClassifier::classify(header_key);
+
+    // Received, DKIM-Signature and all other headers stay where they are
+    if (kind == mlt::HeaderKind::OTHER)
+        return proceed(ctx, SMFIP_NR_HDR);
+
+    switch (kind) {
+        case mlt::HeaderKind::MIME_VERSION:
+            client->mailflags |= mlt::mailflags::TYPE_MIME;
+            // Not signed, but replaced in the signed message
+            client->markHeader(kind, header_key, header_value);
+            return proceed(ctx, SMFIP_NR_HDR);
+        case mlt::HeaderKind::OWN:
+            // Replaced at the end of the message, never signed
+            client->markHeader(kind, header_key, header_value);
+            return proceed(ctx, SMFIP_NR_HDR);
+        case mlt::HeaderKind::CONTENT_TYPE:
+            if (client->findHeader(kind) == nullptr
+                && mlt::Client::isProtectedType(header_value)) {
+                // A signed or encrypted message is never signed again
+                client->mailflags |= mlt::mailflags::TYPE_PROTECTED;
+                return proceed(ctx, SMFIP_NR_HDR);
             }
 
-            client->markedHeaders.push_back(
-                    std::make_pair(header_key, header_value));
-
             // Found multipart message
-            if (strncasecmp(header_key, "Content-Type", 12) == 0)
-                if (strstr(header_value, "multipart/") != nullptr)
-                    client->mailflags |= mlt::mailflags::TYPE_MULTIPART;
-
-            // Found out own header
-            if (strncasecmp(header_key,
-                            mlt_header_name.c_str(),
-                            sizeof(*mlt_header_name.c_str())) == 0) {
-                continue;
+            if (strstr(header_value, "multipart/") != nullptr) {
+                client->mailflags |= mlt::mailflags::TYPE_MULTIPART;
+                client->preamble.start(
+                        mlt::BoundaryScanner::parameter(header_value));
             }
-
-            if (fprintf(client->fcontent,
-                        "%s: %s\r\n",
-                        header_key,
-                        header_value) < 0) {
-                std::cerr << "Error: Unable to write header" << std::endl;
-                return SMFIS_TEMPFAIL;
+            break;
+        case mlt::HeaderKind::CONTENT_TRANSFER_ENCODING:
+            // Written in mlfi_eoh(), when the encoding of the body is known
+            if (::config->getValue<bool>("transcode")) {
+                client->markHeader(kind, header_key, header_value);
+                return proceed(ctx, SMFIP_NR_HDR);
             }
-
             break;
-        }
+        default:
+            break;
     }
 
-    return SMFIS_CONTINUE;
+    client->markHeader(kind, header_key, header_value);
+
+    if (!client->writeContent(header_key, strlen(header_key))
+        || !client->writeContent(": ", 2)
+        || !client->writeContent(header_value, strlen(header_value))
+        || !client->writeContent("\r\n", 2)) {
+        std::cerr << "Error: Unable to write header" << std::endl;
+        client->contentError = true;
+    }
+
+    return proceed(ctx, SMFIP_NR_HDR);
 }
 #endif  // defined _CB_HEADER
 
@@ -268,7 +383,24 @@ sfsistat mlfi_eoh(SMFICTX *ctx) {
     assert(ctx != nullptr);
 
     auto *client = util::mlfipriv(ctx);
-    bool ct_is_set = false;
+    bool ct_is_set =
+            client->findHeader(mlt::HeaderKind::CONTENT_TYPE) != nullptr;
+
+    if (client->contentError)
+        return SMFIS_TEMPFAIL;
+
+    /*
+     * Stop here for a signed or encrypted message, so that its body is not
+     * spooled
+     */
+    if (client->mailflags & mlt::mailflags::TYPE_PROTECTED) {
+        if (::debug)
+            std::cout << "Message is already signed or encrypted, accepting"
+                      << std::endl;
+        client->reset();
+        mlt::Client::countMessage(mlt::Disposition::PROTECTED);
+        return SMFIS_ACCEPT;
+    }
 
     /*
      * Content-Type set without MIME-Version violates RFC2045
@@ -283,20 +415,66 @@ sfsistat mlfi_eoh(SMFICTX *ctx) {
     }
 
     // If we see a plain text email without Content-Type, add this header
-    for (auto &it : client->markedHeaders) {
-        if (it.first == "Content-Type") {
-            ct_is_set = true;
-            break;
-        }
-    }
     if (!ct_is_set) {
-        if (fprintf(client->fcontent, "Content-Type: text/plain\r\n") == 0) {
+        if (!client->writeContent("Content-Type: text/plain\r\n")) {
             std::cerr << "Error: Unable to write Content-Type" << std::endl;
             return SMFIS_TEMPFAIL;
         }
     }
 
-    if (fprintf(client->fcontent, "\r\n") <= 0) {
+    /*
+     * An 8bit or binary body gets a 7bit encoding before it is signed. The
+     * Content-Transfer-Encoding header was held back for this
+     */
+    if (::config->getValue<bool>("transcode")) {
+        const mlt::MarkedHeader *cte =
+                client->findHeader(mlt::HeaderKind::CONTENT_TRANSFER_ENCODING);
+        const mlt::MarkedHeader *ct =
+                client->findHeader(mlt::HeaderKind::CONTENT_TYPE);
+        mlt::Encoding encoding = mlt::Transcoder::select(
+                cte != nullptr ? cte->value.data : nullptr,
+                ct != nullptr ? ct->value.data : nullptr);
+
+        client->transcoder.start(encoding);
+
+        // A multipart body is not encoded, but its parts may be
+        if (!client->transcoder.active() && ct != nullptr
+            && client->mailflags & mlt::mailflags::TYPE_MULTIPART) {
+            client->parts.start(
+                    mlt::BoundaryScanner::parameter(ct->value.data));
+            if (::debug && client->parts.active())
+                std::cout << "Encoding 8bit and binary parts of the body"
+                          << std::endl;
+        }
+
+        bool written = true;
+        if (client->transcoder.active()) {
+            if (::debug)
+                std::cout << "Encoding body as "
+                          << mlt::Transcoder::name(encoding) << std::endl;
+            written = client->writeContent(
+                    std::string("Content-Transfer-Encoding: ")
+                    + mlt::Transcoder::name(encoding) + "\r\n");
+        } else {
+            for (auto &it : client->markedHeaders) {
+                if (it.kind != mlt::HeaderKind::CONTENT_TRANSFER_ENCODING)
+                    continue;
+                written = written
+                          && client->writeContent(it.name.data, it.name.size)
+                          && client->writeContent(": ", 2)
+                          && client->writeContent(it.value.data, it.value.size)
+                          && client->writeContent("\r\n", 2);
+            }
+        }
+
+        if (!written) {
+            std::cerr << "Error: Unable to write Content-Transfer-Encoding"
+                      << std::endl;
+            return SMFIS_TEMPFAIL;
+        }
+    }
+
+    if (!client->writeContent("\r\n")) {
         std::cerr << "Error: Unable to write end of header" << std::endl;
         return SMFIS_TEMPFAIL;
     }
@@ -317,28 +495,26 @@ sfsistat mlfi_body(SMFICTX *ctx, unsigned char *bodyp, size_t body_len) {
 
     auto *client = util::mlfipriv(ctx);
 
-    if (client->optionalPreamble
-        && client->mailflags & mlt::mailflags::TYPE_MULTIPART) {
-        unsigned char *bodyit = bodyp;
-        size_t remaining = body_len;
-
-        /*
-         * Remove preamble, RFC2046, 5.1.1
-         */
-        while (strncmp(
-                (const char *) bodyit, "--", 2) != 0) {
-            if (remaining > 0) {
-                bodyit++;
-                remaining--;
-            }
+    /*
+     * Remove preamble, RFC2046, 5.1.1
+     */
+    if (client->preamble.scanning()) {
+        std::size_t offset = client->preamble.scan(
+                reinterpret_cast<const char *>(bodyp), body_len);
+        if (offset == std::string::npos)
+            return SMFIS_CONTINUE;
+
+        const std::string &pending = client->preamble.pending();
+        if (!writeBody(client, pending.data(), pending.size())) {
+            std::cerr << "Error: Unable to write body" << std::endl;
+            return SMFIS_TEMPFAIL;
         }
-        bodyp = bodyit;
-        body_len = remaining;
-
-        client->optionalPreamble = false;
+        bodyp += offset;
+        body_len -= offset;
     }
 
-    if (fwrite(bodyp, body_len, 1, client->fcontent) <= 0) {
+    if (!writeBody(client, reinterpret_cast<const char *>(bodyp),
+                   body_len)) {
         std::cerr << "Error: Unable to write body" << std::endl;
         return SMFIS_TEMPFAIL;
     }
@@ -362,18 +538,39 @@ sfsistat mlfi_eom(SMFICTX *ctx) {
 
     auto *client = util::mlfipriv(ctx);
 
-    if (client->getFcontentStatus()) {
-        if (fseek(client->fcontent, 0L, SEEK_SET) == -1) {
-            perror("Error: Unwilling to rewind temp file");
+    if (!client->content.isOpen()) {
+        std::cerr << "Error: No message content" << std::endl;
+        return SMFIS_TEMPFAIL;
+    }
+
+    // A multipart body without delimiter keeps its preamble
+    if (client->preamble.scanning()) {
+        client->preamble.stop();
+        const std::string &pending = client->preamble.pending();
+        if (!writeBody(client, pending.data(), pending.size())) {
+            std::cerr << "Error: Unable to write body" << std::endl;
+            return SMFIS_TEMPFAIL;
+        }
+    }
+
+    // Bytes that the encoders kept back for the next chunk
+    if (client->transcoder.active()) {
+        if (!client->writeContent(client->transcoder.finish())) {
+            std::cerr << "Error: Unable to write body" << std::endl;
+            return SMFIS_TEMPFAIL;
+        }
+    }
+    if (client->parts.active()) {
+        if (!client->writeContent(client->parts.finish())) {
+            std::cerr << "Error: Unable to write body" << std::endl;
             return SMFIS_TEMPFAIL;
         }
-    } else {
-        std::cerr << "Error: Temp file is not open" << std::endl;
-        return SMFIS_TEMPFAIL;
     }
 
     smime::Smime smimeMsg(ctx);
 
+    mlt::Client::countMessage(mlt::Disposition::SPOOLED);
+
     if (::debug)
         std::cout << "-> sign()" << std::endl;
     smimeMsg.sign();
@@ -382,12 +579,6 @@ sfsistat mlfi_eom(SMFICTX *ctx) {
     if (!smimeMsg.isSmimeSigned()) {
         if (::debug)
             std::cout << "Email was not signed" << std::endl;
-        // Look for an existing header of this milter
-        for (auto &it : client->markedHeaders)
-            if (it.first == mlt_header_name) {
-                smfi_chgheader(ctx, util::ccp(it.first.c_str()), 1, nullptr);
-                break;
-            }
     } else {
         std::string logmsg = "Signed mail for email address "
                              + client->sessionData["envfrom"];
@@ -399,9 +590,15 @@ sfsistat mlfi_eom(SMFICTX *ctx) {
     if (client->genericError)
         return SMFIS_TEMPFAIL;
 
-    smfi_addheader(
-            ctx, util::ccp(mlt_header_name), util::ccp(
-                    "S/MIME sigh milter - version " + std::string(::version)));
+    // Existing headers of this milter are replaced in place
+    mlt::markedHeaders_t ownHeaders;
+    for (auto &it : client->markedHeaders)
+        if (it.kind == mlt::HeaderKind::OWN)
+            ownHeaders.push_back(it);
+
+    smime::HeaderPlan plan(ownHeaders, {{mlt_header_name,
+            "S/MIME sigh milter - version " + std::string(::version)}});
+    plan.apply(ctx);
 
     /*
      * Clear data structures
@@ -417,7 +614,15 @@ sfsistat mlfi_eom(SMFICTX *ctx) {
  * \brief xxfi_abort() callback
  */
 sfsistat mlfi_abort(SMFICTX *ctx) {
-    return SMFIS_ACCEPT;
+    assert(ctx != nullptr);
+
+    auto *client = util::mlfipriv(ctx);
+
+    // The connection may send another message. The spool is kept for it
+    if (client != nullptr)
+        client->reset();
+
+    return SMFIS_CONTINUE;
 }
 #endif  // defined _CB_ABORT
 
@@ -470,9 +675,63 @@ sfsistat mlfi_negotiate(
     else
         return SMFIS_REJECT;
 
+    /*
+     * The MTA does not send events without a callback. Callbacks that
+     * always continue get no reply
+     */
+    u_long steps = 0;
+#if defined _CB_HELO
+    steps |= SMFIP_NR_HELO;
+#else
+    steps |= SMFIP_NOHELO;
+#endif  // defined _CB_HELO
+#if !defined _CB_ENVFROM
+    steps |= SMFIP_NOMAIL;
+#endif  // ! defined _CB_ENVFROM
+#if defined _CB_ENVRCPT
+    steps |= SMFIP_NR_RCPT;
+#else
+    steps |= SMFIP_NORCPT;
+#endif  // defined _CB_ENVRCPT
+#if defined _CB_DATA
+    steps |= SMFIP_NR_DATA;
+#else
+    steps |= SMFIP_NODATA;
+#endif  // defined _CB_DATA
+#if defined _CB_UNKNOWN
+    steps |= SMFIP_NR_UNKN;
+#else
+    steps |= SMFIP_NOUNKNOWN;
+#endif  // defined _CB_UNKNOWN
+#if defined _CB_HEADER
+    steps |= SMFIP_NR_HDR;
+#else
+    steps |= SMFIP_NOHDRS;
+#endif  // defined _CB_HEADER
+#if !defined _CB_EOH
+    steps |= SMFIP_NOEOH;
+#endif  // ! defined _CB_EOH
+#if !defined _CB_BODY
+    steps |= SMFIP_NOBODY;
+#endif  // ! defined _CB_BODY
+
+    // Only steps that the MTA offers
+    *pf1 = f1 & steps;
     *pf2 = 0;
     *pf3 = 0;
 
+    // Callbacks look up, whether they must not reply
+    auto *client = util::mlfipriv(ctx);
+    if (client == nullptr)
+        client = newClient(ctx);
+    if (client == nullptr)
+        return SMFIS_TEMPFAIL;
+    client->protocol = *pf1;
+
+    if (::debug)
+        std::cout << "Negotiated protocol flags 0x" << std::hex << *pf1
+                  << std::dec << std::endl;
+
     return SMFIS_CONTINUE;
 }
 
@@ -491,6 +750,196 @@ static void initMilter(const std::string &con) {
     }
 }
 
+/*!
+ * @brief Load the map file and all certificates that belong to it
+ *
+ * @return false, if the map file could not be read. The previous map file
+ * stays in use
+ */
+static bool loadMapfile(void) {
+    std::string mapfile = ::config->getValue("mapfile");
+    std::string snapfile = snapshotFile();
+    bool remote = smime::SignClient::enabled();
+    // The snapshot holds keys, which the signer process keeps for itself
+    bool snapshot = ::config->getValue<bool>("snapshot") && !remote;
+
+    if (!mapfile::Map::readMap(mapfile))
+        return false;
+
+    std::vector<mapfile::Entry> entries = mapfile::Map::getEntries();
+    std::vector<mapfile::Entry> stale;
+    std::vector<std::string> certFiles;
+    bool tokens = smime::Pkcs11::ready();
+    bool rewrite = false;
+
+    // Entries with unchanged files are decoded from the snapshot on demand
+    if (snapshot)
+        smime::Snapshot::open(snapfile);
+    for (auto &it : entries) {
+        bool inToken = !remote && smime::Pkcs11::isUri(it.key);
+
+        if (snapshot && !inToken
+            && smime::Snapshot::covers(it.cert, it.key))
+            continue;
+        if (!it.cert.empty())
+            certFiles.push_back(it.cert);
+
+        // Token keys are loaded, when the PKCS#11 module is ready
+        if (inToken && !tokens)
+            continue;
+        stale.push_back(it);
+        if (!inToken)
+            rewrite = true;
+    }
+
+    // Many senders may share a certificate file
+    std::sort(certFiles.begin(), certFiles.end());
+    certFiles.erase(std::unique(certFiles.begin(), certFiles.end()),
+                    certFiles.end());
+
+    // Intermediate certificates are shared by all senders
+    smime::IntermediatePool::rebuild(certFiles, ::config->getValue("cadir"));
+    smime::Pkcs11::clear();
+    smime::CredentialCache::clear();
+    if (::signer)
+        smime::SignService::allow(entries);
+
+    // Find broken entries now and not while signing
+    smime::CredentialCache::prewarm(
+            stale, ::config->getValue<unsigned int>("prewarmthreads"));
+
+    // Written by storeSnapshot() with the privileges of the milter user
+    snapshotDue = snapshot && rewrite;
+
+    return true;
+}
+
+/*!
+ * @brief The snapshot file, next to the map file if none is configured
+ */
+static std::string snapshotFile(void) {
+    std::string snapfile = ::config->getValue("snapshotfile");
+
+    return snapfile.empty() ? ::config->getValue("mapfile") + ".snap"
+                            : snapfile;
+}
+
+/*!
+ * @brief Write the snapshot, if the last load of the map file asks for it
+ *
+ * Not called before the privileges are dropped, so that the file belongs to
+ * the milter user, who replaces it on reload
+ */
+static void storeSnapshot(void) {
+    if (!snapshotDue)
+        return;
+    snapshotDue = false;
+
+    std::string snapfile = snapshotFile();
+    if (smime::Snapshot::write(snapfile, mapfile::Map::getEntries()))
+        smime::Snapshot::open(snapfile);
+}
+
+/*!
+ * @brief Create the self-pipe for SIGHUP and SIGUSR1
+ *
+ * The write end does not block, so that the signal handler never waits.
+ */
+static bool openReloadPipe(void) {
+    if (pipe(reloadPipe) != 0)
+        return false;
+
+    for (int fd : reloadPipe)
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    return fcntl(reloadPipe[1], F_SETFL, O_NONBLOCK) == 0;
+}
+
+/*!
+ * @brief Handle the work of SIGHUP and SIGUSR1
+ *
+ * Runs in its own thread, because reading files, taking locks and logging
+ * are not allowed in a signal handler. The handler writes 'R' for a reload
+ * and 'S' for the statistics to the pipe. Signals that arrive while a
+ * reload runs are handled by one further reload. The thread ends, when the
+ * write end of the pipe is closed.
+ */
+static void signalWorker(void) {
+    char signals[64];
+
+    for (;;) {
+        ssize_t size = read(reloadPipe[0], signals, sizeof(signals));
+        if (size < 0 && errno == EINTR)
+            continue;
+        if (size <= 0)
+            return;
+
+        char *end = signals + size;
+        bool reload = std::find(signals, end, 'R') != end;
+        bool stats = std::find(signals, end, 'S') != end;
+
+        if (reload) {
+            std::cout << "Reloading map file" << std::endl;
+            if (loadMapfile()) {
+                storeSnapshot();
+                syslog(LOG_NOTICE, "%s", "Map file reloaded");
+            } else {
+                std::cerr << "Error: Unable to reload map file" << std::endl;
+                syslog(LOG_ERR, "%s",
+                       "Unable to reload map file. Keeping the previous one");
+            }
+        }
+
+        if (stats) {
+            mlt::Client::logStats();
+            smime::CredentialCache::logStats();
+            smime::SignerPool::logStats();
+            smime::Sha256Engine::logStats();
+            if (::signer)
+                smime::SignService::logStats();
+        }
+    }
+}
+
+/*!
+ * @brief Pass a signal to signalWorker(). Async-signal-safe
+ */
+static void notifyWorker(char what) {
+    int saved = errno;
+
+    // The write end does not block. A full pipe already has work pending
+    if (write(reloadPipe[1], &what, 1) < 0) { /* empty */ }
+    errno = saved;
+}
+
+/*!
+ * @brief Load the PKCS#11 module and all keys in tokens
+ *
+ * Modules do not survive fork(), so this is done after the milter was
+ * daemonized.
+ */
+static void loadTokens(void) {
+    std::string module = ::config->getValue("pkcs11module");
+    if (module.empty() || smime::SignClient::enabled())
+        return;
+
+    unsigned int sessions = ::config->getValue<unsigned int>("pkcs11sessions");
+    if (sessions == 0)
+        sessions = smime::SignerPool::size();
+
+    if (!smime::Pkcs11::initialize(
+            module, ::config->getValue("pkcs11pin"), sessions))
+        return;
+
+    std::vector<mapfile::Entry> tokenEntries;
+    for (auto &it : mapfile::Map::getEntries())
+        if (smime::Pkcs11::isUri(it.key))
+            tokenEntries.push_back(it);
+
+    smime::CredentialCache::prewarm(
+            tokenEntries, ::config->getValue<unsigned int>("prewarmthreads"));
+}
+
 /*!
  * @brief Signal handling
  */
@@ -501,6 +950,10 @@ static void signalHandler(int sig) {
         case SIGQUIT:
             std::cout << "Caught signal " << sig
                       << ". Terminating" << std::endl;
+            if (::signer) {
+                smime::SignService::stop();
+                break;
+            }
             if (::debug) {
                 std::cout << "Calling smfi_stop()...";
                 std::cout.flush();
@@ -516,11 +969,10 @@ static void signalHandler(int sig) {
                       << std::endl;
             exit(EX_SOFTWARE);
         case SIGHUP:
-            std::cout << "Caught signal " << sig
-                      << ". Reloading map file" << std::endl;
-            mapfile::Map::resetCertStore();
-            mapfile::Map::readMap(::config->getValue("mapfile"));
-            syslog(LOG_NOTICE, "%s", "Map file reloaded");
+            notifyWorker('R');
+            break;
+        case SIGUSR1:
+            notifyWorker('S');
             break;
         default:
         { /* empty */ }
@@ -542,6 +994,11 @@ int main(int argc, const char *argv[]) {
     struct passwd *pwd;
     struct group *grp;
 
+    if (!openReloadPipe()) {
+        perror("Error: Unable to create the reload pipe");
+        exit(EX_OSERR);
+    }
+
     if (signal(SIGINT, signalHandler) == SIG_ERR)
         perror("Error: Installing SIGINT failed");
     if (signal(SIGTERM, signalHandler) == SIG_ERR)
@@ -552,6 +1009,8 @@ int main(int argc, const char *argv[]) {
         perror("Error: Installing SIGQUIT failed");
     if (signal(SIGHUP, signalHandler) == SIG_ERR)
         perror("Error: Installing SIGHUP failed");
+    if (signal(SIGUSR1, signalHandler) == SIG_ERR)
+        perror("Error: Installing SIGUSR1 failed");
 
     if (signal(SIGABRT, SIG_IGN) == SIG_ERR)
         perror("Error: Installing SIGABRT failed");
@@ -574,6 +1033,8 @@ int main(int argc, const char *argv[]) {
              "Turn on debugging output")
             ("pidfile,p", po::value<std::string>(&mfpidfile),
              "PID file for the milter")
+            ("signer", po::bool_switch()->default_value(false),
+             "Run as signer process that holds the keys for the milter")
 #if !__APPLE__ && !defined _NOT_DAEMONIZE
             // daemon() is deprecated on OS X 10.5 and newer
             ("daemon,d", po::bool_switch()->default_value(false),
@@ -604,6 +1065,12 @@ int main(int argc, const char *argv[]) {
     // Read configuration file
     ::config = std::make_unique<conf::MilterCfg>(vm);
 
+    ::signer = vm["signer"].as<bool>();
+    if (::signer && ::config->getValue("signersocket").empty()) {
+        std::cerr << "Error: No signer socket defined" << std::endl;
+        exit(EX_CONFIG);
+    }
+
     if (vm.count("socket") == 0)
         mfsocket = ::config->getValue("socket");
     if (vm.count("user") == 0)
@@ -619,7 +1086,21 @@ int main(int argc, const char *argv[]) {
         mfdaemon = true;
 #endif  // !__APPLE__ && !defined _NOT_DAEMONIZE
 
-    mapfile::Map::readMap(::config->getValue("mapfile"));
+    init_openssl();
+
+    smime::CredentialCache::setCapacity(
+            ::config->getValue<std::size_t>("cachesize"));
+    smime::BodyWriter::setChunkSize(
+            ::config->getValue<std::size_t>("chunksize"));
+    mlt::Spool::setMemoryLimit(::config->getValue<std::size_t>("spoolsize"));
+    smime::Sha256Engine::enable(::config->getValue<bool>("multibuffer"));
+    // The milter reads no private keys, if a signer process holds them
+    if (!::signer)
+        smime::SignClient::setSocket(
+                ::config->getValue("signersocket"),
+                ::config->getValue<unsigned int>("signerconnections"),
+                ::config->getValue<unsigned int>("signertimeout"));
+    loadMapfile();
 
     grp = getgrnam(mfgroup.c_str());
     if (grp) {
@@ -659,7 +1140,12 @@ int main(int argc, const char *argv[]) {
         exit(EX_NOUSER);
     }
 
-    initMilter(mfsocket);
+    storeSnapshot();
+
+    if (!::signer)
+        initMilter(mfsocket);
+    else if (!smime::SignService::listen(::config->getValue("signersocket")))
+        exit(EX_UNAVAILABLE);
 
 #if !__APPLE__ && !defined _NOT_DAEMONIZE
     // daemon() is deprecated on OS X 10.5 and newer
@@ -682,19 +1168,21 @@ int main(int argc, const char *argv[]) {
         out.close();
     }
 
-    init_openssl();
+    // Threads do not survive daemon(), so start them afterwards
+    smime::SignerPool::start(::config->getValue<unsigned int>("signthreads"),
+                             ::config->getValue<std::size_t>("signqueue"));
+
+    loadTokens();
 
-    // Define headers
-    ::header.push_back(mlt_header_name);
-    ::header.push_back("MIME-Version");
-    ::header.push_back("Content-ID");
-    ::header.push_back("Content-Type");
-    ::header.push_back("Content-Disposition");
-    ::header.push_back("Content-Description");
-    ::header.push_back("Content-Transfer-Encoding");
+    // Reloads and statistics run here, not in the signal handler
+    std::thread worker(signalWorker);
 
     // Workaround for stolen signals
     std::thread milter {[]() {
+        if (::signer) {
+            smime::SignService::run();
+            return;
+        }
         try {
             smfi_main();
         }
@@ -703,13 +1191,20 @@ int main(int argc, const char *argv[]) {
 
     openlog(miltername.c_str(), LOG_CONS | LOG_NDELAY | LOG_PID, LOG_MAIL);
 
-    std::string logmsg = "Starting milter " + miltername
-                         + " - version " + version;
+    std::string logmsg = (::signer ? "Starting signer " : "Starting milter ")
+                         + miltername + " - version " + version;
     syslog(LOG_NOTICE, "%s", logmsg.c_str());
 
     // Wait for signals
     milter.join();
 
+    close(reloadPipe[1]);
+    worker.join();
+
+    smime::SignClient::stop();
+    smime::SignerPool::stop();
+    smime::Pkcs11::finalize();
+
     deinit_openssl();
 
     if (!mfpidfile.empty()) {
@@ -65,8 +65,21 @@ sfsistat mlfi_negotiate(
         u_long, u_long, u_long, u_long,
         u_long *, u_long  *, u_long *, u_long *);
 
+namespace mlt {
+    class Client;
+}  // namespace mlt
+
 // Other functions
+static mlt::Client *newClient(SMFICTX *);
+static sfsistat proceed(SMFICTX *, u_long);
 static void initMilter(const std::string&);
+static bool loadMapfile(void);
+static std::string snapshotFile(void);
+static void storeSnapshot(void);
+static bool openReloadPipe(void);
+static void signalWorker(void);
+static void notifyWorker(char);
+static void loadTokens(void);
 static void signalHandler(int);
 
 #endif  // SRC_MILTER_H_
@@ -0,0 +1,69 @@
+/*! @file mimeheader.cpp
+ *
+ * @brief Classify and capture the MIME headers of a message
+ *
+ * @author Christian Roessner <c@roessner.co>
+ * @version 1607.1.4
+ * @date 2016-06-10
+ * @copyright Copyright 2016 Christian Roessner <c@roessner.co>
+ */
+
+#include "mimeheader.h"
+
+#include <cstring>
+
+namespace mlt {
+    // Public
+
+    Arena::Arena(std::size_t blockSize)
+            : blockSize(blockSize),
+              blocks(),
+              used(0) { /* empty */ }
+
+    TextView Arena::copy(const char *text, std::size_t size) {
+        std::size_t need = size + 1;
+        char *target;
+
+        if (blocks.empty()) {
+            blocks.emplace_back(new char[blockSize]);
+            used = 0;
+        }
+
+        if (used + need > blockSize) {
+            if (need > blockSize / 4) {
+                // A large value gets its own block before the current one
+                blocks.emplace(blocks.end() - 1, new char[need]);
+                target = blocks[blocks.size() - 2].get();
+                std::memcpy(target, text, size);
+                target[size] = '\0';
+
+                return {target, size};
+            }
+            blocks.emplace_back(new char[blockSize]);
+            used = 0;
+        }
+
+        target = blocks.back().get() + used;
+        std::memcpy(target, text, size);
+        target[size] = '\0';
+        used += need;
+
+        return {target, size};
+    }
+
+    void Arena::reset(void) {
+        if (blocks.empty())
+            return;
+
+        // The last block is always a regular one
+        std::unique_ptr<char[]> keep(std::move(blocks.back()));
+        blocks.clear();
+        blocks.push_back(std::move(keep));
+        used = 0;
+    }
+
+    // Init static
+
+    constexpr HeaderClassifier::Name HeaderClassifier::table[];
+
+}  // namespace mlt
@@ -0,0 +1,184 @@
+/*! @file mimeheader.h
+ *
+ * @brief Classify and capture the MIME headers of a message
+ *
+ * @author Christian Roessner <c@roessner.co>
+ * @version 1607.1.4
+ * @date 2016-06-10
+ * @copyright Copyright 2016 Christian Roessner <c@roessner.co>
+ */
+
+#ifndef SRC_MIMEHEADER_H_
+#define SRC_MIMEHEADER_H_
+
+#include <sys/types.h>
+#include <strings.h>
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace mlt {
+    /*!
+     * @brief Headers that the milter looks at
+     */
+    enum class HeaderKind : u_int8_t {
+        OTHER,
+        OWN,                        // X-Sigh
+        MIME_VERSION,
+        CONTENT_ID,
+        CONTENT_TYPE,
+        CONTENT_DISPOSITION,
+        CONTENT_DESCRIPTION,
+        CONTENT_TRANSFER_ENCODING
+    };
+
+    /*!
+     * @brief Find the HeaderKind of a header name
+     *
+     * The names are placed in a small table with a hash that has no
+     * collisions for them. This is checked by the compiler. A lookup hashes
+     * the length and two characters and compares at most one name.
+     */
+    class HeaderClassifier {
+    public:
+        /*!
+         * @brief The kind of a header name. Case-insensitive
+         */
+        static HeaderKind classify(const char *name) {
+            std::size_t size = 0;
+            while (name[size] != '\0' && size <= maxSize)
+                size++;
+
+            const Name &entry = table[slot(name, size)];
+            if (entry.size != size
+                || strncasecmp(entry.text, name, size) != 0)
+                return HeaderKind::OTHER;
+
+            return entry.kind;
+        }
+
+        /*!
+         * @brief Every name is found in its own slot
+         */
+        static constexpr bool perfect(void) {
+            for (std::size_t i = 0; i < tableSize; i++)
+                if (table[i].kind != HeaderKind::OTHER
+                    && slot(table[i].text, table[i].size) != i)
+                    return false;
+            return true;
+        }
+
+    private:
+        /*!
+         * @brief A header name in the table
+         */
+        struct Name {
+            const char *text;
+            std::size_t size;
+            HeaderKind kind;
+        };
+
+        static constexpr char fold(char c) {
+            return static_cast<char>(c | 0x20);
+        }
+
+        //! @brief Hash of the length, the last and the tenth character
+        static constexpr std::size_t slot(const char *name, std::size_t size) {
+            return size == 0 ? 0 : (size * 4
+                    + static_cast<unsigned char>(fold(name[size - 1]))
+                    + static_cast<unsigned char>(fold(name[size > 9 ? 9 : 0])))
+                    % tableSize;
+        }
+
+        //! @brief Number of slots. A power of two
+        static const std::size_t tableSize = 16;
+
+        //! @brief Length of the longest name
+        static const std::size_t maxSize = 25;
+
+        //! @brief The names by slot
+        static constexpr Name table[tableSize] = {
+                {"Content-ID", 10, HeaderKind::CONTENT_ID},
+                {"", 0, HeaderKind::OTHER},
+                {"", 0, HeaderKind::OTHER},
+                {"Content-Disposition", 19, HeaderKind::CONTENT_DISPOSITION},
+                {"", 0, HeaderKind::OTHER},
+                {"", 0, HeaderKind::OTHER},
+                {"", 0, HeaderKind::OTHER},
+                {"MIME-Version", 12, HeaderKind::MIME_VERSION},
+                {"X-Sigh", 6, HeaderKind::OWN},
+                {"", 0, HeaderKind::OTHER},
+                {"", 0, HeaderKind::OTHER},
+                {"", 0, HeaderKind::OTHER},
+                {"", 0, HeaderKind::OTHER},
+                {"Content-Transfer-Encoding", 25,
+                        HeaderKind::CONTENT_TRANSFER_ENCODING},
+                {"Content-Type", 12, HeaderKind::CONTENT_TYPE},
+                {"Content-Description", 19, HeaderKind::CONTENT_DESCRIPTION}
+        };
+    };
+
+    static_assert(HeaderClassifier::perfect(),
+                  "Header names collide in the table");
+
+    /*!
+     * @brief A string that is owned by someone else
+     */
+    struct TextView {
+        const char *data;
+        std::size_t size;
+
+        inline std::string str(void) const {
+            return std::string(data, size);
+        }
+    };
+
+    /*!
+     * @brief A captured header. The text lives in the Arena of the message
+     */
+    struct MarkedHeader {
+        HeaderKind kind;
+        TextView name;
+        TextView value;
+    };
+
+    /*!
+     * @brief Memory for the captured headers of one message
+     *
+     * Text is appended to large blocks. All of it is freed at once, when
+     * the message is done. The first block is kept for the next message,
+     * so a connection usually allocates no memory for its headers after
+     * the first message.
+     */
+    class Arena {
+    public:
+        /*!
+         * @brief Constructor
+         */
+        explicit Arena(std::size_t = 4096);
+
+        /*!
+         * @brief Copy text into the arena. A null byte is appended
+         */
+        TextView copy(const char *, std::size_t);
+
+        /*!
+         * @brief Forget all text
+         */
+        void reset(void);
+
+    private:
+        //! @brief Size of a regular block
+        const std::size_t blockSize;
+
+        //! @brief The blocks. The last one is filled
+        std::vector<std::unique_ptr<char[]>> blocks;
+
+        //! @brief Bytes used in the last block
+        std::size_t used;
+    };
+}  // namespace mlt
+
+#endif  // SRC_MIMEHEADER_H_
@@ -0,0 +1,347 @@
+/*! @file multipart.cpp
+ *
+ * @brief Encode 8bit and binary parts of a multipart body in 7bit
+ *
+ * @author Christian Roessner <c@roessner.co>
+ * @version 1607.1.4
+ * @date 2016-06-10
+ * @copyright Copyright 2016 Christian Roessner <c@roessner.co>
+ */
+
+#include "multipart.h"
+
+#include <strings.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <utility>
+
+#include "boundary.h"
+#include "mimeheader.h"
+
+namespace mlt {
+
+    // Public
+
+    MultipartTranscoder::MultipartTranscoder(void)
+            : state(State::IDLE),
+              delimiters(),
+              kept(),
+              output(),
+              leaf() { /* empty */ }
+
+    void MultipartTranscoder::start(const std::string &boundary) {
+        reset();
+        if (boundary.empty())
+            return;
+
+        delimiters.push_back("\n--" + boundary);
+        kept = "\n";
+        state = State::TEXT;
+    }
+
+    const std::string &MultipartTranscoder::encode(const char *data,
+                                                   std::size_t len) {
+        output.clear();
+        if (state == State::IDLE) {
+            output.assign(data, len);
+            return output;
+        }
+
+        kept.append(data, len);
+        std::size_t pos = process(false);
+
+        // The last written byte stays in front
+        kept.erase(0, pos - 1);
+
+        return output;
+    }
+
+    const std::string &MultipartTranscoder::finish(void) {
+        output.clear();
+
+        if (state != State::IDLE) {
+            process(true);
+            if (state == State::LEAF)
+                output += leaf.finish();
+        }
+
+        state = State::IDLE;
+        delimiters.clear();
+        kept.clear();
+        leaf.reset();
+
+        return output;
+    }
+
+    void MultipartTranscoder::reset(void) {
+        state = State::IDLE;
+        delimiters.clear();
+        kept.clear();
+        output.clear();
+        leaf.reset();
+    }
+
+    // Private
+
+    std::size_t MultipartTranscoder::process(bool last) {
+        const std::size_t size = kept.size();
+        std::size_t pos = 1;
+
+        for (;;) {
+            if (state == State::HEADERS) {
+                std::size_t end = headerEnd(pos);
+                if (end != std::string::npos) {
+                    startPart(pos, end);
+                    pos = end;
+                    continue;
+                }
+                if (!last && size - pos <= maxHeaders)
+                    return pos;
+
+                // The rest of the body is written as it is
+                delimiters.clear();
+                state = State::TEXT;
+            }
+
+            if (delimiters.empty()) {
+                content(pos, size);
+                return size;
+            }
+
+            const std::string &delimiter = delimiters.back();
+            std::size_t from = pos - 1;
+            std::size_t found = std::string::npos;
+            std::size_t lineEnd = 0;
+            bool close = false;
+            Line line = Line::NO;
+
+            // The byte before pos may be the line break of a delimiter
+            while (from < size) {
+                found = BoundaryScanner::find(kept.data() + from, size - from,
+                                              delimiter.data(),
+                                              delimiter.size());
+                if (found == std::string::npos)
+                    break;
+                found += from;
+                line = delimiterLine(found + delimiter.size(), last, lineEnd,
+                                     close);
+                if (line != Line::NO)
+                    break;
+                from = found + 1;
+                found = std::string::npos;
+            }
+
+            if (found == std::string::npos) {
+                // Keep what may be a delimiter with the CR before it
+                std::size_t safe = size;
+                if (!last)
+                    safe = size > pos + delimiter.size()
+                           ? size - delimiter.size() : pos;
+                content(pos, safe);
+                return safe;
+            }
+
+            // The line break before the delimiter belongs to the delimiter
+            std::size_t end = std::max(found, pos);
+            if (end > pos && kept[end - 1] == '\r')
+                end--;
+            content(pos, end);
+
+            if (line == Line::MORE)
+                return end;
+
+            if (state == State::LEAF) {
+                output += leaf.finish();
+                leaf.reset();
+            }
+            output.append(kept, end, lineEnd - end);
+            pos = lineEnd;
+
+            if (close) {
+                delimiters.pop_back();
+                state = State::TEXT;
+            } else {
+                state = State::HEADERS;
+            }
+        }
+    }
+
+    MultipartTranscoder::Line MultipartTranscoder::delimiterLine(
+            std::size_t after, bool last, std::size_t &lineEnd,
+            bool &close) const {
+        const std::size_t size = kept.size();
+        std::size_t i = after;
+
+        close = false;
+        if (i < size && kept[i] == '-') {
+            if (i + 1 == size)
+                return last ? Line::NO : Line::MORE;
+            // A longer boundary, that starts with this one
+            if (kept[i + 1] != '-')
+                return Line::NO;
+            close = true;
+            i += 2;
+        }
+
+        // Transport padding, RFC2046, 5.1.1
+        while (i < size && (kept[i] == ' ' || kept[i] == '\t'))
+            i++;
+
+        if (close) {
+            // A close delimiter ends the line in any case
+            const void *nl = std::memchr(kept.data() + i, '\n',
+                                         std::min(size - i, maxLine));
+            if (nl != nullptr) {
+                lineEnd = static_cast<std::size_t>(
+                        static_cast<const char *>(nl) - kept.data()) + 1;
+                return Line::YES;
+            }
+        } else if (i < size) {
+            if (kept[i] == '\n') {
+                lineEnd = i + 1;
+                return Line::YES;
+            }
+            if (kept[i] != '\r')
+                return Line::NO;
+            if (i + 1 < size) {
+                if (kept[i + 1] != '\n')
+                    return Line::NO;
+                lineEnd = i + 2;
+                return Line::YES;
+            }
+        }
+
+        if (last) {
+            lineEnd = size;
+            return Line::YES;
+        }
+
+        return size - after > maxLine ? Line::NO : Line::MORE;
+    }
+
+    std::size_t MultipartTranscoder::headerEnd(std::size_t pos) const {
+        const std::string &delimiter = delimiters.back();
+        std::size_t line = pos;
+
+        for (;;) {
+            // A part without a blank line ends at the next delimiter
+            if (kept.compare(line, delimiter.size() - 1, delimiter, 1,
+                             std::string::npos) == 0)
+                return line;
+
+            std::size_t nl = kept.find('\n', line);
+            if (nl == std::string::npos)
+                return std::string::npos;
+            if (nl == line || (nl == line + 1 && kept[line] == '\r'))
+                return nl + 1;
+            line = nl + 1;
+        }
+    }
+
+    void MultipartTranscoder::startPart(std::size_t from, std::size_t to) {
+        std::string type;
+        std::string transferEncoding;
+        std::vector<std::pair<std::size_t, std::size_t>> old;
+
+        for (std::size_t line = from; line < to;) {
+            // A header with its continuation lines
+            std::size_t end = line;
+            do {
+                std::size_t nl = kept.find('\n', end);
+                end = nl == std::string::npos || nl >= to ? to : nl + 1;
+            } while (end < to && (kept[end] == ' ' || kept[end] == '\t'));
+
+            std::size_t colon = kept.find(':', line);
+            if (colon < end) {
+                std::size_t nameEnd = colon;
+                while (nameEnd > line
+                       && isspace(static_cast<unsigned char>(
+                               kept[nameEnd - 1])))
+                    nameEnd--;
+                std::string name(kept, line, nameEnd - line);
+                HeaderKind kind = HeaderClassifier::classify(name.c_str());
+
+                if (kind == HeaderKind::CONTENT_TYPE
+                    || kind == HeaderKind::CONTENT_TRANSFER_ENCODING) {
+                    // Unfolded, RFC5322, 2.2.3
+                    std::string value;
+                    for (std::size_t i = colon + 1; i < end; i++)
+                        if (kept[i] != '\r' && kept[i] != '\n')
+                            value += kept[i];
+
+                    if (kind == HeaderKind::CONTENT_TRANSFER_ENCODING) {
+                        transferEncoding = value;
+                        old.emplace_back(line, end);
+                    } else if (type.empty()) {
+                        type = value;
+                    }
+                }
+            }
+            line = end;
+        }
+
+        const char *ct = type.empty() ? nullptr : type.c_str();
+        if (ct != nullptr) {
+            const char *it = ct;
+            while (isspace(static_cast<unsigned char>(*it)))
+                it++;
+
+            std::string boundary;
+            if (strncasecmp(it, "multipart/", 10) == 0)
+                boundary = BoundaryScanner::parameter(it);
+
+            // The parts of a nested multipart are looked at, too
+            if (!boundary.empty() && delimiters.size() < maxDepth) {
+                output.append(kept, from, to - from);
+                delimiters.push_back("\n--" + boundary);
+                state = State::TEXT;
+                return;
+            }
+        }
+
+        Encoding encoding = Transcoder::select(
+                old.empty() ? nullptr : transferEncoding.c_str(), ct);
+        if (encoding == Encoding::NONE) {
+            output.append(kept, from, to - from);
+            state = State::TEXT;
+            return;
+        }
+
+        // The new header replaces the first old one, the others are dropped
+        std::size_t at = from;
+        for (std::size_t i = 0; i < old.size(); i++) {
+            output.append(kept, at, old[i].first - at);
+            if (i == 0) {
+                output += "Content-Transfer-Encoding: ";
+                output += Transcoder::name(encoding);
+                output += "\r\n";
+            }
+            at = old[i].second;
+        }
+        output.append(kept, at, to - at);
+
+        leaf.start(encoding);
+        state = State::LEAF;
+    }
+
+    void MultipartTranscoder::content(std::size_t from, std::size_t to) {
+        if (to <= from)
+            return;
+
+        if (state == State::LEAF)
+            output += leaf.encode(kept.data() + from, to - from);
+        else
+            output.append(kept, from, to - from);
+    }
+
+    // Init static
+
+    const std::size_t MultipartTranscoder::maxHeaders;
+
+    const std::size_t MultipartTranscoder::maxDepth;
+
+    const std::size_t MultipartTranscoder::maxLine;
+
+}  // namespace mlt
@@ -0,0 +1,161 @@
+/*! @file multipart.h
+ *
+ * @brief Encode 8bit and binary parts of a multipart body in 7bit
+ *
+ * @author Christian Roessner <c@roessner.co>
+ * @version 1607.1.4
+ * @date 2016-06-10
+ * @copyright Copyright 2016 Christian Roessner <c@roessner.co>
+ */
+
+#ifndef SRC_MULTIPART_H_
+#define SRC_MULTIPART_H_
+
+#include <string>
+#include <vector>
+
+#include "transcoder.h"
+
+namespace mlt {
+    /*!
+     * @brief Re-encode the leaf parts of a multipart body, RFC2046, 5.1
+     *
+     * A multipart body itself is never encoded, RFC2045, 6.4, but its parts
+     * may carry 8bit or binary content. The body is split at the delimiter
+     * lines of its boundary, and of the boundaries of nested multipart
+     * parts. Each part starts with a header block. A part that Transcoder
+     * selects gets a new Content-Transfer-Encoding header, and its content is
+     * encoded up to the line break before the next delimiter. Everything
+     * else is written as it is.
+     *
+     * The body arrives in chunks. Bytes that may start a delimiter and an
+     * incomplete header block are kept until the next chunk or finish().
+     * A header block that gets too long is given up, and the rest of the
+     * body is written as it is.
+     */
+    class MultipartTranscoder {
+    public:
+        /*!
+         * @brief Constructor
+         */
+        MultipartTranscoder(void);
+
+        /*!
+         * @brief Start to encode a body with the given boundary
+         *
+         * Stays inactive for an empty boundary.
+         */
+        void start(const std::string &);
+
+        /*!
+         * @brief A body is encoded
+         */
+        inline bool active(void) const { return state != State::IDLE; }
+
+        /*!
+         * @brief Encode the next chunk of the body
+         *
+         * @return The encoded content. It is valid until the next call
+         */
+        const std::string &encode(const char *, std::size_t);
+
+        /*!
+         * @brief Encode everything that was kept back and stop
+         *
+         * @return The rest of the encoded content
+         */
+        const std::string &finish(void);
+
+        /*!
+         * @brief Stop encoding and forget everything
+         */
+        void reset(void);
+
+    private:
+        /*!
+         * @brief What the next bytes of the body are
+         */
+        enum class State {
+            IDLE,
+            //! @brief Preamble, epilogue or a part that is kept
+            TEXT,
+            //! @brief The header block of a part
+            HEADERS,
+            //! @brief A part that is encoded
+            LEAF
+        };
+
+        /*!
+         * @brief Whether a delimiter line was found
+         */
+        enum class Line {
+            NO,
+            YES,
+            MORE
+        };
+
+        /*!
+         * @brief Write or encode as much of the kept bytes as possible
+         *
+         * @return Offset of the first byte that must be kept
+         */
+        std::size_t process(bool);
+
+        /*!
+         * @brief Check the rest of a delimiter line
+         *
+         * Sets the offset after the line and whether it closes the
+         * multipart.
+         */
+        Line delimiterLine(std::size_t, bool, std::size_t &, bool &) const;
+
+        /*!
+         * @brief Offset after the header block that starts at the offset
+         *
+         * @return std::string::npos, if the block is not complete
+         */
+        std::size_t headerEnd(std::size_t) const;
+
+        /*!
+         * @brief Write the header block and choose the state of the part
+         */
+        void startPart(std::size_t, std::size_t);
+
+        /*!
+         * @brief Write or encode content of the current part
+         */
+        void content(std::size_t, std::size_t);
+
+        //! @brief The current state
+        State state;
+
+        //! @brief "\n--" and the boundary for every open multipart
+        std::vector<std::string> delimiters;
+
+        /*!
+         * @brief Bytes that could not be written yet
+         *
+         * The first byte was already written, so that a delimiter is also
+         * found at the start of the kept bytes. At the start of the body,
+         * it is a line break that is not part of the body.
+         */
+        std::string kept;
+
+        //! @brief Encoded content of the last call
+        std::string output;
+
+        //! @brief Encodes the current part
+        Transcoder leaf;
+
+        //! @brief A longer header block is given up
+        static const std::size_t maxHeaders = 65536;
+
+        //! @brief Deeper multipart parts are kept as they are
+        static const std::size_t maxDepth = 32;
+
+        //! @brief A longer line after a boundary is no delimiter line
+        static const std::size_t maxLine = 998;
+    };
+}  // namespace mlt
+
+#endif  // SRC_MULTIPART_H_
@@ -0,0 +1,601 @@
+/*! @file pkcs11.cpp
+ *
+ * @brief Signing keys in a PKCS#11 token
+ *
+ * @author Christian Roessner <c@roessner.co>
+ * @version 1607.1.4
+ * @date 2016-06-10
+ * @copyright Copyright 2016 Christian Roessner <c@roessner.co>
+ */
+
+#include "pkcs11.h"
+
+#include <dlfcn.h>
+#include <syslog.h>
+
+#include <openssl/bn.h>
+#include <openssl/ec.h>
+#include <openssl/err.h>
+
+#include <algorithm>
+#include <cctype>
+#include <iostream>
+
+#if defined _PKCS11
+#define CRYPTOKI_COMPAT
+#include <p11-kit/pkcs11.h>
+#endif  // defined _PKCS11
+
+namespace smime {
+#if defined _PKCS11
+    //! @brief The function list of the loaded module
+    static inline CK_FUNCTION_LIST_PTR p11(void *functions) {
+        return static_cast<CK_FUNCTION_LIST_PTR>(functions);
+    }
+
+    //! @brief Errors after which a session can not be used anymore
+    static bool sessionBroken(CK_RV rv) {
+        switch (rv) {
+            case CKR_SESSION_HANDLE_INVALID:
+            case CKR_SESSION_CLOSED:
+            case CKR_USER_NOT_LOGGED_IN:
+            case CKR_DEVICE_REMOVED:
+            case CKR_DEVICE_ERROR:
+            case CKR_TOKEN_NOT_PRESENT:
+                return true;
+            default:
+                return false;
+        }
+    }
+#endif  // defined _PKCS11
+
+    // Public
+
+    bool Pkcs11::isUri(const std::string &key) {
+        return key.compare(0, 7, "pkcs11:") == 0;
+    }
+
+    bool Pkcs11::ready(void) {
+        std::lock_guard<std::mutex> guard(poolLock);
+
+        return functions != nullptr;
+    }
+
+    void Pkcs11::clear(void) {
+        std::lock_guard<std::mutex> guard(poolLock);
+
+        keys.clear();
+    }
+
+#if defined _PKCS11
+    bool Pkcs11::initialize(const std::string &path, const std::string &pin,
+                            unsigned int count) {
+        std::lock_guard<std::mutex> guard(poolLock);
+
+        if (functions != nullptr || path.empty())
+            return functions != nullptr;
+
+        module = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+        if (module == nullptr) {
+            std::cerr << "Error: Unable to load PKCS#11 module " << path
+                      << ": " << dlerror() << std::endl;
+            syslog(LOG_ERR, "Unable to load PKCS#11 module %s", path.c_str());
+            return false;
+        }
+
+        auto getFunctionList = reinterpret_cast<CK_C_GetFunctionList>(
+                dlsym(module, "C_GetFunctionList"));
+        CK_FUNCTION_LIST_PTR list = nullptr;
+        CK_RV rv = CKR_FUNCTION_FAILED;
+
+        if (getFunctionList != nullptr)
+            rv = getFunctionList(&list);
+        if (rv != CKR_OK || list == nullptr) {
+            report("C_GetFunctionList", rv);
+            dlclose(module);
+            module = nullptr;
+            return false;
+        }
+
+        // Sessions are used from many threads
+        CK_C_INITIALIZE_ARGS args = {};
+        args.flags = CKF_OS_LOCKING_OK;
+
+        rv = list->C_Initialize(&args);
+        if (rv != CKR_OK && rv != CKR_CRYPTOKI_ALREADY_INITIALIZED) {
+            report("C_Initialize", rv);
+            dlclose(module);
+            module = nullptr;
+            return false;
+        }
+
+        functions = list;
+        defaultPin = pin;
+        sessions = count > 0 ? count : 1;
+
+        if (::debug)
+            std::cout << "Loaded PKCS#11 module " << path << " with "
+                      << sessions << " sessions per token" << std::endl;
+        syslog(LOG_INFO, "Loaded PKCS#11 module %s", path.c_str());
+
+        return true;
+    }
+
+    void Pkcs11::finalize(void) {
+        std::lock_guard<std::mutex> guard(poolLock);
+
+        if (functions == nullptr)
+            return;
+
+        for (auto &it : slots) {
+            for (auto &session : it.second->idle)
+                p11(functions)->C_CloseSession(session);
+        }
+        slots.clear();
+        keys.clear();
+
+        p11(functions)->C_Finalize(nullptr);
+        functions = nullptr;
+
+        dlclose(module);
+        module = nullptr;
+    }
+
+    tokenkey_t Pkcs11::findKey(const std::string &uri) {
+        std::map<std::string, std::string> attrs;
+        Slot *slot = nullptr;
+
+        {
+            std::lock_guard<std::mutex> guard(poolLock);
+
+            auto found = keys.find(uri);
+            if (found != keys.end())
+                return found->second;
+
+            if (functions == nullptr) {
+                std::cerr << "Error: No PKCS#11 module loaded for " << uri
+                          << std::endl;
+                report("C_GetFunctionList", CKR_CRYPTOKI_NOT_INITIALIZED);
+                return nullptr;
+            }
+
+            if (!parseUri(uri, attrs)) {
+                std::cerr << "Error: Invalid PKCS#11 URI " << uri
+                          << std::endl;
+                report("URI", CKR_ARGUMENTS_BAD);
+                return nullptr;
+            }
+
+            slot = openSlot(attrs);
+            if (slot == nullptr)
+                return nullptr;
+        }
+
+        CK_SESSION_HANDLE session;
+        if (!acquire(*slot, session))
+            return nullptr;
+
+        /*
+         * Search the private key by its label and/or id
+         */
+        CK_OBJECT_CLASS keyClass = CKO_PRIVATE_KEY;
+        std::vector<CK_ATTRIBUTE> search = {
+                {CKA_CLASS, &keyClass, sizeof(keyClass)}
+        };
+        if (attrs.count("object") == 1)
+            search.push_back({CKA_LABEL, &attrs["object"][0],
+                              attrs["object"].size()});
+        if (attrs.count("id") == 1)
+            search.push_back({CKA_ID, &attrs["id"][0], attrs["id"].size()});
+
+        CK_OBJECT_HANDLE handles[2];
+        CK_ULONG found = 0;
+        CK_RV rv = p11(functions)->C_FindObjectsInit(
+                session, search.data(), search.size());
+        if (rv == CKR_OK) {
+            rv = p11(functions)->C_FindObjects(session, handles, 2, &found);
+            p11(functions)->C_FindObjectsFinal(session);
+        }
+
+        CK_KEY_TYPE keyType = 0;
+        if (rv == CKR_OK && found == 1) {
+            CK_ATTRIBUTE typeAttr = {CKA_KEY_TYPE, &keyType, sizeof(keyType)};
+            rv = p11(functions)->C_GetAttributeValue(session, handles[0],
+                                                     &typeAttr, 1);
+        }
+
+        release(*slot, session, sessionBroken(rv));
+
+        if (rv != CKR_OK) {
+            report("C_FindObjects", rv);
+            return nullptr;
+        }
+        if (found != 1) {
+            std::cerr << "Error: " << (found == 0 ? "No" : "More than one")
+                      << " private key found for " << uri << std::endl;
+            report("C_FindObjects", CKR_KEY_HANDLE_INVALID);
+            return nullptr;
+        }
+
+        auto key = std::make_shared<TokenKey>();
+        key->slot = slot->id;
+        key->handle = handles[0];
+        key->type = keyType;
+
+        std::lock_guard<std::mutex> guard(poolLock);
+        keys[uri] = key;
+
+        return key;
+    }
+
+    bool Pkcs11::sign(const TokenKey &key, const EVP_MD *md,
+                      const unsigned char *data, std::size_t len,
+                      std::vector<unsigned char> &sig) {
+        Slot *slot = nullptr;
+
+        {
+            std::lock_guard<std::mutex> guard(poolLock);
+
+            auto found = slots.find(key.slot);
+            if (functions == nullptr || found == slots.end()) {
+                report("C_SignInit", CKR_SLOT_ID_INVALID);
+                return false;
+            }
+            slot = found->second.get();
+        }
+
+        /*
+         * RSA tokens hash the data themselves. ECDSA works on the digest and
+         * EdDSA on the data
+         */
+        CK_MECHANISM mechanism = {0, nullptr, 0};
+        std::vector<unsigned char> input(data, data + len);
+
+        switch (key.type) {
+            case CKK_RSA:
+                switch (EVP_MD_type(md)) {
+                    case NID_sha256:
+                        mechanism.mechanism = CKM_SHA256_RSA_PKCS;
+                        break;
+                    case NID_sha384:
+                        mechanism.mechanism = CKM_SHA384_RSA_PKCS;
+                        break;
+                    case NID_sha512:
+                        mechanism.mechanism = CKM_SHA512_RSA_PKCS;
+                        break;
+                    default:
+                        report("C_SignInit", CKR_MECHANISM_INVALID);
+                        return false;
+                }
+                break;
+            case CKK_EC: {
+                unsigned char hash[EVP_MAX_MD_SIZE];
+                unsigned int hashlen = 0;
+                if (EVP_Digest(data, len, hash, &hashlen, md, nullptr) != 1)
+                    return false;
+                input.assign(hash, hash + hashlen);
+                mechanism.mechanism = CKM_ECDSA;
+                break;
+            }
+            case CKK_EC_EDWARDS:
+                mechanism.mechanism = CKM_EDDSA;
+                break;
+            default:
+                report("C_SignInit", CKR_KEY_TYPE_INCONSISTENT);
+                return false;
+        }
+
+        CK_SESSION_HANDLE session;
+        if (!acquire(*slot, session))
+            return false;
+
+        CK_ULONG siglen = 0;
+        CK_RV rv = p11(functions)->C_SignInit(session, &mechanism, key.handle);
+        if (rv == CKR_OK)
+            rv = p11(functions)->C_Sign(session, input.data(), input.size(),
+                                        nullptr, &siglen);
+        if (rv == CKR_OK) {
+            sig.resize(siglen);
+            rv = p11(functions)->C_Sign(session, input.data(), input.size(),
+                                        sig.data(), &siglen);
+            sig.resize(siglen);
+        }
+
+        release(*slot, session, sessionBroken(rv));
+
+        if (rv != CKR_OK) {
+            report("C_Sign", rv);
+            return false;
+        }
+
+        if (key.type != CKK_EC)
+            return true;
+
+        /*
+         * PKCS#11 returns r and s concatenated. CMS needs ECDSA-Sig-Value
+         */
+        if (sig.empty() || sig.size() % 2 != 0)
+            return false;
+
+        std::size_t half = sig.size() / 2;
+        std::unique_ptr<ECDSA_SIG, decltype(&ECDSA_SIG_free)> ecsig(
+                ECDSA_SIG_new(), ECDSA_SIG_free);
+        BIGNUM *r = BN_bin2bn(sig.data(), static_cast<int>(half), nullptr);
+        BIGNUM *s = BN_bin2bn(sig.data() + half, static_cast<int>(half),
+                              nullptr);
+        if (!ecsig || r == nullptr || s == nullptr
+            || ECDSA_SIG_set0(ecsig.get(), r, s) != 1) {
+            BN_free(r);
+            BN_free(s);
+            return false;
+        }
+
+        int derlen = i2d_ECDSA_SIG(ecsig.get(), nullptr);
+        if (derlen <= 0)
+            return false;
+        sig.resize(static_cast<std::size_t>(derlen));
+        unsigned char *p = sig.data();
+        i2d_ECDSA_SIG(ecsig.get(), &p);
+
+        return true;
+    }
+
+    // Private
+
+    Pkcs11::Slot::Slot(unsigned long id)
+            : id(id),
+              idle(),
+              open(0),
+              loggedIn(false),
+              pin(),
+              available() { /* empty */ }
+
+    bool Pkcs11::parseUri(const std::string &uri,
+                          std::map<std::string, std::string> &attrs) {
+        if (!isUri(uri))
+            return false;
+
+        auto decode = [](const std::string &value, std::string &result) {
+            result.clear();
+            for (std::size_t i = 0; i < value.size(); i++) {
+                if (value[i] != '%') {
+                    result += value[i];
+                    continue;
+                }
+                if (i + 2 >= value.size()
+                    || !isxdigit(static_cast<unsigned char>(value[i + 1]))
+                    || !isxdigit(static_cast<unsigned char>(value[i + 2])))
+                    return false;
+                result += static_cast<char>(
+                        std::stoi(value.substr(i + 1, 2), nullptr, 16));
+                i += 2;
+            }
+            return true;
+        };
+
+        // Path attributes are separated by ';', query attributes by '&'
+        std::string rest = uri.substr(7);
+        std::string query;
+        std::size_t mark = rest.find('?');
+        if (mark != std::string::npos) {
+            query = rest.substr(mark + 1);
+            rest.erase(mark);
+        }
+
+        auto split = [&](const std::string &part, char separator) {
+            std::size_t start = 0;
+            while (start <= part.size()) {
+                std::size_t end = part.find(separator, start);
+                if (end == std::string::npos)
+                    end = part.size();
+
+                std::string attr = part.substr(start, end - start);
+                start = end + 1;
+                if (attr.empty())
+                    continue;
+
+                std::size_t eq = attr.find('=');
+                if (eq == std::string::npos)
+                    return false;
+                if (!decode(attr.substr(eq + 1), attrs[attr.substr(0, eq)]))
+                    return false;
+            }
+            return true;
+        };
+
+        return split(rest, ';') && split(query, '&');
+    }
+
+    Pkcs11::Slot *Pkcs11::openSlot(
+            const std::map<std::string, std::string> &attrs) {
+        CK_ULONG count = 0;
+        CK_RV rv = p11(functions)->C_GetSlotList(CK_TRUE, nullptr, &count);
+        std::vector<CK_SLOT_ID> list(count);
+        if (rv == CKR_OK && count > 0)
+            rv = p11(functions)->C_GetSlotList(CK_TRUE, list.data(), &count);
+        if (rv != CKR_OK) {
+            report("C_GetSlotList", rv);
+            return nullptr;
+        }
+        list.resize(count);
+
+        /*
+         * Find the token by its slot id or its label. Without both, the
+         * first token is used
+         */
+        auto wanted = attrs.find("token");
+        auto wantedId = attrs.find("slot-id");
+        CK_SLOT_ID slotId = 0;
+        bool matched = false;
+
+        for (auto &it : list) {
+            if (wantedId != attrs.end()) {
+                if (std::to_string(it) != wantedId->second)
+                    continue;
+            } else if (wanted != attrs.end()) {
+                CK_TOKEN_INFO info;
+                if (p11(functions)->C_GetTokenInfo(it, &info) != CKR_OK)
+                    continue;
+                std::string label(reinterpret_cast<char *>(info.label),
+                                  sizeof(info.label));
+                label.erase(label.find_last_not_of(' ') + 1);
+                if (label != wanted->second)
+                    continue;
+            }
+            slotId = it;
+            matched = true;
+            break;
+        }
+
+        if (!matched) {
+            std::cerr << "Error: PKCS#11 token not found" << std::endl;
+            report("C_GetTokenInfo", CKR_TOKEN_NOT_PRESENT);
+            return nullptr;
+        }
+
+        auto found = slots.find(slotId);
+        if (found != slots.end())
+            return found->second.get();
+
+        /*
+         * Open and authenticate all sessions now, so that signing never
+         * has to wait for a login
+         */
+        std::unique_ptr<Slot> slot(new Slot(slotId));
+        auto pin = attrs.find("pin-value");
+        slot->pin = pin != attrs.end() ? pin->second : defaultPin;
+
+        for (unsigned int i = 0; i < sessions; i++) {
+            CK_SESSION_HANDLE session;
+            if (!openSession(*slot, session))
+                break;
+            slot->idle.push_back(session);
+        }
+        if (slot->open == 0)
+            return nullptr;
+
+        if (::debug)
+            std::cout << "Opened " << slot->open << " PKCS#11 sessions for "
+                      << "slot " << slotId << std::endl;
+
+        Slot *result = slot.get();
+        slots[slotId] = std::move(slot);
+
+        return result;
+    }
+
+    bool Pkcs11::acquire(Slot &slot, unsigned long &session) {
+        std::unique_lock<std::mutex> guard(poolLock);
+
+        slot.available.wait(guard, [&slot]() {
+            return !slot.idle.empty() || slot.open < sessions;
+        });
+
+        if (!slot.idle.empty()) {
+            session = slot.idle.back();
+            slot.idle.pop_back();
+            return true;
+        }
+
+        // A broken session was closed. Replace it
+        return openSession(slot, session);
+    }
+
+    void Pkcs11::release(Slot &slot, unsigned long session, bool broken) {
+        {
+            std::lock_guard<std::mutex> guard(poolLock);
+
+            if (broken) {
+                p11(functions)->C_CloseSession(session);
+                slot.open--;
+                slot.loggedIn = false;
+            } else {
+                slot.idle.push_back(session);
+            }
+        }
+        slot.available.notify_one();
+    }
+
+    bool Pkcs11::openSession(Slot &slot, unsigned long &session) {
+        CK_SESSION_HANDLE handle;
+        CK_RV rv = p11(functions)->C_OpenSession(
+                slot.id, CKF_SERIAL_SESSION, nullptr, nullptr, &handle);
+        if (rv != CKR_OK) {
+            report("C_OpenSession", rv);
+            return false;
+        }
+
+        // The login state is shared by all sessions of a token
+        if (!slot.loggedIn) {
+            rv = p11(functions)->C_Login(
+                    handle, CKU_USER,
+                    reinterpret_cast<CK_UTF8CHAR_PTR>(&slot.pin[0]),
+                    slot.pin.size());
+            if (rv != CKR_OK && rv != CKR_USER_ALREADY_LOGGED_IN) {
+                report("C_Login", rv);
+                p11(functions)->C_CloseSession(handle);
+                return false;
+            }
+            slot.loggedIn = true;
+        }
+
+        session = handle;
+        slot.open++;
+
+        return true;
+    }
+#else
+    bool Pkcs11::initialize(const std::string &path, const std::string &,
+                            unsigned int) {
+        if (!path.empty()) {
+            std::cerr << "Error: PKCS#11 support was not compiled in"
+                      << std::endl;
+            syslog(LOG_ERR, "PKCS#11 support was not compiled in");
+        }
+
+        return false;
+    }
+
+    void Pkcs11::finalize(void) { /* empty */ }
+
+    tokenkey_t Pkcs11::findKey(const std::string &uri) {
+        std::cerr << "Error: PKCS#11 support was not compiled in. Unable to "
+                  << "use " << uri << std::endl;
+        report("C_GetFunctionList", 0);
+
+        return nullptr;
+    }
+
+    bool Pkcs11::sign(const TokenKey &, const EVP_MD *,
+                      const unsigned char *, std::size_t,
+                      std::vector<unsigned char> &) {
+        return false;
+    }
+#endif  // defined _PKCS11
+
+    void Pkcs11::report(const char *what, unsigned long rv) {
+        if (::debug)
+            std::cout << "PKCS#11 " << what << " failed: 0x" << std::hex << rv
+                      << std::dec << std::endl;
+        syslog(LOG_ERR, "PKCS#11 %s failed: 0x%lx", what, rv);
+
+        // Callers report the reason from the OpenSSL error queue
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        ERR_raise_data(ERR_LIB_USER, ERR_R_OPERATION_FAIL,
+                       "PKCS#11 %s failed: 0x%lx", what, rv);
+#else
+        EVPerr(0, ERR_R_INTERNAL_ERROR);
+#endif  // OPENSSL_VERSION_NUMBER >= 0x30000000L
+    }
+
+    // Init static
+
+    void *Pkcs11::module = nullptr;
+    void *Pkcs11::functions = nullptr;
+    std::string Pkcs11::defaultPin;
+    unsigned int Pkcs11::sessions = 1;
+    std::map<unsigned long, std::unique_ptr<Pkcs11::Slot>> Pkcs11::slots;
+    std::map<std::string, tokenkey_t> Pkcs11::keys;
+    std::mutex Pkcs11::poolLock;
+
+}  // namespace smime
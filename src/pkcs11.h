@@ -0,0 +1,189 @@
+/*! @file pkcs11.h
+ *
+ * @brief Signing keys in a PKCS#11 token
+ *
+ * @author Christian Roessner <c@roessner.co>
+ * @version 1607.1.4
+ * @date 2016-06-10
+ * @copyright Copyright 2016 Christian Roessner <c@roessner.co>
+ */
+
+#ifndef SRC_PKCS11_H_
+#define SRC_PKCS11_H_
+
+#include <openssl/evp.h>
+
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+extern bool debug;
+
+namespace smime {
+    /*!
+     * @brief A private key object in a token
+     */
+    struct TokenKey {
+        //! @brief The slot that holds the token
+        unsigned long slot;
+
+        //! @brief Object handle of the private key
+        unsigned long handle;
+
+        //! @brief PKCS#11 key type (CKK_RSA, CKK_EC, CKK_EC_EDWARDS)
+        unsigned long type;
+    };
+
+    using tokenkey_t = std::shared_ptr<const TokenKey>;
+
+    /*!
+     * @brief PKCS#11 key backend
+     *
+     * A map file entry may name a key in a token with a PKCS#11 URI, RFC7512,
+     * instead of a key file:
+     *
+     * cert:/path/to/cert.pem,pkcs11:token=sigh;object=alice
+     *
+     * Opening a session and logging in to a token is expensive. The module
+     * is loaded once and for each token a fixed number of sessions is opened
+     * and authenticated, when the first key of the token is used. Signing
+     * operations borrow a session from this pool. Key handles are looked up
+     * once per URI and cached until the map file is reloaded.
+     */
+    class Pkcs11 {
+    public:
+        /*!
+         * @brief A key name is a PKCS#11 URI
+         */
+        static bool isUri(const std::string &);
+
+        /*!
+         * @brief Load and initialize a PKCS#11 module
+         *
+         * The PIN is used for all tokens that have no pin-value in their
+         * URI. The number of sessions is opened for each token.
+         */
+        static bool initialize(const std::string &, const std::string &,
+                               unsigned int);
+
+        /*!
+         * @brief Close all sessions and unload the module
+         */
+        static void finalize(void);
+
+        /*!
+         * @brief A module was loaded
+         */
+        static bool ready(void);
+
+        /*!
+         * @brief Find the private key for a URI
+         *
+         * @return nullptr, if the token or key was not found
+         */
+        static tokenkey_t findKey(const std::string &);
+
+        /*!
+         * @brief Forget all cached key handles
+         */
+        static void clear(void);
+
+        /*!
+         * @brief Sign data with a token key
+         *
+         * The data is hashed with the digest algorithm, if the key type
+         * needs it. The signature is returned in the encoding that CMS uses
+         * for the key type.
+         */
+        static bool sign(const TokenKey &, const EVP_MD *,
+                         const unsigned char *, std::size_t,
+                         std::vector<unsigned char> &);
+
+    private:
+        /*!
+         * @brief Session pool of one token
+         */
+        struct Slot {
+            explicit Slot(unsigned long);
+
+            //! @brief The slot id
+            const unsigned long id;
+
+            //! @brief Sessions that are not in use
+            std::vector<unsigned long> idle;
+
+            //! @brief Number of open sessions
+            std::size_t open;
+
+            //! @brief The token is logged in
+            bool loggedIn;
+
+            //! @brief The PIN for the token
+            std::string pin;
+
+            //! @brief Signals that a session was returned
+            std::condition_variable available;
+        };
+
+        /*!
+         * @brief Split a PKCS#11 URI into its decoded attributes
+         */
+        static bool parseUri(const std::string &,
+                             std::map<std::string, std::string> &);
+
+        /*!
+         * @brief Find the slot for a token and fill its session pool
+         */
+        static Slot *openSlot(const std::map<std::string, std::string> &);
+
+        /*!
+         * @brief Borrow a session. Waits, if all sessions are in use
+         *
+         * @return false, if no session could be opened
+         */
+        static bool acquire(Slot &, unsigned long &);
+
+        /*!
+         * @brief Return a session to the pool
+         *
+         * A broken session is closed and replaced on the next acquire().
+         */
+        static void release(Slot &, unsigned long, bool);
+
+        /*!
+         * @brief Open a session and log in, if needed. poolLock is held
+         */
+        static bool openSession(Slot &, unsigned long &);
+
+        /*!
+         * @brief Report a failed PKCS#11 call
+         */
+        static void report(const char *, unsigned long);
+
+        //! @brief Handle from dlopen()
+        static void *module;
+
+        //! @brief Function list of the module
+        static void *functions;
+
+        //! @brief Default PIN
+        static std::string defaultPin;
+
+        //! @brief Number of sessions per token
+        static unsigned int sessions;
+
+        //! @brief Session pools by slot id
+        static std::map<unsigned long, std::unique_ptr<Slot>> slots;
+
+        //! @brief Cached key handles by URI
+        static std::map<std::string, tokenkey_t> keys;
+
+        //! @brief Protects slots, sessions and keys
+        static std::mutex poolLock;
+    };
+}  // namespace smime
+
+#endif  // SRC_PKCS11_H_
@@ -0,0 +1,553 @@
+/*! @file sha256mb.cpp
+ *
+ * @brief Multi-buffer SHA-256 for the content digests of many messages
+ *
+ * @author Christian Roessner <c@roessner.co>
+ * @version 1607.1.4
+ * @date 2016-06-10
+ * @copyright Copyright 2016 Christian Roessner <c@roessner.co>
+ */
+
+#include "sha256mb.h"
+
+#include <syslog.h>
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+// SHA256_Transform() is the only way to the block function of OpenSSL 3
+#define OPENSSL_SUPPRESS_DEPRECATED
+#include <openssl/sha.h>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define _SHA256_AVX2
+#include <cpuid.h>
+#include <immintrin.h>
+#endif  // defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+
+namespace smime {
+    //! @brief Round constants, FIPS 180-4
+    static const uint32_t roundConstants[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+            0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+            0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+            0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+            0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+            0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+            0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+            0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+            0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+    };
+
+    //! @brief Initial hash value, FIPS 180-4
+    static const uint32_t initialState[8] = {
+            0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+            0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    //! @brief Number of jobs that are hashed at the same time
+    static const int laneCount = 8;
+
+    //! @brief Most blocks run in lanes before free lanes are filled again
+    static const std::size_t maxSteps = 64;
+
+    //! @brief Input for lanes without a job
+    static const unsigned char idleInput[maxSteps * 64] = {};
+
+    static inline uint32_t rotr(uint32_t x, int n) {
+        return (x >> n) | (x << (32 - n));
+    }
+
+#if defined _SHA256_AVX2
+    /*!
+     * @brief Compress blocks of eight independent streams
+     *
+     * state[i][lane] is word i of the hash state of a lane.
+     */
+    __attribute__((target("avx2")))
+    static void compressLanes(uint32_t state[8][laneCount],
+                              const unsigned char *const data[laneCount],
+                              std::size_t blocks) {
+#define ROTR(x, n) _mm256_or_si256(_mm256_srli_epi32(x, n), \
+                                   _mm256_slli_epi32(x, 32 - (n)))
+        const __m256i byteSwap = _mm256_setr_epi8(
+                3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+
+        __m256i s[8];
+        for (int i = 0; i < 8; i++)
+            s[i] = _mm256_loadu_si256(
+                    reinterpret_cast<const __m256i *>(state[i]));
+
+        for (std::size_t block = 0; block < blocks; block++) {
+            __m256i w[16];
+
+            /*
+             * Each lane reads its block as eight words at a time. A
+             * transpose turns them into one word of all lanes per register
+             */
+            for (int half = 0; half < 2; half++) {
+                __m256i r[8];
+                for (int lane = 0; lane < laneCount; lane++)
+                    r[lane] = _mm256_loadu_si256(
+                            reinterpret_cast<const __m256i *>(
+                                    data[lane] + block * 64 + half * 32));
+
+                __m256i t0 = _mm256_unpacklo_epi32(r[0], r[1]);
+                __m256i t1 = _mm256_unpackhi_epi32(r[0], r[1]);
+                __m256i t2 = _mm256_unpacklo_epi32(r[2], r[3]);
+                __m256i t3 = _mm256_unpackhi_epi32(r[2], r[3]);
+                __m256i t4 = _mm256_unpacklo_epi32(r[4], r[5]);
+                __m256i t5 = _mm256_unpackhi_epi32(r[4], r[5]);
+                __m256i t6 = _mm256_unpacklo_epi32(r[6], r[7]);
+                __m256i t7 = _mm256_unpackhi_epi32(r[6], r[7]);
+
+                __m256i u0 = _mm256_unpacklo_epi64(t0, t2);
+                __m256i u1 = _mm256_unpackhi_epi64(t0, t2);
+                __m256i u2 = _mm256_unpacklo_epi64(t1, t3);
+                __m256i u3 = _mm256_unpackhi_epi64(t1, t3);
+                __m256i u4 = _mm256_unpacklo_epi64(t4, t6);
+                __m256i u5 = _mm256_unpackhi_epi64(t4, t6);
+                __m256i u6 = _mm256_unpacklo_epi64(t5, t7);
+                __m256i u7 = _mm256_unpackhi_epi64(t5, t7);
+
+                __m256i *out = w + half * 8;
+                out[0] = _mm256_permute2x128_si256(u0, u4, 0x20);
+                out[1] = _mm256_permute2x128_si256(u1, u5, 0x20);
+                out[2] = _mm256_permute2x128_si256(u2, u6, 0x20);
+                out[3] = _mm256_permute2x128_si256(u3, u7, 0x20);
+                out[4] = _mm256_permute2x128_si256(u0, u4, 0x31);
+                out[5] = _mm256_permute2x128_si256(u1, u5, 0x31);
+                out[6] = _mm256_permute2x128_si256(u2, u6, 0x31);
+                out[7] = _mm256_permute2x128_si256(u3, u7, 0x31);
+                for (int i = 0; i < 8; i++)
+                    out[i] = _mm256_shuffle_epi8(out[i], byteSwap);
+            }
+
+            __m256i a = s[0], b = s[1], c = s[2], d = s[3];
+            __m256i e = s[4], f = s[5], g = s[6], h = s[7];
+
+            for (int t = 0; t < 64; t++) {
+                __m256i wt;
+                if (t < 16) {
+                    wt = w[t];
+                } else {
+                    __m256i w15 = w[(t - 15) & 15];
+                    __m256i w2 = w[(t - 2) & 15];
+                    __m256i s0 = _mm256_xor_si256(
+                            _mm256_xor_si256(ROTR(w15, 7), ROTR(w15, 18)),
+                            _mm256_srli_epi32(w15, 3));
+                    __m256i s1 = _mm256_xor_si256(
+                            _mm256_xor_si256(ROTR(w2, 17), ROTR(w2, 19)),
+                            _mm256_srli_epi32(w2, 10));
+                    wt = _mm256_add_epi32(
+                            _mm256_add_epi32(w[t & 15], s0),
+                            _mm256_add_epi32(w[(t - 7) & 15], s1));
+                    w[t & 15] = wt;
+                }
+
+                __m256i sum1 = _mm256_xor_si256(
+                        _mm256_xor_si256(ROTR(e, 6), ROTR(e, 11)),
+                        ROTR(e, 25));
+                __m256i ch = _mm256_xor_si256(_mm256_and_si256(e, f),
+                                              _mm256_andnot_si256(e, g));
+                __m256i t1 = _mm256_add_epi32(
+                        _mm256_add_epi32(h, sum1),
+                        _mm256_add_epi32(
+                                ch, _mm256_add_epi32(
+                                        wt, _mm256_set1_epi32(static_cast<int>(
+                                                roundConstants[t])))));
+                __m256i sum0 = _mm256_xor_si256(
+                        _mm256_xor_si256(ROTR(a, 2), ROTR(a, 13)),
+                        ROTR(a, 22));
+                __m256i maj = _mm256_or_si256(
+                        _mm256_and_si256(_mm256_or_si256(a, b), c),
+                        _mm256_and_si256(a, b));
+                __m256i t2 = _mm256_add_epi32(sum0, maj);
+
+                h = g;
+                g = f;
+                f = e;
+                e = _mm256_add_epi32(d, t1);
+                d = c;
+                c = b;
+                b = a;
+                a = _mm256_add_epi32(t1, t2);
+            }
+
+            s[0] = _mm256_add_epi32(s[0], a);
+            s[1] = _mm256_add_epi32(s[1], b);
+            s[2] = _mm256_add_epi32(s[2], c);
+            s[3] = _mm256_add_epi32(s[3], d);
+            s[4] = _mm256_add_epi32(s[4], e);
+            s[5] = _mm256_add_epi32(s[5], f);
+            s[6] = _mm256_add_epi32(s[6], g);
+            s[7] = _mm256_add_epi32(s[7], h);
+        }
+
+        for (int i = 0; i < 8; i++)
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(state[i]), s[i]);
+#undef ROTR
+    }
+#endif  // defined _SHA256_AVX2
+
+    // Public
+
+    void Sha256Engine::enable(bool on, bool withShaNi) {
+        std::lock_guard<std::mutex> guard(engineLock);
+
+        active = on && haveAvx2() && (withShaNi || !haveShaNi());
+
+        if (::debug)
+            std::cout << "Multi-buffer SHA-256 "
+                      << (active ? "enabled" : "disabled") << std::endl;
+        if (on && !active)
+            syslog(LOG_INFO, "Multi-buffer SHA-256 not used, the CPU has %s",
+                   haveAvx2() ? "SHA extensions" : "no AVX2");
+    }
+
+    bool Sha256Engine::enabled(void) {
+        std::lock_guard<std::mutex> guard(engineLock);
+
+        return active;
+    }
+
+    void Sha256Engine::compress(uint32_t *state, const unsigned char *data,
+                                std::size_t blocks) {
+        if (blocks == 0)
+            return;
+
+        // Without a second stream, no lane could be shared
+        if (streams.load(std::memory_order_relaxed) < 2) {
+            compressSingle(state, data, blocks);
+            return;
+        }
+
+        Job job = {state, data, blocks, false};
+
+        std::unique_lock<std::mutex> guard(engineLock);
+
+        if (!active) {
+            guard.unlock();
+            compressSingle(state, data, blocks);
+            return;
+        }
+
+        jobs++;
+        pending.push_back(&job);
+
+        while (!job.done) {
+            if (combining) {
+                finished.wait(guard);
+                continue;
+            }
+            combining = true;
+            combine(guard, job);
+            combining = false;
+            // Another thread may take over with new jobs
+            finished.notify_all();
+        }
+    }
+
+    void Sha256Engine::compressScalar(uint32_t *state,
+                                      const unsigned char *data,
+                                      std::size_t blocks) {
+        for (std::size_t block = 0; block < blocks; block++, data += 64) {
+            uint32_t w[64];
+
+            for (int t = 0; t < 16; t++)
+                w[t] = static_cast<uint32_t>(data[4 * t]) << 24
+                       | static_cast<uint32_t>(data[4 * t + 1]) << 16
+                       | static_cast<uint32_t>(data[4 * t + 2]) << 8
+                       | static_cast<uint32_t>(data[4 * t + 3]);
+            for (int t = 16; t < 64; t++) {
+                uint32_t s0 = rotr(w[t - 15], 7) ^ rotr(w[t - 15], 18)
+                              ^ (w[t - 15] >> 3);
+                uint32_t s1 = rotr(w[t - 2], 17) ^ rotr(w[t - 2], 19)
+                              ^ (w[t - 2] >> 10);
+                w[t] = w[t - 16] + s0 + w[t - 7] + s1;
+            }
+
+            uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+            uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+            for (int t = 0; t < 64; t++) {
+                uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25))
+                              + ((e & f) ^ (~e & g)) + roundConstants[t]
+                              + w[t];
+                uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22))
+                              + ((a & b) ^ (a & c) ^ (b & c));
+                h = g;
+                g = f;
+                f = e;
+                e = d + t1;
+                d = c;
+                c = b;
+                b = a;
+                a = t1 + t2;
+            }
+
+            state[0] += a;
+            state[1] += b;
+            state[2] += c;
+            state[3] += d;
+            state[4] += e;
+            state[5] += f;
+            state[6] += g;
+            state[7] += h;
+        }
+    }
+
+    void Sha256Engine::compressSingle(uint32_t *state,
+                                      const unsigned char *data,
+                                      std::size_t blocks) {
+#if defined OPENSSL_NO_DEPRECATED_3_0
+        compressScalar(state, data, blocks);
+#else
+        SHA256_CTX ctx;
+        std::copy(state, state + 8, ctx.h);
+        for (std::size_t block = 0; block < blocks; block++, data += 64)
+            SHA256_Transform(&ctx, data);
+        std::copy(ctx.h, ctx.h + 8, state);
+#endif  // defined OPENSSL_NO_DEPRECATED_3_0
+    }
+
+    void Sha256Engine::logStats(void) {
+        std::lock_guard<std::mutex> guard(engineLock);
+
+        if (!active)
+            return;
+
+        double lanes = steps > 0 ? static_cast<double>(laneBlocks) / steps
+                                 : 0.0;
+
+        if (::debug)
+            std::cout << "Multi-buffer SHA-256: jobs=" << jobs
+                      << " lane_blocks=" << laneBlocks
+                      << " steps=" << steps
+                      << " avg_lanes=" << lanes << std::endl;
+        syslog(LOG_INFO, "Multi-buffer SHA-256: jobs=%lu lane_blocks=%lu "
+                         "steps=%lu avg_lanes=%.2f",
+               jobs, laneBlocks, steps, lanes);
+    }
+
+    // Private
+
+    void Sha256Engine::combine(std::unique_lock<std::mutex> &guard,
+                               const Job &own) {
+#if defined _SHA256_AVX2
+        Job *lane[laneCount] = {};
+        const unsigned char *input[laneCount] = {};
+        std::size_t remaining[laneCount] = {};
+        // Idle lanes are compressed, too
+        uint32_t state[8][laneCount] = {};
+
+        for (;;) {
+            int used = 0;
+
+            // Give free lanes to waiting jobs
+            for (int l = 0; l < laneCount; l++) {
+                if (lane[l] == nullptr && !pending.empty()) {
+                    lane[l] = pending.front();
+                    pending.pop_front();
+                    input[l] = lane[l]->data;
+                    remaining[l] = lane[l]->blocks;
+                    for (int i = 0; i < 8; i++)
+                        state[i][l] = lane[l]->state[i];
+                }
+                if (lane[l] != nullptr)
+                    used++;
+            }
+            if (used == 0)
+                return;
+
+            guard.unlock();
+
+            std::size_t count = maxSteps;
+            const unsigned char *data[laneCount];
+            for (int l = 0; l < laneCount; l++) {
+                if (lane[l] != nullptr) {
+                    count = std::min(count, remaining[l]);
+                    data[l] = input[l];
+                } else {
+                    data[l] = idleInput;
+                }
+            }
+
+            if (used == 1) {
+                /*
+                 * Eight lanes for one job are slower than OpenSSL.
+                 * Jobs that arrive meanwhile join after count blocks
+                 */
+                for (int l = 0; l < laneCount; l++) {
+                    if (lane[l] == nullptr)
+                        continue;
+                    uint32_t single[8];
+                    for (int i = 0; i < 8; i++)
+                        single[i] = state[i][l];
+                    compressSingle(single, input[l], count);
+                    for (int i = 0; i < 8; i++)
+                        state[i][l] = single[i];
+                }
+            } else {
+                compressLanes(state, data, count);
+            }
+
+            guard.lock();
+
+            if (used > 1) {
+                steps += count;
+                laneBlocks += count * static_cast<std::size_t>(used);
+            }
+
+            bool done = false;
+            for (int l = 0; l < laneCount; l++) {
+                if (lane[l] == nullptr)
+                    continue;
+                input[l] += count * 64;
+                remaining[l] -= count;
+                if (remaining[l] > 0)
+                    continue;
+                for (int i = 0; i < 8; i++)
+                    lane[l]->state[i] = state[i][l];
+                lane[l]->done = true;
+                lane[l] = nullptr;
+                done = true;
+            }
+            if (done)
+                finished.notify_all();
+
+            if (!own.done)
+                continue;
+
+            /*
+             * Our own job is done. Hand the others back, so that the
+             * combiner does not hash for everybody while its own message
+             * waits
+             */
+            for (int l = laneCount - 1; l >= 0; l--) {
+                if (lane[l] == nullptr)
+                    continue;
+                for (int i = 0; i < 8; i++)
+                    lane[l]->state[i] = state[i][l];
+                lane[l]->data = input[l];
+                lane[l]->blocks = remaining[l];
+                pending.push_front(lane[l]);
+            }
+            return;
+        }
+#else
+        while (!own.done) {
+            Job *job = pending.front();
+            pending.pop_front();
+
+            guard.unlock();
+            compressSingle(job->state, job->data, job->blocks);
+            guard.lock();
+
+            job->done = true;
+        }
+        finished.notify_all();
+#endif  // defined _SHA256_AVX2
+    }
+
+    bool Sha256Engine::haveAvx2(void) {
+#if defined _SHA256_AVX2
+        return __builtin_cpu_supports("avx2");
+#else
+        return false;
+#endif  // defined _SHA256_AVX2
+    }
+
+    bool Sha256Engine::haveShaNi(void) {
+#if defined _SHA256_AVX2
+        unsigned int eax, ebx, ecx, edx;
+        if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) == 0)
+            return false;
+        return (ebx & (1U << 29)) != 0;
+#else
+        return false;
+#endif  // defined _SHA256_AVX2
+    }
+
+    Sha256Stream::Sha256Stream(void)
+            : length(0),
+              buffer(),
+              counted(true) {
+        std::copy(initialState, initialState + 8, state);
+        buffer.reserve(chunkSize);
+        Sha256Engine::streams++;
+    }
+
+    Sha256Stream::~Sha256Stream(void) {
+        if (counted)
+            Sha256Engine::streams--;
+    }
+
+    void Sha256Stream::update(const void *data, std::size_t len) {
+        const unsigned char *in = static_cast<const unsigned char *>(data);
+
+        length += len;
+
+        while (len > 0) {
+            std::size_t take = std::min(len, chunkSize - buffer.size());
+            buffer.insert(buffer.end(), in, in + take);
+            in += take;
+            len -= take;
+
+            if (buffer.size() == chunkSize) {
+                Sha256Engine::compress(state, buffer.data(), chunkSize / 64);
+                buffer.clear();
+            }
+        }
+    }
+
+    void Sha256Stream::final(unsigned char *md) {
+        uint64_t bits = length * 8;
+
+        // Padding, FIPS 180-4, 5.1.1
+        buffer.push_back(0x80);
+        while (buffer.size() % 64 != 56)
+            buffer.push_back(0x00);
+        for (int i = 7; i >= 0; i--)
+            buffer.push_back(static_cast<unsigned char>(bits >> (8 * i)));
+
+        Sha256Engine::compress(state, buffer.data(), buffer.size() / 64);
+        buffer.clear();
+
+        if (counted) {
+            Sha256Engine::streams--;
+            counted = false;
+        }
+
+        for (int i = 0; i < 8; i++) {
+            md[4 * i] = static_cast<unsigned char>(state[i] >> 24);
+            md[4 * i + 1] = static_cast<unsigned char>(state[i] >> 16);
+            md[4 * i + 2] = static_cast<unsigned char>(state[i] >> 8);
+            md[4 * i + 3] = static_cast<unsigned char>(state[i]);
+        }
+    }
+
+    // Init static
+
+    bool Sha256Engine::active = false;
+    std::mutex Sha256Engine::engineLock;
+    std::condition_variable Sha256Engine::finished;
+    std::deque<Sha256Engine::Job *> Sha256Engine::pending;
+    bool Sha256Engine::combining = false;
+    u_long Sha256Engine::jobs = 0;
+    u_long Sha256Engine::laneBlocks = 0;
+    u_long Sha256Engine::steps = 0;
+    std::atomic<unsigned int> Sha256Engine::streams(0);
+    const std::size_t Sha256Stream::digestSize;
+    const std::size_t Sha256Stream::chunkSize;
+
+}  // namespace smime
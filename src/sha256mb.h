@@ -0,0 +1,207 @@
+/*! @file sha256mb.h
+ *
+ * @brief Multi-buffer SHA-256 for the content digests of many messages
+ *
+ * @author Christian Roessner <c@roessner.co>
+ * @version 1607.1.4
+ * @date 2016-06-10
+ * @copyright Copyright 2016 Christian Roessner <c@roessner.co>
+ */
+
+#ifndef SRC_SHA256MB_H_
+#define SRC_SHA256MB_H_
+
+#include <sys/types.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+extern bool debug;
+
+namespace smime {
+    /*!
+     * @brief Hash the content of concurrent messages in SIMD lanes
+     *
+     * Each connection thread hashes the content of its own message. A CPU
+     * with AVX2 can run eight independent SHA-256 compressions in one set of
+     * vector registers. If the CPU has no SHA extensions, this is several
+     * times faster than hashing the messages one after the other.
+     *
+     * Threads hand their blocks to the engine. The first thread that finds
+     * no other thread hashing becomes the combiner. It puts all waiting
+     * jobs into the eight lanes and fills a lane again as soon as its job is
+     * done. When its own job is done, it queues the unfinished jobs again
+     * and one of the waiting threads takes over. A job that runs alone is
+     * hashed with the SHA-256 code of OpenSSL.
+     *
+     * As long as only one Sha256Stream exists, its blocks never enter the
+     * engine. They are hashed by OpenSSL without taking engineLock.
+     */
+    class Sha256Engine {
+    public:
+        /*!
+         * @brief Turn the engine on or off
+         *
+         * The engine is only used, if the CPU has AVX2 and no SHA
+         * extensions. Otherwise OpenSSL is faster. The second argument
+         * skips the check of the SHA extensions.
+         */
+        static void enable(bool, bool = false);
+
+        /*!
+         * @brief The engine is used for content digests
+         */
+        static bool enabled(void);
+
+        /*!
+         * @brief Compress whole 64 byte blocks into a hash state
+         *
+         * The blocks may be hashed together with the blocks of other threads.
+         */
+        static void compress(uint32_t *, const unsigned char *, std::size_t);
+
+        /*!
+         * @brief Compress whole 64 byte blocks in the calling thread
+         *
+         * Portable C code. Used where OpenSSL has no block function and as
+         * reference for benchmarks.
+         */
+        static void compressScalar(uint32_t *, const unsigned char *,
+                                   std::size_t);
+
+        /*!
+         * @brief Compress whole 64 byte blocks of one job
+         *
+         * Uses the block function of OpenSSL, which picks the SHA extensions
+         * or the best vector code of the CPU.
+         */
+        static void compressSingle(uint32_t *, const unsigned char *,
+                                   std::size_t);
+
+        /*!
+         * @brief Write job and lane counters to syslog
+         */
+        static void logStats(void);
+
+    private:
+        friend class Sha256Stream;
+
+        /*!
+         * @brief Blocks of one thread that wait for the combiner
+         */
+        struct Job {
+            //! @brief Hash state of the stream
+            uint32_t *state;
+
+            //! @brief The blocks
+            const unsigned char *data;
+
+            //! @brief Number of blocks
+            std::size_t blocks;
+
+            //! @brief The blocks were hashed
+            bool done;
+        };
+
+        /*!
+         * @brief Hash waiting jobs until the own job is done
+         *
+         * engineLock is held. Jobs that are not done yet are queued again.
+         */
+        static void combine(std::unique_lock<std::mutex> &, const Job &);
+
+        /*!
+         * @brief The CPU can run the AVX2 code
+         */
+        static bool haveAvx2(void);
+
+        /*!
+         * @brief The CPU has the SHA extensions
+         */
+        static bool haveShaNi(void);
+
+        //! @brief Use the engine
+        static bool active;
+
+        //! @brief Protects the jobs and the counters
+        static std::mutex engineLock;
+
+        //! @brief Signals the waiting threads that jobs were done
+        static std::condition_variable finished;
+
+        //! @brief Jobs that wait for a lane
+        static std::deque<Job *> pending;
+
+        //! @brief A thread runs combine()
+        static bool combining;
+
+        //! @brief Number of jobs
+        static u_long jobs;
+
+        //! @brief Number of blocks hashed in lanes
+        static u_long laneBlocks;
+
+        //! @brief Number of eight lane steps
+        static u_long steps;
+
+        //! @brief Number of Sha256Stream instances
+        static std::atomic<unsigned int> streams;
+    };
+
+    /*!
+     * @brief A SHA-256 digest that is computed with the Sha256Engine
+     *
+     * Input is collected until a chunk is complete. Whole chunks are handed
+     * to the engine, so that the threads meet there with larger jobs.
+     */
+    class Sha256Stream {
+    public:
+        /*!
+         * @brief Constructor
+         */
+        Sha256Stream(void);
+
+        /*!
+         * @brief Destructor
+         */
+        ~Sha256Stream(void);
+
+        Sha256Stream(const Sha256Stream &) = delete;
+        Sha256Stream &operator=(const Sha256Stream &) = delete;
+
+        /*!
+         * @brief Add data to the digest
+         */
+        void update(const void *, std::size_t);
+
+        /*!
+         * @brief Finish the digest and write its 32 bytes
+         */
+        void final(unsigned char *);
+
+        //! @brief Size of a digest in bytes
+        static const std::size_t digestSize = 32;
+
+    private:
+        //! @brief The hash state
+        uint32_t state[8];
+
+        //! @brief Number of bytes added
+        uint64_t length;
+
+        //! @brief Data that was not yet hashed
+        std::vector<unsigned char> buffer;
+
+        //! @brief Counted in Sha256Engine::streams until final()
+        bool counted;
+
+        //! @brief Size of the chunks handed to the engine
+        static const std::size_t chunkSize = 16384;
+    };
+}  // namespace smime
+
+#endif  // SRC_SHA256MB_H_
@@ -0,0 +1,161 @@
+/*! @file signchannel.cpp
+ *
+ * @brief Framed messages between the milter and the signer process
+ *
+ * @author Christian Roessner <c@roessner.co>
+ * @version 1607.1.4
+ * @date 2016-06-10
+ * @copyright Copyright 2016 Christian Roessner <c@roessner.co>
+ */
+
+#include "signchannel.h"
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+
+namespace smime {
+    // Public
+
+    SignChannel::SignChannel(int fd)
+            : fd(fd),
+              writeLock(),
+              output(),
+              writing(false),
+              broken(false),
+              input() { /* empty */ }
+
+    SignChannel::~SignChannel(void) {
+        close(fd);
+    }
+
+    bool SignChannel::send(const std::vector<unsigned char> &frame) {
+        std::unique_lock<std::mutex> guard(writeLock);
+
+        if (broken)
+            return false;
+
+        put(output, static_cast<uint32_t>(frame.size()), 4);
+        output.insert(output.end(), frame.begin(), frame.end());
+
+        // The writing thread takes this frame with its next write
+        if (writing)
+            return true;
+        writing = true;
+
+        std::vector<unsigned char> chunk;
+        while (!output.empty() && !broken) {
+            chunk.clear();
+            chunk.swap(output);
+            guard.unlock();
+
+            const unsigned char *data = chunk.data();
+            std::size_t remaining = chunk.size();
+            while (remaining > 0) {
+                // A closed peer must not kill us with SIGPIPE
+                ssize_t n = ::send(fd, data, remaining, MSG_NOSIGNAL);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0)
+                    break;
+                data += n;
+                remaining -= static_cast<std::size_t>(n);
+            }
+
+            guard.lock();
+            if (remaining > 0) {
+                broken = true;
+                // Lets the receiving thread fail all open requests
+                ::shutdown(fd, SHUT_RDWR);
+            }
+        }
+        writing = false;
+
+        return !broken;
+    }
+
+    bool SignChannel::receive(std::vector<std::vector<unsigned char>> &frames) {
+        frames.clear();
+
+        for (;;) {
+            std::size_t pos = 0;
+            uint32_t length = 0;
+
+            while (input.size() - pos >= 4) {
+                std::size_t at = pos;
+                get(input, at, length, 4);
+                if (length > maxFrame)
+                    return false;
+                if (input.size() - at < length)
+                    break;
+                frames.emplace_back(input.begin() + at,
+                                    input.begin() + at + length);
+                pos = at + length;
+            }
+            input.erase(input.begin(), input.begin() + pos);
+
+            if (!frames.empty())
+                return true;
+
+            std::size_t used = input.size();
+            input.resize(used + maxFrame);
+            ssize_t n = read(fd, input.data() + used, maxFrame);
+            input.resize(used + (n > 0 ? static_cast<std::size_t>(n) : 0));
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+        }
+    }
+
+    void SignChannel::shutdown(void) {
+        std::lock_guard<std::mutex> guard(writeLock);
+
+        broken = true;
+        ::shutdown(fd, SHUT_RDWR);
+    }
+
+    void SignChannel::put(std::vector<unsigned char> &frame, uint32_t value,
+                          std::size_t bytes) {
+        while (bytes-- > 0)
+            frame.push_back(static_cast<unsigned char>(value >> (8 * bytes)));
+    }
+
+    void SignChannel::put(std::vector<unsigned char> &frame,
+                          const std::string &value) {
+        put(frame, static_cast<uint32_t>(value.size()), 2);
+        frame.insert(frame.end(), value.begin(), value.end());
+    }
+
+    bool SignChannel::get(const std::vector<unsigned char> &frame,
+                          std::size_t &pos, uint32_t &value,
+                          std::size_t bytes) {
+        if (frame.size() < pos || frame.size() - pos < bytes)
+            return false;
+
+        value = 0;
+        while (bytes-- > 0)
+            value = (value << 8) | frame[pos++];
+
+        return true;
+    }
+
+    bool SignChannel::get(const std::vector<unsigned char> &frame,
+                          std::size_t &pos, std::string &value) {
+        uint32_t length;
+
+        if (!get(frame, pos, length, 2) || frame.size() - pos < length)
+            return false;
+
+        value.assign(frame.begin() + pos, frame.begin() + pos + length);
+        pos += length;
+
+        return true;
+    }
+
+    // Init static
+
+    const std::size_t SignChannel::maxFrame;
+
+}  // namespace smime
@@ -0,0 +1,126 @@
+/*! @file signchannel.h
+ *
+ * @brief Framed messages between the milter and the signer process
+ *
+ * @author Christian Roessner <c@roessner.co>
+ * @version 1607.1.4
+ * @date 2016-06-10
+ * @copyright Copyright 2016 Christian Roessner <c@roessner.co>
+ */
+
+#ifndef SRC_SIGNCHANNEL_H_
+#define SRC_SIGNCHANNEL_H_
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+extern bool debug;
+
+namespace smime {
+    /*!
+     * @brief A unix socket connection that carries frames
+     *
+     * A frame is a 32 bit length in network byte order, followed by the
+     * frame data. Many threads may send on one channel at the same time and
+     * do not wait for each other's answers. Frames that are sent while a
+     * write is in progress are collected and written by the thread that is
+     * already writing, so a burst of requests needs only a few system calls.
+     *
+     * Requests and responses start with a 32 bit id that the client chooses.
+     * A signing request carries:
+     *
+     * id, digest NID (16 bit), certificate name, key name, data to sign
+     *
+     * Names are prefixed with a 16 bit length. A response carries:
+     *
+     * id, status (8 bit, 0 is success), signature or error message
+     */
+    class SignChannel {
+    public:
+        /*!
+         * @brief Constructor. The channel owns the socket
+         */
+        explicit SignChannel(int);
+
+        /*!
+         * @brief Destructor. Closes the socket
+         */
+        ~SignChannel(void);
+
+        SignChannel(const SignChannel &) = delete;
+        SignChannel &operator=(const SignChannel &) = delete;
+
+        /*!
+         * @brief Send one frame
+         *
+         * @return false, if the connection is broken
+         */
+        bool send(const std::vector<unsigned char> &);
+
+        /*!
+         * @brief Wait for data and return all complete frames
+         *
+         * Only one thread may receive on a channel.
+         *
+         * @return false, if the connection was closed or a frame was too big
+         */
+        bool receive(std::vector<std::vector<unsigned char>> &);
+
+        /*!
+         * @brief Wake up the receiving thread and stop all I/O
+         */
+        void shutdown(void);
+
+        /*!
+         * @brief Append an integer in network byte order
+         */
+        static void put(std::vector<unsigned char> &, uint32_t, std::size_t);
+
+        /*!
+         * @brief Append a string with a 16 bit length
+         */
+        static void put(std::vector<unsigned char> &, const std::string &);
+
+        /*!
+         * @brief Read an integer in network byte order
+         *
+         * @return false, if the frame is too short
+         */
+        static bool get(const std::vector<unsigned char> &, std::size_t &,
+                        uint32_t &, std::size_t);
+
+        /*!
+         * @brief Read a string with a 16 bit length
+         *
+         * @return false, if the frame is too short
+         */
+        static bool get(const std::vector<unsigned char> &, std::size_t &,
+                        std::string &);
+
+        //! @brief Largest accepted frame
+        static const std::size_t maxFrame = 65536;
+
+    private:
+        //! @brief The socket
+        const int fd;
+
+        //! @brief Protects output and writing
+        std::mutex writeLock;
+
+        //! @brief Frames that wait for the writing thread
+        std::vector<unsigned char> output;
+
+        //! @brief A thread is writing
+        bool writing;
+
+        //! @brief The socket failed
+        bool broken;
+
+        //! @brief Received data that does not form a complete frame yet
+        std::vector<unsigned char> input;
+    };
+}  // namespace smime
+
+#endif  // SRC_SIGNCHANNEL_H_
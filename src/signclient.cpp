@@ -0,0 +1,267 @@
+/*! @file signclient.cpp
+ *
+ * @brief Sign with keys that are held by a signer process
+ *
+ * @author Christian Roessner <c@roessner.co>
+ * @version 1607.1.4
+ * @date 2016-06-10
+ * @copyright Copyright 2016 Christian Roessner <c@roessner.co>
+ */
+
+#include "signclient.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <openssl/err.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+
+namespace smime {
+    // Public
+
+    void SignClient::setSocket(const std::string &path,
+                               unsigned int count, unsigned int seconds) {
+        stop();
+
+        std::lock_guard<std::mutex> guard(clientLock);
+
+        socketPath = path;
+        timeout = seconds > 0 ? seconds : 1;
+        connections.clear();
+
+        if (socketPath.empty())
+            return;
+
+        if (count == 0)
+            count = 1;
+        for (unsigned int i = 0; i < count; i++)
+            connections.emplace_back(new Connection());
+    }
+
+    bool SignClient::enabled(void) {
+        std::lock_guard<std::mutex> guard(clientLock);
+
+        return !socketPath.empty();
+    }
+
+    bool SignClient::sign(const std::string &cert, const std::string &key,
+                          const EVP_MD *md, const unsigned char *data,
+                          std::size_t len, std::vector<unsigned char> &sig) {
+        Request request;
+        std::shared_ptr<SignChannel> channel;
+        Connection *conn;
+        uint32_t id;
+
+        // The request id is filled in, when it is known
+        std::vector<unsigned char> frame;
+        frame.reserve(10 + cert.size() + key.size() + len);
+        SignChannel::put(frame, 0, 4);
+        SignChannel::put(frame, static_cast<uint32_t>(EVP_MD_type(md)), 2);
+        SignChannel::put(frame, cert);
+        SignChannel::put(frame, key);
+        frame.insert(frame.end(), data, data + len);
+
+        // The signer would drop the connection and all requests on it
+        if (frame.size() > SignChannel::maxFrame) {
+            report("Request too large for the signer process");
+            return false;
+        }
+
+        {
+            std::lock_guard<std::mutex> guard(clientLock);
+
+            if (connections.empty()) {
+                report("No signer socket");
+                return false;
+            }
+
+            // Spread the requests over all connections
+            conn = connections[next++ % connections.size()].get();
+            if (!conn->channel && !connect(*conn))
+                return false;
+
+            channel = conn->channel;
+            id = ++lastId;
+            conn->pending[id] = &request;
+        }
+
+        std::vector<unsigned char> header;
+        SignChannel::put(header, id, 4);
+        std::copy(header.begin(), header.end(), frame.begin());
+
+        /*
+         * If sending fails, the connection is shut down and the reader
+         * thread fails all its pending requests, including this one
+         */
+        channel->send(frame);
+
+        std::unique_lock<std::mutex> guard(clientLock);
+
+        if (!request.finished.wait_for(
+                guard, std::chrono::seconds(timeout),
+                [&request]() { return request.done; })) {
+            conn->pending.erase(id);
+            guard.unlock();
+            report("No answer from the signer process");
+            return false;
+        }
+        guard.unlock();
+
+        if (!request.ok) {
+            report("Signer process failed: " + std::string(
+                    request.result.begin(), request.result.end()));
+            return false;
+        }
+
+        sig.swap(request.result);
+
+        return true;
+    }
+
+    void SignClient::stop(void) {
+        std::vector<std::thread> readers;
+
+        {
+            std::lock_guard<std::mutex> guard(clientLock);
+
+            for (auto &it : connections) {
+                if (it->channel)
+                    it->channel->shutdown();
+                if (it->reader.joinable())
+                    readers.push_back(std::move(it->reader));
+            }
+        }
+
+        // The readers need clientLock to finish
+        for (auto &it : readers)
+            it.join();
+    }
+
+    // Private
+
+    SignClient::Request::Request(void)
+            : done(false),
+              ok(false),
+              result(),
+              finished() { /* empty */ }
+
+    bool SignClient::connect(Connection &conn) {
+        // The reader of the broken connection has already left
+        if (conn.reader.joinable())
+            conn.reader.join();
+
+        struct sockaddr_un addr;
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (socketPath.size() >= sizeof(addr.sun_path)) {
+            report("Signer socket path too long");
+            return false;
+        }
+        std::strncpy(addr.sun_path, socketPath.c_str(),
+                     sizeof(addr.sun_path) - 1);
+
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            report("Unable to create socket: " + std::string(strerror(errno)));
+            return false;
+        }
+        if (::connect(fd, reinterpret_cast<struct sockaddr *>(&addr),
+                      sizeof(addr)) != 0) {
+            int error = errno;
+            close(fd);
+            report("Unable to connect to signer process: "
+                   + std::string(strerror(error)));
+            return false;
+        }
+
+        conn.channel = std::make_shared<SignChannel>(fd);
+        conn.reader = std::thread(receive, &conn, conn.channel);
+
+        if (::debug)
+            std::cout << "Connected to signer process at " << socketPath
+                      << std::endl;
+
+        return true;
+    }
+
+    void SignClient::receive(Connection *conn,
+                             std::shared_ptr<SignChannel> channel) {
+        std::vector<std::vector<unsigned char>> frames;
+
+        while (channel->receive(frames)) {
+            std::lock_guard<std::mutex> guard(clientLock);
+
+            for (auto &frame : frames) {
+                std::size_t pos = 0;
+                uint32_t id;
+                uint32_t status;
+
+                if (!SignChannel::get(frame, pos, id, 4)
+                    || !SignChannel::get(frame, pos, status, 1))
+                    continue;
+
+                // The request may have timed out
+                auto found = conn->pending.find(id);
+                if (found == conn->pending.end())
+                    continue;
+
+                Request *request = found->second;
+                request->ok = status == 0;
+                request->result.assign(frame.begin() + pos, frame.end());
+                request->done = true;
+                request->finished.notify_one();
+                conn->pending.erase(found);
+            }
+        }
+
+        if (::debug)
+            std::cout << "Connection to signer process closed" << std::endl;
+
+        static const std::string closed("connection closed");
+
+        std::lock_guard<std::mutex> guard(clientLock);
+
+        for (auto &it : conn->pending) {
+            it.second->ok = false;
+            it.second->result.assign(closed.begin(), closed.end());
+            it.second->done = true;
+            it.second->finished.notify_one();
+        }
+        conn->pending.clear();
+
+        if (conn->channel == channel)
+            conn->channel.reset();
+    }
+
+    void SignClient::report(const std::string &what) {
+        if (::debug)
+            std::cout << what << std::endl;
+        syslog(LOG_ERR, "%s", what.c_str());
+
+        // Callers report the reason from the OpenSSL error queue
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        ERR_raise_data(ERR_LIB_USER, ERR_R_OPERATION_FAIL, "%s",
+                       what.c_str());
+#else
+        EVPerr(0, ERR_R_INTERNAL_ERROR);
+#endif  // OPENSSL_VERSION_NUMBER >= 0x30000000L
+    }
+
+    // Init static
+
+    std::string SignClient::socketPath;
+    unsigned int SignClient::timeout = 10;
+    std::vector<std::unique_ptr<SignClient::Connection>>
+            SignClient::connections;
+    std::size_t SignClient::next = 0;
+    uint32_t SignClient::lastId = 0;
+    std::mutex SignClient::clientLock;
+
+}  // namespace smime
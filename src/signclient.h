@@ -0,0 +1,142 @@
+/*! @file signclient.h
+ *
+ * @brief Sign with keys that are held by a signer process
+ *
+ * @author Christian Roessner <c@roessner.co>
+ * @version 1607.1.4
+ * @date 2016-06-10
+ * @copyright Copyright 2016 Christian Roessner <c@roessner.co>
+ */
+
+#ifndef SRC_SIGNCLIENT_H_
+#define SRC_SIGNCLIENT_H_
+
+#include <openssl/evp.h>
+
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "signchannel.h"
+
+extern bool debug;
+
+namespace smime {
+    /*!
+     * @brief Client for the signer process
+     *
+     * If a signer socket is configured, the milter never reads private
+     * keys. It only sends the encoded signed attributes of a SignerInfo to
+     * the signer process and gets back the signature.
+     *
+     * All signing threads share a few connections. Requests are tagged with
+     * an id, so a thread sends its request without waiting for the answers
+     * to earlier requests on the same connection. A reader thread per
+     * connection hands each answer to the thread that waits for it.
+     * Connections are opened on first use and again after they broke.
+     */
+    class SignClient {
+    public:
+        /*!
+         * @brief Set the socket, the number of connections and the timeout
+         *
+         * An empty socket path turns off the signer process. The timeout is
+         * given in seconds.
+         */
+        static void setSocket(const std::string &, unsigned int,
+                              unsigned int);
+
+        /*!
+         * @brief Keys are held by a signer process
+         */
+        static bool enabled(void);
+
+        /*!
+         * @brief Sign data with the key of a map file entry
+         *
+         * The entry is given by its certificate and key name.
+         */
+        static bool sign(const std::string &, const std::string &,
+                         const EVP_MD *, const unsigned char *, std::size_t,
+                         std::vector<unsigned char> &);
+
+        /*!
+         * @brief Close all connections
+         */
+        static void stop(void);
+
+    private:
+        /*!
+         * @brief A request that waits for its answer
+         */
+        struct Request {
+            Request(void);
+
+            //! @brief The answer was received
+            bool done;
+
+            //! @brief The signer sent a signature
+            bool ok;
+
+            //! @brief Signature or error message
+            std::vector<unsigned char> result;
+
+            //! @brief Signals the waiting thread
+            std::condition_variable finished;
+        };
+
+        /*!
+         * @brief A connection to the signer process
+         */
+        struct Connection {
+            //! @brief nullptr, if not connected
+            std::shared_ptr<SignChannel> channel;
+
+            //! @brief Receives the answers
+            std::thread reader;
+
+            //! @brief Requests by id that wait for an answer
+            std::map<uint32_t, Request *> pending;
+        };
+
+        /*!
+         * @brief Open a connection and start its reader. clientLock is held
+         */
+        static bool connect(Connection &);
+
+        /*!
+         * @brief Main loop of a reader thread
+         */
+        static void receive(Connection *, std::shared_ptr<SignChannel>);
+
+        /*!
+         * @brief Report a failed request
+         */
+        static void report(const std::string &);
+
+        //! @brief Path of the signer socket
+        static std::string socketPath;
+
+        //! @brief Seconds to wait for an answer
+        static unsigned int timeout;
+
+        //! @brief The connections
+        static std::vector<std::unique_ptr<Connection>> connections;
+
+        //! @brief Connection for the next request
+        static std::size_t next;
+
+        //! @brief Id of the last request
+        static uint32_t lastId;
+
+        //! @brief Protects the connections and their pending requests
+        static std::mutex clientLock;
+    };
+}  // namespace smime
+
+#endif  // SRC_SIGNCLIENT_H_
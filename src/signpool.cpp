@@ -0,0 +1,247 @@
+/*! @file signpool.cpp
+ *
+ * @brief Fixed size thread pool for signing operations
+ *
+ * @author Christian Roessner <c@roessner.co>
+ * @version 1607.1.4
+ * @date 2016-06-10
+ * @copyright Copyright 2016 Christian Roessner <c@roessner.co>
+ */
+
+#include "signpool.h"
+
+#include <openssl/crypto.h>
+#include <openssl/rand.h>
+#include <syslog.h>
+
+#include <iostream>
+#include <memory>
+#include <utility>
+
+namespace smime {
+    using std::chrono::duration_cast;
+    using std::chrono::microseconds;
+
+    // Public
+
+    void SignerPool::start(unsigned int threads, std::size_t queueDepth) {
+        std::lock_guard<std::mutex> guard(poolLock);
+
+        if (running)
+            return;
+
+        if (threads == 0)
+            threads = std::thread::hardware_concurrency();
+        if (threads == 0)
+            threads = 1;
+
+        depth = queueDepth;
+        running = true;
+
+        for (unsigned int i = 0; i < threads; i++)
+            workers.emplace_back(work);
+
+        if (::debug)
+            std::cout << "Started " << threads << " signing threads with a "
+                      << "queue depth of " << depth << std::endl;
+        syslog(LOG_INFO, "Started %u signing threads, queue depth %lu",
+               threads, depth);
+    }
+
+    void SignerPool::stop(void) {
+        {
+            std::lock_guard<std::mutex> guard(poolLock);
+            if (!running)
+                return;
+            running = false;
+        }
+        pending.notify_all();
+
+        for (auto &it : workers)
+            it.join();
+        workers.clear();
+    }
+
+    SignerPool::Status SignerPool::run(
+            const std::function<void(void)> &task) {
+        Job job(task, false);
+
+        {
+            std::unique_lock<std::mutex> guard(poolLock);
+
+            if (!running) {
+                runInline(task, guard);
+                return Status::DONE;
+            }
+
+            if (!enqueue(&job))
+                return Status::FULL;
+        }
+        pending.notify_one();
+
+        std::unique_lock<std::mutex> guard(poolLock);
+        job.finished.wait(guard, [&job]() { return job.done; });
+
+        return Status::DONE;
+    }
+
+    SignerPool::Status SignerPool::post(std::function<void(void)> task) {
+        {
+            std::unique_lock<std::mutex> guard(poolLock);
+
+            if (!running) {
+                runInline(task, guard);
+                return Status::DONE;
+            }
+
+            std::unique_ptr<Job> job(new Job(std::move(task), true));
+            if (!enqueue(job.get()))
+                return Status::FULL;
+            job.release();
+        }
+        pending.notify_one();
+
+        return Status::DONE;
+    }
+
+    unsigned int SignerPool::size(void) {
+        std::lock_guard<std::mutex> guard(poolLock);
+
+        return static_cast<unsigned int>(workers.size());
+    }
+
+    void SignerPool::logStats(void) {
+        std::lock_guard<std::mutex> guard(poolLock);
+
+        u_long waitAvg = jobs > 0 ? waitTotal / jobs : 0;
+        u_long runAvg = jobs > 0 ? runTotal / jobs : 0;
+
+        if (::debug)
+            std::cout << "Signing pool: threads=" << workers.size()
+                      << " queued=" << queue.size()
+                      << " jobs=" << jobs
+                      << " rejected=" << rejected
+                      << " wait_avg_us=" << waitAvg
+                      << " wait_max_us=" << waitMax
+                      << " run_avg_us=" << runAvg << std::endl;
+        syslog(LOG_INFO,
+               "Signing pool: threads=%lu queued=%lu jobs=%lu rejected=%lu "
+               "wait_avg_us=%lu wait_max_us=%lu run_avg_us=%lu",
+               workers.size(), queue.size(), jobs, rejected,
+               waitAvg, waitMax, runAvg);
+    }
+
+    // Private
+
+    SignerPool::Job::Job(std::function<void(void)> task, bool detached)
+            : task(std::move(task)),
+              detached(detached),
+              queued(),
+              done(false),
+              finished() { /* empty */ }
+
+    void SignerPool::work(void) {
+        /*
+         * Each thread has its own random generators. Set them up now and
+         * not in the first signing job
+         */
+        unsigned char seed;
+        if (RAND_bytes(&seed, 1) != 1 || RAND_priv_bytes(&seed, 1) != 1)
+            std::cerr << "Error: Unable to seed random generator"
+                      << std::endl;
+
+        std::unique_lock<std::mutex> guard(poolLock);
+
+        for (;;) {
+            pending.wait(guard, []() { return !running || !queue.empty(); });
+
+            // Queued jobs are finished before the pool stops
+            if (queue.empty()) {
+                guard.unlock();
+                OPENSSL_thread_stop();
+                return;
+            }
+
+            Job *job = queue.front();
+            queue.pop_front();
+            guard.unlock();
+
+            clock_type::time_point begin = clock_type::now();
+            job->task();
+            clock_type::time_point end = clock_type::now();
+            clock_type::duration wait = begin - job->queued;
+
+            if (::debug)
+                std::cout << "\tSigning job waited "
+                          << duration_cast<microseconds>(wait).count()
+                          << "us and ran "
+                          << duration_cast<microseconds>(end - begin).count()
+                          << "us" << std::endl;
+
+            // Nobody waits for a posted job
+            if (job->detached) {
+                delete job;
+                job = nullptr;
+            }
+
+            guard.lock();
+            account(wait, end - begin);
+            if (job != nullptr) {
+                job->done = true;
+                job->finished.notify_one();
+            }
+        }
+    }
+
+    void SignerPool::runInline(const std::function<void(void)> &task,
+                               std::unique_lock<std::mutex> &guard) {
+        guard.unlock();
+        clock_type::time_point begin = clock_type::now();
+        task();
+        clock_type::time_point end = clock_type::now();
+
+        guard.lock();
+        account(clock_type::duration::zero(), end - begin);
+    }
+
+    bool SignerPool::enqueue(Job *job) {
+        if (depth > 0 && queue.size() >= depth) {
+            rejected++;
+            return false;
+        }
+
+        job->queued = clock_type::now();
+        queue.push_back(job);
+
+        return true;
+    }
+
+    void SignerPool::account(clock_type::duration wait,
+                             clock_type::duration run) {
+        u_long waitUs = static_cast<u_long>(
+                duration_cast<microseconds>(wait).count());
+        u_long runUs = static_cast<u_long>(
+                duration_cast<microseconds>(run).count());
+
+        jobs++;
+        waitTotal += waitUs;
+        runTotal += runUs;
+        if (waitUs > waitMax)
+            waitMax = waitUs;
+    }
+
+    // Init static
+
+    std::mutex SignerPool::poolLock;
+    std::condition_variable SignerPool::pending;
+    std::deque<SignerPool::Job *> SignerPool::queue;
+    std::vector<std::thread> SignerPool::workers;
+    std::size_t SignerPool::depth = 0;
+    bool SignerPool::running = false;
+    u_long SignerPool::jobs = 0;
+    u_long SignerPool::rejected = 0;
+    u_long SignerPool::waitTotal = 0;
+    u_long SignerPool::waitMax = 0;
+    u_long SignerPool::runTotal = 0;
+
+}  // namespace smime
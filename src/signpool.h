@@ -0,0 +1,176 @@
+/*! @file signpool.h
+ *
+ * @brief Fixed size thread pool for signing operations
+ *
+ * @author Christian Roessner <c@roessner.co>
+ * @version 1607.1.4
+ * @date 2016-06-10
+ * @copyright Copyright 2016 Christian Roessner <c@roessner.co>
+ */
+
+#ifndef SRC_SIGNPOOL_H_
+#define SRC_SIGNPOOL_H_
+
+#include <sys/types.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+extern bool debug;
+
+namespace smime {
+    /*!
+     * @brief Worker threads that run the private key operations
+     *
+     * libmilter uses one thread per SMTP connection. If every connection
+     * thread signed its messages itself, a burst of connections would run
+     * as many RSA operations in parallel and the threads would compete for
+     * CPU and caches. Instead, the connection threads hand the signing job
+     * to a fixed number of workers and wait for the result.
+     *
+     * The queue is bounded. If it is full, the job is rejected and the
+     * message can be deferred with a temporary failure.
+     */
+    class SignerPool {
+    public:
+        /*!
+         * @brief Result of a submitted job
+         */
+        enum class Status {
+            //! @brief The job was run
+            DONE,
+            //! @brief The queue was full and the job was not run
+            FULL
+        };
+
+        /*!
+         * @brief Start the worker threads
+         *
+         * If the number of threads is 0, one thread per CPU core is used. A
+         * queue depth of 0 does not limit the queue.
+         * The pool must be started after the process was daemonized.
+         */
+        static void start(unsigned int, std::size_t);
+
+        /*!
+         * @brief Finish all queued jobs and join the worker threads
+         */
+        static void stop(void);
+
+        /*!
+         * @brief Run a job in the pool and wait until it is done
+         *
+         * If the pool is not running, the job is run in the calling thread.
+         */
+        static Status run(const std::function<void(void)> &);
+
+        /*!
+         * @brief Queue a job and return without waiting for it
+         *
+         * The job must report its result itself. If the pool is not
+         * running, the job is run in the calling thread.
+         */
+        static Status post(std::function<void(void)>);
+
+        /*!
+         * @brief Number of worker threads
+         */
+        static unsigned int size(void);
+
+        /*!
+         * @brief Write job counters and timings to syslog
+         */
+        static void logStats(void);
+
+    private:
+        using clock_type = std::chrono::steady_clock;
+
+        /*!
+         * @brief A queued job
+         *
+         * A job from run() lives on the stack of the waiting thread. A job
+         * from post() is owned by the pool and deleted after it was run.
+         */
+        struct Job {
+            Job(std::function<void(void)>, bool);
+
+            //! @brief The work to do
+            std::function<void(void)> task;
+
+            //! @brief Nobody waits for the job
+            const bool detached;
+
+            //! @brief Time when the job was queued
+            clock_type::time_point queued;
+
+            //! @brief The job was run by a worker
+            bool done;
+
+            //! @brief Signals the waiting thread
+            std::condition_variable finished;
+        };
+
+        /*!
+         * @brief Main loop of a worker thread
+         */
+        static void work(void);
+
+        /*!
+         * @brief Add timings of a finished job to the counters
+         */
+        static void account(clock_type::duration, clock_type::duration);
+
+        /*!
+         * @brief Run a job in the calling thread. poolLock is held
+         */
+        static void runInline(const std::function<void(void)> &,
+                              std::unique_lock<std::mutex> &);
+
+        /*!
+         * @brief Queue a job. poolLock is held
+         *
+         * @return false, if the queue is full
+         */
+        static bool enqueue(Job *);
+
+        //! @brief Protects the queue and the counters
+        static std::mutex poolLock;
+
+        //! @brief Signals the workers that a job was queued
+        static std::condition_variable pending;
+
+        //! @brief Jobs waiting for a worker
+        static std::deque<Job *> queue;
+
+        //! @brief The worker threads
+        static std::vector<std::thread> workers;
+
+        //! @brief Maximum number of waiting jobs. 0 is unlimited
+        static std::size_t depth;
+
+        //! @brief Workers are accepting jobs
+        static bool running;
+
+        //! @brief Number of finished jobs
+        static u_long jobs;
+
+        //! @brief Number of jobs that were rejected
+        static u_long rejected;
+
+        //! @brief Sum of the time that jobs waited for a worker in us
+        static u_long waitTotal;
+
+        //! @brief Longest time that a job waited for a worker in us
+        static u_long waitMax;
+
+        //! @brief Sum of the time that jobs ran in us
+        static u_long runTotal;
+    };
+}  // namespace smime
+
+#endif  // SRC_SIGNPOOL_H_
@@ -0,0 +1,310 @@
+/*! @file signservice.cpp
+ *
+ * @brief Signer process that holds the private keys
+ *
+ * @author Christian Roessner <c@roessner.co>
+ * @version 1607.1.4
+ * @date 2016-06-10
+ * @copyright Copyright 2016 Christian Roessner <c@roessner.co>
+ */
+
+#include "signservice.h"
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <openssl/err.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+
+#include "credcache.h"
+#include "signpool.h"
+#include "smime.h"
+
+namespace smime {
+    // Public
+
+    bool SignService::listen(const std::string &path) {
+        struct sockaddr_un addr;
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+            std::cerr << "Error: Invalid signer socket path " << path
+                      << std::endl;
+            return false;
+        }
+        std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+        // Replace the socket of an earlier run, but never a regular file
+        struct stat st;
+        if (lstat(path.c_str(), &st) == 0) {
+            if (!S_ISSOCK(st.st_mode)) {
+                std::cerr << "Error: " << path << " exists and is not a "
+                          << "socket" << std::endl;
+                return false;
+            }
+            unlink(path.c_str());
+        }
+
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            perror("Error: Unable to create signer socket");
+            return false;
+        }
+
+        // Only the owner and the group of the milter may connect
+        mode_t mask = umask(0117);
+        int result = bind(fd, reinterpret_cast<struct sockaddr *>(&addr),
+                          sizeof(addr));
+        umask(mask);
+
+        if (result != 0 || ::listen(fd, SOMAXCONN) != 0) {
+            perror("Error: Unable to listen on signer socket");
+            close(fd);
+            return false;
+        }
+
+        listener = fd;
+        socketPath = path;
+        running = true;
+
+        if (::debug)
+            std::cout << "Signer listens on " << path << std::endl;
+
+        return true;
+    }
+
+    void SignService::run(void) {
+        syslog(LOG_NOTICE, "Signer listens on %s", socketPath.c_str());
+
+        while (running) {
+            int fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (!running)
+                    break;
+                if (errno == EINTR || errno == ECONNABORTED)
+                    continue;
+                syslog(LOG_ERR, "Signer: accept() failed: %s",
+                       strerror(errno));
+                // Out of file descriptors. Give connections time to close
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                continue;
+            }
+
+            std::lock_guard<std::mutex> guard(serviceLock);
+
+            // Forget connections that were closed by the milter
+            for (auto it = sessions.begin(); it != sessions.end();) {
+                if (it->closed) {
+                    it->reader.join();
+                    it = sessions.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+
+            sessions.emplace_back();
+            Session &session = sessions.back();
+            session.channel = std::make_shared<SignChannel>(fd);
+            session.reader = std::thread(serve, &session);
+
+            if (::debug)
+                std::cout << "Signer: new connection, " << sessions.size()
+                          << " open" << std::endl;
+        }
+
+        close(listener);
+        listener = -1;
+        unlink(socketPath.c_str());
+
+        std::list<Session> remaining;
+        {
+            std::lock_guard<std::mutex> guard(serviceLock);
+            for (auto &it : sessions)
+                it.channel->shutdown();
+            remaining.splice(remaining.begin(), sessions);
+        }
+
+        // The readers need serviceLock to finish
+        for (auto &it : remaining)
+            it.reader.join();
+    }
+
+    void SignService::stop(void) {
+        running = false;
+
+        // Wakes up accept()
+        if (listener >= 0)
+            ::shutdown(listener, SHUT_RDWR);
+    }
+
+    void SignService::allow(const std::vector<mapfile::Entry> &entries) {
+        std::lock_guard<std::mutex> guard(serviceLock);
+
+        allowed.clear();
+        for (auto &it : entries)
+            allowed.insert(it.cert + '\0' + it.key);
+    }
+
+    void SignService::logStats(void) {
+        std::lock_guard<std::mutex> guard(serviceLock);
+
+        std::size_t open = 0;
+        for (auto &it : sessions)
+            if (!it.closed)
+                open++;
+
+        if (::debug)
+            std::cout << "Signer: connections=" << open
+                      << " requests=" << requests
+                      << " failed=" << failed
+                      << " rejected=" << rejected << std::endl;
+        syslog(LOG_INFO,
+               "Signer: connections=%lu requests=%lu failed=%lu rejected=%lu",
+               open, requests, failed, rejected);
+    }
+
+    // Private
+
+    void SignService::serve(Session *session) {
+        std::vector<std::vector<unsigned char>> frames;
+
+        while (session->channel->receive(frames))
+            for (auto &it : frames)
+                handle(session->channel, it);
+
+        // Queued requests fail to send their answers
+        session->channel->shutdown();
+
+        std::lock_guard<std::mutex> guard(serviceLock);
+        session->closed = true;
+    }
+
+    void SignService::handle(const std::shared_ptr<SignChannel> &channel,
+                             const std::vector<unsigned char> &frame) {
+        std::size_t pos = 0;
+        uint32_t id;
+        uint32_t nid;
+        std::string cert;
+        std::string key;
+
+        if (!SignChannel::get(frame, pos, id, 4))
+            return;
+
+        bool valid = SignChannel::get(frame, pos, nid, 2)
+                     && SignChannel::get(frame, pos, cert)
+                     && SignChannel::get(frame, pos, key);
+        {
+            std::lock_guard<std::mutex> guard(serviceLock);
+
+            requests++;
+            // Only keys from the map file are used
+            valid = valid && allowed.count(cert + '\0' + key) > 0;
+            if (!valid)
+                failed++;
+        }
+        if (!valid) {
+            answer(channel, id, "unknown key or malformed request");
+            return;
+        }
+
+        std::vector<unsigned char> data(frame.begin() + pos, frame.end());
+
+        SignerPool::Status status = SignerPool::post(
+                [channel, id, nid, cert, key, data]() {
+                    signRequest(channel, id, static_cast<int>(nid), cert,
+                                key, data);
+                });
+
+        if (status == SignerPool::Status::FULL) {
+            {
+                std::lock_guard<std::mutex> guard(serviceLock);
+                rejected++;
+            }
+            answer(channel, id, "signing queue is full");
+        }
+    }
+
+    void SignService::signRequest(const std::shared_ptr<SignChannel> &channel,
+                                  uint32_t id, int nid,
+                                  const std::string &cert,
+                                  const std::string &key,
+                                  const std::vector<unsigned char> &data) {
+        bool missing = false;
+        std::vector<unsigned char> sig;
+
+        ERR_clear_error();
+
+        credentials_t creds = CredentialCache::get(cert, key, missing);
+        const EVP_MD *md = getDigest(nid);
+        bool matches = creds && md != nullptr && creds->digest() != nullptr
+                       && EVP_MD_type(creds->digest()) == nid;
+
+        if (matches
+            && Smime::signData(*creds, md, data.data(), data.size(), sig)) {
+            answer(channel, id, true, sig.data(), sig.size());
+            return;
+        }
+
+        std::string reason;
+        if (missing) {
+            reason = "missing certificate or key";
+        } else if (creds && !matches) {
+            reason = "digest does not match the key";
+        } else {
+            char buf[120];
+            ERR_error_string_n(ERR_get_error(), buf, sizeof(buf));
+            reason = buf;
+        }
+        ERR_clear_error();
+
+        {
+            std::lock_guard<std::mutex> guard(serviceLock);
+            failed++;
+        }
+
+        syslog(LOG_ERR, "Signer: can not sign with %s: %s", key.c_str(),
+               reason.c_str());
+        answer(channel, id, reason);
+    }
+
+    void SignService::answer(const std::shared_ptr<SignChannel> &channel,
+                             uint32_t id, bool ok, const unsigned char *data,
+                             std::size_t len) {
+        std::vector<unsigned char> frame;
+
+        frame.reserve(5 + len);
+        SignChannel::put(frame, id, 4);
+        SignChannel::put(frame, ok ? 0 : 1, 1);
+        frame.insert(frame.end(), data, data + len);
+
+        // A closed connection has nobody to tell
+        channel->send(frame);
+    }
+
+    void SignService::answer(const std::shared_ptr<SignChannel> &channel,
+                             uint32_t id, const std::string &message) {
+        answer(channel, id, false,
+               reinterpret_cast<const unsigned char *>(message.data()),
+               message.size());
+    }
+
+    // Init static
+
+    int SignService::listener = -1;
+    std::string SignService::socketPath;
+    std::atomic<bool> SignService::running(false);
+    std::mutex SignService::serviceLock;
+    std::list<SignService::Session> SignService::sessions;
+    std::set<std::string> SignService::allowed;
+    u_long SignService::requests = 0;
+    u_long SignService::failed = 0;
+    u_long SignService::rejected = 0;
+
+}  // namespace smime
@@ -0,0 +1,150 @@
+/*! @file signservice.h
+ *
+ * @brief Signer process that holds the private keys
+ *
+ * @author Christian Roessner <c@roessner.co>
+ * @version 1607.1.4
+ * @date 2016-06-10
+ * @copyright Copyright 2016 Christian Roessner <c@roessner.co>
+ */
+
+#ifndef SRC_SIGNSERVICE_H_
+#define SRC_SIGNSERVICE_H_
+
+#include <sys/types.h>
+
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "mapfile.h"
+#include "signchannel.h"
+
+extern bool debug;
+
+namespace smime {
+    /*!
+     * @brief Sign requests of the milter with the keys of the map file
+     *
+     * The milter parses untrusted mail content. In split mode it does not
+     * read any private key. The signer process loads the map file and all
+     * keys, listens on a unix socket and signs the encoded signed attributes
+     * that the milter sends.
+     *
+     * Each connection has a thread that reads requests. Requests are run by
+     * the SignerPool, so many requests of one connection are signed at the
+     * same time. Answers are sent as soon as they are ready, not in the
+     * order of the requests.
+     */
+    class SignService {
+    public:
+        /*!
+         * @brief Create the unix socket
+         *
+         * An existing socket file is replaced. The socket is accessible by
+         * the owner and the group.
+         */
+        static bool listen(const std::string &);
+
+        /*!
+         * @brief Accept connections until stop() is called
+         */
+        static void run(void);
+
+        /*!
+         * @brief Stop accepting connections. Safe in a signal handler
+         */
+        static void stop(void);
+
+        /*!
+         * @brief Set the map file entries whose keys may be used
+         */
+        static void allow(const std::vector<mapfile::Entry> &);
+
+        /*!
+         * @brief Write request counters to syslog
+         */
+        static void logStats(void);
+
+    private:
+        /*!
+         * @brief A connection from the milter
+         */
+        struct Session {
+            //! @brief The connection
+            std::shared_ptr<SignChannel> channel;
+
+            //! @brief Reads the requests
+            std::thread reader;
+
+            //! @brief The milter closed the connection
+            bool closed = false;
+        };
+
+        /*!
+         * @brief Main loop of a reader thread
+         */
+        static void serve(Session *);
+
+        /*!
+         * @brief Check a request and hand it to the signing pool
+         */
+        static void handle(const std::shared_ptr<SignChannel> &,
+                           const std::vector<unsigned char> &);
+
+        /*!
+         * @brief Run a request in a signing thread
+         */
+        static void signRequest(const std::shared_ptr<SignChannel> &,
+                                uint32_t, int, const std::string &,
+                                const std::string &,
+                                const std::vector<unsigned char> &);
+
+        /*!
+         * @brief Send the answer to a request
+         */
+        static void answer(const std::shared_ptr<SignChannel> &, uint32_t,
+                           bool, const unsigned char *, std::size_t);
+
+        /*!
+         * @brief Send an error message as answer to a request
+         */
+        static void answer(const std::shared_ptr<SignChannel> &, uint32_t,
+                           const std::string &);
+
+        //! @brief The listening socket
+        static int listener;
+
+        //! @brief Path of the listening socket
+        static std::string socketPath;
+
+        //! @brief Accept connections
+        static std::atomic<bool> running;
+
+        //! @brief Protects the sessions, the allowed keys and the counters
+        static std::mutex serviceLock;
+
+        //! @brief Open connections
+        static std::list<Session> sessions;
+
+        //! @brief Certificate and key names of the map file
+        static std::set<std::string> allowed;
+
+        //! @brief Number of requests
+        static u_long requests;
+
+        //! @brief Number of failed requests
+        static u_long failed;
+
+        //! @brief Number of requests rejected by a full signing queue
+        static u_long rejected;
+    };
+}  // namespace smime
+
+#endif  // SRC_SIGNSERVICE_H_
@@ -10,85 +10,90 @@
 
 #include "smime.h"
 
-#include <openssl/pkcs7.h>
+#include <openssl/cms.h>
 #include <openssl/err.h>
-#include <pthread.h>
+#include <openssl/rand.h>
 #include <syslog.h>
 
+#include <algorithm>
+#include <cstring>
 #include <string>
 #include <sstream>
 #include <utility>
-#include <boost/filesystem.hpp>
+
+#include <boost/algorithm/string/join.hpp>
 
 #include "common.h"
 #include "client.h"
 #include "mapfile.h"
-
-/* we have this global to let the callback get easy access to it */
-static pthread_mutex_t *lockarray;
-
-static void lock_callback(int mode, int type, char *file, int line) {
-    (void) file;
-    (void) line;
-
-    if (mode & CRYPTO_LOCK) {
-        pthread_mutex_lock(&(lockarray[type]));
-    }
-    else {
-        pthread_mutex_unlock(&(lockarray[type]));
-    }
-}
-
-static unsigned long thread_id(void) {
-    unsigned long ret;
-
-    ret = (unsigned long) pthread_self();
-    return ret;
-}
+#include "credcache.h"
+#include "bodywriter.h"
+#include "headerplan.h"
+#include "signpool.h"
+#include "pkcs11.h"
+#include "signclient.h"
+
+/*!
+ * @brief Digest algorithms that are fetched once on startup
+ *
+ * With OpenSSL 3, every implicit lookup like EVP_sha256() has to find the
+ * implementation in the provider store again. Fetching the algorithms once
+ * avoids this work and its locking for every message.
+ */
+static struct {
+    int nid;
+    const char *name;
+    EVP_MD *md;
+} fetchedDigests[] = {
+        {NID_sha256, "SHA256", nullptr},
+        {NID_sha384, "SHA384", nullptr},
+        {NID_sha512, "SHA512", nullptr}
+};
 
 void init_openssl(void) {
-    int i;
-
-    // initialize lock array
-    lockarray = (pthread_mutex_t *) OPENSSL_malloc(
-            CRYPTO_num_locks() * sizeof(pthread_mutex_t));
-    for (i=0; i<CRYPTO_num_locks(); i++) {
-        pthread_mutex_init(&(lockarray[i]), nullptr);
+    /*
+     * OpenSSL 1.1 and newer are thread safe without locking callbacks.
+     * Error strings and algorithms are loaded explicitly, so that this does
+     * not happen later in a connection thread
+     */
+    OPENSSL_init_crypto(OPENSSL_INIT_LOAD_CRYPTO_STRINGS
+                        | OPENSSL_INIT_ADD_ALL_CIPHERS
+                        | OPENSSL_INIT_ADD_ALL_DIGESTS, nullptr);
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    for (auto &it : fetchedDigests) {
+        if (it.md == nullptr)
+            it.md = EVP_MD_fetch(nullptr, it.name, nullptr);
+        if (it.md == nullptr)
+            std::cerr << "Error: Unable to fetch digest " << it.name
+                      << std::endl;
     }
-
-    CRYPTO_set_id_callback((unsigned long (*)()) thread_id);
-    CRYPTO_set_locking_callback(
-            (void (*)(int, int, const char *, int)) lock_callback);
-
-    // initialize cipher and digest lookup functions
-    OpenSSL_add_all_algorithms();
-
-    // initialize the error strings
-    ERR_load_crypto_strings();
+#endif  // OPENSSL_VERSION_NUMBER >= 0x30000000L
 }
 
 void deinit_openssl(void) {
-    int i;
-
-    // free lock array
-    CRYPTO_set_locking_callback(nullptr);
-    for (i=0; i<CRYPTO_num_locks(); i++)
-        pthread_mutex_destroy(&(lockarray[i]));
-
-    OPENSSL_free(lockarray);
-
-    // de-initialisation ciphers and digests lookup functions
-    EVP_cleanup();
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    for (auto &it : fetchedDigests) {
+        EVP_MD_free(it.md);
+        it.md = nullptr;
+    }
+#endif  // OPENSSL_VERSION_NUMBER >= 0x30000000L
 
-    // free all previously loaded error strings
-    ERR_free_strings();
+    // Everything else is released by OpenSSL at exit
 }
 
-namespace fs = boost::filesystem;
-
 namespace smime {
     // Public
 
+    const EVP_MD *getDigest(int nid) {
+        for (auto &it : fetchedDigests)
+            if (it.nid == nid && it.md != nullptr)
+                return it.md;
+
+        // Not fetched or OpenSSL 1.1
+        return EVP_get_digestbynid(nid);
+    }
+
     Smime::Smime(SMFICTX *ctx)
             : ctx(ctx),
               smimeSigned(false),
@@ -110,24 +115,18 @@ namespace smime {
         if (mailFrom.empty())
             return;
 
+        // Errors of an earlier message must not show up for this one
+        ERR_clear_error();
+
         auto *client = util::mlfipriv(ctx);
         bool signedOrEncrypted = false;
-        std::vector<std::string> contentType;
-
-        contentType.push_back("multipart/signed");
-        contentType.push_back("multipart/encrypted");
-        contentType.push_back("application/pkcs7-mime");
 
+        // The same check as at the end of the headers
         for (auto &it : client->markedHeaders) {
-            if (it.first == "Content-Type") {
-                std::size_t found;
-                for (std::size_t i=0; i<contentType.size(); i++) {
-                    found = it.second.find(contentType.at(i));
-                    if (found != std::string::npos) {
-                        signedOrEncrypted = true;
-                        break;
-                    }
-                }
+            if (it.kind == mlt::HeaderKind::CONTENT_TYPE) {
+                // Text in the header arena is null terminated
+                signedOrEncrypted =
+                        mlt::Client::isProtectedType(it.value.data);
                 break;
             }
         }
@@ -148,307 +147,484 @@ namespace smime {
 
         mapfile::Map email(mailFrom);
 
-        auto cert = fs::path(email.getSmimeFilename<mapfile::Smime::CERT>());
-        auto key = fs::path(email.getSmimeFilename<mapfile::Smime::KEY>());
+        /*
+         * Get the parsed certificates, keys and intermediate certificates.
+         * If the files did not change since the last message, no file needs
+         * to be read at all. A sender may have more than one key
+         */
+        std::vector<Signer> signers;
 
-        if (!fs::exists(cert) && !fs::is_regular(cert))
-            return;
-        if (!fs::exists(key) && !fs::is_regular(key))
+        for (auto &it : email.getSigners()) {
+            bool missing = false;
+            Signer signer;
+
+            signer.creds = CredentialCache::get(it.cert, it.key, missing);
+            if (missing)
+                continue;
+            if (!signer.creds) {
+                handleSSLError();
+                return;
+            }
+            signer.md = signer.creds->digest();
+
+            /*
+             * The content digest was usually computed while the message was
+             * received. Other digest algorithms need a pass over the temp
+             * file
+             */
+            unsigned char md[EVP_MAX_MD_SIZE];
+            unsigned int mdlen = 0;
+            if (!client->getContentDigest(signer.md, md, &mdlen)
+                && !digestContent(signer.md, md, &mdlen)) {
+                handleSSLError();
+                return;
+            }
+            signer.digest.assign(md, md + mdlen);
+
+            signers.push_back(std::move(signer));
+        }
+
+        if (signers.empty())
             return;
 
         /*
          * Signing starts here
+         *
+         * Only the SignedData structure and the private key operations are
+         * left to do. They run in the signing pool, so that the number of
+         * parallel private key operations does not depend on the number of
+         * connections.
          */
 
-        int flags = PKCS7_DETACHED | PKCS7_STREAM | PKCS7_PARTIAL;
+        std::vector<unsigned char> der;
+        u_long sslError = 0;
 
+        SignerPool::Status status = SignerPool::run([&]() {
+            ERR_clear_error();
+            if (!createSignature(signers, der)) {
+                // The error queue belongs to the worker thread
+                sslError = ERR_get_error();
+                ERR_clear_error();
+            }
+        });
 
-        /* S/MIME certificate
-         *
-         * Open a certificate file and create a source BIO for further
-         * processing
-         */
-        BIO_ptr tbio1(BIO_new_file(cert.string().c_str(), "r"), bioDeleter);
-        if (!tbio1) {
-            handleSSLError();
+        if (status == SignerPool::Status::FULL) {
+            std::string logmsg = "Signing queue full. Deferring mail for "
+                                 "email address <" + mailFrom + ">";
+
+            std::cerr << "Error: " << logmsg << std::endl;
+            syslog(LOG_WARNING, "%s", logmsg.c_str());
+            client->genericError = true;
             return;
         }
 
-        /*
-         * Use the tbio1 BIO and read in a PEM formated x509 certificate
-         */
-        X509_ptr scert(PEM_read_bio_X509(tbio1.get(), nullptr, 0, nullptr),
-                       x509Deleter);
-        if (!scert) {
-            handleSSLError();
+        if (der.empty()) {
+            handleSSLError(sslError);
             return;
         }
 
-        /* S/MIME key
-         *
-         * Open another BIO source for the key file
-         */
-        BIO_ptr tbio2(BIO_new_file(key.string().c_str(), "r"), bioDeleter);
-        if (!tbio2) {
+        std::string boundary = makeBoundary();
+        if (boundary.empty()) {
             handleSSLError();
             return;
         }
 
         /*
-         * Use the tbio2 BIO and read in a PEM formated key
+         * Add the top-level headers of the multipart/signed message. With
+         * more than one signer, micalg lists all digest algorithms, RFC5751
          */
-        EVP_PKEY_ptr skey(
-                PEM_read_bio_PrivateKey(tbio2.get(), nullptr, 0, nullptr),
-                evpPkeyDeleter);
-        if (!skey) {
-            handleSSLError();
-            return;
+        std::vector<std::string> algorithms;
+        for (auto &it : signers) {
+            std::string name = micalg(it.md);
+            if (std::find(algorithms.begin(), algorithms.end(), name)
+                == algorithms.end())
+                algorithms.push_back(name);
         }
 
-        /*
-         * Load intermediate certificates if available
-         */
-        if (::debug)
-            std::cout << "-> loadIntermediate()" << std::endl;
-        STACK_OF_X509_ptr chain(loadIntermediate(cert.string()));
-        if (::debug)
-            std::cout << "<- loadIntermediate()" << std::endl;
+        HeaderPlan::headers_t newHeaders = {
+                {"MIME-Version", "1.0"},
+                {"Content-Type",
+                        "multipart/signed; "
+                        "protocol=\"application/x-pkcs7-signature\"; "
+                        "micalg=\"" + boost::algorithm::join(algorithms, ",")
+                        + "\"; boundary=\"" + boundary + "\""}
+        };
 
         /*
-         * Create a source BIO with the mail content stored earlier in a
-         * temporary file
+         * The original MIME headers move into the signed body part. The
+         * header of this milter is handled by the caller
          */
-        BIO_ptr in(BIO_new_file(client->getTempFile().c_str(), "r"),
-                   bioDeleter);
-        if (!in) {
-            handleSSLError();
-            return;
-        }
+        mlt::markedHeaders_t oldHeaders;
+        for (auto &it : client->markedHeaders)
+            if (it.kind != mlt::HeaderKind::OWN)
+                oldHeaders.push_back(it);
 
-        /*
-         * Use all the source BIOs and generate a signed PKCS#7 data structure
-         */
-        PKCS7_ptr p7(PKCS7_sign(scert.get(), skey.get(), chain.get(), in.get(),
-                                flags),
-                     pkcs7Deleter);
-        if (!p7) {
-            handleSSLError();
+        HeaderPlan plan(oldHeaders, newHeaders);
+        if (plan.apply(ctx) == MI_FAILURE) {
+            client->genericError = true;
             return;
         }
 
         /*
-         * Create a new memory BIO sink
+         * Write the new body: the signed content from the spool as the
+         * first part and the signature as the second part
          */
-        BIO_ptr out(BIO_new(BIO_s_mem()), bioDeleter);
-        if (!out) {
-            handleSSLError();
+        BodyWriter body(ctx, BodyWriter::getChunkSize());
+
+        std::string head = "This is an S/MIME signed message\r\n\r\n--"
+                           + boundary + "\r\n";
+        if (!body.write(head.data(), head.size())
+            || !writeContent(body)
+            || !writeSignature(body, boundary, der)
+            || !body.flush()) {
+            client->genericError = true;
             return;
         }
 
-        /*
-         * Adds the appropriate MIME headers to a PKCS#7 structure to produce
-         * an S/MIME message. The result is placed in the BIO sink 'out'
-         */
-        if (!SMIME_write_PKCS7(out.get(), p7.get(), in.get(), flags)) {
-            handleSSLError();
-            return;
-        }
+        // Successfully signed an email
+        smimeSigned = true;
+
+        if (::debug)
+            std::cout << "\tReplaced body with " << body.written()
+                      << " bytes" << std::endl;
+    }
+
+    // Private
+
+    bool Smime::createSignature(const std::vector<Signer> &signers,
+                                std::vector<unsigned char> &der) {
+        int flags = CMS_DETACHED | CMS_PARTIAL | CMS_BINARY;
 
         /*
-         * Remove original headers
+         * Create an empty detached SignedData structure
          */
-        for (auto &it : client->markedHeaders) {
-            if (removeHeader(it.first) == MI_FAILURE) {
-                std::cerr << "Error: Unable to remove header " << it.first
-                           << std::endl;
-                client->genericError = true;
-                return;
-            }
-        }
+        CMS_ContentInfo_ptr cms(CMS_sign(nullptr, nullptr, nullptr, nullptr,
+                                         flags),
+                                cmsContentInfoDeleter);
+        if (!cms)
+            return false;
 
-        while (true) {
-            char line[max_header_length];
-            split_t header;
+        std::vector<X509 *> certs;
 
-            if (BIO_gets(out.get(), line, max_header_length) < 0) {
-                std::cerr << "Error: Reading header line from BIO"
-                          << std::endl;
-                handleSSLError();
-                return;
+        for (auto &it : signers) {
+            const Credentials &creds = *it.creds;
+
+            /*
+             * Add the intermediate certificates. Signers may share them
+             */
+            certs.push_back(creds.cert.get());
+            for (int i = 0; creds.chain && i < sk_X509_num(creds.chain.get());
+                 i++) {
+                X509 *x509 = sk_X509_value(creds.chain.get(), i);
+                if (std::any_of(certs.begin(), certs.end(), [x509](X509 *x) {
+                        return X509_cmp(x, x509) == 0;
+                    }))
+                    continue;
+                if (!CMS_add1_cert(cms.get(), x509))
+                    return false;
+                certs.push_back(x509);
             }
 
             /*
-             * Found empty line
-             *
-             * Normally we would expect CRLF, but the BIO currently only
-             * contains a LF at the end of header lines.
+             * Add the signer. The digest algorithm must be the one that was
+             * used for the content digest
              */
-            if ((strcmp(line, "\n") == 0) || (strcmp(line, "\r\n")) == 0)
-                break;
+            CMS_SignerInfo *si = CMS_add1_signer(
+                    cms.get(), creds.cert.get(), creds.key.get(), it.md,
+                    flags);
+            if (si == nullptr)
+                return false;
 
-            // Add PKCS#7 header to message
-            split(header, line, is_any_of(":"), token_compress_on);
-            if (header.size() != 2) {
-                std::cerr << "Error: Broken header line in PKCS#7"
-                          << std::endl;
-                client->genericError = true;
-                return;
-            }
-            // Remove white space
-            trim(header.at(1));
-            if (addHeader(header.at(0), header.at(1)) == MI_FAILURE) {
-                std::cerr << "Error: Unable to add header " << header.at(0)
-                          << std::endl;
-                client->genericError = true;
-                return;
+            /*
+             * CMS_add1_signer() does not know the signature algorithm for
+             * Ed25519 keys, RFC8419
+             */
+            if (EVP_PKEY_id(creds.key.get()) == EVP_PKEY_ED25519) {
+                X509_ALGOR *alg = nullptr;
+                CMS_SignerInfo_get0_algs(si, nullptr, nullptr, nullptr, &alg);
+                if (alg == nullptr
+                    || !X509_ALGOR_set0(alg, OBJ_nid2obj(NID_ED25519),
+                                        V_ASN1_UNDEF, nullptr))
+                    return false;
             }
+
+            /*
+             * Add the precomputed message digest, the content type and the
+             * signing time and sign the signed attributes
+             */
+            std::unique_ptr<ASN1_TIME, decltype(&ASN1_TIME_free)> now(
+                    X509_gmtime_adj(nullptr, 0), ASN1_TIME_free);
+            if (!now)
+                return false;
+
+            if (CMS_signed_add1_attr_by_NID(
+                        si, NID_pkcs9_contentType, V_ASN1_OBJECT,
+                        OBJ_nid2obj(NID_pkcs7_data), -1) <= 0
+                || CMS_signed_add1_attr_by_NID(
+                        si, NID_pkcs9_signingTime, now->type, now.get(),
+                        -1) <= 0
+                || CMS_signed_add1_attr_by_NID(
+                        si, NID_pkcs9_messageDigest, V_ASN1_OCTET_STRING,
+                        it.digest.data(),
+                        static_cast<int>(it.digest.size())) <= 0
+                || !signAttributes(si, creds, it.md))
+                return false;
         }
 
         /*
-         * Set the BIO sink to a character array 'outmem'. Close the sink
-         * afterwards. The result is now stored in the character array
+         * DER encode the signature for the application/pkcs7-signature part
          */
-        BUF_MEM *outmem = nullptr;
-        BIO_get_mem_ptr(out.get(), &outmem);
-        if (outmem == nullptr) {
-            std::cerr << "Error: Unable to get body from PKCS#7"
-                      << std::endl;
-            handleSSLError();
-            return;
-        } else
-            (void) BIO_set_close(out.get(), BIO_NOCLOSE);
-
-        // Finally replace the body
-        if (smfi_replacebody(
-                ctx,
-                (unsigned char *) (outmem->data),
-                (int) outmem->length) == MI_FAILURE) {
-            std::cerr << "Error: Could not replace message body"
-                      << std::endl;
-            client->genericError = true;
-        } else {
-            // Successfully signed an email
-            smimeSigned = true;
-        }
+        int derlen = i2d_CMS_ContentInfo(cms.get(), nullptr);
+        if (derlen <= 0)
+            return false;
 
-        // Cleanup
-        if (outmem) {
-            BUF_MEM_free(outmem);
-            if (::debug)
-                std::cout << "\tBUF_MEM_free() called" << std::endl;
-        }
-    }
+        std::vector<unsigned char> result(static_cast<std::size_t>(derlen));
+        unsigned char *derp = result.data();
+        if (i2d_CMS_ContentInfo(cms.get(), &derp) != derlen)
+            return false;
 
-    // Private
+        der.swap(result);
 
-    int Smime::addHeader(const std::string &headerk,
-                         const std::string &headerv) {
-        return smfi_chgheader(ctx,
-                              util::ccp(headerk.c_str()),
-                              0,
-                              util::ccp(headerv.c_str()));
+        return true;
     }
 
-    int Smime::removeHeader(const std::string &headerk) {
-        return smfi_chgheader(ctx, util::ccp(headerk.c_str()), 1, nullptr);
-    }
+    bool Smime::signAttributes(CMS_SignerInfo *si, const Credentials &creds,
+                               const EVP_MD *md) {
+        /*
+         * The signature covers the DER encoded SET OF signed attributes.
+         * DER requires the encoded elements to be sorted
+         */
+        std::vector<std::vector<unsigned char>> attributes;
+        std::size_t total = 0;
 
-    void Smime::handleSSLError(void) {
-        auto *client = util::mlfipriv(ctx);
-        u_long e = ERR_get_error();
-        char buf[120];
-        (void) ERR_error_string(e, buf);
+        for (int i = 0; i < CMS_signed_get_attr_count(si); i++) {
+            X509_ATTRIBUTE *attr = CMS_signed_get_attr(si, i);
+            int len = i2d_X509_ATTRIBUTE(attr, nullptr);
+            if (len <= 0)
+                return false;
 
-        std::cerr << "Error: Signing data: " << buf << std::endl;
-        syslog(LOG_ERR, "%s", buf);
+            std::vector<unsigned char> encoded(static_cast<std::size_t>(len));
+            unsigned char *p = encoded.data();
+            i2d_X509_ATTRIBUTE(attr, &p);
 
-        client->genericError = true;
+            total += encoded.size();
+            attributes.push_back(std::move(encoded));
+        }
+        std::sort(attributes.begin(), attributes.end());
+
+        std::vector<unsigned char> tbs;
+        tbs.push_back(V_ASN1_SET | V_ASN1_CONSTRUCTED);
+        if (total < 0x80) {
+            tbs.push_back(static_cast<unsigned char>(total));
+        } else {
+            std::vector<unsigned char> length;
+            for (std::size_t n = total; n > 0; n >>= 8)
+                length.insert(length.begin(),
+                              static_cast<unsigned char>(n & 0xff));
+            tbs.push_back(static_cast<unsigned char>(0x80 | length.size()));
+            tbs.insert(tbs.end(), length.begin(), length.end());
+        }
+        for (auto &it : attributes)
+            tbs.insert(tbs.end(), it.begin(), it.end());
+
+        std::vector<unsigned char> sig;
+        bool done;
+
+        // Keys in the signer process never enter the milter
+        if (!creds.remoteKey.empty())
+            done = SignClient::sign(creds.remoteCert, creds.remoteKey, md,
+                                    tbs.data(), tbs.size(), sig);
+        else
+            done = signData(creds, md, tbs.data(), tbs.size(), sig);
+
+        return done
+               && ASN1_STRING_set(CMS_SignerInfo_get0_signature(si),
+                                  sig.data(),
+                                  static_cast<int>(sig.size())) == 1;
     }
 
-    STACK_OF_X509_ptr Smime::loadIntermediate(const std::string &file) {
-        int num;
-        int numCerts;
+    bool Smime::signData(const Credentials &creds, const EVP_MD *md,
+                         const unsigned char *data, std::size_t len,
+                         std::vector<unsigned char> &sig) {
+        // Keys in a token sign with the token
+        if (creds.token)
+            return Pkcs11::sign(*creds.token, md, data, len, sig);
 
-        // Dummy return statement aka nullptr
-        STACK_OF_X509_ptr empty(nullptr, stackOfX509Deleter);
+        EVP_PKEY *key = creds.key.get();
 
         /*
-         * Create a BIO source for the chain file
+         * Ed25519 signs the data itself and takes no digest
          */
-        BIO_ptr bio(BIO_new_file(file.c_str(), "r"), bioDeleter);
-        if (!bio) {
-            handleSSLError();
-            if (::debug)
-                std::cout << "\t!bio" << std::endl;
-            return empty;
-        }
+        if (EVP_PKEY_id(key) == EVP_PKEY_ED25519)
+            md = nullptr;
+
+        std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)> mdctx(
+                EVP_MD_CTX_new(), EVP_MD_CTX_free);
+        std::size_t siglen = 0;
+        if (!mdctx
+            || EVP_DigestSignInit(mdctx.get(), nullptr, md, nullptr,
+                                  key) != 1
+            || EVP_DigestSign(mdctx.get(), nullptr, &siglen, data, len) != 1)
+            return false;
+
+        sig.resize(siglen);
+        if (EVP_DigestSign(mdctx.get(), sig.data(), &siglen, data, len) != 1)
+            return false;
+        sig.resize(siglen);
+
+        return true;
+    }
 
-        /*
-         * Load the certificates from the source BIO 'bio' onto the stack
-         */
-        STACK_OF_X509_INFO_ptr stackInfo(PEM_X509_INFO_read_bio(
-                bio.get(), nullptr, nullptr, nullptr), stackOfX509InfoDeleter);
-        if (!stackInfo) {
-            handleSSLError();
-            if (::debug)
-                std::cout << "\t!stackInfo" << std::endl;
-            return empty;
+    bool Smime::signContent(const std::vector<credentials_t> &creds,
+                            const unsigned char *data, std::size_t len,
+                            std::vector<unsigned char> &der) {
+        std::vector<Signer> signers;
+
+        for (auto &it : creds) {
+            Signer signer;
+            signer.creds = it;
+            signer.md = it->digest();
+
+            unsigned char md[EVP_MAX_MD_SIZE];
+            unsigned int mdlen = 0;
+            if (signer.md == nullptr
+                || EVP_Digest(data, len, md, &mdlen, signer.md,
+                              nullptr) != 1)
+                return false;
+            signer.digest.assign(md, md + mdlen);
+
+            signers.push_back(std::move(signer));
         }
 
-        /*
-         * Count the number of certificates that are on the stack
-         */
-        num = sk_X509_INFO_num(stackInfo.get());
-        if(num < 0) {
-            if (::debug)
-                std::cout << "\tnum<0" << std::endl;
-            return empty;
+        return createSignature(signers, der);
+    }
+
+    bool Smime::digestContent(const EVP_MD *type, unsigned char *md,
+                              unsigned int *mdlen) {
+        auto *client = util::mlfipriv(ctx);
+        std::vector<char> buffer(65536);
+
+        std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)> mdctx(
+                EVP_MD_CTX_new(), EVP_MD_CTX_free);
+        if (!mdctx || EVP_DigestInit_ex(mdctx.get(), type, nullptr) != 1)
+            return false;
+
+        BIO_ptr in(client->content.newBio(), bioDeleter);
+        if (!in)
+            return false;
+
+        int n;
+        while ((n = BIO_read(in.get(), buffer.data(),
+                             static_cast<int>(buffer.size()))) > 0) {
+            if (EVP_DigestUpdate(mdctx.get(), buffer.data(),
+                                 static_cast<std::size_t>(n)) != 1)
+                return false;
+        }
+        if (n < 0) {
+            std::cerr << "Error: Unable to read message content" << std::endl;
+            return false;
         }
 
-        /*
-         * Create empty stack of x509 certificates
-         */
-        STACK_OF_X509_ptr stack(sk_X509_new_null(), stackOfX509Deleter);
-        if (!stack) {
-            handleSSLError();
-            if (::debug)
-                std::cout << "\t!stack" << std::endl;
-            return empty;
+        return EVP_DigestFinal_ex(mdctx.get(), md, mdlen) == 1;
+    }
+
+    std::string Smime::makeBoundary(void) {
+        unsigned char random[16];
+        char hex[sizeof(random) * 2 + 1];
+
+        if (RAND_bytes(random, sizeof(random)) != 1)
+            return std::string();
+
+        for (std::size_t i = 0; i < sizeof(random); i++)
+            snprintf(hex + i * 2, 3, "%02X", random[i]);
+
+        return "----" + std::string(hex);
+    }
+
+    std::string Smime::micalg(const EVP_MD *md) {
+        switch (EVP_MD_type(md)) {
+            case NID_sha1:
+                return "sha1";
+            case NID_sha224:
+                return "sha-224";
+            case NID_sha256:
+                return "sha-256";
+            case NID_sha384:
+                return "sha-384";
+            case NID_sha512:
+                return "sha-512";
+            default:
+                return "unknown";
         }
+    }
+
+    bool Smime::writeContent(BodyWriter &body) {
+        auto *client = util::mlfipriv(ctx);
+        std::vector<char> buffer(BodyWriter::getChunkSize() > 0
+                                 ? BodyWriter::getChunkSize() : 65536);
 
         /*
-         * Load each certificate from the info stack onto our x509 stack. We
-         * skip the first certificate, because we only want intermediate
-         * certificates and we must prevent the PKCS#7 call from loading a
-         * duplicate S/MIME certificate, as this leads to a segmentation
-         * fault. We expect a correct sorted certificate order!
+         * The spool holds the canonical content that was digested. It is
+         * copied byte by byte
          */
-        bool first_cert_in_file = true;
-        while (sk_X509_INFO_num(stackInfo.get())) {
-            X509_INFO_ptr xi(sk_X509_INFO_shift(stackInfo.get()),
-                             x509InfoDeleter);
-            if (first_cert_in_file) {
-                first_cert_in_file = false;
-                continue;  // Never load the main certificate onto the stack!
-            }
-            if (xi->x509 != nullptr) {
-                sk_X509_push(stack.get(), xi->x509);
-                xi->x509 = nullptr;
-            }
+        BIO_ptr in(client->content.newBio(), bioDeleter);
+        if (!in)
+            return false;
+
+        int n;
+        while ((n = BIO_read(in.get(), buffer.data(),
+                             static_cast<int>(buffer.size()))) > 0) {
+            if (!body.write(buffer.data(), static_cast<std::size_t>(n)))
+                return false;
+        }
+        if (n < 0) {
+            std::cerr << "Error: Unable to read message content" << std::endl;
+            return false;
         }
 
+        return true;
+    }
+
+    bool Smime::writeSignature(BodyWriter &body, const std::string &boundary,
+                               const std::vector<unsigned char> &der) {
+        std::string part = "\r\n--" + boundary + "\r\n"
+                "Content-Type: application/x-pkcs7-signature; "
+                "name=\"smime.p7s\"\r\n"
+                "Content-Transfer-Encoding: base64\r\n"
+                "Content-Disposition: attachment; "
+                "filename=\"smime.p7s\"\r\n\r\n";
+
         /*
-         * Only return the stack, if there were any certificates in the chain.
-         * Otherwise use our empty stack dummy
+         * Base64 with lines of 64 characters
          */
-        numCerts = sk_X509_num(stack.get());
-        if(numCerts == 0) {
-            if (::debug)
-                std::cout << "\tstack empty" << std::endl;
-            stack = std::move(empty);
+        unsigned char line[65];
+        for (std::size_t pos = 0; pos < der.size(); pos += 48) {
+            std::size_t len = der.size() - pos < 48 ? der.size() - pos : 48;
+            int n = EVP_EncodeBlock(line, der.data() + pos,
+                                    static_cast<int>(len));
+            part.append(reinterpret_cast<char *>(line),
+                        static_cast<std::size_t>(n));
+            part.append("\r\n");
         }
 
-        return stack;
+        part += "\r\n--" + boundary + "--\r\n\r\n";
+
+        return body.write(part.data(), part.size());
+    }
+
+    void Smime::handleSSLError(void) {
+        handleSSLError(ERR_get_error());
+    }
+
+    void Smime::handleSSLError(u_long e) {
+        auto *client = util::mlfipriv(ctx);
+        char buf[120];
+        (void) ERR_error_string(e, buf);
+
+        std::cerr << "Error: Signing data: " << buf << std::endl;
+        syslog(LOG_ERR, "%s", buf);
+
+        client->genericError = true;
     }
 
     // Wrapper functions
@@ -485,19 +661,19 @@ namespace smime {
         }
     }
 
-    void pkcs7Deleter(PKCS7 *ptr) {
+    void cmsContentInfoDeleter(CMS_ContentInfo *ptr) {
         if (ptr != nullptr) {
-            PKCS7_free(ptr);
+            CMS_ContentInfo_free(ptr);
             if (::debug)
-                std::cout << "\tPKCS7_free() called" << std::endl;
+                std::cout << "\tCMS_ContentInfo_free() called" << std::endl;
         }
     }
 
     void stackOfX509Deleter(STACK_OF(X509) *ptr) {
         if (ptr != nullptr) {
-            sk_X509_free(ptr);
+            sk_X509_pop_free(ptr, X509_free);
             if (::debug)
-                std::cout << "\tsk_X509_free() called" << std::endl;
+                std::cout << "\tsk_X509_pop_free() called" << std::endl;
         }
     }
 
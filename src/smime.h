@@ -12,6 +12,7 @@
 #define SRC_SMIME_H_
 
 #include <libmilter/mfapi.h>
+#include <openssl/cms.h>
 #include <openssl/pem.h>
 
 #include <string>
@@ -19,35 +20,41 @@
 #include <fstream>
 #include <memory>
 #include <vector>
-#include <boost/algorithm/string.hpp>
+
+#include "bodywriter.h"
 
 void init_openssl(void);
 void deinit_openssl(void);
 
 namespace smime {
-    using boost::split;
-    using boost::trim;
-    using boost::is_any_of;
-    using boost::token_compress_on;
-
-    using split_t =  std::vector<std::string>;
+    /*!
+     * @brief A digest algorithm by its NID
+     *
+     * SHA-256, SHA-384 and SHA-512 are fetched once in init_openssl().
+     */
+    const EVP_MD *getDigest(int);
 
     // Wrapper functions
     void bioDeleter(BIO *);
     void x509Deleter(X509 *);
     void x509InfoDeleter(X509_INFO *);
     void evpPkeyDeleter(EVP_PKEY *);
-    void pkcs7Deleter(PKCS7 *);
+    void cmsContentInfoDeleter(CMS_ContentInfo *);
     void stackOfX509Deleter(STACK_OF(X509) *);
     void stackOfX509InfoDeleter(STACK_OF(X509_INFO) *);
 
+    // Defined in credcache.h
+    struct Credentials;
+    using credentials_t = std::shared_ptr<const Credentials>;
+
     // Type definitions for OpenSSL
     using BIO_ptr = std::unique_ptr<BIO, decltype(&bioDeleter)>;
     using X509_ptr = std::unique_ptr<X509, decltype(&x509Deleter)>;
     using X509_INFO_ptr = std::unique_ptr<X509_INFO,
             decltype(&x509InfoDeleter)>;
     using EVP_PKEY_ptr = std::unique_ptr<EVP_PKEY, decltype(&evpPkeyDeleter)>;
-    using PKCS7_ptr = std::unique_ptr<PKCS7, decltype(&pkcs7Deleter)>;
+    using CMS_ContentInfo_ptr = std::unique_ptr<CMS_ContentInfo,
+            decltype(&cmsContentInfoDeleter)>;
     using STACK_OF_X509_ptr = std::unique_ptr<STACK_OF(X509),
             decltype(&stackOfX509Deleter)>;
     using STACK_OF_X509_INFO_ptr = std::unique_ptr<STACK_OF(X509_INFO),
@@ -78,22 +85,91 @@ namespace smime {
          */
         void sign(void);
 
+        /*!
+         * @brief Sign data with a key file or a key in a token
+         *
+         * The signer process uses this for the requests of the milter.
+         */
+        static bool signData(const Credentials &, const EVP_MD *,
+                             const unsigned char *, std::size_t,
+                             std::vector<unsigned char> &);
+
+        /*!
+         * @brief Create a detached signature for content in memory
+         *
+         * The same DER encoded SignedData structure as for a mail, with one
+         * signer per key and the digest of each key. Used to check the
+         * signatures.
+         */
+        static bool signContent(const std::vector<credentials_t> &,
+                                const unsigned char *, std::size_t,
+                                std::vector<unsigned char> &);
+
     private:
         /*!
-         * @brief Add headers that were generated in sign()
+         * @brief One key that signs the message
+         */
+        struct Signer {
+            //! @brief Certificate, key and chain
+            credentials_t creds;
+
+            //! @brief The digest algorithm for the key
+            const EVP_MD *md = nullptr;
+
+            //! @brief The content digest
+            std::vector<unsigned char> digest;
+        };
+
+        /*!
+         * @brief Create the DER encoded detached signature
          *
-         * When a message was signed, new headers need to be added to the
-         * message.
+         * The SignedData structure has one SignerInfo for each signer. This
+         * is run by a thread of the signing pool. If it fails, the OpenSSL
+         * error queue of that thread holds the reason.
          */
-        int addHeader(const std::string &, const std::string &);
+        static bool createSignature(const std::vector<Signer> &,
+                                    std::vector<unsigned char> &);
 
         /*!
-         * @brief Remove headers from original mail
+         * @brief Sign the signed attributes of a SignerInfo
          *
-         * When signing, new headers are generated and existing ones are
-         * embedded inside the new message body.
+         * CMS_SignerInfo_sign() can not handle Ed25519 keys, keys in a token
+         * or keys in the signer process, so the signature is created here
+         * for all key types.
          */
-        int removeHeader(const std::string &);
+        static bool signAttributes(CMS_SignerInfo *, const Credentials &,
+                                   const EVP_MD *);
+
+        /*!
+         * @brief Compute a content digest from the spooled content
+         *
+         * Used for digest algorithms that were not computed while the
+         * message was received.
+         */
+        bool digestContent(const EVP_MD *, unsigned char *, unsigned int *);
+
+        /*!
+         * @brief Create a random MIME boundary
+         *
+         * @return An empty string, if no random data was available
+         */
+        static std::string makeBoundary(void);
+
+        /*!
+         * @brief The micalg parameter for a digest algorithm, RFC5751
+         */
+        static std::string micalg(const EVP_MD *);
+
+        /*!
+         * @brief Copy the signed content from the spool to the new body
+         */
+        bool writeContent(BodyWriter &);
+
+        /*!
+         * @brief Write the signature part and the closing boundary
+         */
+        bool writeSignature(BodyWriter &, const std::string &,
+                            const std::vector<unsigned char> &);
 
         /*!
          * @brief Error handler for S/MIME signing problems
@@ -104,15 +180,9 @@ namespace smime {
         void handleSSLError(void);
 
         /*!
-         * @brief Load intermediate S/MIME certificates
-         *
-         * The S/MIME certificate may have several intermediate certficates
-         * concatenated. Try to load them for signing.
-         *
-         * As this function uses a jump label, the code is separated from the
-         * main signing routine sign().
+         * @brief Error handler for an error code from another thread
          */
-        STACK_OF_X509_ptr loadIntermediate(const std::string &);
+        void handleSSLError(u_long);
 
         /*!
          * @brief The current client context that was created on connect
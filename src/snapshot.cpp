@@ -0,0 +1,553 @@
+/*! @file snapshot.cpp
+ *
+ * @brief Binary snapshot of parsed signing credentials
+ *
+ * @author Christian Roessner <c@roessner.co>
+ * @version 1607.1.4
+ * @date 2016-06-10
+ * @copyright Copyright 2016 Christian Roessner <c@roessner.co>
+ */
+
+#include "snapshot.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <syslog.h>
+
+#include <openssl/err.h>
+#include <openssl/x509.h>
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <set>
+
+#include "certpool.h"
+#include "pkcs11.h"
+
+namespace smime {
+    //! @brief This lock protects the current region
+    static std::mutex snapshotLock;
+
+    //! @brief Magic bytes at the beginning of a snapshot file
+    static const char snapMagic[8] = {'S', 'I', 'G', 'H', 'S', 'N', 'A', 'P'};
+
+    //! @brief Format version. Increase on every layout change
+    static const std::uint32_t snapVersion = 1;
+
+    /*
+     * On-disk layout. All offsets are relative to the beginning of the file.
+     * The file is only read on the host that wrote it, so native byte order
+     * is used.
+     *
+     * SnapHeader
+     * SnapBlob[certs]          Deduplicated intermediate certificates
+     * SnapIndex[records]       Sorted by id (cert path '\0' key path)
+     * SnapRecord, uint32_t[chainCount] chain references, for each record
+     * Blob data
+     */
+
+    struct SnapHeader {
+        char magic[8];
+        std::uint32_t version;
+        std::uint32_t records;
+        std::uint32_t certs;
+        std::uint32_t reserved;
+        std::uint64_t certOffset;
+        std::uint64_t indexOffset;
+        std::uint64_t size;
+    };
+
+    struct SnapBlob {
+        std::uint64_t offset;
+        std::uint32_t length;
+        std::uint32_t reserved;
+    };
+
+    struct SnapStamp {
+        std::uint64_t dev;
+        std::uint64_t ino;
+        std::int64_t size;
+        std::int64_t mtime;
+        std::int64_t ctime;
+    };
+
+    struct SnapIndex {
+        SnapBlob id;
+        std::uint64_t record;
+    };
+
+    struct SnapRecord {
+        SnapStamp certStamp;
+        SnapStamp keyStamp;
+        SnapBlob cert;
+        SnapBlob key;
+        std::uint32_t chainCount;
+        std::uint32_t reserved;
+    };
+
+    /*!
+     * @brief Read a structure from an unaligned position
+     */
+    template <typename T>
+    static T readAt(const char *data, std::uint64_t offset) {
+        T result;
+        std::memcpy(&result, data + offset, sizeof(T));
+        return result;
+    }
+
+    /*!
+     * @brief Append a structure to a buffer
+     */
+    template <typename T>
+    static void append(std::string &buf, const T &value) {
+        buf.append(reinterpret_cast<const char *>(&value), sizeof(T));
+    }
+
+    static SnapStamp toSnapStamp(const FileStamp &stamp) {
+        SnapStamp result;
+
+        result.dev = static_cast<std::uint64_t>(stamp.dev);
+        result.ino = static_cast<std::uint64_t>(stamp.ino);
+        result.size = static_cast<std::int64_t>(stamp.size);
+        result.mtime = static_cast<std::int64_t>(stamp.mtime);
+        result.ctime = static_cast<std::int64_t>(stamp.ctime);
+
+        return result;
+    }
+
+    static bool sameStamp(const SnapStamp &stored, const FileStamp &stamp) {
+        SnapStamp now = toSnapStamp(stamp);
+
+        return std::memcmp(&stored, &now, sizeof(SnapStamp)) == 0;
+    }
+
+    static bool inside(std::uint64_t offset, std::uint64_t length,
+                       std::size_t size) {
+        return offset <= size && length <= size - offset;
+    }
+
+    // Public
+
+    void Snapshot::open(const std::string &file) {
+        region_t fresh;
+
+        int fd = ::open(file.c_str(), O_RDONLY);
+        if (fd != -1) {
+            struct stat st;
+            if (fstat(fd, &st) == 0 && st.st_size > 0) {
+                void *addr = mmap(nullptr, static_cast<std::size_t>(st.st_size),
+                                  PROT_READ, MAP_SHARED, fd, 0);
+                if (addr != MAP_FAILED) {
+                    fresh = std::make_shared<const Region>(
+                            addr, static_cast<std::size_t>(st.st_size));
+                    if (!validate(*fresh)) {
+                        std::cerr << "Error: Ignoring damaged snapshot "
+                                  << file << std::endl;
+                        fresh.reset();
+                    }
+                }
+            }
+            ::close(fd);
+        }
+
+        if (::debug)
+            std::cout << "Snapshot " << file
+                      << (fresh ? " mapped" : " not available") << std::endl;
+
+        std::lock_guard<std::mutex> guard(snapshotLock);
+        region = fresh;
+    }
+
+    void Snapshot::close(void) {
+        std::lock_guard<std::mutex> guard(snapshotLock);
+        region.reset();
+    }
+
+    credentials_t Snapshot::decode(const std::string &cert,
+                                   const std::string &key,
+                                   const FileStamp &certStamp,
+                                   const FileStamp &keyStamp) {
+        region_t current;
+        {
+            std::lock_guard<std::mutex> guard(snapshotLock);
+            current = region;
+        }
+        if (!current)
+            return nullptr;
+
+        std::uint64_t offset = find(*current, cert + '\0' + key);
+        if (offset == 0
+            || !Snapshot::current(*current, offset, certStamp, keyStamp))
+            return nullptr;
+
+        const char *data = current->data;
+        auto record = readAt<SnapRecord>(data, offset);
+        auto header = readAt<SnapHeader>(data, 0);
+        auto entry = std::make_shared<Credentials>();
+
+        entry->certStamp = certStamp;
+        entry->keyStamp = keyStamp;
+
+        auto p = reinterpret_cast<const unsigned char *>(
+                data + record.cert.offset);
+        entry->cert.reset(d2i_X509(nullptr, &p, record.cert.length));
+        if (!entry->cert)
+            return nullptr;
+
+        p = reinterpret_cast<const unsigned char *>(data + record.key.offset);
+        entry->key.reset(d2i_AutoPrivateKey(nullptr, &p, record.key.length));
+        if (!entry->key)
+            return nullptr;
+
+        if (record.chainCount > 0) {
+            STACK_OF_X509_ptr stack(sk_X509_new_null(), stackOfX509Deleter);
+            if (!stack)
+                return nullptr;
+
+            std::uint64_t refs = offset + sizeof(SnapRecord);
+            for (std::uint32_t i = 0; i < record.chainCount; i++) {
+                auto ref = readAt<std::uint32_t>(
+                        data, refs + i * sizeof(std::uint32_t));
+                auto blob = readAt<SnapBlob>(
+                        data, header.certOffset + ref * sizeof(SnapBlob));
+
+                p = reinterpret_cast<const unsigned char *>(
+                        data + blob.offset);
+                X509 *x509 = d2i_X509(nullptr, &p, blob.length);
+                if (x509 == nullptr)
+                    return nullptr;
+
+                // Share the certificate with all other senders
+                x509 = IntermediatePool::intern(x509);
+                if (sk_X509_push(stack.get(), x509) == 0) {
+                    X509_free(x509);
+                    return nullptr;
+                }
+            }
+            entry->chain = std::move(stack);
+        }
+
+        return entry;
+    }
+
+    bool Snapshot::covers(const std::string &cert, const std::string &key) {
+        region_t current;
+        {
+            std::lock_guard<std::mutex> guard(snapshotLock);
+            current = region;
+        }
+        if (!current)
+            return false;
+
+        FileStamp certStamp;
+        FileStamp keyStamp;
+        if (!CredentialCache::stamp(cert, certStamp)
+            || !CredentialCache::stamp(key, keyStamp))
+            return false;
+
+        std::uint64_t offset = find(*current, cert + '\0' + key);
+
+        return offset != 0
+               && Snapshot::current(*current, offset, certStamp, keyStamp);
+    }
+
+    bool Snapshot::covers(const std::vector<mapfile::Entry> &entries) {
+        for (auto &it : entries)
+            if (!covers(it.cert, it.key))
+                return false;
+
+        return true;
+    }
+
+    bool Snapshot::write(const std::string &file,
+                         const std::vector<mapfile::Entry> &entries) {
+        struct Pending {
+            std::string id;
+            SnapStamp certStamp;
+            SnapStamp keyStamp;
+            std::string cert;
+            std::string key;
+            std::vector<std::uint32_t> chain;
+        };
+
+        std::vector<Pending> pending;
+        std::set<std::string> seen;
+        std::vector<std::string> certs;
+        std::map<std::string, std::uint32_t> certIndex;
+
+        auto internDer = [&](const std::string &der) {
+            auto found = certIndex.find(der);
+            if (found != certIndex.end())
+                return found->second;
+            auto ref = static_cast<std::uint32_t>(certs.size());
+            certs.push_back(der);
+            certIndex[der] = ref;
+            return ref;
+        };
+
+        auto toDer = [](X509 *x509) {
+            std::string der;
+            int len = i2d_X509(x509, nullptr);
+            if (len > 0) {
+                der.resize(static_cast<std::size_t>(len));
+                auto p = reinterpret_cast<unsigned char *>(&der[0]);
+                i2d_X509(x509, &p);
+            }
+            return der;
+        };
+
+        for (auto &it : entries) {
+            std::string id = it.cert + '\0' + it.key;
+            bool missing = false;
+
+            if (!seen.insert(id).second)
+                continue;
+
+            // Keys in a token never leave it
+            if (Pkcs11::isUri(it.key))
+                continue;
+
+            // Use the cache. Unchanged entries come from the old snapshot
+            credentials_t creds = CredentialCache::get(it.cert, it.key,
+                                                       missing);
+            if (!creds) {
+                ERR_clear_error();
+                continue;
+            }
+
+            Pending record;
+            record.id = id;
+            record.certStamp = toSnapStamp(creds->certStamp);
+            record.keyStamp = toSnapStamp(creds->keyStamp);
+            record.cert = toDer(creds->cert.get());
+
+            int len = i2d_PrivateKey(creds->key.get(), nullptr);
+            if (len <= 0 || record.cert.empty()) {
+                ERR_clear_error();
+                continue;
+            }
+            record.key.resize(static_cast<std::size_t>(len));
+            auto p = reinterpret_cast<unsigned char *>(&record.key[0]);
+            i2d_PrivateKey(creds->key.get(), &p);
+
+            if (creds->chain) {
+                for (int i = 0; i < sk_X509_num(creds->chain.get()); i++)
+                    record.chain.push_back(internDer(
+                            toDer(sk_X509_value(creds->chain.get(), i))));
+            }
+
+            pending.push_back(std::move(record));
+        }
+
+        std::sort(pending.begin(), pending.end(),
+                  [](const Pending &a, const Pending &b) {
+                      return a.id < b.id;
+                  });
+
+        /*
+         * Compute the layout
+         */
+        std::uint64_t certOffset = sizeof(SnapHeader);
+        std::uint64_t indexOffset = certOffset + certs.size() * sizeof(SnapBlob);
+        std::uint64_t recordOffset = indexOffset
+                                     + pending.size() * sizeof(SnapIndex);
+        std::uint64_t dataOffset = recordOffset;
+        for (auto &it : pending)
+            dataOffset += sizeof(SnapRecord)
+                          + it.chain.size() * sizeof(std::uint32_t);
+
+        std::string tables;
+        std::string records;
+        std::string blobs;
+
+        auto blob = [&](const std::string &content) {
+            SnapBlob result;
+            result.offset = dataOffset + blobs.size();
+            result.length = static_cast<std::uint32_t>(content.size());
+            result.reserved = 0;
+            blobs.append(content);
+            return result;
+        };
+
+        for (auto &it : certs)
+            append(tables, blob(it));
+
+        for (auto &it : pending) {
+            SnapIndex index;
+            index.id = blob(it.id);
+            index.record = recordOffset + records.size();
+            append(tables, index);
+
+            SnapRecord record;
+            record.certStamp = it.certStamp;
+            record.keyStamp = it.keyStamp;
+            record.cert = blob(it.cert);
+            record.key = blob(it.key);
+            record.chainCount = static_cast<std::uint32_t>(it.chain.size());
+            record.reserved = 0;
+            append(records, record);
+            for (auto ref : it.chain)
+                append(records, ref);
+        }
+
+        SnapHeader header;
+        std::memcpy(header.magic, snapMagic, sizeof(snapMagic));
+        header.version = snapVersion;
+        header.records = static_cast<std::uint32_t>(pending.size());
+        header.certs = static_cast<std::uint32_t>(certs.size());
+        header.reserved = 0;
+        header.certOffset = certOffset;
+        header.indexOffset = indexOffset;
+        header.size = dataOffset + blobs.size();
+
+        std::string out;
+        out.reserve(header.size);
+        append(out, header);
+        out.append(tables);
+        out.append(records);
+        out.append(blobs);
+
+        // Never leave keys lying around in a half written file
+        std::string temp = file + ".tmp";
+        int fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if (fd == -1) {
+            perror("Error: Unable to create snapshot");
+            return false;
+        }
+
+        std::size_t written = 0;
+        while (written < out.size()) {
+            ssize_t n = ::write(fd, out.data() + written, out.size() - written);
+            if (n <= 0) {
+                perror("Error: Unable to write snapshot");
+                ::close(fd);
+                unlink(temp.c_str());
+                return false;
+            }
+            written += static_cast<std::size_t>(n);
+        }
+
+        if (fsync(fd) != 0 || ::close(fd) != 0
+            || rename(temp.c_str(), file.c_str()) != 0) {
+            perror("Error: Unable to store snapshot");
+            unlink(temp.c_str());
+            return false;
+        }
+
+        syslog(LOG_NOTICE, "Snapshot written with %lu entries",
+               pending.size());
+        if (::debug)
+            std::cout << "Snapshot " << file << " written with "
+                      << pending.size() << " entries" << std::endl;
+
+        return true;
+    }
+
+    // Private
+
+    Snapshot::Region::Region(void *addr, std::size_t length)
+            : data(static_cast<const char *>(addr)),
+              length(length) { /* empty */ }
+
+    Snapshot::Region::~Region(void) {
+        munmap(const_cast<char *>(data), length);
+    }
+
+    bool Snapshot::validate(const Region &mapped) {
+        const char *data = mapped.data;
+        std::size_t size = mapped.length;
+
+        if (size < sizeof(SnapHeader))
+            return false;
+
+        auto header = readAt<SnapHeader>(data, 0);
+        if (std::memcmp(header.magic, snapMagic, sizeof(snapMagic)) != 0
+            || header.version != snapVersion
+            || header.size != size)
+            return false;
+
+        if (!inside(header.certOffset,
+                    std::uint64_t(header.certs) * sizeof(SnapBlob), size)
+            || !inside(header.indexOffset,
+                       std::uint64_t(header.records) * sizeof(SnapIndex),
+                       size))
+            return false;
+
+        for (std::uint32_t i = 0; i < header.certs; i++) {
+            auto blob = readAt<SnapBlob>(
+                    data, header.certOffset + i * sizeof(SnapBlob));
+            if (!inside(blob.offset, blob.length, size))
+                return false;
+        }
+
+        for (std::uint32_t i = 0; i < header.records; i++) {
+            auto index = readAt<SnapIndex>(
+                    data, header.indexOffset + i * sizeof(SnapIndex));
+            if (!inside(index.id.offset, index.id.length, size)
+                || !inside(index.record, sizeof(SnapRecord), size))
+                return false;
+
+            auto record = readAt<SnapRecord>(data, index.record);
+            if (!inside(record.cert.offset, record.cert.length, size)
+                || !inside(record.key.offset, record.key.length, size)
+                || !inside(index.record + sizeof(SnapRecord),
+                           std::uint64_t(record.chainCount)
+                           * sizeof(std::uint32_t), size))
+                return false;
+
+            for (std::uint32_t j = 0; j < record.chainCount; j++) {
+                auto ref = readAt<std::uint32_t>(
+                        data, index.record + sizeof(SnapRecord)
+                              + j * sizeof(std::uint32_t));
+                if (ref >= header.certs)
+                    return false;
+            }
+        }
+
+        return true;
+    }
+
+    std::uint64_t Snapshot::find(const Region &mapped, const std::string &id) {
+        const char *data = mapped.data;
+        auto header = readAt<SnapHeader>(data, 0);
+
+        std::uint32_t low = 0;
+        std::uint32_t high = header.records;
+
+        while (low < high) {
+            std::uint32_t mid = low + (high - low) / 2;
+            auto index = readAt<SnapIndex>(
+                    data, header.indexOffset + mid * sizeof(SnapIndex));
+
+            int cmp = id.compare(0, std::string::npos,
+                                 data + index.id.offset, index.id.length);
+            if (cmp == 0)
+                return index.record;
+            if (cmp < 0)
+                high = mid;
+            else
+                low = mid + 1;
+        }
+
+        return 0;
+    }
+
+    bool Snapshot::current(const Region &mapped, std::uint64_t offset,
+                           const FileStamp &certStamp,
+                           const FileStamp &keyStamp) {
+        auto record = readAt<SnapRecord>(mapped.data, offset);
+
+        return sameStamp(record.certStamp, certStamp)
+               && sameStamp(record.keyStamp, keyStamp);
+    }
+
+    // Init static
+
+    Snapshot::region_t Snapshot::region = nullptr;
+
+}  // namespace smime
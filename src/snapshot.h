@@ -0,0 +1,125 @@
+/*! @file snapshot.h
+ *
+ * @brief Binary snapshot of parsed signing credentials
+ *
+ * @author Christian Roessner <c@roessner.co>
+ * @version 1607.1.4
+ * @date 2016-06-10
+ * @copyright Copyright 2016 Christian Roessner <c@roessner.co>
+ */
+
+#ifndef SRC_SNAPSHOT_H_
+#define SRC_SNAPSHOT_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "credcache.h"
+#include "mapfile.h"
+
+extern bool debug;
+
+namespace smime {
+    /*!
+     * @brief Fast start file with DER encoded credentials
+     *
+     * Decoding PEM files is the most expensive part of loading a large map
+     * file. The snapshot stores the DER encoded certificate, key and chain of
+     * every map file entry together with the stamps of the source files and
+     * a sorted index. The file is mapped into memory on startup and on
+     * reload. An entry is only decoded, when the credential cache asks for
+     * it and its source files did not change. If any source file changed,
+     * a new snapshot is written.
+     *
+     * The file contains unencrypted private keys. It is created with mode
+     * 0600.
+     */
+    class Snapshot {
+    public:
+        /*!
+         * @brief Map a snapshot file into memory
+         *
+         * A previously mapped snapshot is released. If the file does not
+         * exist or is damaged, no snapshot is used.
+         */
+        static void open(const std::string &);
+
+        /*!
+         * @brief Release the current snapshot
+         */
+        static void close(void);
+
+        /*!
+         * @brief Decode credentials from the snapshot
+         *
+         * @return nullptr, if there is no entry for certificate and key or
+         * if the source files changed since the snapshot was written
+         */
+        static credentials_t decode(const std::string &, const std::string &,
+                                    const FileStamp &, const FileStamp &);
+
+        /*!
+         * @brief The snapshot has a current entry for certificate and key
+         */
+        static bool covers(const std::string &, const std::string &);
+
+        /*!
+         * @brief The snapshot has current entries for all map file entries
+         */
+        static bool covers(const std::vector<mapfile::Entry> &);
+
+        /*!
+         * @brief Write a new snapshot for all map file entries
+         *
+         * Entries that are current in the mapped snapshot are copied without
+         * decoding them. All other entries are loaded with the credential
+         * cache. The file is replaced atomically.
+         */
+        static bool write(const std::string &,
+                          const std::vector<mapfile::Entry> &);
+
+    private:
+        /*!
+         * @brief A mapped snapshot file
+         */
+        struct Region {
+            Region(void *, std::size_t);
+            ~Region(void);
+
+            //! @brief Start of the mapping
+            const char *data;
+
+            //! @brief Length of the mapping
+            std::size_t length;
+        };
+
+        using region_t = std::shared_ptr<const Region>;
+
+        /*!
+         * @brief Check the header and all tables of a mapped file
+         */
+        static bool validate(const Region &);
+
+        /*!
+         * @brief Find the record for certificate and key
+         *
+         * @return Offset of the record or 0, if not found
+         */
+        static std::uint64_t find(const Region &, const std::string &);
+
+        /*!
+         * @brief The record matches the current source files
+         */
+        static bool current(const Region &, std::uint64_t,
+                            const FileStamp &, const FileStamp &);
+
+        /*!
+         * @brief The currently mapped snapshot. May be nullptr
+         */
+        static region_t region;
+    };
+}  // namespace smime
+
+#endif  // SRC_SNAPSHOT_H_
@@ -0,0 +1,192 @@
+/*! @file spool.cpp
+ *
+ * @brief Keep the content of a message in memory or in a temp file
+ *
+ * @author Christian Roessner <c@roessner.co>
+ * @version 1607.1.4
+ * @date 2016-06-10
+ * @copyright Copyright 2016 Christian Roessner <c@roessner.co>
+ */
+
+#include "spool.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <iostream>
+
+namespace mlt {
+    // Public
+
+    Spool::Spool(void)
+            : directory(),
+              buffer(),
+              fd(-1),
+              spilled(false),
+              opened(false),
+              total(0) { /* empty */ }
+
+    Spool::~Spool(void) {
+        close();
+    }
+
+    void Spool::open(const std::string &tmpdir) {
+        clear();
+        directory = tmpdir;
+        opened = true;
+    }
+
+    bool Spool::write(const char *data, std::size_t len) {
+        if (!opened)
+            return false;
+
+        total += len;
+
+        if (!spilled) {
+            if (buffer.size() + len <= memoryLimit) {
+                buffer.insert(buffer.end(), data, data + len);
+                return true;
+            }
+            if (!spill())
+                return false;
+        }
+
+        // Collect small writes. Large ones go to the file directly
+        std::size_t chunk = std::max(memoryLimit, writeSize);
+        if (buffer.size() + len > chunk && !flush())
+            return false;
+        if (len < chunk) {
+            buffer.insert(buffer.end(), data, data + len);
+            return true;
+        }
+
+        while (len > 0) {
+            ssize_t n = ::write(fd, data, len);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                perror("Error: Unable to write spool file");
+                return false;
+            }
+            data += n;
+            len -= static_cast<std::size_t>(n);
+        }
+
+        return true;
+    }
+
+    BIO *Spool::newBio(void) {
+        if (!opened)
+            return nullptr;
+
+        if (!spilled) {
+            static const char empty = '\0';
+            return BIO_new_mem_buf(buffer.empty() ? &empty : buffer.data(),
+                                   static_cast<int>(buffer.size()));
+        }
+
+        if (!flush())
+            return nullptr;
+        if (lseek(fd, 0, SEEK_SET) == -1) {
+            perror("Error: Unwilling to rewind spool file");
+            return nullptr;
+        }
+
+        return BIO_new_fd(fd, BIO_NOCLOSE);
+    }
+
+    void Spool::clear(void) {
+        buffer.clear();
+        spilled = false;
+        opened = false;
+        total = 0;
+
+        // A large write buffer is not kept
+        if (buffer.capacity() > std::max(memoryLimit, writeSize))
+            std::vector<char>().swap(buffer);
+    }
+
+    void Spool::close(void) {
+        clear();
+        std::vector<char>().swap(buffer);
+
+        if (fd >= 0) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+
+    void Spool::setMemoryLimit(std::size_t size) {
+        memoryLimit = size;
+    }
+
+    // Private
+
+    bool Spool::spill(void) {
+        if (fd < 0) {
+            if (!createFile())
+                return false;
+        } else if (ftruncate(fd, 0) != 0 || lseek(fd, 0, SEEK_SET) == -1) {
+            perror("Error: Unable to reuse spool file");
+            return false;
+        }
+
+        if (::debug)
+            std::cout << "Spilling message content to disk" << std::endl;
+
+        spilled = true;
+
+        return flush();
+    }
+
+    bool Spool::flush(void) {
+        const char *data = buffer.data();
+        std::size_t len = buffer.size();
+
+        while (len > 0) {
+            ssize_t n = ::write(fd, data, len);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                perror("Error: Unable to write spool file");
+                return false;
+            }
+            data += n;
+            len -= static_cast<std::size_t>(n);
+        }
+        buffer.clear();
+
+        return true;
+    }
+
+    bool Spool::createFile(void) {
+#if defined O_TMPFILE && !defined _KEEP_TEMPFILES
+        fd = ::open(directory.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+        if (fd >= 0)
+            return true;
+        // Not supported by the file system. Use a named file
+#endif  // defined O_TMPFILE && ! defined _KEEP_TEMPFILES
+
+        std::string path = directory + "/XXXXXXXXXXXXXXXX.eml";
+        fd = mkostemps(&path[0], 4, O_CLOEXEC);
+        if (fd < 0) {
+            perror("Error: Unable to create spool file");
+            return false;
+        }
+#if !defined _KEEP_TEMPFILES
+        unlink(path.c_str());
+#endif  // ! defined _KEEP_TEMPFILES
+
+        return true;
+    }
+
+    // Init static
+
+    std::size_t Spool::memoryLimit = 65536;
+
+    const std::size_t Spool::writeSize;
+
+}  // namespace mlt
@@ -0,0 +1,139 @@
+/*! @file spool.h
+ *
+ * @brief Keep the content of a message in memory or in a temp file
+ *
+ * @author Christian Roessner <c@roessner.co>
+ * @version 1607.1.4
+ * @date 2016-06-10
+ * @copyright Copyright 2016 Christian Roessner <c@roessner.co>
+ */
+
+#ifndef SRC_SPOOL_H_
+#define SRC_SPOOL_H_
+
+#include <openssl/bio.h>
+
+#include <string>
+#include <vector>
+
+extern bool debug;
+
+namespace mlt {
+    /*!
+     * @brief Content of the current message of a connection
+     *
+     * Content is kept in memory up to a configured size. Larger messages
+     * spill to an anonymous file in the temp directory, which has no name
+     * and disappears when it is closed. Nothing touches the file system for
+     * a message that fits into memory.
+     *
+     * The memory and the file are reused for the next message of the same
+     * connection.
+     */
+    class Spool {
+    public:
+        /*!
+         * @brief Constructor
+         */
+        Spool(void);
+
+        /*!
+         * @brief Destructor
+         */
+        ~Spool(void);
+
+        Spool(const Spool &) = delete;
+        Spool &operator=(const Spool &) = delete;
+
+        /*!
+         * @brief Start a new message
+         *
+         * A file is only created in the given directory, if the message
+         * gets larger than the memory limit.
+         */
+        void open(const std::string &);
+
+        /*!
+         * @brief Append content
+         */
+        bool write(const char *, std::size_t);
+
+        /*!
+         * @brief A BIO that reads the content from the beginning
+         *
+         * Content in memory is not copied. Only one BIO may be used at a
+         * time, and nothing may be written while it is used. The caller
+         * frees the BIO.
+         *
+         * @return nullptr on error
+         */
+        BIO *newBio(void);
+
+        /*!
+         * @brief Forget the content, but keep memory and file for reuse
+         */
+        void clear(void);
+
+        /*!
+         * @brief Free memory and close the file
+         */
+        void close(void);
+
+        /*!
+         * @brief A message was started and not cleared yet
+         */
+        inline bool isOpen(void) const { return opened; }
+
+        /*!
+         * @brief Number of bytes written for the current message
+         */
+        inline std::size_t size(void) const { return total; }
+
+        /*!
+         * @brief Set the size up to which messages are kept in memory
+         */
+        static void setMemoryLimit(std::size_t);
+
+    private:
+        /*!
+         * @brief Move the content in memory to a file
+         */
+        bool spill(void);
+
+        /*!
+         * @brief Write the buffer to the file
+         */
+        bool flush(void);
+
+        /*!
+         * @brief Create an anonymous file in the temp directory
+         */
+        bool createFile(void);
+
+        //! @brief The temp directory
+        std::string directory;
+
+        //! @brief The content or, after a spill, the write buffer
+        std::vector<char> buffer;
+
+        //! @brief The spill file. -1, if none was created yet
+        int fd;
+
+        //! @brief The content of the current message is in the file
+        bool spilled;
+
+        //! @brief A message was started
+        bool opened;
+
+        //! @brief Number of bytes of the current message
+        std::size_t total;
+
+        //! @brief Messages up to this size are kept in memory
+        static std::size_t memoryLimit;
+
+        //! @brief Minimum size of a write to the spill file
+        static const std::size_t writeSize = 65536;
+    };
+}  // namespace mlt
+
+#endif  // SRC_SPOOL_H_
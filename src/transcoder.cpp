@@ -0,0 +1,453 @@
+/*! @file transcoder.cpp
+ *
+ * @brief Encode 8bit and binary content in 7bit before signing
+ *
+ * @author Christian Roessner <c@roessner.co>
+ * @version 1607.1.4
+ * @date 2016-06-10
+ * @copyright Copyright 2016 Christian Roessner <c@roessner.co>
+ */
+
+#include "transcoder.h"
+
+#include <strings.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define _TRANSCODER_SIMD
+#include <immintrin.h>
+#endif  // defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+
+namespace mlt {
+    static const char hexDigits[] = "0123456789ABCDEF";
+
+    static const char base64Alphabet[] =
+            "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    //! @brief Bytes that are looked at for a run of literal characters
+    static const std::size_t qpScanSize = 128;
+
+    /*!
+     * @brief A byte that quoted-printable keeps as it is, RFC2045, 6.7
+     *
+     * Space and tab are only encoded at the end of a line, which is checked
+     * by the caller.
+     */
+    static inline bool isLiteral(unsigned char c) {
+        return (c >= ' ' && c <= '~' && c != '=') || c == '\t';
+    }
+
+    static std::size_t literalRunScalar(const char *data, std::size_t len,
+                                        std::size_t from) {
+        for (std::size_t i = from; i < len; i++)
+            if (!isLiteral(static_cast<unsigned char>(data[i])))
+                return i;
+
+        return len;
+    }
+
+    static void base64Scalar(const unsigned char *in, std::size_t groups,
+                             char *out) {
+        for (std::size_t i = 0; i < groups; i++, in += 3, out += 4) {
+            unsigned long bits = (static_cast<unsigned long>(in[0]) << 16)
+                                 | (static_cast<unsigned long>(in[1]) << 8)
+                                 | in[2];
+            out[0] = base64Alphabet[(bits >> 18) & 0x3f];
+            out[1] = base64Alphabet[(bits >> 12) & 0x3f];
+            out[2] = base64Alphabet[(bits >> 6) & 0x3f];
+            out[3] = base64Alphabet[bits & 0x3f];
+        }
+    }
+
+#if defined _TRANSCODER_SIMD
+    /*
+     * A byte is literal, if it is greater than 31 as a signed value, which
+     * excludes all 8bit bytes, and neither DEL nor "=". Tab is literal, too.
+     */
+
+    static std::size_t literalRunSse2(const char *data, std::size_t len) {
+        const __m128i low = _mm_set1_epi8(31);
+        const __m128i del = _mm_set1_epi8(127);
+        const __m128i equals = _mm_set1_epi8('=');
+        const __m128i tab = _mm_set1_epi8('\t');
+        std::size_t i = 0;
+
+        for (; i + 16 <= len; i += 16) {
+            __m128i v = _mm_loadu_si128(
+                    reinterpret_cast<const __m128i *>(data + i));
+            __m128i special = _mm_or_si128(_mm_cmpeq_epi8(v, del),
+                                           _mm_cmpeq_epi8(v, equals));
+            __m128i literal = _mm_or_si128(
+                    _mm_andnot_si128(special, _mm_cmpgt_epi8(v, low)),
+                    _mm_cmpeq_epi8(v, tab));
+            unsigned int mask = ~static_cast<unsigned int>(
+                    _mm_movemask_epi8(literal)) & 0xffff;
+            if (mask != 0)
+                return i + __builtin_ctz(mask);
+        }
+
+        return literalRunScalar(data, len, i);
+    }
+
+    __attribute__((target("avx2")))
+    static std::size_t literalRunAvx2(const char *data, std::size_t len) {
+        const __m256i low = _mm256_set1_epi8(31);
+        const __m256i del = _mm256_set1_epi8(127);
+        const __m256i equals = _mm256_set1_epi8('=');
+        const __m256i tab = _mm256_set1_epi8('\t');
+        std::size_t i = 0;
+
+        for (; i + 32 <= len; i += 32) {
+            __m256i v = _mm256_loadu_si256(
+                    reinterpret_cast<const __m256i *>(data + i));
+            __m256i special = _mm256_or_si256(_mm256_cmpeq_epi8(v, del),
+                                              _mm256_cmpeq_epi8(v, equals));
+            __m256i literal = _mm256_or_si256(
+                    _mm256_andnot_si256(special, _mm256_cmpgt_epi8(v, low)),
+                    _mm256_cmpeq_epi8(v, tab));
+            unsigned int mask = ~static_cast<unsigned int>(
+                    _mm256_movemask_epi8(literal));
+            if (mask != 0)
+                return i + __builtin_ctz(mask);
+        }
+
+        // The rest is shorter than 32 bytes
+        return i + literalRunSse2(data + i, len - i);
+    }
+
+    /*
+     * Four groups of three bytes are spread over 16 bytes, so that every
+     * 32 bit word holds one group. The multiplications move the four 6 bit
+     * values of each group into their own bytes. The values are then turned
+     * into characters by adding an offset that depends on their range.
+     */
+    __attribute__((target("ssse3")))
+    static std::size_t base64Ssse3(const unsigned char *in,
+                                   std::size_t groups, char *out) {
+        const __m128i spread = _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4,
+                                             7, 6, 8, 7, 10, 9, 11, 10);
+        const __m128i offsets = _mm_setr_epi8(
+                'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+                '/' - 63, 'A', 0, 0);
+        std::size_t i = 0;
+
+        // 16 bytes are loaded for 12, so stop before the last 4 bytes
+        for (; i + 6 <= groups; i += 4) {
+            __m128i v = _mm_loadu_si128(
+                    reinterpret_cast<const __m128i *>(in + i * 3));
+            v = _mm_shuffle_epi8(v, spread);
+
+            __m128i high = _mm_mulhi_epu16(
+                    _mm_and_si128(v, _mm_set1_epi32(0x0fc0fc00)),
+                    _mm_set1_epi32(0x04000040));
+            __m128i low = _mm_mullo_epi16(
+                    _mm_and_si128(v, _mm_set1_epi32(0x003f03f0)),
+                    _mm_set1_epi32(0x01000010));
+            __m128i values = _mm_or_si128(high, low);
+
+            // 0-25 use offset 13, 26-51 use 0, 52-63 use 1-12
+            __m128i range = _mm_or_si128(
+                    _mm_subs_epu8(values, _mm_set1_epi8(51)),
+                    _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), values),
+                                  _mm_set1_epi8(13)));
+            _mm_storeu_si128(
+                    reinterpret_cast<__m128i *>(out + i * 4),
+                    _mm_add_epi8(values, _mm_shuffle_epi8(offsets, range)));
+        }
+
+        return i;
+    }
+#endif  // defined _TRANSCODER_SIMD
+
+    // Public
+
+    Transcoder::Transcoder(void)
+            : encoding(Encoding::NONE),
+              output(),
+              column(0),
+              pendingCR(false),
+              pendingSpace(0),
+              rest(),
+              restSize(0) { /* empty */ }
+
+    Encoding Transcoder::select(const char *transferEncoding,
+                                const char *contentType) {
+        if (transferEncoding == nullptr)
+            return Encoding::NONE;
+
+        if (contentType != nullptr) {
+            while (isspace(static_cast<unsigned char>(*contentType)))
+                contentType++;
+            if (strncasecmp(contentType, "multipart/", 10) == 0
+                || strncasecmp(contentType, "message/", 8) == 0)
+                return Encoding::NONE;
+        }
+
+        while (isspace(static_cast<unsigned char>(*transferEncoding)))
+            transferEncoding++;
+        std::size_t size = 0;
+        while (transferEncoding[size] != '\0'
+               && transferEncoding[size] != ';'
+               && transferEncoding[size] != '('
+               && !isspace(static_cast<unsigned char>(
+                       transferEncoding[size])))
+            size++;
+
+        if (size == 4 && strncasecmp(transferEncoding, "8bit", 4) == 0)
+            return Encoding::QUOTED_PRINTABLE;
+        if (size == 6 && strncasecmp(transferEncoding, "binary", 6) == 0)
+            return Encoding::BASE64;
+
+        return Encoding::NONE;
+    }
+
+    const char *Transcoder::name(Encoding value) {
+        switch (value) {
+            case Encoding::QUOTED_PRINTABLE:
+                return "quoted-printable";
+            case Encoding::BASE64:
+                return "base64";
+            default:
+                return "8bit";
+        }
+    }
+
+    void Transcoder::start(Encoding value) {
+        reset();
+        encoding = value;
+    }
+
+    const std::string &Transcoder::encode(const char *data, std::size_t len) {
+        output.clear();
+        if (len == 0)
+            return output;
+
+        switch (encoding) {
+            case Encoding::QUOTED_PRINTABLE:
+                encodeQp(data, len);
+                break;
+            case Encoding::BASE64:
+                encodeBase64(reinterpret_cast<const unsigned char *>(data),
+                             len);
+                break;
+            default:
+                output.assign(data, len);
+        }
+
+        return output;
+    }
+
+    const std::string &Transcoder::finish(void) {
+        output.clear();
+
+        switch (encoding) {
+            case Encoding::QUOTED_PRINTABLE:
+                if (pendingCR)
+                    putQpByte('\r');
+                if (pendingSpace != 0)
+                    putQpByte(static_cast<unsigned char>(pendingSpace));
+                break;
+            case Encoding::BASE64:
+                if (restSize > 0) {
+                    unsigned char group[3] = {rest[0], 0, 0};
+                    if (restSize == 2)
+                        group[1] = rest[1];
+                    char chars[4];
+                    base64Scalar(group, 1, chars);
+                    chars[3] = '=';
+                    if (restSize == 1)
+                        chars[2] = '=';
+                    output.append(chars, 4);
+                    column += 4;
+                }
+                if (column > 0)
+                    output += "\r\n";
+                break;
+            default:
+                break;
+        }
+
+        pendingCR = false;
+        pendingSpace = 0;
+        restSize = 0;
+        column = 0;
+
+        return output;
+    }
+
+    void Transcoder::reset(void) {
+        encoding = Encoding::NONE;
+        output.clear();
+        column = 0;
+        pendingCR = false;
+        pendingSpace = 0;
+        restSize = 0;
+    }
+
+    std::size_t Transcoder::literalRun(const char *data, std::size_t len) {
+#if defined _TRANSCODER_SIMD
+        static const bool avx2 = __builtin_cpu_supports("avx2");
+
+        if (avx2)
+            return literalRunAvx2(data, len);
+
+        return literalRunSse2(data, len);
+#else
+        return literalRunScalar(data, len, 0);
+#endif  // defined _TRANSCODER_SIMD
+    }
+
+    void Transcoder::base64Groups(const unsigned char *in, std::size_t groups,
+                                  char *out) {
+        std::size_t done = 0;
+
+#if defined _TRANSCODER_SIMD
+        static const bool ssse3 = __builtin_cpu_supports("ssse3");
+
+        if (ssse3)
+            done = base64Ssse3(in, groups, out);
+#endif  // defined _TRANSCODER_SIMD
+
+        base64Scalar(in + done * 3, groups - done, out + done * 4);
+    }
+
+    // Private
+
+    void Transcoder::encodeQp(const char *data, std::size_t len) {
+        std::size_t i = 0;
+
+        // Bytes of the last chunk that depend on this one
+        if (pendingCR) {
+            pendingCR = false;
+            if (data[0] == '\n') {
+                output += "\r\n";
+                column = 0;
+                i = 1;
+            } else {
+                putQpByte('\r');
+            }
+        } else if (pendingSpace != 0) {
+            if (data[0] == '\r' || data[0] == '\n')
+                putQpByte(static_cast<unsigned char>(pendingSpace));
+            else
+                putQp(&pendingSpace, 1);
+            pendingSpace = 0;
+        }
+
+        while (i < len) {
+            std::size_t room = column < qpLineSize ? qpLineSize - column : 0;
+            std::size_t run = std::min(
+                    literalRun(data + i, std::min(len - i, qpScanSize)), room);
+
+            // A space or tab at the end of a line is encoded
+            if (run > 0 && (data[i + run - 1] == ' '
+                            || data[i + run - 1] == '\t')
+                && (i + run == len || data[i + run] == '\r'
+                    || data[i + run] == '\n'))
+                run--;
+
+            output.append(data + i, run);
+            column += run;
+            i += run;
+            if (i == len)
+                break;
+
+            // Line breaks, 8bit bytes and what did not fit into the line
+            auto c = static_cast<unsigned char>(data[i]);
+            bool last = i + 1 == len;
+            char next = last ? '\0' : data[i + 1];
+
+            if (c == '\n') {
+                output += "\r\n";
+                column = 0;
+            } else if (c == '\r') {
+                if (last) {
+                    pendingCR = true;
+                } else if (next == '\n') {
+                    output += "\r\n";
+                    column = 0;
+                    i++;
+                } else {
+                    putQpByte(c);
+                }
+            } else if (c == ' ' || c == '\t') {
+                if (last)
+                    pendingSpace = static_cast<char>(c);
+                else if (next == '\r' || next == '\n')
+                    putQpByte(c);
+                else
+                    putQp(data + i, 1);
+            } else if (isLiteral(c)) {
+                putQp(data + i, 1);
+            } else {
+                putQpByte(c);
+            }
+            i++;
+        }
+    }
+
+    void Transcoder::encodeBase64(const unsigned char *data, std::size_t len) {
+        std::size_t i = 0;
+
+        // Complete the group of the last chunk
+        if (restSize > 0) {
+            while (restSize < 3 && i < len)
+                rest[restSize++] = data[i++];
+            if (restSize < 3)
+                return;
+            putBase64(rest, 1);
+            restSize = 0;
+        }
+
+        std::size_t groups = (len - i) / 3;
+        putBase64(data + i, groups);
+        i += groups * 3;
+
+        while (i < len)
+            rest[restSize++] = data[i++];
+    }
+
+    void Transcoder::putBase64(const unsigned char *in, std::size_t groups) {
+        while (groups > 0) {
+            std::size_t count = std::min(groups,
+                                         (base64LineSize - column) / 4);
+            std::size_t offset = output.size();
+
+            output.resize(offset + count * 4);
+            base64Groups(in, count, &output[offset]);
+            column += count * 4;
+            in += count * 3;
+            groups -= count;
+
+            if (column == base64LineSize) {
+                output += "\r\n";
+                column = 0;
+            }
+        }
+    }
+
+    void Transcoder::putQp(const char *text, std::size_t size) {
+        if (column + size > qpLineSize) {
+            output += "=\r\n";
+            column = 0;
+        }
+        output.append(text, size);
+        column += size;
+    }
+
+    void Transcoder::putQpByte(unsigned char c) {
+        char encoded[3] = {'=', hexDigits[c >> 4], hexDigits[c & 0x0f]};
+        putQp(encoded, 3);
+    }
+
+    // Init static
+
+    const std::size_t Transcoder::qpLineSize;
+
+    const std::size_t Transcoder::base64LineSize;
+
+}  // namespace mlt
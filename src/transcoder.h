@@ -0,0 +1,158 @@
+/*! @file transcoder.h
+ *
+ * @brief Encode 8bit and binary content in 7bit before signing
+ *
+ * @author Christian Roessner <c@roessner.co>
+ * @version 1607.1.4
+ * @date 2016-06-10
+ * @copyright Copyright 2016 Christian Roessner <c@roessner.co>
+ */
+
+#ifndef SRC_TRANSCODER_H_
+#define SRC_TRANSCODER_H_
+
+#include <string>
+
+namespace mlt {
+    /*!
+     * @brief Content-Transfer-Encoding of the signed content
+     */
+    enum class Encoding {
+        NONE,
+        QUOTED_PRINTABLE,
+        BASE64
+    };
+
+    /*!
+     * @brief Re-encode the body of a message with a 7bit transfer encoding
+     *
+     * A relay that can not transport 8bit data converts such a body to 7bit
+     * and breaks the signature. Encoding the content before it is signed
+     * avoids this. 8bit text is encoded as quoted-printable, binary content
+     * as base64, RFC2045, 6.7 and 6.8.
+     *
+     * The body arrives in chunks. Everything that can not be decided yet,
+     * like a CR at the end of a chunk or up to two bytes of a base64 group,
+     * is kept until the next chunk or finish().
+     */
+    class Transcoder {
+    public:
+        /*!
+         * @brief Constructor
+         */
+        Transcoder(void);
+
+        /*!
+         * @brief The encoding for a body with the given headers
+         *
+         * Only a body that is no multipart or message type is encoded,
+         * RFC2045, 6.4.
+         *
+         * @return Encoding::NONE, if the body is kept as it is
+         */
+        static Encoding select(const char *, const char *);
+
+        /*!
+         * @brief Value of the Content-Transfer-Encoding header
+         */
+        static const char *name(Encoding);
+
+        /*!
+         * @brief Start to encode a new body
+         */
+        void start(Encoding);
+
+        /*!
+         * @brief A body is encoded
+         */
+        inline bool active(void) const { return encoding != Encoding::NONE; }
+
+        /*!
+         * @brief Encode the next chunk of the body
+         *
+         * @return The encoded content. It is valid until the next call
+         */
+        const std::string &encode(const char *, std::size_t);
+
+        /*!
+         * @brief Encode everything that was kept back
+         *
+         * @return The rest of the encoded content
+         */
+        const std::string &finish(void);
+
+        /*!
+         * @brief Stop encoding and forget everything
+         */
+        void reset(void);
+
+        /*!
+         * @brief Number of leading bytes that quoted-printable keeps as
+         * they are
+         */
+        static std::size_t literalRun(const char *, std::size_t);
+
+        /*!
+         * @brief Encode groups of three bytes as four base64 characters
+         */
+        static void base64Groups(const unsigned char *, std::size_t, char *);
+
+    private:
+        /*!
+         * @brief Quoted-printable for a chunk
+         */
+        void encodeQp(const char *, std::size_t);
+
+        /*!
+         * @brief Base64 for a chunk
+         */
+        void encodeBase64(const unsigned char *, std::size_t);
+
+        /*!
+         * @brief Append complete groups and break lines
+         */
+        void putBase64(const unsigned char *, std::size_t);
+
+        /*!
+         * @brief Append quoted-printable text to the current line
+         *
+         * Starts a new line with a soft line break, if the text does not
+         * fit.
+         */
+        void putQp(const char *, std::size_t);
+
+        /*!
+         * @brief Append an encoded byte "=XX" to the current line
+         */
+        void putQpByte(unsigned char);
+
+        //! @brief The current encoding
+        Encoding encoding;
+
+        //! @brief Encoded content of the last call
+        std::string output;
+
+        //! @brief Characters in the current output line
+        std::size_t column;
+
+        //! @brief Quoted-printable: a CR ended the last chunk
+        bool pendingCR;
+
+        //! @brief Quoted-printable: a space or tab ended the last chunk
+        char pendingSpace;
+
+        //! @brief Base64: bytes of an incomplete group
+        unsigned char rest[3];
+
+        //! @brief Base64: number of bytes in rest
+        std::size_t restSize;
+
+        //! @brief Quoted-printable: characters per line before the "="
+        static const std::size_t qpLineSize = 75;
+
+        //! @brief Base64: characters per line
+        static const std::size_t base64LineSize = 76;
+    };
+}  // namespace mlt
+
+#endif  // SRC_TRANSCODER_H_